@@ -1,9 +1,11 @@
 #ifndef __ANS_ENCODE_H__
 #define __ANS_ENCODE_H__
 
+#include <cassert>
 #include <cstdint>
 #include <memory>
 #include <numeric>
+#include <string>
 #include <vector>
 #include "bits.h"
 
@@ -40,12 +42,54 @@ namespace ans {
     std::vector<uint32_t> Fs;
   };
 
+  // Everything an encoder needs to know about a set of options. Building
+  // this normalizes the frequencies to M and, for tANS, builds the shuffled
+  // encoding table, which is far more expensive than encoding a single group
+  // of symbols. Tables are immutable, so one table can be shared by every
+  // encoder that uses the same options, e.g. all of the streams in all of the
+  // interleaved groups of a texture.
+  struct EncoderTable {
+    const EType type;
+    const uint32_t b;
+    const uint32_t k;
+    const uint32_t M;
+    const int log_b;
+
+    // Normalized frequencies and their cumulative sums
+    const std::vector<uint32_t> F;
+    const std::vector<uint32_t> B;
+
+    // Only used by tANS. See the tANS encoder for details.
+    const std::vector<uint32_t> enc_table;
+
+    // Per-symbol constants that let the encoders replace the division by
+    // F[s] with a multiply and shifts, similar to ryg_rans. For a state x,
+    //   t = (x * rcp_freq) >> 32
+    //   x / F[s] = (t + ((x - t) >> rcp_shift1)) >> rcp_shift2
+    // which is exact for every 32-bit x. x_max is the renormalization bound
+    // b * k * F[s].
+    struct SymbolInfo {
+      uint32_t x_max;
+      uint32_t rcp_freq;
+      uint16_t rcp_shift1;
+      uint16_t rcp_shift2;
+    };
+    const std::vector<SymbolInfo> symbol_info;
+
+    // Returns null if the options are invalid.
+    static std::shared_ptr<const EncoderTable> Create(const Options &opts);
+
+   private:
+    EncoderTable(EType type, uint32_t b, uint32_t k, std::vector<uint32_t> &&F);
+  };
+
   class Encoder {
    public:
      virtual ~Encoder() { }
      virtual void Encode(uint32_t symbol, BitWriter *w) = 0;
      virtual uint32_t GetState() const = 0;
      static std::unique_ptr<Encoder> Create(const Options &opts);
+     static std::unique_ptr<Encoder> Create(const std::shared_ptr<const EncoderTable> &table);
   protected:
     Encoder() { }
   };
@@ -54,19 +98,115 @@ namespace ans {
    public:
      virtual ~Decoder() { }
      virtual uint32_t Decode(BitReader *r) = 0;
+     virtual uint32_t Decode(ReverseBitReader *r) = 0;
      virtual uint32_t GetState() const = 0;
      static std::unique_ptr<Decoder> Create(uint32_t state, const Options &opts);
   protected:
     Decoder() { }
   };
 
+  // rANS decoder that finds each symbol with a single lookup into a table
+  // that has one entry per slot in [0, M), rather than searching the
+  // cumulative frequencies. The entries use the same layout that the OpenCL
+  // build_table kernel produces. Decoder::Create picks this decoder for rANS
+  // whenever M is at most kMaxTableSize.
+  class rANS_TableDecoder : public Decoder {
+   public:
+    struct TableEntry {
+      uint16_t freq;
+      uint16_t cum_freq;
+      uint8_t  symbol;
+    };
+
+    static const uint32_t kMaxTableSize = (1 << 15);
+
+    // Expects normalized frequencies that sum to M
+    rANS_TableDecoder(uint32_t state, const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k);
+
+    virtual uint32_t Decode(BitReader *r) override { return DecodeSymbol(r); }
+    virtual uint32_t Decode(ReverseBitReader *r) override { return DecodeSymbol(r); }
+    virtual uint32_t GetState() const override { return _state; }
+
+    // Decodes num_symbols symbols from a single stream without going through
+    // a virtual call per symbol. Since rANS is a stack, symbols are decoded in
+    // the reverse order that they were encoded, so they are written to 'out'
+    // back to front in order for out[0, num_symbols) to match the encoder input.
+    // Reader is either a BitReader or a ReverseBitReader.
+    template<typename Reader>
+    void DecodeN(Reader *r, uint8_t *out, size_t num_symbols) {
+      for (size_t i = num_symbols; i > 0; --i) {
+        out[i - 1] = static_cast<uint8_t>(DecodeSymbol(r));
+      }
+    }
+
+    const std::vector<TableEntry> &GetTable() const { return _table; }
+
+   private:
+    const uint32_t _M;
+    const uint32_t _k;
+    const uint32_t _b;
+    const uint32_t _log_b;
+
+    // If M is a power of two we can avoid the division when decoding
+    const uint32_t _log_M;
+    const bool _M_is_pow2;
+
+    std::vector<TableEntry> _table;
+
+    uint32_t _state;
+
+    template<typename Reader>
+    inline uint32_t DecodeSymbol(Reader *r) {
+      assert(_k * _M <= _state && _state < (_b * _k * _M));
+
+      uint32_t slot, quot;
+      if (_M_is_pow2) {
+        slot = _state & (_M - 1);
+        quot = _state >> _log_M;
+      } else {
+        slot = _state % _M;
+        quot = _state / _M;
+      }
+
+      const TableEntry &entry = _table[slot];
+      _state = quot * entry.freq - entry.cum_freq + slot;
+
+      // Renormalize
+      while (_state < _k * _M) {
+        _state <<= _log_b;
+        _state |= static_cast<uint32_t>(r->ReadBits(_log_b));
+      }
+
+      return entry.symbol;
+    }
+  };
+
   std::vector<uint8_t> EncodeInterleaved(const std::vector<uint8_t> &symbols,
                                          const Options &opts, size_t num_streams);
 
+  // Same as above, but reuses a table that was built ahead of time. Use this
+  // when encoding many groups with the same histogram. Both methods of
+  // dividing by the symbol frequencies produce identical streams; the
+  // divisions are only kept around for comparison.
+  std::vector<uint8_t> EncodeInterleaved(const uint8_t *symbols, size_t num_symbols,
+                                         const EncoderTable &table, size_t num_streams,
+                                         bool use_reciprocals = true);
+
   std::vector<uint8_t> DecodeInterleaved(const std::vector<uint8_t> &data,
                                          size_t num_symbols,
                                          const Options &opts, size_t num_streams);
 
+  // Decodes the interleaved streams directly out of the given span without
+  // copying the renormalization stream. The second variant writes the
+  // num_symbols decoded symbols to out.
+  std::vector<uint8_t> DecodeInterleaved(const uint8_t *data, size_t data_sz,
+                                         size_t num_symbols,
+                                         const Options &opts, size_t num_streams);
+
+  void DecodeInterleaved(const uint8_t *data, size_t data_sz,
+                         size_t num_symbols, const Options &opts,
+                         size_t num_streams, uint8_t *out);
+
   // If we expect our symbol frequency to have 1 << 11 precision, we only have 1 << 4
   // available for state-precision
   namespace ocl {
@@ -74,8 +214,53 @@ namespace ans {
     static const size_t kNumEncodedSymbols = 256;
     static const size_t kThreadsPerEncodingGroup = 32;
 
-    std::vector<uint32_t> NormalizeFrequencies(const std::vector<uint32_t> &F);
-    ans::Options GetOpenCLOptions(const std::vector<uint32_t> &F);
+    // The product k * M is fixed so that the 16-bit renormalization keeps the
+    // state within 31 bits regardless of the table size.
+    static const uint32_t kDecoderL = (1 << 15);
+
+    // The shape of the streams that the OpenCL kernels decode: frequencies are
+    // normalized to table_size, and each of the threads_per_group interleaved
+    // streams in a group decodes num_encoded_symbols symbols. The defaults are
+    // the constants above. The kernels are compiled separately for each
+    // geometry using the -D options from BuildOptions().
+    struct Geometry {
+      uint32_t table_size;
+      uint32_t num_encoded_symbols;
+      uint32_t threads_per_group;
+
+      Geometry()
+        : table_size(static_cast<uint32_t>(kANSTableSize))
+        , num_encoded_symbols(static_cast<uint32_t>(kNumEncodedSymbols))
+        , threads_per_group(static_cast<uint32_t>(kThreadsPerEncodingGroup))
+      { }
+
+      Geometry(uint32_t M, uint32_t symbols, uint32_t threads)
+        : table_size(M), num_encoded_symbols(symbols), threads_per_group(threads)
+      { }
+
+      // Table sizes are powers of two from 1 << 8 to 1 << 15, and groups
+      // have at most 256 streams.
+      bool IsValid() const;
+
+      size_t SymbolsPerGroup() const {
+        return static_cast<size_t>(num_encoded_symbols) * threads_per_group;
+      }
+
+      std::string BuildOptions() const;
+
+      bool operator==(const Geometry &other) const {
+        return table_size == other.table_size &&
+          num_encoded_symbols == other.num_encoded_symbols &&
+          threads_per_group == other.threads_per_group;
+      }
+
+      bool operator!=(const Geometry &other) const { return !(*this == other); }
+    };
+
+    std::vector<uint32_t> NormalizeFrequencies(const std::vector<uint32_t> &F,
+                                               uint32_t table_size = kANSTableSize);
+    ans::Options GetOpenCLOptions(const std::vector<uint32_t> &F,
+                                  uint32_t table_size = kANSTableSize);
   }
 
 }  // namespace ans
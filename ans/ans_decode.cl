@@ -1,12 +1,30 @@
 #pragma OPENCL EXTENSION cl_khr_byte_addressable_store : enable
 #pragma OPENCL EXTENSION cl_khr_local_int32_extended_atomics : enable
 
+// The geometry can be overridden with -D build options, see
+// ans::ocl::Geometry::BuildOptions
+#ifndef ANS_TABLE_SIZE_LOG
 #define ANS_TABLE_SIZE_LOG  11
-#define ANS_TABLE_SIZE      (1 << ANS_TABLE_SIZE_LOG)
-#define NUM_ENCODED_SYMBOLS 256
+#endif
+
+#ifndef ANS_DECODER_K
 #define ANS_DECODER_K       (1 << 4)
+#endif
+
+#ifndef NUM_ENCODED_SYMBOLS
+#define NUM_ENCODED_SYMBOLS 256
+#endif
+
+#ifndef THREADS_PER_ENCODING_GROUP
+#define THREADS_PER_ENCODING_GROUP 32
+#endif
+
+#define ANS_TABLE_SIZE      (1 << ANS_TABLE_SIZE_LOG)
 #define ANS_DECODER_L       (ANS_DECODER_K * ANS_TABLE_SIZE)
 
+// One bit per thread in the group for whether or not it needs to renormalize
+#define NORMALIZATION_MASK_WORDS ((THREADS_PER_ENCODING_GROUP + 31) / 32)
+
 typedef struct AnsTableEntry_Struct {
 	ushort freq;
 	ushort cum_freq;
@@ -31,6 +49,7 @@ void ans_decode_single(const    __global   AnsTableEntry *table,
   uint state = ((const __global uint *)(data + offset) - get_local_size(0))[get_local_id(0)];
   uint next_to_read = (offset - (get_local_size(0) * 4)) / 2;
   const __global ushort *stream_data = (const __global ushort *)data;
+  const uint mask_word = get_local_id(0) / 32;
 
   barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -42,24 +61,33 @@ void ans_decode_single(const    __global   AnsTableEntry *table,
 
     // Set the bit for this invocation...
     const uint normalization_bit =
-      ((uint)(state < ANS_DECODER_L)) << get_local_id(0);
-    atomic_or(normalization_mask, normalization_bit);
+      ((uint)(state < ANS_DECODER_L)) << (get_local_id(0) % 32);
+    atomic_or(normalization_mask + mask_word, normalization_bit);
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
+    // Count the renormalizations in the whole group and in the threads
+    // before this one...
+    uint total_to_read = 0;
+    uint num_before_me = 0;
+    for (uint w = 0; w < NORMALIZATION_MASK_WORDS; ++w) {
+      const uint num_in_word = popcount(normalization_mask[w]);
+      total_to_read += num_in_word;
+      num_before_me += (w < mask_word) ? num_in_word : 0;
+    }
+
     // If we need to renormalize, then do so...
-    const uint total_to_read = popcount(*normalization_mask);
     if (normalization_bit != 0) {
       const uint up_to_me_mask = normalization_bit - 1;
       uint num_to_skip = total_to_read;
-      num_to_skip -= popcount(*normalization_mask & up_to_me_mask) + 1;
+      num_to_skip -= num_before_me + popcount(normalization_mask[mask_word] & up_to_me_mask) + 1;
       state = (state << 16) | stream_data[next_to_read - num_to_skip - 1];
     }
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
     // Clear the bit in the normalization mask...
-    atomic_and(normalization_mask, ~normalization_bit);
+    atomic_and(normalization_mask + mask_word, ~normalization_bit);
 
     // Advance the read pointer by the number of shorts read
     next_to_read -= total_to_read;
@@ -86,15 +114,16 @@ __kernel void ans_decode(const __global   AnsTableEntry *global_table,
   }
   #endif
 
-	__local uint normalization_mask;
-  if (0 == get_local_id(0)) {
-    normalization_mask = 0;
+	__local uint normalization_mask[NORMALIZATION_MASK_WORDS];
+  if (get_local_id(0) < NORMALIZATION_MASK_WORDS) {
+    normalization_mask[get_local_id(0)] = 0;
   }
 
-  ans_decode_single(global_table, &normalization_mask, get_group_id(0), data, out_stream);
+  ans_decode_single(global_table, normalization_mask, get_group_id(0), data, out_stream);
 }
 
 __kernel void ans_decode_multiple(const __global   AnsTableEntry *global_table,
+                                  const __global   uint          *table_ids,
                                   const            uint           num_offsets,
 								                  const __global   uint          *offsets,
                                   const __global   uchar         *data,
@@ -124,19 +153,20 @@ __kernel void ans_decode_multiple(const __global   AnsTableEntry *global_table,
   #if 0
   __local AnsTableEntry table[ANS_TABLE_SIZE];
   for (size_t i = get_local_id(0); i < ANS_TABLE_SIZE; i += get_local_size(0)) {
-    uint gidx = x * ANS_TABLE_SIZE + i;
+    uint gidx = table_ids[x] * ANS_TABLE_SIZE + i;
     table[i].freq = global_table[gidx].freq;
     table[i].cum_freq = global_table[gidx].cum_freq;
     table[i].symbol = global_table[gidx].symbol;
   }
   #endif
 
-  __local uint normalization_mask;
-  if (0 == get_local_id(0)) {
-    normalization_mask = 0;
+  __local uint normalization_mask[NORMALIZATION_MASK_WORDS];
+  if (get_local_id(0) < NORMALIZATION_MASK_WORDS) {
+    normalization_mask[get_local_id(0)] = 0;
   }
 
-  ans_decode_single(global_table + x * ANS_TABLE_SIZE, &normalization_mask,
+  // Streams with similar statistics may share a table
+  ans_decode_single(global_table + table_ids[x] * ANS_TABLE_SIZE, normalization_mask,
                     (id - output_offsets[x]) / (get_local_size(0) * NUM_ENCODED_SYMBOLS),
                     data + input_offsets[x],
                     out_stream + output_offsets[x]);
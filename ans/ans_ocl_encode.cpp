@@ -1,17 +1,45 @@
 #include "ans.h"
 #include "histogram.h"
+#include "ans_utils.h"
+
+#include <sstream>
 
 namespace ans {
 namespace ocl {
-  std::vector<uint32_t> NormalizeFrequencies(const std::vector<uint32_t> &F) {
-    return std::move(ans::GenerateHistogram(F, kANSTableSize));
+  static bool IsPowerOfTwo(uint32_t x) {
+    return x != 0 && (x & (x - 1)) == 0;
+  }
+
+  bool Geometry::IsValid() const {
+    return IsPowerOfTwo(table_size) &&
+      (1U << 8) <= table_size && table_size <= kDecoderL &&
+      0 < num_encoded_symbols &&
+      0 < threads_per_group && threads_per_group <= 256;
   }
 
-  ans::Options GetOpenCLOptions(const std::vector<uint32_t> &F) {
+  std::string Geometry::BuildOptions() const {
+    assert(IsValid());
+
+    std::stringstream ss;
+    ss << "-D ANS_TABLE_SIZE_LOG=" << IntLog2(table_size)
+       << " -D ANS_DECODER_K=" << (kDecoderL / table_size)
+       << " -D NUM_ENCODED_SYMBOLS=" << num_encoded_symbols
+       << " -D THREADS_PER_ENCODING_GROUP=" << threads_per_group
+       << " ";
+    return ss.str();
+  }
+
+  std::vector<uint32_t> NormalizeFrequencies(const std::vector<uint32_t> &F, uint32_t table_size) {
+    return std::move(ans::GenerateHistogram(F, table_size));
+  }
+
+  ans::Options GetOpenCLOptions(const std::vector<uint32_t> &F, uint32_t table_size) {
+    assert(IsPowerOfTwo(table_size) && table_size <= kDecoderL);
+
     Options opts;
     opts.b = 1 << 16;
-    opts.k = 1 << 4;
-    opts.M = kANSTableSize;
+    opts.k = kDecoderL / table_size;
+    opts.M = table_size;
     opts.Fs = F;
     opts.type = eType_rANS;
     return opts;
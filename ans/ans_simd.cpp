@@ -0,0 +1,518 @@
+#include <cassert>
+#include <cstring>
+#include <numeric>
+
+#include "ans_simd.h"
+#include "ans_utils.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define ANS_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and clang only let us use intrinsics for instruction sets that are
+// enabled for the function that uses them. This lets us build every path
+// regardless of -march and pick one at runtime.
+#if defined(__GNUC__) || defined(__clang__)
+#define ANS_TARGET(x) __attribute__((target(x)))
+#else
+#define ANS_TARGET(x)
+#endif
+
+namespace ans {
+namespace simd {
+
+static const size_t kMaxStreams = InterleavedDecoder::kMaxStreams;
+
+static inline uint32_t PopCount(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<uint32_t>(__builtin_popcountll(x));
+#else
+  uint32_t result = 0;
+  for (; x != 0; x &= x - 1) {
+    result++;
+  }
+  return result;
+#endif
+}
+
+static inline uint16_t LoadWord(const uint8_t *ptr) {
+  uint16_t result;
+  memcpy(&result, ptr, sizeof(result));
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CPU feature detection
+//
+
+#ifdef ANS_SIMD_X86
+static bool HostSupports(EInstructionSet set) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_cpu_init();
+  switch (set) {
+  case eInstructionSet_SSE41: return __builtin_cpu_supports("sse4.1") != 0;
+  case eInstructionSet_AVX2: return __builtin_cpu_supports("avx2") != 0;
+  case eInstructionSet_AVX512: return __builtin_cpu_supports("avx512f") != 0;
+  default: break;
+  }
+  return false;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  const int max_leaf = info[0];
+
+  __cpuid(info, 1);
+  const bool sse41 = (info[2] & (1 << 19)) != 0;
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  const uint64_t xcr0 = osxsave ? _xgetbv(0) : 0;
+  const bool os_avx = (xcr0 & 0x6) == 0x6;
+  const bool os_avx512 = (xcr0 & 0xE6) == 0xE6;
+
+  bool avx2 = false, avx512 = false;
+  if (max_leaf >= 7) {
+    __cpuidex(info, 7, 0);
+    avx2 = os_avx && (info[1] & (1 << 5)) != 0;
+    avx512 = os_avx512 && (info[1] & (1 << 16)) != 0;
+  }
+
+  switch (set) {
+  case eInstructionSet_SSE41: return sse41;
+  case eInstructionSet_AVX2: return avx2;
+  case eInstructionSet_AVX512: return avx512;
+  default: break;
+  }
+  return false;
+#else
+  return false;
+#endif
+}
+#endif  // ANS_SIMD_X86
+
+bool IsSupported(EInstructionSet set) {
+  if (eInstructionSet_Scalar == set) {
+    return true;
+  }
+
+#ifdef ANS_SIMD_X86
+  return HostSupports(set);
+#else
+  return false;
+#endif
+}
+
+EInstructionSet GetBestInstructionSet() {
+  static const EInstructionSet best = []() {
+    for (int set = kNumInstructionSets - 1; set > eInstructionSet_Scalar; --set) {
+      if (IsSupported(static_cast<EInstructionSet>(set))) {
+        return static_cast<EInstructionSet>(set);
+      }
+    }
+    return eInstructionSet_Scalar;
+  }();
+  return best;
+}
+
+static size_t LaneWidth(EInstructionSet set) {
+  switch (set) {
+  case eInstructionSet_SSE41: return 4;
+  case eInstructionSet_AVX2: return 8;
+  case eInstructionSet_AVX512: return 16;
+  default: break;
+  }
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Decoding loops
+//
+// All of the loops below are transliterations of ans_decode_single in
+// ans_decode.cl. If a stream's state drops below L, it reads the next word
+// from the end of the shared stream. Streams with lower lane indices read
+// words closer to the front, so for a set of streams that all need to
+// renormalize, the words are read in order starting at next - total. The
+// SIMD versions find the words for each register by expanding the next few
+// words of the stream into the lanes that are set in the normalization mask.
+//
+
+struct DecodeParams {
+  const uint32_t *table;
+  const uint8_t *stream;
+  size_t num_words;
+  uint32_t states[kMaxStreams];
+  size_t num_streams;
+  size_t num_symbols;
+  uint32_t log_M;
+  uint32_t L;
+};
+
+static inline void WriteSymbols(const uint8_t *syms, size_t num_streams,
+                                size_t num_symbols, size_t i, uint8_t *out) {
+  uint8_t *dst = out + num_symbols - 1 - i;
+  for (size_t strm = 0; strm < num_streams; ++strm) {
+    dst[strm * num_symbols] = syms[strm];
+  }
+}
+
+static bool DecodeScalar(DecodeParams *p, uint8_t *out) {
+  const uint32_t M_mask = (1 << p->log_M) - 1;
+  size_t next = p->num_words;
+
+  for (size_t i = 0; i < p->num_symbols; ++i) {
+    uint8_t syms[kMaxStreams];
+    uint64_t mask = 0;
+    for (size_t strm = 0; strm < p->num_streams; ++strm) {
+      const uint32_t state = p->states[strm];
+      const uint32_t slot = state & M_mask;
+      const uint32_t entry = p->table[slot];
+      p->states[strm] = (state >> p->log_M) * ((entry & 0xFFF) + 1) + ((entry >> 12) & 0xFFF);
+      mask |= static_cast<uint64_t>(p->states[strm] < p->L) << strm;
+      syms[strm] = static_cast<uint8_t>(entry >> 24);
+    }
+
+    const uint32_t total = PopCount(mask);
+    if (total > next) {
+      return false;
+    }
+
+    size_t pos = next - total;
+    for (size_t strm = 0; strm < p->num_streams; ++strm) {
+      if ((mask >> strm) & 1) {
+        p->states[strm] = (p->states[strm] << 16) | LoadWord(p->stream + 2 * pos);
+        pos++;
+      }
+    }
+
+    next -= total;
+    WriteSymbols(syms, p->num_streams, p->num_symbols, i, out);
+  }
+
+  return true;
+}
+
+#ifdef ANS_SIMD_X86
+
+// For each mask of renormalizing lanes, stores the index of the stream word
+// that each lane reads relative to the first word read by the register.
+struct ExpandTables {
+  uint8_t sse[16][16];
+  uint8_t avx2[256][8];
+
+  ExpandTables() {
+    for (int m = 0; m < 16; ++m) {
+      int rank = 0;
+      for (int lane = 0; lane < 4; ++lane) {
+        uint8_t *shuf = sse[m] + lane * 4;
+        if ((m >> lane) & 1) {
+          shuf[0] = static_cast<uint8_t>(2 * rank);
+          shuf[1] = static_cast<uint8_t>(2 * rank + 1);
+          rank++;
+        } else {
+          shuf[0] = shuf[1] = 0x80;
+        }
+        shuf[2] = shuf[3] = 0x80;
+      }
+    }
+
+    for (int m = 0; m < 256; ++m) {
+      int rank = 0;
+      for (int lane = 0; lane < 8; ++lane) {
+        avx2[m][lane] = static_cast<uint8_t>(((m >> lane) & 1) ? rank++ : 0);
+      }
+    }
+  }
+};
+
+static const ExpandTables kExpandTables;
+
+ANS_TARGET("sse4.1")
+static bool DecodeSSE41(DecodeParams *p, uint8_t *out) {
+  const size_t num_regs = p->num_streams / 4;
+  const __m128i M_mask = _mm_set1_epi32((1 << p->log_M) - 1);
+  const __m128i log_M = _mm_cvtsi32_si128(p->log_M);
+  const __m128i low_mask = _mm_set1_epi32(0xFFF);
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000));
+  const __m128i biased_L = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(p->L)), sign);
+  const __m128i sym_shuf = _mm_setr_epi8(3, 7, 11, 15, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1);
+
+  __m128i states[kMaxStreams / 4];
+  for (size_t r = 0; r < num_regs; ++r) {
+    states[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p->states + 4 * r));
+  }
+
+  size_t next = p->num_words;
+  for (size_t i = 0; i < p->num_symbols; ++i) {
+    uint8_t syms[kMaxStreams];
+    __m128i need[kMaxStreams / 4];
+    int masks[kMaxStreams / 4];
+    uint32_t total = 0;
+
+    for (size_t r = 0; r < num_regs; ++r) {
+      const __m128i slot = _mm_and_si128(states[r], M_mask);
+      const __m128i entry = _mm_setr_epi32(
+        static_cast<int>(p->table[_mm_extract_epi32(slot, 0)]),
+        static_cast<int>(p->table[_mm_extract_epi32(slot, 1)]),
+        static_cast<int>(p->table[_mm_extract_epi32(slot, 2)]),
+        static_cast<int>(p->table[_mm_extract_epi32(slot, 3)]));
+
+      const __m128i freq = _mm_add_epi32(_mm_and_si128(entry, low_mask), one);
+      const __m128i bias = _mm_and_si128(_mm_srli_epi32(entry, 12), low_mask);
+      const __m128i quot = _mm_srl_epi32(states[r], log_M);
+      states[r] = _mm_add_epi32(_mm_mullo_epi32(quot, freq), bias);
+
+      need[r] = _mm_cmplt_epi32(_mm_xor_si128(states[r], sign), biased_L);
+      masks[r] = _mm_movemask_ps(_mm_castsi128_ps(need[r]));
+      total += PopCount(static_cast<uint64_t>(masks[r]));
+
+      const int s = _mm_cvtsi128_si32(_mm_shuffle_epi8(entry, sym_shuf));
+      memcpy(syms + 4 * r, &s, 4);
+    }
+
+    if (total > next) {
+      return false;
+    }
+
+    size_t pos = next - total;
+    for (size_t r = 0; r < num_regs; ++r) {
+      const __m128i words = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p->stream + 2 * pos));
+      const __m128i shuf = _mm_loadu_si128(reinterpret_cast<const __m128i *>(kExpandTables.sse[masks[r]]));
+      const __m128i renorm = _mm_or_si128(_mm_slli_epi32(states[r], 16), _mm_shuffle_epi8(words, shuf));
+      states[r] = _mm_blendv_epi8(states[r], renorm, need[r]);
+      pos += PopCount(static_cast<uint64_t>(masks[r]));
+    }
+
+    next -= total;
+    WriteSymbols(syms, p->num_streams, p->num_symbols, i, out);
+  }
+
+  for (size_t r = 0; r < num_regs; ++r) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p->states + 4 * r), states[r]);
+  }
+
+  return true;
+}
+
+ANS_TARGET("avx2")
+static bool DecodeAVX2(DecodeParams *p, uint8_t *out) {
+  const size_t num_regs = p->num_streams / 8;
+  const __m256i M_mask = _mm256_set1_epi32((1 << p->log_M) - 1);
+  const __m128i log_M = _mm_cvtsi32_si128(p->log_M);
+  const __m256i low_mask = _mm256_set1_epi32(0xFFF);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i sign = _mm256_set1_epi32(static_cast<int>(0x80000000));
+  const __m256i biased_L = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(p->L)), sign);
+  const __m256i sym_shuf = _mm256_setr_epi8(
+    3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m256i sym_perm = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+  const int *table = reinterpret_cast<const int *>(p->table);
+
+  __m256i states[kMaxStreams / 8];
+  for (size_t r = 0; r < num_regs; ++r) {
+    states[r] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p->states + 8 * r));
+  }
+
+  size_t next = p->num_words;
+  for (size_t i = 0; i < p->num_symbols; ++i) {
+    uint8_t syms[kMaxStreams];
+    __m256i need[kMaxStreams / 8];
+    int masks[kMaxStreams / 8];
+    uint32_t total = 0;
+
+    for (size_t r = 0; r < num_regs; ++r) {
+      const __m256i slot = _mm256_and_si256(states[r], M_mask);
+      const __m256i entry = _mm256_i32gather_epi32(table, slot, 4);
+
+      const __m256i freq = _mm256_add_epi32(_mm256_and_si256(entry, low_mask), one);
+      const __m256i bias = _mm256_and_si256(_mm256_srli_epi32(entry, 12), low_mask);
+      const __m256i quot = _mm256_srl_epi32(states[r], log_M);
+      states[r] = _mm256_add_epi32(_mm256_mullo_epi32(quot, freq), bias);
+
+      need[r] = _mm256_cmpgt_epi32(biased_L, _mm256_xor_si256(states[r], sign));
+      masks[r] = _mm256_movemask_ps(_mm256_castsi256_ps(need[r]));
+      total += PopCount(static_cast<uint64_t>(masks[r]));
+
+      const __m256i s = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(entry, sym_shuf), sym_perm);
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(syms + 8 * r), _mm256_castsi256_si128(s));
+    }
+
+    if (total > next) {
+      return false;
+    }
+
+    size_t pos = next - total;
+    for (size_t r = 0; r < num_regs; ++r) {
+      const __m256i words = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p->stream + 2 * pos)));
+      const __m256i idx = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(kExpandTables.avx2[masks[r]])));
+      const __m256i renorm = _mm256_or_si256(_mm256_slli_epi32(states[r], 16),
+                                             _mm256_permutevar8x32_epi32(words, idx));
+      states[r] = _mm256_blendv_epi8(states[r], renorm, need[r]);
+      pos += PopCount(static_cast<uint64_t>(masks[r]));
+    }
+
+    next -= total;
+    WriteSymbols(syms, p->num_streams, p->num_symbols, i, out);
+  }
+
+  for (size_t r = 0; r < num_regs; ++r) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p->states + 8 * r), states[r]);
+  }
+
+  return true;
+}
+
+ANS_TARGET("avx512f")
+static bool DecodeAVX512(DecodeParams *p, uint8_t *out) {
+  const size_t num_regs = p->num_streams / 16;
+  const __m512i M_mask = _mm512_set1_epi32((1 << p->log_M) - 1);
+  const __m128i log_M = _mm_cvtsi32_si128(p->log_M);
+  const __m512i low_mask = _mm512_set1_epi32(0xFFF);
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512i L = _mm512_set1_epi32(static_cast<int>(p->L));
+
+  __m512i states[kMaxStreams / 16];
+  for (size_t r = 0; r < num_regs; ++r) {
+    states[r] = _mm512_loadu_si512(p->states + 16 * r);
+  }
+
+  size_t next = p->num_words;
+  for (size_t i = 0; i < p->num_symbols; ++i) {
+    uint8_t syms[kMaxStreams];
+    __mmask16 masks[kMaxStreams / 16];
+    uint32_t total = 0;
+
+    for (size_t r = 0; r < num_regs; ++r) {
+      const __m512i slot = _mm512_and_si512(states[r], M_mask);
+      const __m512i entry = _mm512_i32gather_epi32(slot, p->table, 4);
+
+      const __m512i freq = _mm512_add_epi32(_mm512_and_si512(entry, low_mask), one);
+      const __m512i bias = _mm512_and_si512(_mm512_srli_epi32(entry, 12), low_mask);
+      const __m512i quot = _mm512_srl_epi32(states[r], log_M);
+      states[r] = _mm512_add_epi32(_mm512_mullo_epi32(quot, freq), bias);
+
+      masks[r] = _mm512_cmplt_epu32_mask(states[r], L);
+      total += PopCount(static_cast<uint64_t>(masks[r]));
+
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(syms + 16 * r),
+                       _mm512_cvtepi32_epi8(_mm512_srli_epi32(entry, 24)));
+    }
+
+    if (total > next) {
+      return false;
+    }
+
+    size_t pos = next - total;
+    for (size_t r = 0; r < num_regs; ++r) {
+      const __m512i words = _mm512_cvtepu16_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p->stream + 2 * pos)));
+      states[r] = _mm512_mask_or_epi32(states[r], masks[r], _mm512_slli_epi32(states[r], 16),
+                                       _mm512_maskz_expand_epi32(masks[r], words));
+      pos += PopCount(static_cast<uint64_t>(masks[r]));
+    }
+
+    next -= total;
+    WriteSymbols(syms, p->num_streams, p->num_symbols, i, out);
+  }
+
+  for (size_t r = 0; r < num_regs; ++r) {
+    _mm512_storeu_si512(p->states + 16 * r, states[r]);
+  }
+
+  return true;
+}
+
+#endif  // ANS_SIMD_X86
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// InterleavedDecoder
+//
+
+static std::vector<uint32_t> BuildPackedTable(const std::vector<uint32_t> &F, uint32_t M) {
+  std::vector<uint32_t> table;
+  table.reserve(M);
+
+  uint32_t cum_freq = 0;
+  for (size_t sym = 0; sym < F.size(); ++sym) {
+    for (uint32_t j = 0; j < F[sym]; ++j) {
+      uint32_t entry = (F[sym] - 1) | (j << 12) | (static_cast<uint32_t>(sym) << 24);
+      table.push_back(entry);
+    }
+    cum_freq += F[sym];
+  }
+
+  assert(cum_freq == M);
+  return std::move(table);
+}
+
+static EInstructionSet ChooseInstructionSet(EInstructionSet set, size_t num_streams) {
+  // Fall back to narrower registers if we can't fill the wide ones
+  while (eInstructionSet_Scalar != set &&
+         (!IsSupported(set) || (num_streams % LaneWidth(set)) != 0)) {
+    set = static_cast<EInstructionSet>(set - 1);
+  }
+  return set;
+}
+
+InterleavedDecoder::InterleavedDecoder(const std::vector<uint32_t> &F,
+                                       size_t num_streams, size_t num_symbols,
+                                       EInstructionSet set)
+  : InterleavedDecoder(F, ocl::Geometry(static_cast<uint32_t>(ocl::kANSTableSize),
+                                        static_cast<uint32_t>(num_symbols),
+                                        static_cast<uint32_t>(num_streams)), set)
+{ }
+
+InterleavedDecoder::InterleavedDecoder(const std::vector<uint32_t> &F,
+                                       const ocl::Geometry &geom, EInstructionSet set)
+  : _num_streams(geom.threads_per_group)
+  , _num_symbols(geom.num_encoded_symbols)
+  , _set(ChooseInstructionSet(set, geom.threads_per_group))
+  , _log_M(IntLog2(geom.table_size))
+  , _L(ocl::GetOpenCLOptions(F, geom.table_size).k * geom.table_size)
+  , _table(BuildPackedTable(ocl::NormalizeFrequencies(F, geom.table_size), geom.table_size))
+{
+  assert(0 < _num_streams && _num_streams <= kMaxStreams);
+  assert(geom.table_size <= kMaxTableSize);
+  assert(ocl::GetOpenCLOptions(F, geom.table_size).b == (1 << 16));
+  assert(F.size() <= 256);
+}
+
+bool InterleavedDecoder::Decode(const uint8_t *data, size_t data_sz, uint8_t *out) const {
+  const size_t states_sz = _num_streams * sizeof(uint32_t);
+  if (data_sz < states_sz || ((data_sz - states_sz) % 2) != 0) {
+    return false;
+  }
+
+  DecodeParams params;
+  params.table = _table.data();
+  params.stream = data;
+  params.num_words = (data_sz - states_sz) / 2;
+  params.num_streams = _num_streams;
+  params.num_symbols = _num_symbols;
+  params.log_M = _log_M;
+  params.L = _L;
+  memcpy(params.states, data + data_sz - states_sz, states_sz);
+
+  switch (_set) {
+#ifdef ANS_SIMD_X86
+  case eInstructionSet_SSE41: return DecodeSSE41(&params, out);
+  case eInstructionSet_AVX2: return DecodeAVX2(&params, out);
+  case eInstructionSet_AVX512: return DecodeAVX512(&params, out);
+#endif
+  default: break;
+  }
+
+  return DecodeScalar(&params, out);
+}
+
+}  // namespace simd
+}  // namespace ans
@@ -0,0 +1,82 @@
+#ifndef __ANS_SIMD_H__
+#define __ANS_SIMD_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "ans.h"
+
+namespace ans {
+namespace simd {
+
+  enum EInstructionSet {
+    eInstructionSet_Scalar,
+    eInstructionSet_SSE41,
+    eInstructionSet_AVX2,
+    eInstructionSet_AVX512,
+
+    kNumInstructionSets
+  };
+
+  // Returns the widest instruction set that both this build and the
+  // host CPU support.
+  EInstructionSet GetBestInstructionSet();
+  bool IsSupported(EInstructionSet set);
+
+  // CPU decoder for groups of interleaved rANS streams that runs the same
+  // algorithm as the OpenCL ans_decode kernel: all streams in a group
+  // decode one symbol in lockstep, and the streams that need to renormalize
+  // read their next 16 bits from the shared stream in order of their lane
+  // index. Each lane in a SIMD register corresponds to one stream, so we
+  // decode 4, 8 or 16 streams per instruction with SSE4.1, AVX2 or AVX-512.
+  //
+  // The expected input is a single group as written by ans::EncodeInterleaved
+  // using the options from ans::ocl::GetOpenCLOptions: the renormalization
+  // stream in 16-bit words followed by one 32-bit state per stream. The output
+  // matches the OpenCL decoder bit for bit: stream i's symbols are written to
+  // out[i * num_symbols, (i + 1) * num_symbols) in the order they were encoded.
+  class InterleavedDecoder {
+   public:
+    // Frequencies are normalized to ocl::kANSTableSize as the OpenCL
+    // decoder does.
+    InterleavedDecoder(const std::vector<uint32_t> &F,
+                       size_t num_streams = ocl::kThreadsPerEncodingGroup,
+                       size_t num_symbols = ocl::kNumEncodedSymbols,
+                       EInstructionSet set = GetBestInstructionSet());
+
+    // Decodes groups with the given geometry. Tables can have at most
+    // kMaxTableSize entries, and groups at most kMaxStreams streams.
+    InterleavedDecoder(const std::vector<uint32_t> &F, const ocl::Geometry &geom,
+                       EInstructionSet set = GetBestInstructionSet());
+
+    // Returns false if the data is too short for the number of
+    // renormalizations that the streams request.
+    bool Decode(const uint8_t *data, size_t data_sz, uint8_t *out) const;
+
+    EInstructionSet InstructionSet() const { return _set; }
+    size_t NumStreams() const { return _num_streams; }
+    size_t NumSymbols() const { return _num_symbols; }
+
+    // Each table entry is packed into 32 bits so that it can be fetched
+    // with a single gather:
+    //   bits  0-11: frequency - 1
+    //   bits 12-23: slot - cumulative frequency
+    //   bits 24-31: symbol
+    static const uint32_t kMaxTableSize = (1 << 12);
+
+    // The renormalization mask of a group is kept in a single 64-bit integer
+    static const size_t kMaxStreams = 64;
+
+   private:
+    const size_t _num_streams;
+    const size_t _num_symbols;
+    const EInstructionSet _set;
+    const uint32_t _log_M;
+    const uint32_t _L;
+    std::vector<uint32_t> _table;
+  };
+
+}  // namespace simd
+}  // namespace ans
+
+#endif  // __ANS_SIMD_H__
@@ -0,0 +1,170 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+
+#include "ans.h"
+#include "ans_simd.h"
+#include "gtest/gtest.h"
+
+static std::vector<uint8_t> GenerateSymbols(const std::vector<uint32_t> &F, size_t num_symbols) {
+  const uint32_t M = std::accumulate(F.begin(), F.end(), 0U);
+
+  std::vector<uint8_t> symbols;
+  symbols.reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    uint32_t r = rand() % M;
+    uint8_t symbol = 0;
+    while (r >= F[symbol]) {
+      r -= F[symbol];
+      symbol++;
+    }
+    symbols.push_back(symbol);
+  }
+
+  return std::move(symbols);
+}
+
+TEST(SIMD, DecodesInterleavedGroups) {
+  srand(0);
+
+  const size_t num_streams = ans::ocl::kThreadsPerEncodingGroup;
+  const size_t num_symbols = ans::ocl::kNumEncodedSymbols;
+  const std::vector<uint32_t> Fs[] = {
+    { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 },
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 },
+    { 2000, 1, 1, 1 },
+  };
+
+  for (const auto &F : Fs) {
+    ans::Options opts = ans::ocl::GetOpenCLOptions(F);
+    std::vector<uint8_t> symbols = GenerateSymbols(F, num_streams * num_symbols);
+    std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+
+    for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+      ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+      if (!ans::simd::IsSupported(is)) {
+        continue;
+      }
+
+      ans::simd::InterleavedDecoder decoder(F, num_streams, num_symbols, is);
+      ASSERT_EQ(decoder.InstructionSet(), is);
+
+      std::vector<uint8_t> decoded(symbols.size(), 0xFF);
+      ASSERT_TRUE(decoder.Decode(encoded.data(), encoded.size(), decoded.data()));
+      for (size_t i = 0; i < symbols.size(); ++i) {
+        ASSERT_EQ(decoded[i], symbols[i]) << "Instruction set: " << set;
+      }
+    }
+  }
+}
+
+TEST(SIMD, HandlesOtherGroupSizes) {
+  srand(0);
+
+  const std::vector<uint32_t> F = { 3, 14, 7, 5, 5, 3, 13, 2, 2, 2, 1, 8, 1, 1 };
+  ans::Options opts = ans::ocl::GetOpenCLOptions(F);
+
+  for (size_t num_streams : { 4, 8, 12, 16, 64 }) {
+    std::vector<uint8_t> symbols = GenerateSymbols(F, num_streams * 64);
+    std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+
+    for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+      ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+      ans::simd::InterleavedDecoder decoder(F, num_streams, 64, is);
+
+      std::vector<uint8_t> decoded(symbols.size(), 0xFF);
+      ASSERT_TRUE(decoder.Decode(encoded.data(), encoded.size(), decoded.data()));
+      for (size_t i = 0; i < symbols.size(); ++i) {
+        ASSERT_EQ(decoded[i], symbols[i]) << "Streams: " << num_streams;
+      }
+    }
+  }
+}
+
+TEST(SIMD, DecodesOtherGeometries) {
+  srand(0);
+
+  const std::vector<uint32_t> F = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+  const ans::ocl::Geometry geoms[] = {
+    ans::ocl::Geometry(1 << 12, 256, 16),
+    ans::ocl::Geometry(1 << 10, 128, 8),
+    ans::ocl::Geometry(1 << 9, 64, 64),
+  };
+
+  for (const auto &geom : geoms) {
+    ans::Options opts = ans::ocl::GetOpenCLOptions(F, geom.table_size);
+    std::vector<uint8_t> symbols = GenerateSymbols(F, geom.SymbolsPerGroup());
+    std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, geom.threads_per_group);
+
+    for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+      ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+      ans::simd::InterleavedDecoder decoder(F, geom, is);
+
+      std::vector<uint8_t> decoded(symbols.size(), 0xFF);
+      ASSERT_TRUE(decoder.Decode(encoded.data(), encoded.size(), decoded.data()));
+      for (size_t i = 0; i < symbols.size(); ++i) {
+        ASSERT_EQ(decoded[i], symbols[i]) << "Table size: " << geom.table_size;
+      }
+    }
+  }
+}
+
+TEST(SIMD, RejectsTruncatedGroups) {
+  srand(0);
+
+  const std::vector<uint32_t> F = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+  const size_t num_streams = ans::ocl::kThreadsPerEncodingGroup;
+  const size_t num_symbols = ans::ocl::kNumEncodedSymbols;
+
+  ans::Options opts = ans::ocl::GetOpenCLOptions(F);
+  std::vector<uint8_t> symbols = GenerateSymbols(F, num_streams * num_symbols);
+  std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+
+  // Drop the first half of the renormalization stream
+  const size_t stream_sz = encoded.size() - num_streams * 4;
+  std::vector<uint8_t> truncated(encoded.begin() + (stream_sz / 4) * 2, encoded.end());
+
+  ans::simd::InterleavedDecoder decoder(F);
+  std::vector<uint8_t> decoded(symbols.size());
+  EXPECT_FALSE(decoder.Decode(truncated.data(), truncated.size(), decoded.data()));
+  EXPECT_FALSE(decoder.Decode(encoded.data(), num_streams * 4 - 1, decoded.data()));
+}
+
+TEST(SIMD, Throughput) {
+  srand(0);
+
+  const std::vector<uint32_t> F = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+  const size_t num_streams = ans::ocl::kThreadsPerEncodingGroup;
+  const size_t num_symbols = ans::ocl::kNumEncodedSymbols;
+  const size_t num_groups = 256;
+
+  ans::Options opts = ans::ocl::GetOpenCLOptions(F);
+  std::vector<uint8_t> symbols = GenerateSymbols(F, num_streams * num_symbols);
+  std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+
+  std::vector<uint8_t> decoded(symbols.size());
+  for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+    ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+    if (!ans::simd::IsSupported(is)) {
+      continue;
+    }
+
+    ans::simd::InterleavedDecoder decoder(F, num_streams, num_symbols, is);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < num_groups; ++i) {
+      ASSERT_TRUE(decoder.Decode(encoded.data(), encoded.size(), decoded.data()));
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> secs = end - start;
+    const double mb = static_cast<double>(num_groups * symbols.size()) / (1024.0 * 1024.0);
+    std::cout << "Instruction set " << set << ": " << (mb / secs.count()) << " MB/s" << std::endl;
+
+    for (size_t i = 0; i < symbols.size(); ++i) {
+      ASSERT_EQ(decoded[i], symbols[i]);
+    }
+  }
+}
@@ -1,5 +1,8 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
+#include <iostream>
 #include <numeric>
 
 #include "ans.h"
@@ -449,3 +452,275 @@ TEST(Codec, CanInterleaveStreamsWithDifferentSymbolsFromDistributions) {
     }
   }
 }
+
+TEST(Codec, CanBatchDecodeWithTable) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+  const size_t num_symbols = 4096;
+
+  ans::Options opts;
+  opts.type = ans::eType_rANS;
+  opts.b = 256;
+  opts.k = 2;
+  opts.Fs = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+
+  // Test both power of two and non power of two denominators
+  const uint32_t Ms[] = {
+    static_cast<uint32_t>(ans::ocl::kANSTableSize),
+    std::accumulate(opts.Fs.begin(), opts.Fs.end(), 0U)
+  };
+
+  for (auto M : Ms) {
+    opts.M = M;
+
+    std::vector<uint8_t> symbols;
+    symbols.reserve(num_symbols);
+
+    std::vector<unsigned char> stream(num_symbols * 4, 0);
+    ans::BitWriter w(stream.data());
+
+    std::unique_ptr<ans::Encoder> enc = ans::Encoder::Create(opts);
+    for (size_t i = 0; i < num_symbols; ++i) {
+      int r = rand() % std::accumulate(opts.Fs.begin(), opts.Fs.end(), 0);
+      uint8_t symbol = 0;
+      int freq = 0;
+      for (auto f : opts.Fs) {
+        freq += f;
+        if (r < freq) {
+          break;
+        }
+        symbol++;
+      }
+      symbols.push_back(symbol);
+      enc->Encode(symbol, &w);
+    }
+
+    stream.resize(w.BytesWritten());
+    std::reverse(stream.begin(), stream.end());
+
+    std::unique_ptr<ans::Decoder> dec = ans::Decoder::Create(enc->GetState(), opts);
+    ans::rANS_TableDecoder *table_dec = dynamic_cast<ans::rANS_TableDecoder *>(dec.get());
+    ASSERT_TRUE(NULL != table_dec);
+
+    std::vector<uint8_t> decoded(num_symbols, 0);
+    ans::BitReader r(stream.data());
+    table_dec->DecodeN(&r, decoded.data(), num_symbols);
+
+    EXPECT_EQ(r.BytesRead(), static_cast<int>(stream.size()));
+    EXPECT_EQ(table_dec->GetState(), opts.k * opts.M);
+    for (size_t i = 0; i < num_symbols; ++i) {
+      EXPECT_EQ(decoded[i], symbols[i]) << "Index: " << i;
+    }
+  }
+}
+
+TEST(Codec, CanDecodeInterleavedStreamsInPlace) {
+  srand(0);
+  const size_t num_symbols = 256;
+  const size_t num_streams = 32;
+
+  ans::Options opts;
+  opts.k = 2;
+  opts.Fs = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+  opts.M = std::accumulate(opts.Fs.begin(), opts.Fs.end(), 0);
+
+  for (auto ty : { ans::eType_rANS, ans::eType_tANS }) {
+    for (uint32_t b : { 256, 1 << 16 }) {
+      opts.type = ty;
+      opts.b = b;
+
+      std::vector<uint8_t> symbols;
+      symbols.reserve(num_symbols * num_streams);
+      for (size_t i = 0; i < num_symbols * num_streams; ++i) {
+        int r = rand() % opts.M;
+        uint8_t symbol = 0;
+        while (r >= static_cast<int>(opts.Fs[symbol])) {
+          r -= opts.Fs[symbol];
+          symbol++;
+        }
+        symbols.push_back(symbol);
+      }
+
+      std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+
+      // Place the stream at an unaligned offset in a larger buffer to make sure
+      // that we only read the span that we're given.
+      std::vector<uint8_t> buffer(encoded.size() + 6, 0xA5);
+      std::copy(encoded.begin(), encoded.end(), buffer.begin() + 3);
+
+      std::vector<uint8_t> decoded(symbols.size());
+      ans::DecodeInterleaved(buffer.data() + 3, encoded.size(), symbols.size(),
+                             opts, num_streams, decoded.data());
+
+      for (size_t i = 0; i < symbols.size(); ++i) {
+        ASSERT_EQ(decoded[i], symbols[i]) << "b: " << b << " Index: " << i;
+      }
+    }
+  }
+}
+
+TEST(Codec, CanShareEncoderTables) {
+  srand(0);
+  const size_t num_streams = 32;
+  const size_t num_symbols = 256;
+  const size_t num_groups = 8;
+
+  ans::Options opts;
+  opts.b = 1 << 16;
+  opts.k = 1 << 4;
+  opts.M = 1 << 11;
+  opts.Fs = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+
+  for (auto ty : { ans::eType_rANS, ans::eType_tANS }) {
+    opts.type = ty;
+    std::shared_ptr<const ans::EncoderTable> table = ans::EncoderTable::Create(opts);
+    ASSERT_TRUE(static_cast<bool>(table));
+    EXPECT_EQ(table->M, opts.M);
+
+    std::vector<uint8_t> symbols;
+    for (size_t i = 0; i < num_groups * num_streams * num_symbols; ++i) {
+      symbols.push_back(static_cast<uint8_t>(rand() % opts.Fs.size()));
+    }
+
+    for (size_t g = 0; g < num_groups; ++g) {
+      const size_t group_sz = num_streams * num_symbols;
+      std::vector<uint8_t> group(symbols.begin() + g * group_sz,
+                                 symbols.begin() + (g + 1) * group_sz);
+
+      std::vector<uint8_t> expected = ans::EncodeInterleaved(group, opts, num_streams);
+      std::vector<uint8_t> shared =
+        ans::EncodeInterleaved(symbols.data() + g * group_sz, group_sz, *table, num_streams);
+      ASSERT_EQ(expected, shared);
+
+      std::vector<uint8_t> decoded =
+        ans::DecodeInterleaved(shared, group_sz, opts, num_streams);
+      ASSERT_EQ(decoded, group);
+    }
+
+    // Encoders that share a table behave like ones that build their own
+    std::unique_ptr<ans::Encoder> a = ans::Encoder::Create(opts);
+    std::unique_ptr<ans::Encoder> b = ans::Encoder::Create(table);
+    ans::ContainedBitWriter wa, wb;
+    for (size_t i = 0; i < num_symbols; ++i) {
+      a->Encode(symbols[i], &wa);
+      b->Encode(symbols[i], &wb);
+      ASSERT_EQ(a->GetState(), b->GetState());
+    }
+    EXPECT_EQ(wa.GetData(), wb.GetData());
+  }
+}
+
+TEST(Codec, ReciprocalEncodingMatchesDivision) {
+  srand(0);
+  const size_t num_streams = 32;
+  const size_t num_symbols = 512;
+
+  struct TestCase {
+    uint32_t b, k, M;
+  } test_cases[] = {
+    { 1 << 16, 1 << 4, 1 << 11 },
+    { 256, 2, 0 },
+    { 2, 1, 0 },
+    // States get close to 2^32 here...
+    { 256, 1 << 11, (1 << 13) - 1 },
+  };
+
+  for (auto ty : { ans::eType_rANS, ans::eType_tANS }) {
+    for (const auto &test : test_cases) {
+      ans::Options opts;
+      opts.type = ty;
+      opts.b = test.b;
+      opts.k = test.k;
+
+      // Lots of different frequencies, including ones and large primes
+      for (size_t i = 0; i < 200; ++i) {
+        opts.Fs.push_back(1 + ((i * i * 7919) % 97) * (i % 3));
+      }
+      opts.Fs.push_back(1009);
+      opts.M = (0 == test.M) ? std::accumulate(opts.Fs.begin(), opts.Fs.end(), 0U) : test.M;
+
+      std::shared_ptr<const ans::EncoderTable> table = ans::EncoderTable::Create(opts);
+      ASSERT_TRUE(static_cast<bool>(table));
+
+      std::vector<uint8_t> symbols;
+      for (size_t i = 0; i < num_streams * num_symbols; ++i) {
+        uint8_t s;
+        do {
+          s = static_cast<uint8_t>(rand() % table->F.size());
+        } while (0 == table->F[s]);
+        symbols.push_back(s);
+      }
+
+      std::vector<uint8_t> divided =
+        ans::EncodeInterleaved(symbols.data(), symbols.size(), *table, num_streams, false);
+      std::vector<uint8_t> multiplied =
+        ans::EncodeInterleaved(symbols.data(), symbols.size(), *table, num_streams, true);
+      ASSERT_EQ(divided, multiplied) << "b: " << test.b << " k: " << test.k;
+    }
+  }
+}
+
+TEST(Codec, ReciprocalEncodingBenchmark) {
+  srand(0);
+  const size_t num_streams = ans::ocl::kThreadsPerEncodingGroup;
+  const size_t num_symbols = ans::ocl::kNumEncodedSymbols;
+  const size_t num_groups = 512;
+
+  std::vector<uint32_t> F = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+  std::shared_ptr<const ans::EncoderTable> table =
+    ans::EncoderTable::Create(ans::ocl::GetOpenCLOptions(F));
+
+  std::vector<uint8_t> symbols;
+  symbols.reserve(num_groups * num_streams * num_symbols);
+  for (size_t i = 0; i < num_groups * num_streams * num_symbols; ++i) {
+    symbols.push_back(static_cast<uint8_t>(rand() % F.size()));
+  }
+
+  const size_t group_sz = num_streams * num_symbols;
+  double times[2];
+  std::vector<uint8_t> last_groups[2];
+  for (int use_reciprocals = 0; use_reciprocals < 2; ++use_reciprocals) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t g = 0; g < num_groups; ++g) {
+      last_groups[use_reciprocals] =
+        ans::EncodeInterleaved(symbols.data() + g * group_sz, group_sz, *table,
+                               num_streams, use_reciprocals != 0);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    times[use_reciprocals] = std::chrono::duration<double>(end - start).count();
+  }
+
+  const double mb = static_cast<double>(symbols.size()) / (1024.0 * 1024.0);
+  std::cout << "Encoding with division: " << (mb / times[0]) << " MB/s" << std::endl;
+  std::cout << "Encoding with reciprocals: " << (mb / times[1]) << " MB/s" << std::endl;
+
+  EXPECT_EQ(last_groups[0], last_groups[1]);
+}
+
+TEST(Codec, OpenCLGeometryKeepsStateInRange) {
+  const std::vector<uint32_t> F = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+  for (uint32_t M = (1 << 8); M <= (1 << 15); M <<= 1) {
+    ans::ocl::Geometry geom(M, 256, 32);
+    ASSERT_TRUE(geom.IsValid());
+
+    ans::Options opts = ans::ocl::GetOpenCLOptions(F, M);
+    EXPECT_EQ(opts.k * opts.M, ans::ocl::kDecoderL);
+    EXPECT_LT(static_cast<uint64_t>(opts.b) * opts.k * opts.M, 1ULL << 32);
+
+    std::vector<uint32_t> normalized = ans::ocl::NormalizeFrequencies(F, M);
+    EXPECT_EQ(std::accumulate(normalized.begin(), normalized.end(), 0U), M);
+  }
+
+  // The defaults match the constants that the kernels were written for
+  ans::ocl::Geometry geom;
+  EXPECT_EQ(geom.BuildOptions(),
+            "-D ANS_TABLE_SIZE_LOG=11 -D ANS_DECODER_K=16 "
+            "-D NUM_ENCODED_SYMBOLS=256 -D THREADS_PER_ENCODING_GROUP=32 ");
+  EXPECT_EQ(ans::ocl::GetOpenCLOptions(F).k, 16U);
+
+  EXPECT_FALSE(ans::ocl::Geometry(3000, 256, 32).IsValid());
+  EXPECT_FALSE(ans::ocl::Geometry(1 << 16, 256, 32).IsValid());
+  EXPECT_FALSE(ans::ocl::Geometry(1 << 11, 0, 32).IsValid());
+  EXPECT_FALSE(ans::ocl::Geometry(1 << 11, 256, 512).IsValid());
+}
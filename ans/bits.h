@@ -2,18 +2,32 @@
 #define __ANS_BITS_H__
 
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <vector>
 
 namespace ans {
 
+  // All of the readers and writers below pack bits LSB first. Rather than
+  // looping over individual bits, they move up to 32 bits at a time through
+  // a 64-bit window that covers exactly the bytes being touched, so they
+  // never read or write memory outside of the bits that they're asked for.
+  static inline uint64_t LowBitsMask(int num_bits) {
+    return (static_cast<uint64_t>(1) << num_bits) - 1;
+  }
+
+  static inline bool IsLittleEndian() {
+    const uint16_t x = 1;
+    return reinterpret_cast<const unsigned char*>(&x)[0] == 1;
+  }
+
   class BitWriter {
    public:
     BitWriter(unsigned char* out)
-      : _bits_written(0), _bytes_written(0), _out(out), _bits_left(8) { }
+      : _bits_written(0), _bytes_written(0), _out(out), _bit_offset(0) { }
 
     BitWriter(unsigned char* out, int bit_offset)
-      : _bits_written(0), _bytes_written(0), _out(out), _bits_left(8 - bit_offset) {
+      : _bits_written(0), _bytes_written(0), _out(out), _bit_offset(bit_offset) {
       assert(bit_offset < 8);
       assert(bit_offset >= 0);
     }
@@ -24,131 +38,189 @@ namespace ans {
     int BitsWritten() const { return _bits_written; }
 
     virtual void WriteBit(int bit) {
-      _bits_written++;
-      if (8 == _bits_left) {
-        _bytes_written++;
-      }
-
-      const int shift = 8 - _bits_left;
-      *(_out) &= ~(1 << shift);
-      *(_out) |= (!!bit) << shift;
-      if (0 == --_bits_left) {
-        _bits_left = 8;
-        _out += 1;
-      }
+      const int pos = _bit_offset + _bits_written;
+      unsigned char* dst = _out + (pos >> 3);
+      const int shift = pos & 7;
+      *dst = static_cast<unsigned char>((*dst & ~(1 << shift)) | ((!!bit) << shift));
+      Advance(1);
     }
 
     virtual void WriteBits(int val, int num_bits) {
-      // If we're outputting bytes, then we can just write to memory
-      if (8 == _bits_left && (num_bits & 7) == 0) {
-        assert(reinterpret_cast<unsigned char*>(&num_bits)[0] == num_bits ||
-               !"Must be little endian!");
-        const int num_bytes = num_bits / 8;
-        memcpy(_out, reinterpret_cast<const void*>(&val), num_bytes);
-        _bytes_written += num_bytes;
-        _bits_written += num_bytes * 8;
-        _out += num_bytes;
-      } else {
-        for (int i = 0; i < num_bits; ++i) {
-          WriteBit(val & 1);
-          val >>= 1;
-        }
+      assert(num_bits >= 0 && num_bits <= 32);
+      assert(IsLittleEndian() || !"Must be little endian!");
+
+      // Read-modify-write the bytes that the new bits land in so that we
+      // don't clobber any of the surrounding bits.
+      const int pos = _bit_offset + _bits_written;
+      unsigned char* dst = _out + (pos >> 3);
+      const int shift = pos & 7;
+      const size_t num_bytes = (shift + num_bits + 7) >> 3;
+      const uint64_t mask = LowBitsMask(num_bits) << shift;
+
+      uint64_t window = 0;
+      if (0 != shift || (num_bits & 7) != 0) {
+        memcpy(&window, dst, num_bytes);
       }
+      window &= ~mask;
+      window |= (static_cast<uint64_t>(static_cast<uint32_t>(val)) << shift) & mask;
+      memcpy(dst, &window, num_bytes);
+
+      Advance(num_bits);
     }
 
   protected:
     int _bits_written;
     int _bytes_written;
   private:
+    void Advance(int num_bits) {
+      // Partially written bytes that we started with don't count
+      _bits_written += num_bits;
+      _bytes_written = (_bit_offset + _bits_written + 7) / 8 - (_bit_offset + 7) / 8;
+    }
+
     unsigned char* _out;
-    int _bits_left;
+    int _bit_offset;
   };
 
-  class ContainedBitWriter : public BitWriter {
+  // Bit writer that owns its output. Bits are collected in a 64-bit
+  // accumulator and appended to the output four bytes at a time.
+  class ContainedBitWriter final : public BitWriter {
    public:
-    ContainedBitWriter() : BitWriter(NULL) { }
+    ContainedBitWriter() : BitWriter(NULL), _accum(0), _accum_bits(0) { }
 
     virtual void WriteBit(int bit) override {
-      if ((_bits_written % 8) == 0) {
-        _out.push_back(0);
-        BitWriter w(_out.data() + _bytes_written);
-        w.WriteBit(bit);
-      } else {
-        BitWriter w(_out.data() + _bytes_written - 1, _bits_written % 8);
-        w.WriteBit(bit);
-      }
-
-      if ((_bits_written % 8) == 0) {
-        ++_bytes_written;
-      }
-      ++_bits_written;
+      WriteBits(!!bit, 1);
     }
 
     virtual void WriteBits(int val, int num_bits) override {
-      assert(num_bits > 0);
-      size_t target_bytes = (_bits_written + num_bits + 7) / 8;
-      _out.resize(target_bytes, 0);
-
-      if ((_bits_written % 8) == 0) {
-        BitWriter w(_out.data() + _bytes_written);
-        w.WriteBits(val, num_bits);
-      } else {
-        BitWriter w(_out.data() + _bytes_written - 1, _bits_written % 8);
-        w.WriteBits(val, num_bits);
+      assert(num_bits > 0 && num_bits <= 32);
+      assert(IsLittleEndian() || !"Must be little endian!");
+
+      _accum |= (static_cast<uint64_t>(static_cast<uint32_t>(val)) & LowBitsMask(num_bits)) << _accum_bits;
+      _accum_bits += num_bits;
+      if (_accum_bits >= 32) {
+        const size_t end = _out.size();
+        _out.resize(end + 4);
+        memcpy(_out.data() + end, &_accum, 4);
+        _accum >>= 32;
+        _accum_bits -= 32;
       }
 
       _bits_written += num_bits;
-      _bytes_written = static_cast<int>(target_bytes);
+      _bytes_written = (_bits_written + 7) / 8;
     }
 
-    std::vector<uint8_t> GetData() const { return _out; }
+    std::vector<uint8_t> GetData() const {
+      std::vector<uint8_t> result;
+      result.reserve(_bytes_written);
+      result.insert(result.end(), _out.begin(), _out.end());
+
+      const size_t end = result.size();
+      result.resize(end + (_accum_bits + 7) / 8);
+      memcpy(result.data() + end, &_accum, result.size() - end);
+      return result;
+    }
 
    private:
     std::vector<uint8_t> _out;
+    uint64_t _accum;
+    int _accum_bits;
   };
 
   class BitReader {
    public:
     BitReader(const unsigned char* in)
-      : _in(in), _bytes_read(0), _bits_left(8) { }
+      : _in(in), _bits_read(0) { }
 
-    int BytesRead() const { return _bytes_read; }
+    int BytesRead() const { return (_bits_read + 7) / 8; }
 
     int ReadBit() {
-      if (8 == _bits_left) {
-        _bytes_read++;
-      }
+      const int result = (_in[_bits_read >> 3] >> (_bits_read & 7)) & 1;
+      _bits_read++;
+      return result;
+    }
+
+    int ReadBits(int num_bits) {
+      assert(num_bits >= 0 && num_bits <= 32);
+      assert(IsLittleEndian() || !"Must be little endian!");
 
-      const int shift = 8 - _bits_left;
-      int result = !!((*_in) & (1 << shift));
-      if (0 == --_bits_left) {
-        _bits_left = 8;
-        _in += 1;
+      const int shift = _bits_read & 7;
+      const size_t num_bytes = (shift + num_bits + 7) >> 3;
+
+      uint64_t window = 0;
+      memcpy(&window, _in + (_bits_read >> 3), num_bytes);
+      _bits_read += num_bits;
+      return static_cast<int>((window >> shift) & LowBitsMask(num_bits));
+    }
+
+  private:
+    const unsigned char* _in;
+    int _bits_read;
+  };
+
+  // Reads a stream of fixed-size words in reverse order without copying it.
+  // The words are laid out as if written one after another with BitWriter,
+  // i.e. word i starts at bit i * word_bits of the input. Reading from this
+  // reader is equivalent to reading the words out of a BitWriter stream
+  // that wrote them from last to first, which is the order in which the
+  // rANS decoders consume renormalization words. Reading past the first
+  // word returns zeros. This isn't a BitReader: the decoders take either one
+  // by its concrete type so that reading stays a direct call.
+  class ReverseBitReader {
+   public:
+    ReverseBitReader(const unsigned char* in, size_t num_words, int word_bits)
+      : _in(in), _word_bits(word_bits), _words_left(num_words)
+      , _word(0), _bits_left(0) {
+      assert(0 < word_bits && word_bits <= 32);
+    }
+
+    size_t WordsLeft() const { return _words_left; }
+
+    int ReadBit() {
+      if (0 == _bits_left) {
+        _word = NextWord();
+        _bits_left = _word_bits;
       }
+
+      const int result = _word & 1;
+      _word >>= 1;
+      _bits_left--;
       return result;
     }
 
     int ReadBits(int num_bits) {
-      // If we're outputting bytes, then we can just write to memory
+      // Renormalization always reads whole words
+      if (0 == _bits_left && num_bits == _word_bits) {
+        return static_cast<int>(NextWord());
+      }
+
       int result = 0;
-      if (8 == _bits_left && (num_bits & 7) == 0) {
-        assert(reinterpret_cast<unsigned char*>(&num_bits)[0] == num_bits ||
-               !"Must be little endian!");
-        const int num_bytes = num_bits / 8;
-        memcpy(reinterpret_cast<void*>(&result), _in, num_bytes);
-        _bytes_read += num_bytes;
-        _in += num_bytes;
-      } else {
-        for (int i = 0; i < num_bits; ++i) {
-          result |= (ReadBit() << i);
-        }
+      for (int i = 0; i < num_bits; ++i) {
+        result |= (ReadBit() << i);
       }
       return result;
     }
 
   private:
+    uint32_t NextWord() {
+      if (0 == _words_left) {
+        return 0;
+      }
+
+      const size_t bit_offset = --_words_left * static_cast<size_t>(_word_bits);
+      assert(IsLittleEndian() || !"Must be little endian!");
+      const int shift = static_cast<int>(bit_offset & 7);
+      const size_t num_bytes = (shift + _word_bits + 7) >> 3;
+
+      uint64_t window = 0;
+      memcpy(&window, _in + bit_offset / 8, num_bytes);
+      return static_cast<uint32_t>((window >> shift) & LowBitsMask(_word_bits));
+    }
+
     const unsigned char* _in;
-    int _bytes_read;
+    const int _word_bits;
+    size_t _words_left;
+    uint32_t _word;
     int _bits_left;
   };
 
@@ -1,4 +1,8 @@
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
 
 #include "bits.h"
 #include "gtest/gtest.h"
@@ -172,3 +176,110 @@ TEST(Bits, CanWriteThenReadSameValues_ContainedBitWriter) {
     EXPECT_EQ(i - 1, r.ReadBits(i));
   }
 }
+
+TEST(Bits, CanReadWordsInReverse) {
+  for (int word_bits : { 3, 8, 16 }) {
+    ans::ContainedBitWriter w;
+    const int num_words = 37;
+    for (int i = 0; i < num_words; ++i) {
+      w.WriteBits(i & ((1 << word_bits) - 1), word_bits);
+    }
+
+    std::vector<uint8_t> data = std::move(w.GetData());
+    ans::ReverseBitReader r(data.data(), num_words, word_bits);
+    for (int i = num_words - 1; i >= 0; --i) {
+      EXPECT_EQ(i & ((1 << word_bits) - 1), r.ReadBits(word_bits));
+    }
+
+    EXPECT_EQ(0U, r.WordsLeft());
+    EXPECT_EQ(0, r.ReadBits(word_bits));
+  }
+}
+
+TEST(Bits, CanReadBitsAcrossReversedWords) {
+  // Words 0xAB and 0xCD read back to front should produce the bits
+  // of 0xCD followed by the bits of 0xAB.
+  const uint8_t data[2] = { 0xAB, 0xCD };
+  ans::ReverseBitReader r(data, 2, 8);
+  EXPECT_EQ(0xD, r.ReadBits(4));
+  EXPECT_EQ(0xBC, r.ReadBits(8));
+  EXPECT_EQ(0xA, r.ReadBits(4));
+}
+
+TEST(Bits, PreservesSurroundingBits) {
+  uint8_t stream[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+  ans::BitWriter w(stream, 3);
+  w.WriteBits(0, 13);
+  EXPECT_EQ(stream[0], 0x07);
+  EXPECT_EQ(stream[1], 0x00);
+  EXPECT_EQ(stream[2], 0xFF);
+  EXPECT_EQ(stream[3], 0xFF);
+  EXPECT_EQ(w.BitsWritten(), 13);
+  EXPECT_EQ(w.BytesWritten(), 1);
+}
+
+// Writes and reads back a few megabytes of variable-length codes to make
+// sure that the bit streams don't become a bottleneck for the encoders.
+static const size_t kNumThroughputValues = 1 << 21;
+
+static std::vector<std::pair<int, int> > GenerateCodes() {
+  srand(0);
+  std::vector<std::pair<int, int> > codes;
+  codes.reserve(kNumThroughputValues);
+  for (size_t i = 0; i < kNumThroughputValues; ++i) {
+    int num_bits = 1 + (rand() % 16);
+    codes.push_back(std::make_pair(rand() & ((1 << num_bits) - 1), num_bits));
+  }
+  return std::move(codes);
+}
+
+static double MegabytesPerSecond(size_t num_bits, std::chrono::high_resolution_clock::duration d) {
+  const double secs = std::chrono::duration<double>(d).count();
+  return (static_cast<double>(num_bits) / (8.0 * 1024.0 * 1024.0)) / secs;
+}
+
+TEST(Bits, Throughput) {
+  const std::vector<std::pair<int, int> > codes = std::move(GenerateCodes());
+  size_t total_bits = 0;
+  for (const auto &code : codes) {
+    total_bits += code.second;
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  ans::ContainedBitWriter cw;
+  for (const auto &code : codes) {
+    cw.WriteBits(code.first, code.second);
+  }
+  std::vector<uint8_t> data = std::move(cw.GetData());
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout << "ContainedBitWriter: " << MegabytesPerSecond(total_bits, end - start)
+            << " MB/s" << std::endl;
+
+  ASSERT_EQ(data.size(), (total_bits + 7) / 8);
+  ASSERT_EQ(static_cast<size_t>(cw.BitsWritten()), total_bits);
+
+  std::vector<uint8_t> raw(data.size(), 0);
+  start = std::chrono::high_resolution_clock::now();
+  ans::BitWriter w(raw.data());
+  for (const auto &code : codes) {
+    w.WriteBits(code.first, code.second);
+  }
+  end = std::chrono::high_resolution_clock::now();
+  std::cout << "BitWriter: " << MegabytesPerSecond(total_bits, end - start)
+            << " MB/s" << std::endl;
+
+  ASSERT_EQ(raw, data);
+
+  start = std::chrono::high_resolution_clock::now();
+  ans::BitReader r(data.data());
+  size_t num_mismatched = 0;
+  for (const auto &code : codes) {
+    num_mismatched += r.ReadBits(code.second) != code.first;
+  }
+  end = std::chrono::high_resolution_clock::now();
+  std::cout << "BitReader: " << MegabytesPerSecond(total_bits, end - start)
+            << " MB/s" << std::endl;
+
+  EXPECT_EQ(num_mismatched, 0U);
+  EXPECT_EQ(static_cast<size_t>(r.BytesRead()), data.size());
+}
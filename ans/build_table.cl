@@ -1,8 +1,14 @@
 #pragma OPENCL EXTENSION cl_khr_byte_addressable_store : enable
 
+#ifndef ANS_TABLE_SIZE_LOG
 #define ANS_TABLE_SIZE_LOG  11
+#endif
+
 #define MAX_NUM_SYMBOLS     256
 
+// Enough iterations to binary search all of the symbols
+#define NUM_SEARCH_ITERATIONS (ANS_TABLE_SIZE_LOG > 9 ? ANS_TABLE_SIZE_LOG : 9)
+
 typedef struct AnsTableEntry_Struct {
 	ushort freq;
 	ushort cum_freq;
@@ -65,7 +71,7 @@ __kernel void build_table(const __global ushort        *frequencies,
 
   // condition:
   // cumulative_frequencies[x] <= id < cumulative_frequencies[x + 1]
-  for (int i = 0; i < ANS_TABLE_SIZE_LOG; ++i) {
+  for (int i = 0; i < NUM_SEARCH_ITERATIONS; ++i) {
     uint too_high = (uint)(id < cumulative_frequencies[x]);
 	uint too_low = (uint)(x < MAX_NUM_SYMBOLS - 1 && cumulative_frequencies[x + 1] <= id);
 
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include <random>
 #include <numeric>
 
@@ -31,7 +32,14 @@ public:
             static_cast<uint64_t>(_M)) < (1ULL << 32));
   }
 
-  virtual uint32_t Decode(BitReader *r) override {
+  virtual uint32_t Decode(BitReader *r) override { return DecodeSymbol(r); }
+  virtual uint32_t Decode(ReverseBitReader *r) override { return DecodeSymbol(r); }
+
+  uint32_t GetState() const override { return _state; }
+
+private:
+  template<typename Reader>
+  uint32_t DecodeSymbol(Reader *r) {
     assert(_k * _M <= _state && _state < (_b * _k * _M));
 
     // Decode
@@ -49,9 +57,6 @@ public:
     return symbol;
   }
 
-  uint32_t GetState() const override { return _state; }
-
-private:
   const std::vector<uint32_t> _F;
   const std::vector<uint32_t> _B;
 
@@ -92,6 +97,50 @@ private:
   }
 };
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Table-driven rANS
+//
+
+static std::vector<rANS_TableDecoder::TableEntry>
+BuildSlotTable(const std::vector<uint32_t> &Fs, const uint32_t M) {
+  std::vector<rANS_TableDecoder::TableEntry> table(M);
+
+  uint32_t cum_freq = 0;
+  for (uint32_t i = 0; i < Fs.size(); ++i) {
+    for (uint32_t j = 0; j < Fs[i]; ++j) {
+      rANS_TableDecoder::TableEntry &entry = table[cum_freq + j];
+      entry.freq = static_cast<uint16_t>(Fs[i]);
+      entry.cum_freq = static_cast<uint16_t>(cum_freq);
+      entry.symbol = static_cast<uint8_t>(i);
+    }
+    cum_freq += Fs[i];
+  }
+
+  assert(cum_freq == M);
+  return std::move(table);
+}
+
+rANS_TableDecoder::rANS_TableDecoder(uint32_t state, const std::vector<uint32_t> &Fs,
+                                     uint32_t b, uint32_t k)
+  : _M(std::accumulate(Fs.begin(), Fs.end(), 0U))
+  , _k(k)
+  , _b(b)
+  , _log_b(IntLog2(b))
+  , _log_M(IntLog2(_M))
+  , _M_is_pow2((_M & (_M - 1)) == 0)
+  , _table(BuildSlotTable(Fs, _M))
+  , _state(state)
+{
+  assert((b & (_b - 1)) == 0 || "rANS encoder may only emit powers-of-two for renormalization!");
+  assert((k & (_k - 1)) == 0 || "rANS encoder must have power-of-two multiple of precision!");
+  assert(_M <= kMaxTableSize);
+  assert(Fs.size() <= 256);
+  assert((static_cast<uint64_t>(b) *
+          static_cast<uint64_t>(_k) *
+          static_cast<uint64_t>(_M)) < (1ULL << 32));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // tANS
@@ -104,10 +153,14 @@ public:
   // b to know how many bytes/bits etc to emit at a time.
   tANS_Decoder(uint32_t state, const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k);
 
-  virtual uint32_t Decode(BitReader *r) override;
+  virtual uint32_t Decode(BitReader *r) override { return DecodeSymbol(r); }
+  virtual uint32_t Decode(ReverseBitReader *r) override { return DecodeSymbol(r); }
   virtual uint32_t GetState() const override { return _state; }
 
 private:
+  template<typename Reader>
+  uint32_t DecodeSymbol(Reader *r);
+
   const std::vector<uint32_t> _F;
   const std::vector<uint32_t> _B;
 
@@ -181,7 +234,8 @@ tANS_Decoder::tANS_Decoder(uint32_t state, const std::vector<uint32_t> &Fs, uint
           static_cast<uint64_t>(_M)) < (1ULL << 32));
 }
 
-uint32_t tANS_Decoder::Decode(BitReader *r) {
+template<typename Reader>
+uint32_t tANS_Decoder::DecodeSymbol(Reader *r) {
   assert(_k * _M <= _state && _state < (_b * _k * _M));
 
   // Decode
@@ -218,7 +272,13 @@ std::unique_ptr<Decoder> Decoder::Create(uint32_t state, const Options &_opts) {
 
   switch (opts.type) {
   case eType_rANS:
-    dec.reset(new rANS_Decoder(state, normalized_fs, opts.b, opts.k));
+    // For small enough M, a table lookup is much cheaper than searching
+    // the cumulative frequencies for every symbol...
+    if (opts.M <= rANS_TableDecoder::kMaxTableSize && normalized_fs.size() <= 256) {
+      dec.reset(new rANS_TableDecoder(state, normalized_fs, opts.b, opts.k));
+    } else {
+      dec.reset(new rANS_Decoder(state, normalized_fs, opts.b, opts.k));
+    }
     break;
   case eType_tANS:
     dec.reset(new tANS_Decoder(state, normalized_fs, opts.b, opts.k));
@@ -239,56 +299,57 @@ std::unique_ptr<Decoder> Decoder::Create(uint32_t state, const Options &_opts) {
 
 std::vector<uint8_t> DecodeInterleaved(const std::vector<uint8_t> &data, size_t num_symbols,
                                        const Options &opts, size_t num_streams) {
+  return std::move(DecodeInterleaved(data.data(), data.size(), num_symbols, opts, num_streams));
+}
+
+std::vector<uint8_t> DecodeInterleaved(const uint8_t *data, size_t data_sz, size_t num_symbols,
+                                       const Options &opts, size_t num_streams) {
   if ((num_symbols % num_streams) != 0) {
     assert(!"Number of symbols does not divide requested number of streams.");
     return std::vector<uint8_t>();
   }
 
+  std::vector<uint8_t> symbols(num_symbols, 0);
+  DecodeInterleaved(data, data_sz, num_symbols, opts, num_streams, symbols.data());
+  return std::move(symbols);
+}
+
+void DecodeInterleaved(const uint8_t *data, size_t data_sz, size_t num_symbols,
+                       const Options &opts, size_t num_streams, uint8_t *out) {
+  if ((num_symbols % num_streams) != 0) {
+    assert(!"Number of symbols does not divide requested number of streams.");
+    return;
+  }
+
   // Initialize decoders
   std::vector<std::unique_ptr<Decoder>> decoders;
   decoders.reserve(num_streams);
-  assert(data.size() >= num_streams * 4
+  assert(data_sz >= num_streams * 4
          || "Data size not large enough to hold state values for decoders!");
-  const uint32_t *states =
-    reinterpret_cast<const uint32_t *>(data.data() + data.size()) - num_streams;
+  const size_t encoded_data_size = data_sz - num_streams * 4;
   for (size_t i = 0; i < num_streams; ++i) {
-    decoders.push_back(Decoder::Create(states[i], opts));
+    uint32_t state;
+    memcpy(&state, data + encoded_data_size + i * 4, sizeof(state));
+    decoders.push_back(Decoder::Create(state, opts));
   }
 
+  // The encoders wrote their renormalization words front to back, so the
+  // decoders need to consume them back to front.
   const int bits_per_normalization = IntLog2(opts.b);
-  const size_t encoded_data_size = data.size() - num_streams * 4;
-
-  std::vector<uint32_t> normalization_stream;
-  BitReader data_reader(data.data());
-  for (size_t i = 0; i < encoded_data_size * 8; i += bits_per_normalization) {
-    uint32_t norm = data_reader.ReadBits(bits_per_normalization);
-    normalization_stream.push_back(norm);
-  }
-
-  std::reverse(normalization_stream.begin(), normalization_stream.end());
-
-  // Pack it in again...
-  ContainedBitWriter encoded_writer;
-  for (const auto &renorm : normalization_stream) {
-    encoded_writer.WriteBits(renorm, bits_per_normalization);
-  }
-
-  std::vector<uint8_t> encoded_data = std::move(encoded_writer.GetData());
-  BitReader encoded_reader(encoded_data.data());
+  const size_t num_words =
+    (encoded_data_size * 8 + bits_per_normalization - 1) / bits_per_normalization;
+  ReverseBitReader encoded_reader(data, num_words, bits_per_normalization);
 
   const size_t symbols_per_stream = num_symbols / num_streams;
   assert(symbols_per_stream * num_streams == num_symbols);
 
-  std::vector<uint8_t> symbols(num_symbols, 0);
   for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
     for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
       size_t decoder_idx = num_streams - strm_idx - 1;
       size_t idx = (decoder_idx + 1) * symbols_per_stream - sym_idx - 1;
-      symbols[idx] = decoders[decoder_idx]->Decode(&encoded_reader);
+      out[idx] = static_cast<uint8_t>(decoders[decoder_idx]->Decode(&encoded_reader));
     }
   }
-
-  return std::move(symbols);
 }
 
 }  // namespace ans
@@ -1,4 +1,6 @@
 #include <algorithm>
+#include <cstring>
+#include <numeric>
 #include <random>
 #include <vector>
 
@@ -11,108 +13,25 @@ namespace ans {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// rANS
+// Encoder tables
 //
 
-class rANS_Encoder : public Encoder {
-public:
-  // The constructor initializes M to be the sum of all Fs. It uses k
-  // to determine the proper normalization interval for encoding. It uses
-  // b to know how many bytes/bits etc to emit at a time.
-  rANS_Encoder(const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k);
-
-  virtual void Encode(uint32_t symbol, BitWriter *w) override;
-  virtual uint32_t GetState() const override { return _state; }
-
-private:
-  const std::vector<uint32_t> _F;
-  const std::vector<uint32_t> _B;
-
-  const uint32_t _M;
-  const uint32_t _b;
-  const uint32_t _k;
-  const int _log_b;
-
-  uint32_t _state;
-};
-
-rANS_Encoder::rANS_Encoder(const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k)
-  : Encoder()
-  , _F(Fs)
-  , _B(CumulativeSum(Fs))
-  , _M(_B.back() + _F.back())
-  , _b(b)
-  , _k(k)
-  , _log_b(IntLog2(b))
-  , _state(_k * _M)
-{
-  assert((b & (b - 1)) == 0 || "rANS encoder may only emit powers-of-two for renormalization!");
-  assert(static_cast<uint64_t>(_k) * static_cast<uint64_t>(_M) < (1ULL << 32));
-  assert((static_cast<uint64_t>(b) *
-          static_cast<uint64_t>(_k) *
-          static_cast<uint64_t>(_M)) < (1ULL << 32));
-}
-
-void rANS_Encoder::Encode(uint32_t symbol, BitWriter *w) {
-  assert(_k * _M <= _state && _state < _b * _k * _M);
-  assert(symbol < _F.size());
-
-  // Renormalize
-  uint32_t upper_bound = _b * _k * _F[symbol];
-  while (_state >= upper_bound) {
-    w->WriteBits(_state & (_b - 1), _log_b);
-    _state /= _b;
-  }
-
-  // Encode
-  _state = ((_state / _F[symbol]) * _M) + _B[symbol] + (_state % _F[symbol]);
-}
-
-////////////////////////////////////////////////////////////////////////////////
+// This is a table of the rearranged symbols to be used for tANS.
 //
-// tANS
+// Whenever we encode a symbol, s, we have to make sure that the current
+// state is within the range [Fs, bFs). If not, then we need to stream
+// out bits until it is. We also know that if the state is within
+// [Fs, q*Fs), then the state after encoding will end up within [M, q*M)
+// for any integer q <= b. To be more specific, if the state is within
+// [q*Fs, (q+1)*Fs) prior to encoding, then the state after encoding will
+// be within [q*M, (q+1)*M). Moreover, if x is in [Fs, 2*Fs) and x' = C(x)
+// is within [M, 2*M), and y is in [q*Fs, (q+1)*Fs) such that y = x mod Fs,
+// then y' = C(y) = x' mod M.
 //
-
-class tANS_Encoder : public Encoder {
-public:
-  // The constructor initializes M to be the sum of all Fs. It uses k
-  // to determine the proper normalization interval for encoding. It uses
-  // b to know how many bytes/bits etc to emit at a time.
-  tANS_Encoder(const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k);
-
-  virtual void Encode(uint32_t symbol, BitWriter *w) override;
-  virtual uint32_t GetState() const override { return _state; }
-
-private:
-  const std::vector<uint32_t> _F;
-  const std::vector<uint32_t> _B;
-
-  const uint32_t _M;
-  const uint32_t _b;
-  const uint32_t _k;
-  const int _log_b;
-
-  // This is a table of the rearranged symbols to be used for tANS.
-  //
-  // Whenever we encode a symbol, s, we have to make sure that the current
-  // state is within the range [Fs, bFs). If not, then we need to stream
-  // out bits until it is. We also know that if the state is within
-  // [Fs, q*Fs), then the state after encoding will end up within [M, q*M)
-  // for any integer q <= b. To be more specific, if the state is within
-  // [q*Fs, (q+1)*Fs) prior to encoding, then the state after encoding will
-  // be within [q*M, (q+1)*M). Moreover, if x is in [Fs, 2*Fs) and x' = C(x)
-  // is within [M, 2*M), and y is in [q*Fs, (q+1)*Fs) such that y = x mod Fs,
-  // then y' = C(y) = x' mod M.
-  //
-  // This means that regardless of k and b, we only need a table of size M
-  // and that when we do an encoding step, we need to find
-  //
-  // x' = (x / Fs) * M + _enc_table[Bs + (x % Fs)];
-  const std::vector<uint32_t> _enc_table;
-
-  uint32_t _state;
-};
-
+// This means that regardless of k and b, we only need a table of size M
+// and that when we do an encoding step, we need to find
+//
+// x' = (x / Fs) * M + enc_table[Bs + (x % Fs)];
 static std::vector<uint32_t> BuildEncTable(const std::vector<uint32_t> &Fs, const uint32_t M) {
   // Collect symbols...
   std::vector<uint32_t> unpacked_table = std::vector<uint32_t>(M);
@@ -148,66 +67,209 @@ static std::vector<uint32_t> BuildEncTable(const std::vector<uint32_t> &Fs, cons
   return std::move(result);
 }
 
-tANS_Encoder::tANS_Encoder(const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k)
-  : Encoder()
-  , _F(Fs)
-  , _B(CumulativeSum(Fs))
-  , _M(_B.back() + _F.back())
-  , _b(b)
-  , _k(k)
-  , _log_b(IntLog2(b))
-  , _enc_table(std::move(BuildEncTable(Fs, _M)))
-  , _state(_k * _M)
+static std::vector<EncoderTable::SymbolInfo>
+BuildSymbolInfo(const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k) {
+  std::vector<EncoderTable::SymbolInfo> result(Fs.size());
+  for (size_t i = 0; i < Fs.size(); ++i) {
+    const uint32_t F = Fs[i];
+    EncoderTable::SymbolInfo &info = result[i];
+    if (0 == F) {
+      // Can't be encoded
+      memset(&info, 0, sizeof(info));
+      continue;
+    }
+
+    // Round-up division by F, i.e. with l = ceil(log2(F)), the multiplier
+    // is 2^32 * (2^l - F) / F + 1 and the total shift is l.
+    const uint32_t l = static_cast<uint32_t>(IntLog2(F)) + (((F & (F - 1)) != 0) ? 1 : 0);
+    const uint64_t rcp = (((1ULL << l) - F) << 32) / F + 1;
+    assert(rcp <= 0xFFFFFFFFULL);
+
+    info.x_max = b * k * F;
+    info.rcp_freq = static_cast<uint32_t>(rcp);
+    info.rcp_shift1 = static_cast<uint16_t>(std::min(l, 1U));
+    info.rcp_shift2 = static_cast<uint16_t>((l > 0) ? l - 1 : 0);
+  }
+
+  return std::move(result);
+}
+
+EncoderTable::EncoderTable(EType _type, uint32_t _b, uint32_t _k, std::vector<uint32_t> &&_F)
+  : type(_type)
+  , b(_b)
+  , k(_k)
+  , M(std::accumulate(_F.begin(), _F.end(), 0U))
+  , log_b(IntLog2(_b))
+  , F(std::move(_F))
+  , B(CumulativeSum(F))
+  , enc_table(eType_tANS == _type ? BuildEncTable(F, M) : std::vector<uint32_t>())
+  , symbol_info(BuildSymbolInfo(F, _b, _k))
 {
-  assert((b & (b - 1)) == 0 || "rANS encoder may only emit powers-of-two for renormalization!");
-  assert(static_cast<uint64_t>(_k) * static_cast<uint64_t>(_M) < (1ULL << 32));
+  assert((b & (b - 1)) == 0 || "ANS encoder may only emit powers-of-two for renormalization!");
+  assert(static_cast<uint64_t>(k) * static_cast<uint64_t>(M) < (1ULL << 32));
   assert((static_cast<uint64_t>(b) *
-          static_cast<uint64_t>(_k) *
-          static_cast<uint64_t>(_M)) < (1ULL << 32));
+          static_cast<uint64_t>(k) *
+          static_cast<uint64_t>(M)) < (1ULL << 32));
 }
 
-void tANS_Encoder::Encode(uint32_t symbol, BitWriter *w) {
-  assert(_k * _M <= _state && _state < _b * _k * _M);
-  assert(symbol < _F.size());
+std::shared_ptr<const EncoderTable> EncoderTable::Create(const Options &_opts) {
+  Options opts(_opts);
 
-  // Renormalize
-  uint32_t upper_bound = _b * _k * _F[symbol];
-  while (_state >= upper_bound) {
-    w->WriteBits(_state & (_b - 1), _log_b);
-    _state /= _b;
+  std::shared_ptr<const EncoderTable> table;
+  if (!FixInvalidOptions(&opts)) {
+    assert(!"Invalid options!");
+    return table;
   }
 
-  // Make sure it's normalized...
-  assert(_state >= _k * _F[symbol]);
+  if (opts.type != eType_rANS && opts.type != eType_tANS) {
+    assert(!"Unknown type!");
+    return table;
+  }
 
-  // Encode
-  _state = ((_state / _F[symbol]) * _M) + _enc_table[_B[symbol] + (_state % _F[symbol])];
+  int denom = static_cast<int>(opts.M);
+  std::vector<uint32_t> normalized_fs =
+    ans::GenerateHistogram(opts.Fs, denom);
+
+  table.reset(new EncoderTable(opts.type, opts.b, opts.k, std::move(normalized_fs)));
+  return table;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// ANS Factory
+// Encoding steps
+//
+// These are shared between the virtual encoders below and the interleaved
+// encoding loop, which instantiates them with a concrete writer so that
+// neither the step nor the writer goes through a virtual call.
 //
 
-std::unique_ptr<Encoder> Encoder::Create(const Options &_opts) {
-  Options opts(_opts);
+struct rANS_Step {
+  template<typename Writer>
+  static inline uint32_t Encode(const EncoderTable &t, uint32_t state, uint32_t symbol, Writer *w) {
+    assert(t.k * t.M <= state && state < t.b * t.k * t.M);
+    assert(symbol < t.F.size());
+
+    // Renormalize
+    const uint32_t F = t.F[symbol];
+    uint32_t upper_bound = t.b * t.k * F;
+    while (state >= upper_bound) {
+      w->WriteBits(state & (t.b - 1), t.log_b);
+      state /= t.b;
+    }
 
-  std::unique_ptr<Encoder> enc;
-  if (!FixInvalidOptions(&opts)) {
-    assert(!"Invalid options!");
-    return std::move(enc);
+    // Encode
+    return ((state / F) * t.M) + t.B[symbol] + (state % F);
   }
+};
 
-  int denom = static_cast<int>(opts.M);
-  std::vector<uint32_t> normalized_fs =
-    ans::GenerateHistogram(opts.Fs, denom);
+struct tANS_Step {
+  template<typename Writer>
+  static inline uint32_t Encode(const EncoderTable &t, uint32_t state, uint32_t symbol, Writer *w) {
+    assert(t.k * t.M <= state && state < t.b * t.k * t.M);
+    assert(symbol < t.F.size());
+
+    // Renormalize
+    const uint32_t F = t.F[symbol];
+    uint32_t upper_bound = t.b * t.k * F;
+    while (state >= upper_bound) {
+      w->WriteBits(state & (t.b - 1), t.log_b);
+      state /= t.b;
+    }
 
-  switch (opts.type) {
+    // Make sure it's normalized...
+    assert(state >= t.k * F);
+
+    // Encode
+    return ((state / F) * t.M) + t.enc_table[t.B[symbol] + (state % F)];
+  }
+};
+
+// Same as above, but with the divisions by b and F[s] replaced by shifts
+// and reciprocal multiplies. These produce exactly the same states.
+template<typename Writer>
+static inline uint32_t RenormalizeAndDivide(const EncoderTable &t, uint32_t *state,
+                                            uint32_t symbol, Writer *w) {
+  const EncoderTable::SymbolInfo &info = t.symbol_info[symbol];
+
+  uint32_t x = *state;
+  while (x >= info.x_max) {
+    w->WriteBits(x & (t.b - 1), t.log_b);
+    x >>= t.log_b;
+  }
+  *state = x;
+
+  const uint32_t q = static_cast<uint32_t>((static_cast<uint64_t>(x) * info.rcp_freq) >> 32);
+  return (q + ((x - q) >> info.rcp_shift1)) >> info.rcp_shift2;
+}
+
+struct rANS_ReciprocalStep {
+  template<typename Writer>
+  static inline uint32_t Encode(const EncoderTable &t, uint32_t state, uint32_t symbol, Writer *w) {
+    assert(t.k * t.M <= state && state < t.b * t.k * t.M);
+    assert(symbol < t.F.size());
+
+    const uint32_t q = RenormalizeAndDivide(t, &state, symbol, w);
+    assert(q == state / t.F[symbol]);
+    return q * t.M + t.B[symbol] + (state - q * t.F[symbol]);
+  }
+};
+
+struct tANS_ReciprocalStep {
+  template<typename Writer>
+  static inline uint32_t Encode(const EncoderTable &t, uint32_t state, uint32_t symbol, Writer *w) {
+    assert(t.k * t.M <= state && state < t.b * t.k * t.M);
+    assert(symbol < t.F.size());
+
+    const uint32_t q = RenormalizeAndDivide(t, &state, symbol, w);
+    assert(q == state / t.F[symbol]);
+    assert(state >= t.k * t.F[symbol]);
+    return q * t.M + t.enc_table[t.B[symbol] + (state - q * t.F[symbol])];
+  }
+};
+
+// rANS and tANS only differ in their encoding step
+template<typename Step>
+class ANS_Encoder : public Encoder {
+public:
+  ANS_Encoder(const std::shared_ptr<const EncoderTable> &table)
+    : Encoder()
+    , _table(table)
+    , _state(table->k * table->M)
+  { }
+
+  virtual void Encode(uint32_t symbol, BitWriter *w) override {
+    _state = Step::Encode(*_table, _state, symbol, w);
+  }
+
+  virtual uint32_t GetState() const override { return _state; }
+
+private:
+  const std::shared_ptr<const EncoderTable> _table;
+  uint32_t _state;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ANS Factory
+//
+
+std::unique_ptr<Encoder> Encoder::Create(const Options &opts) {
+  std::shared_ptr<const EncoderTable> table = EncoderTable::Create(opts);
+  if (!table) {
+    return std::unique_ptr<Encoder>();
+  }
+
+  return std::move(Create(table));
+}
+
+std::unique_ptr<Encoder> Encoder::Create(const std::shared_ptr<const EncoderTable> &table) {
+  std::unique_ptr<Encoder> enc;
+  switch (table->type) {
     case eType_rANS:
-      enc.reset(new rANS_Encoder(normalized_fs, opts.b, opts.k));
+      enc.reset(new ANS_Encoder<rANS_ReciprocalStep>(table));
       break;
     case eType_tANS:
-      enc.reset(new tANS_Encoder(normalized_fs, opts.b, opts.k));
+      enc.reset(new ANS_Encoder<tANS_ReciprocalStep>(table));
       break;
     default:
       assert(!"Unknown type!");
@@ -222,28 +284,59 @@ std::unique_ptr<Encoder> Encoder::Create(const Options &_opts) {
 // Interleaved encoding
 //
 
+template<typename Step>
+static void EncodeStreams(const uint8_t *symbols, size_t symbols_per_stream,
+                          const EncoderTable &table, size_t num_streams,
+                          uint32_t *states, ContainedBitWriter *w) {
+  for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
+    for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
+      size_t idx = strm_idx * symbols_per_stream + sym_idx;
+      states[strm_idx] = Step::Encode(table, states[strm_idx], symbols[idx], w);
+    }
+  }
+}
+
 std::vector<uint8_t> EncodeInterleaved(const std::vector<uint8_t> &symbols,
                                        const Options &opts, size_t num_streams) {
-  if ((symbols.size() % num_streams) != 0) {
-    assert(!"Number of symbols does not divide requested number of streams.");
+  std::shared_ptr<const EncoderTable> table = EncoderTable::Create(opts);
+  if (!table) {
     return std::vector<uint8_t>();
   }
 
-  std::vector<std::unique_ptr<Encoder>> encoders;
-  encoders.reserve(num_streams);
-  for (size_t i = 0; i < num_streams; ++i) {
-    encoders.push_back(Encoder::Create(opts));
+  return std::move(EncodeInterleaved(symbols.data(), symbols.size(), *table, num_streams));
+}
+
+std::vector<uint8_t> EncodeInterleaved(const uint8_t *symbols, size_t num_symbols,
+                                       const EncoderTable &table, size_t num_streams,
+                                       bool use_reciprocals) {
+  if ((num_symbols % num_streams) != 0) {
+    assert(!"Number of symbols does not divide requested number of streams.");
+    return std::vector<uint8_t>();
   }
 
-  const size_t symbols_per_stream = symbols.size() / num_streams;
+  const size_t symbols_per_stream = num_symbols / num_streams;
+  std::vector<uint32_t> states(num_streams, table.k * table.M);
   ContainedBitWriter w;
 
-  assert(symbols_per_stream * num_streams == symbols.size());
-  for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
-    for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
-      size_t idx = strm_idx * symbols_per_stream + sym_idx;
-      encoders[strm_idx]->Encode(symbols[idx], &w);
-    }
+  assert(symbols_per_stream * num_streams == num_symbols);
+  switch (table.type) {
+    case eType_rANS:
+      if (use_reciprocals) {
+        EncodeStreams<rANS_ReciprocalStep>(symbols, symbols_per_stream, table, num_streams, states.data(), &w);
+      } else {
+        EncodeStreams<rANS_Step>(symbols, symbols_per_stream, table, num_streams, states.data(), &w);
+      }
+      break;
+    case eType_tANS:
+      if (use_reciprocals) {
+        EncodeStreams<tANS_ReciprocalStep>(symbols, symbols_per_stream, table, num_streams, states.data(), &w);
+      } else {
+        EncodeStreams<tANS_Step>(symbols, symbols_per_stream, table, num_streams, states.data(), &w);
+      }
+      break;
+    default:
+      assert(!"Unknown type!");
+      break;
   }
 
   std::vector<uint8_t> result = std::move(w.GetData());
@@ -251,10 +344,7 @@ std::vector<uint8_t> EncodeInterleaved(const std::vector<uint8_t> &symbols,
   // Write the states at the end of the stream...
   const size_t end_of_stream = result.size();
   result.resize(end_of_stream + num_streams * 4);
-  uint32_t *states = reinterpret_cast<uint32_t *>(result.data() + end_of_stream);
-  for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
-    states[strm_idx] = encoders[strm_idx]->GetState();
-  }
+  memcpy(result.data() + end_of_stream, states.data(), num_streams * 4);
 
   return std::move(result);
 }
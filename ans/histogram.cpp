@@ -2,9 +2,11 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 #include <functional>
 #include <numeric>
+#include <thread>
 
 namespace ans {
   struct Symbol {
@@ -24,6 +26,72 @@ namespace ans {
   }
 #endif
 
+  static const size_t kNumCountBuckets = 4;
+  static const size_t kMinBytesPerCountThread = 1 << 16;
+
+  static void CountBytesRange(const uint8_t *symbols, size_t num_symbols, uint32_t *counts) {
+    // Consecutive symbols land in different buckets, so a run of equal
+    // symbols doesn't wait on the previous increment of the same counter.
+    uint32_t buckets[kNumCountBuckets][256];
+    memset(buckets, 0, sizeof(buckets));
+
+    size_t i = 0;
+    for (; i + kNumCountBuckets <= num_symbols; i += kNumCountBuckets) {
+      buckets[0][symbols[i + 0]]++;
+      buckets[1][symbols[i + 1]]++;
+      buckets[2][symbols[i + 2]]++;
+      buckets[3][symbols[i + 3]]++;
+    }
+
+    for (; i < num_symbols; ++i) {
+      buckets[0][symbols[i]]++;
+    }
+
+    for (size_t j = 0; j < 256; ++j) {
+      counts[j] = buckets[0][j] + buckets[1][j] + buckets[2][j] + buckets[3][j];
+    }
+  }
+
+  std::vector<uint32_t> CountBytes(const uint8_t *symbols, size_t num_symbols,
+                                   size_t num_threads) {
+    if (0 == num_threads) {
+      num_threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    num_threads = std::min(num_threads, num_symbols / kMinBytesPerCountThread);
+
+    std::vector<uint32_t> counts(256, 0);
+    if (num_threads <= 1) {
+      CountBytesRange(symbols, num_symbols, counts.data());
+      return std::move(counts);
+    }
+
+    // Each thread fills its own table and we add them up afterwards, so the
+    // result doesn't depend on how the input was split.
+    std::vector<uint32_t> thread_counts(num_threads * 256);
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+
+    const size_t symbols_per_thread = (num_symbols + num_threads - 1) / num_threads;
+    for (size_t i = 0; i < num_threads; ++i) {
+      const size_t start = std::min(num_symbols, i * symbols_per_thread);
+      const size_t end = std::min(num_symbols, start + symbols_per_thread);
+      threads.push_back(std::thread(CountBytesRange, symbols + start, end - start,
+                                    thread_counts.data() + i * 256));
+    }
+
+    for (auto &t : threads) {
+      t.join();
+    }
+
+    for (size_t i = 0; i < num_threads; ++i) {
+      for (size_t j = 0; j < 256; ++j) {
+        counts[j] += thread_counts[i * 256 + j];
+      }
+    }
+
+    return std::move(counts);
+  }
+
   static double GetFreqChange(int count, int new_count, int correction_sign) {
     return log2(static_cast<double>(new_count) /
                 static_cast<double>(new_count + correction_sign)) *
@@ -1,8 +1,10 @@
 #ifndef __HISTOGRAM_H__
 #define __HISTOGRAM_H__
 
+#include <cstddef>
 #include <cstdint>
 #include <limits>
+#include <type_traits>
 #include <vector>
 
 namespace ans {
@@ -13,12 +15,34 @@ namespace ans {
   std::vector<uint32_t> GenerateHistogram(const std::vector<uint32_t> &counts,
                                           const int M);
 
+  // Returns the number of times each byte value occurs in `symbols`. The
+  // counts are spread over several sub-histograms so that runs of the same
+  // symbol don't stall on a single counter. Inputs that are large enough are
+  // split across `num_threads` threads, or one per core if it's zero.
+  std::vector<uint32_t> CountBytes(const uint8_t *symbols, size_t num_symbols,
+                                   size_t num_threads = 1);
+
   template<typename T>
-  std::vector<uint32_t> CountSymbols(const std::vector<T> &symbols) {
+  std::vector<uint32_t> CountSymbols(const std::vector<T> &symbols, size_t num_threads = 1) {
     uint32_t minval = static_cast<uint32_t>(std::numeric_limits<T>::min());
     uint32_t maxval = static_cast<uint32_t>(std::numeric_limits<T>::max());
     uint32_t range = maxval - minval + 1;
 
+    if (sizeof(T) == 1) {
+      std::vector<uint32_t> byte_counts =
+        CountBytes(reinterpret_cast<const uint8_t *>(symbols.data()), symbols.size(), num_threads);
+      if (!std::is_signed<T>::value) {
+        return std::move(byte_counts);
+      }
+
+      // Signed bytes start at -128, which is stored as 0x80
+      std::vector<uint32_t> counts(range, 0);
+      for (uint32_t i = 0; i < range; ++i) {
+        counts[i] = byte_counts[(i + minval) & 0xFF];
+      }
+      return std::move(counts);
+    }
+
     std::vector<uint32_t> counts(range, 0);
     for (auto s : symbols) {
       counts[s - minval]++;
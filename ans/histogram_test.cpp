@@ -1,5 +1,9 @@
 #include "gtest/gtest.h"
 
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
 #include "histogram.h"
 
 template<typename T, typename U> ::testing::AssertionResult
@@ -101,3 +105,103 @@ TEST(Histogram, ProperlyDistributesFreqsNPOT) {
   std::vector<uint32_t> expected(expected_vec, expected_vec + (sizeof(expected_vec) / sizeof(expected_vec[0])));
   EXPECT_TRUE(VectorsAreEqual(hist, expected));
 }
+
+static std::vector<uint8_t> GenerateBytes(size_t num_bytes) {
+  srand(0);
+  std::vector<uint8_t> bytes;
+  bytes.reserve(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) {
+    // Long runs of the same few symbols, like the index deltas
+    bytes.push_back(static_cast<uint8_t>(128 + (rand() % 3) * (rand() % 2)));
+  }
+  return std::move(bytes);
+}
+
+static std::vector<uint32_t> CountBytesScalar(const std::vector<uint8_t> &bytes) {
+  std::vector<uint32_t> counts(256, 0);
+  for (auto b : bytes) {
+    counts[b]++;
+  }
+  return std::move(counts);
+}
+
+TEST(Histogram, CountsBytes) {
+  for (size_t num_bytes : { 0, 1, 3, 17, 1000, 1 << 20 }) {
+    std::vector<uint8_t> bytes = GenerateBytes(num_bytes);
+    std::vector<uint32_t> expected = CountBytesScalar(bytes);
+
+    for (size_t num_threads : { 1, 2, 7, 0 }) {
+      std::vector<uint32_t> counts = ans::CountBytes(bytes.data(), bytes.size(), num_threads);
+      EXPECT_TRUE(VectorsAreEqual(counts, expected)) << "Threads: " << num_threads;
+    }
+  }
+}
+
+TEST(Histogram, CountsSignedSymbols) {
+  const int8_t symbols_vec[] = { -128, -1, 0, 0, 5, 127, -1, -1 };
+  std::vector<int8_t> symbols(symbols_vec, symbols_vec + (sizeof(symbols_vec) / sizeof(symbols_vec[0])));
+  std::vector<uint32_t> counts = ans::CountSymbols(symbols);
+
+  ASSERT_EQ(counts.size(), 256);
+  EXPECT_EQ(counts[0], 1);
+  EXPECT_EQ(counts[127], 3);
+  EXPECT_EQ(counts[128], 2);
+  EXPECT_EQ(counts[133], 1);
+  EXPECT_EQ(counts[255], 1);
+
+  const int16_t shorts_vec[] = { -300, 300, 300 };
+  std::vector<int16_t> shorts(shorts_vec, shorts_vec + (sizeof(shorts_vec) / sizeof(shorts_vec[0])));
+  std::vector<uint32_t> short_counts = ans::CountSymbols(shorts);
+
+  ASSERT_EQ(short_counts.size(), 65536);
+  EXPECT_EQ(short_counts[32768 - 300], 1);
+  EXPECT_EQ(short_counts[32768 + 300], 2);
+}
+
+TEST(Histogram, CountingThroughput) {
+  const size_t kNumBytes = 1 << 24;
+  std::vector<uint8_t> bytes = GenerateBytes(kNumBytes);
+  const double mb = static_cast<double>(kNumBytes) / (1024.0 * 1024.0);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<uint32_t> expected = CountBytesScalar(bytes);
+  auto end = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double> secs = end - start;
+  std::cout << "Scalar: " << (mb / secs.count()) << " MB/s" << std::endl;
+
+  for (size_t num_threads : { 1, 0 }) {
+    start = std::chrono::high_resolution_clock::now();
+    std::vector<uint32_t> counts = ans::CountBytes(bytes.data(), bytes.size(), num_threads);
+    end = std::chrono::high_resolution_clock::now();
+
+    secs = end - start;
+    std::cout << "Buckets (" << ((0 == num_threads) ? "all cores" : "one thread") << "): "
+              << (mb / secs.count()) << " MB/s" << std::endl;
+
+    EXPECT_TRUE(VectorsAreEqual(counts, expected));
+  }
+}
+
+TEST(Histogram, NormalizationThroughput) {
+  srand(0);
+  const size_t kNumTables = 10000;
+
+  std::vector<std::vector<uint32_t> > counts(kNumTables, std::vector<uint32_t>(256));
+  for (auto &c : counts) {
+    for (auto &x : c) {
+      x = static_cast<uint32_t>(rand() % 1000);
+    }
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for (const auto &c : counts) {
+    std::vector<uint32_t> hist = ans::GenerateHistogram(c, 1 << 11);
+    ASSERT_EQ(hist.size(), c.size());
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double> secs = end - start;
+  std::cout << "Normalized " << (static_cast<double>(kNumTables) / secs.count())
+            << " tables/s" << std::endl;
+}
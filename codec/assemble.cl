@@ -1,54 +1,66 @@
 #pragma OPENCL EXTENSION cl_khr_byte_addressable_store : enable
 
+// Matches TextureInfo in decoder.cpp
+typedef struct {
+  uint stream_offsets[4];
+  uint blocks_x;
+  uint blocks_y;
+  uint first_block;
+  uint width;
+  uint height;
+  uint out_offset;
+  uint refs_offset;
+  uint num_refs;
+} TextureInfo;
+
 #ifdef GENTC_APPLE
-static uint NumBlocks();
-static uint ThreadIdx();
-static int Get(const __global char *planes, uint offset);
-static int GetY(const __global char *planes, uint endpoint_idx);
-static int GetCo(const __global char *planes, uint endpoint_idx);
-static int GetCg(const __global char *planes, uint endpoint_idx);
+static uint FindTexture(const __global TextureInfo *textures, uint num_textures, uint block);
+static int Get(const __global char *planes, uint num_blocks, uint offset);
+static int GetY(const __global char *planes, uint num_blocks, uint endpoint_idx);
+static int GetCo(const __global char *planes, uint num_blocks, uint endpoint_idx);
+static int GetCg(const __global char *planes, uint num_blocks, uint endpoint_idx);
 static int4 YCoCgToRGB(int4 in);
-static ushort GetPixel(const __global char *planes, uint endpoint_idx);
+static ushort GetPixel(const __global char *planes, uint num_blocks, uint endpoint_idx);
 #endif
 
-uint NumBlocks() {
-  return get_global_size(0) * get_global_size(1);
-}
-
-uint ThreadIdx() {
-  return get_global_id(1) * get_global_size(0) + get_global_id(0);
-}
-
-int Get(const __global char *planes, uint offset) {
-  const uint idx = NumBlocks() * offset + ThreadIdx();
-  return (int)(planes[idx]);
+// The blocks of all of the textures of a batch are numbered one after
+// another. Returns the texture that the given block belongs to.
+uint FindTexture(const __global TextureInfo *textures, uint num_textures, uint block) {
+  uint first = 0;
+  uint last = num_textures;
+  while (last - first > 1) {
+    const uint mid = (first + last) / 2;
+    if (textures[mid].first_block <= block) {
+      first = mid;
+    } else {
+      last = mid;
+    }
+  }
+  return first;
 }
 
-int GetY(const __global char *planes, uint endpoint_idx) {
-  return Get(planes, endpoint_idx);
+// The endpoint planes of a texture are num_blocks apart, and planes points
+// at the block that we're assembling in the first one.
+int Get(const __global char *planes, uint num_blocks, uint offset) {
+  return (int)(planes[num_blocks * offset]);
 }
 
-int GetCo(const __global char *planes, uint endpoint_idx) {
-  return Get(planes, 2 + 2 * endpoint_idx);
+int GetY(const __global char *planes, uint num_blocks, uint endpoint_idx) {
+  return Get(planes, num_blocks, endpoint_idx);
 }
 
-int GetCg(const __global char *planes, uint endpoint_idx) {
-  return Get(planes, 2 + 2 * endpoint_idx + 1);
+int GetCo(const __global char *planes, uint num_blocks, uint endpoint_idx) {
+  return Get(planes, num_blocks, 2 + 2 * endpoint_idx);
 }
 
-int4 YCoCgToRGB(int4 in) {
-  int4 out;
-  int t = in.x - (in.z / 2);
-  out.y = in.z + t;
-  out.z = (t - in.y) / 2;
-  out.x = out.z + in.y;
-  return out;
+int GetCg(const __global char *planes, uint num_blocks, uint endpoint_idx) {
+  return Get(planes, num_blocks, 2 + 2 * endpoint_idx + 1);
 }
 
-ushort GetPixel(const __global char *planes, uint endpoint_idx) {
-  int y = GetY(planes, endpoint_idx);
-  int co = GetCo(planes, endpoint_idx);
-  int cg = GetCg(planes, endpoint_idx);
+ushort GetPixel(const __global char *planes, uint num_blocks, uint endpoint_idx) {
+  int y = GetY(planes, num_blocks, endpoint_idx);
+  int co = GetCo(planes, num_blocks, endpoint_idx);
+  int cg = GetCg(planes, num_blocks, endpoint_idx);
 
   int4 rgb = YCoCgToRGB((int4)(y, co, cg, 0));
 
@@ -61,42 +73,76 @@ ushort GetPixel(const __global char *planes, uint endpoint_idx) {
   return pixel;
 }
 
-__kernel void assemble_dxt(const __global    int  *global_palette,
-                           const __constant uint  *global_offsets,
-                           const __global   char  *endpoint_planes,
-                           const __global    int  *indices,
-                                 __global ushort  *global_out) {
-  const uint global_offset = NumBlocks() * 6 * get_global_id(2);
+// The assembly kernels have one thread for every coded block of the batch.
+// The blocks of all of the textures are numbered one after another, and
+// each thread looks up the texture of its block, but only writes it out if
+// it covers the texture's width x height pixels. Each texture is written
+// starting out_offset bytes into global_out.
+__kernel void assemble_dxt(const __global        int  *global_palette,
+                           const __global TextureInfo *textures,
+                           const                 uint  num_textures,
+                           const __global       char  *endpoint_planes,
+                           const __global        int  *indices,
+                                 __global     ushort  *global_out) {
+  const uint block = get_global_id(0);
+  const __global TextureInfo *texture = textures + FindTexture(textures, num_textures, block);
+  const uint num_blocks = texture->blocks_x * texture->blocks_y;
+  const uint block_idx = block - texture->first_block;
+  const uint block_x = block_idx % texture->blocks_x;
+  const uint block_y = block_idx / texture->blocks_x;
+
+  const uint blocks_x = (texture->width + 3) / 4;
+  const uint blocks_y = (texture->height + 3) / 4;
+  if (block_x >= blocks_x || block_y >= blocks_y) {
+    return;
+  }
+
+  const __global char *planes = endpoint_planes + 6 * texture->first_block + block_idx;
 
-  ushort ep1 = GetPixel(endpoint_planes + global_offset, 0);
-  ushort ep2 = GetPixel(endpoint_planes + global_offset, 1);
+  ushort ep1 = GetPixel(planes, num_blocks, 0);
+  ushort ep2 = GetPixel(planes, num_blocks, 1);
 
-  __global ushort *out = global_out + get_global_id(2) * NumBlocks() * 4;
-  out[4 * ThreadIdx() + 0] = ep1;
-  out[4 * ThreadIdx() + 1] = ep2;
+  const uint out_idx = block_y * blocks_x + block_x;
+  __global ushort *out = global_out + texture->out_offset / 2;
+  out[4 * out_idx + 0] = ep1;
+  out[4 * out_idx + 1] = ep2;
 
-  const __global int *palette = global_palette + global_offsets[4 * get_global_id(2) + 2] / 4;
-  const uint plt_idx = indices[get_global_id(2) * NumBlocks() + ThreadIdx()];
-  *((__global uint *)(out) + 2 * ThreadIdx() + 1) = palette[plt_idx];
+  const __global int *palette = global_palette + texture->stream_offsets[2] / 4;
+  const uint plt_idx = indices[block];
+  *((__global uint *)(out) + 2 * out_idx + 1) = palette[plt_idx];
 }
 
-__kernel void assemble_rgb(const __global   uint  *global_palette,
-                           const __constant uint  *global_offsets,
-                           const __global   char  *endpoint_planes,
-						   const __global    int  *indices,
-						         __global  uchar  *global_out) {
-  const uint global_offset = NumBlocks() * 6 * get_global_id(2);
+__kernel void assemble_rgb(const __global       uint  *global_palette,
+                           const __global TextureInfo *textures,
+                           const                 uint  num_textures,
+                           const __global       char  *endpoint_planes,
+                           const __global        int  *indices,
+                                 __global      uchar  *global_out) {
+  const uint block = get_global_id(0);
+  const __global TextureInfo *texture = textures + FindTexture(textures, num_textures, block);
+  const uint num_blocks = texture->blocks_x * texture->blocks_y;
+  const uint block_idx = block - texture->first_block;
+  const uint block_x = block_idx % texture->blocks_x;
+  const uint block_y = block_idx / texture->blocks_x;
+
+  const uint width = texture->width;
+  const uint height = texture->height;
+  if (4 * block_x >= width || 4 * block_y >= height) {
+    return;
+  }
+
+  const __global char *planes = endpoint_planes + 6 * texture->first_block + block_idx;
 
   int4 palette[4];
 
-  palette[0].x = GetY(endpoint_planes + global_offset, 0);
-  palette[0].y = GetCo(endpoint_planes + global_offset, 0);
-  palette[0].z = GetCg(endpoint_planes + global_offset, 0);
+  palette[0].x = GetY(planes, num_blocks, 0);
+  palette[0].y = GetCo(planes, num_blocks, 0);
+  palette[0].z = GetCg(planes, num_blocks, 0);
   palette[0] = YCoCgToRGB(palette[0]);
 
-  palette[1].x = GetY(endpoint_planes + global_offset, 1);
-  palette[1].y = GetCo(endpoint_planes + global_offset, 1);
-  palette[1].z = GetCg(endpoint_planes + global_offset, 1);
+  palette[1].x = GetY(planes, num_blocks, 1);
+  palette[1].y = GetCo(planes, num_blocks, 1);
+  palette[1].z = GetCg(planes, num_blocks, 1);
   palette[1] = YCoCgToRGB(palette[1]);
 
   palette[0].x = (palette[0].x << 3) | (palette[0].x >> 2);
@@ -110,21 +156,23 @@ __kernel void assemble_rgb(const __global   uint  *global_palette,
   palette[2] = (2 * palette[0] + palette[1]) / 3;
   palette[3] = (palette[0] + 2 * palette[1]) / 3;
 
-  const uint plt_idx = indices[get_global_id(2) * NumBlocks() + ThreadIdx()];
-  uint idx = (global_palette + global_offsets[4 * get_global_id(2) + 2] / 4)[plt_idx];
+  const uint plt_idx = indices[block];
+  uint idx = (global_palette + texture->stream_offsets[2] / 4)[plt_idx];
 
-  __global uchar *out = global_out + NumBlocks() * 3 * 16 * get_global_id(2);
+  __global uchar *out = global_out + texture->out_offset;
   for (int i = 0; i < 16; ++i) {
     int4 rgb = palette[idx & 3];
 
-    uint x = 4 * get_global_id(0) + (i % 4);
-    uint y = 4 * get_global_id(1) + (i / 4);
+    uint x = 4 * block_x + (i % 4);
+    uint y = 4 * block_y + (i / 4);
 
-    uint out_offset  = 3 * (4 * get_global_size(0) * y + x);
-    out[out_offset + 0] = rgb.x;
-    out[out_offset + 1] = rgb.y;
-    out[out_offset + 2] = rgb.z;
+    if (x < width && y < height) {
+      uint pixel_offset = 3 * (width * y + x);
+      out[pixel_offset + 0] = rgb.x;
+      out[pixel_offset + 1] = rgb.y;
+      out[pixel_offset + 2] = rgb.z;
+    }
 
     idx >>= 2;
   }
-}
\ No newline at end of file
+}
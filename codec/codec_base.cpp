@@ -13,14 +13,173 @@ void GenTCHeader::Print() const {
   std::cout << "Chroma compressed size: " << chroma_cmp_sz << std::endl;
   std::cout << "Palette size compressed: " << palette_sz << std::endl;
   std::cout << "Palette index deltas compressed: " << indices_sz << std::endl;
+
+  std::cout << "ANS table size: " << ans_table_size << std::endl;
+  std::cout << "ANS symbols per stream: " << ans_num_encoded_symbols << std::endl;
+  std::cout << "ANS streams per group: " << ans_threads_per_group << std::endl;
+  std::cout << "Tile index size: " << tile_index_sz << std::endl;
+  std::cout << "Coefficient order: "
+            << ((eCoefficientOrder_Bands == coefficient_order) ? "bands" : "tiles") << std::endl;
+  std::cout << "Long-range index references: " << index_refs << std::endl;
+
+  static const char *kStreamNames[kNumStreamTypes] = { "Y", "Chroma", "Palette", "Indices" };
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    std::cout << kStreamNames[i] << " frequency table: ";
+    if (kInlineFreqTable == table_ids[i]) {
+      std::cout << "inline" << std::endl;
+    } else {
+      std::cout << "shared #" << table_ids[i] << std::endl;
+    }
+  }
+}
+
+size_t GenTCHeader::NumInlineTables() const {
+  size_t num_inline = 0;
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    if (kInlineFreqTable == table_ids[i]) {
+      num_inline++;
+    }
+  }
+  return num_inline;
+}
+
+size_t GenTCHeader::CodedBlocksWide() const {
+  return ((BlocksWide() + kWaveletBlockDim - 1) / kWaveletBlockDim) * kWaveletBlockDim;
+}
+
+size_t GenTCHeader::CodedBlocksHigh() const {
+  return ((BlocksHigh() + kWaveletBlockDim - 1) / kWaveletBlockDim) * kWaveletBlockDim;
+}
+
+size_t GenTCHeader::NumSymbols(EStreamType stream) const {
+  const size_t num_blocks = NumCodedBlocks();
+  size_t num_symbols = 0;
+  switch (stream) {
+  case eStreamType_Y: num_symbols = 2 * num_blocks; break;
+  case eStreamType_Chroma: num_symbols = 4 * num_blocks; break;
+  case eStreamType_Palette: num_symbols = palette_bytes + 4 * index_refs; break;
+  case eStreamType_Indices: num_symbols = num_blocks; break;
+  default:
+    assert(!"Unknown stream type!");
+    return 0;
+  }
+
+  const size_t symbols_per_group = ANSGeometry().SymbolsPerGroup();
+  return ((num_symbols + symbols_per_group - 1) / symbols_per_group) * symbols_per_group;
+}
+
+size_t GenTCHeader::NumPreviewSymbols(EStreamType stream, size_t scale) const {
+  assert(eCoefficientOrder_Bands == coefficient_order);
+  assert(0 < scale && scale <= kMaxPreviewScale && (scale & (scale - 1)) == 0);
+
+  size_t num_planes = 0;
+  switch (stream) {
+  case eStreamType_Y: num_planes = 2; break;
+  case eStreamType_Chroma: num_planes = 4; break;
+  default: return NumSymbols(stream);
+  }
+
+  const size_t dim = kWaveletBlockDim / scale;
+  const size_t num_tiles = NumCodedBlocks() / (kWaveletBlockDim * kWaveletBlockDim);
+  const size_t symbols_per_group = ANSGeometry().SymbolsPerGroup();
+  const size_t num_groups = (num_planes * num_tiles * dim * dim + symbols_per_group - 1) / symbols_per_group;
+  return num_groups * symbols_per_group;
+}
+
+size_t GenTCHeader::StreamsEnd() const {
+  return sizeof(*this) + NumInlineTables() * kFreqTableSz
+    + y_cmp_sz + chroma_cmp_sz + palette_sz + indices_sz;
+}
+
+size_t BandOrderIndex(size_t x, size_t y, size_t tile, size_t plane,
+                      size_t num_tiles, size_t num_planes) {
+  assert(x < kWaveletBlockDim && y < kWaveletBlockDim);
+  assert(tile < num_tiles && plane < num_planes);
+
+  // The band is the smallest square that holds the coefficient
+  size_t end = kCoarsestBandDim;
+  while (x >= end || y >= end) {
+    end *= 2;
+  }
+  const size_t begin = (kCoarsestBandDim == end) ? 0 : end / 2;
+
+  // The rows above the square of the previous band only have the values to
+  // its right, and the rows below it are whole.
+  const size_t band_idx = (y < begin)
+    ? y * (end - begin) + (x - begin)
+    : begin * (end - begin) + (y - begin) * end + x;
+
+  const size_t band_sz = end * end - begin * begin;
+  return num_planes * num_tiles * begin * begin + (plane * num_tiles + tile) * band_sz + band_idx;
 }
 
-void GenTCHeader::LoadFrom(const uint8_t *buf) {
+bool GenTCHeader::LoadFrom(const uint8_t *buf) {
   // Read the header
   memcpy(this, buf, sizeof(*this));
+  if (kGenTCMagic != magic) {
+    return false;
+  }
+
 #ifndef NDEBUG
   Print();
 #endif
+  return true;
+}
+
+bool GenTCHeader::LoadFrom(const std::vector<uint8_t> &cmp_data) {
+  if (cmp_data.size() < sizeof(*this) || !LoadFrom(cmp_data.data())) {
+    return false;
+  }
+
+  return static_cast<uint64_t>(StreamsEnd()) + tile_index_sz <= cmp_data.size();
+}
+
+void GenTCMipChainHeader::LoadFrom(const uint8_t *buf) {
+  memcpy(this, buf, sizeof(*this));
+}
+
+bool LoadMipChain(const std::vector<uint8_t> &cmp_data,
+                  std::vector<std::vector<uint8_t> > *levels,
+                  std::vector<uint8_t> *dictionary) {
+  GenTCMipChainHeader chain;
+  if (cmp_data.size() < sizeof(chain)) {
+    return false;
+  }
+
+  chain.LoadFrom(cmp_data.data());
+  if (kMipChainMagic != chain.magic) {
+    return false;
+  }
+
+  if (0 == chain.num_levels || chain.num_levels > kMaxMipLevels ||
+      (chain.dictionary_sz % kFreqTableSz) != 0) {
+    return false;
+  }
+
+  // Make sure that the dictionary and every level fit before copying any
+  // of them. The sizes are 32-bit, so adding them up in 64 bits can't
+  // overflow.
+  uint64_t end = static_cast<uint64_t>(sizeof(chain)) + chain.dictionary_sz;
+  for (size_t i = 0; i < chain.num_levels; ++i) {
+    end += chain.level_sz[i];
+  }
+
+  if (end > cmp_data.size()) {
+    return false;
+  }
+
+  const uint8_t *data = cmp_data.data() + sizeof(chain);
+  dictionary->assign(data, data + chain.dictionary_sz);
+  data += chain.dictionary_sz;
+
+  levels->clear();
+  levels->reserve(chain.num_levels);
+  for (size_t i = 0; i < chain.num_levels; ++i) {
+    levels->push_back(std::vector<uint8_t>(data, data + chain.level_sz[i]));
+    data += chain.level_sz[i];
+  }
+
+  return true;
 }
 
 }  //  namespace GenTC
@@ -4,9 +4,43 @@
 #include <cassert>
 #include <cstdint>
 #include <cstdlib>
+#include <vector>
+
+#include "ans.h"
 
 namespace GenTC {
+  // Each compressed stream is preceded by 256 normalized 16-bit frequencies.
+  static const size_t kFreqTableSz = 512;
+
+  // Table id for frequency tables that are stored in the compressed data
+  // right after the header rather than in a dictionary shared by a batch.
+  static const uint32_t kInlineFreqTable = 0xFFFFFFFF;
+
+  enum EStreamType {
+    eStreamType_Y,
+    eStreamType_Chroma,
+    eStreamType_Palette,
+    eStreamType_Indices,
+
+    kNumStreamTypes
+  };
+
+  // The wavelet coefficients of the endpoint planes are either stored one
+  // wavelet block after another, or grouped by band so that the coarse bands
+  // of every plane come first. See BandOrderIndex.
+  enum ECoefficientOrder {
+    eCoefficientOrder_Tiles,
+    eCoefficientOrder_Bands
+  };
+
+  // Every texture starts with this word. Its last character is the version
+  // of the layout of the header and the streams, and goes up whenever either
+  // of them changes, so that decoders reject textures that they would
+  // otherwise misread.
+  static const uint32_t kGenTCMagic = 0x31435447;  // "GTC1"
+
   struct GenTCHeader {
+    uint32_t magic;
     uint32_t width;
     uint32_t height;
     uint32_t palette_bytes;
@@ -14,13 +48,115 @@ namespace GenTC {
     uint32_t chroma_cmp_sz;
     uint32_t palette_sz;
     uint32_t indices_sz;
+    uint32_t table_ids[kNumStreamTypes];
+
+    // The geometry of the interleaved ANS streams. The decoder compiles its
+    // kernels for each geometry that it comes across.
+    uint32_t ans_table_size;
+    uint32_t ans_num_encoded_symbols;
+    uint32_t ans_threads_per_group;
+
+    // The size of the tile index stored after the streams, or zero if the
+    // texture doesn't have one. See tile_index.h.
+    uint32_t tile_index_sz;
+
+    // One of ECoefficientOrder
+    uint32_t coefficient_order;
+
+    // The number of long-range index references. They are stored as 32-bit
+    // little-endian palette indices in the palette stream, right after the
+    // palette_bytes bytes of the palette itself.
+    uint32_t index_refs;
+
+    ans::ocl::Geometry ANSGeometry() const {
+      return ans::ocl::Geometry(ans_table_size, ans_num_encoded_symbols, ans_threads_per_group);
+    }
+
+    // The number of frequency tables between the header and the streams.
+    size_t NumInlineTables() const;
+
+    // width and height are the dimensions of the texture itself, which don't
+    // need to be multiples of anything. It is covered by BlocksWide() x
+    // BlocksHigh() DXT blocks, but the streams hold the endpoints and indices
+    // of CodedBlocksWide() x CodedBlocksHigh() blocks, padded out to whole
+    // wavelet blocks. Decoders never write the padding.
+    size_t BlocksWide() const { return (width + 3) / 4; }
+    size_t BlocksHigh() const { return (height + 3) / 4; }
+    size_t NumBlocks() const { return BlocksWide() * BlocksHigh(); }
+    size_t CodedBlocksWide() const;
+    size_t CodedBlocksHigh() const;
+    size_t NumCodedBlocks() const { return CodedBlocksWide() * CodedBlocksHigh(); }
+
+    // The number of bytes that a stream decodes to. Streams are padded to a
+    // whole number of interleaved groups, so small textures decode to a few
+    // more bytes than they use.
+    size_t NumSymbols(EStreamType stream) const;
+
+    // The number of bytes of a stream needed to decode a preview that is
+    // 1 / scale the size of the texture, rounded up to whole groups. Only the
+    // coarse bands of the endpoint planes are needed, so the texture needs
+    // to have its coefficients in band order.
+    size_t NumPreviewSymbols(EStreamType stream, size_t scale) const;
+
+    // Where the compressed streams end, relative to the start of the header.
+    size_t StreamsEnd() const;
 
     void Print() const;
+
+    // Reads the header from the start of buf. Returns false if buf doesn't
+    // start with kGenTCMagic, in which case the header must not be used.
+    bool LoadFrom(const uint8_t *buf);
+
+    // Same as above, but also returns false if cmp_data is too small to
+    // hold the header or the streams and tile index that it describes.
+    bool LoadFrom(const std::vector<uint8_t> &cmp_data);
+  };
+
+  // A whole mip chain can be stored in one stream. It starts with a
+  // GenTCMipChainHeader, followed by the dictionary of frequency tables that
+  // the levels share, and then each level, largest first, as a texture with
+  // its own GenTCHeader. The levels refer to the dictionary just like the
+  // textures of a batch compressed with CompressDXTs.
+  static const uint32_t kMipChainMagic = 0x50494D47;  // "GMIP"
+  static const size_t kMaxMipLevels = 16;
+
+  struct GenTCMipChainHeader {
+    uint32_t magic;
+    uint32_t num_levels;
+    uint32_t dictionary_sz;
+    uint32_t level_sz[kMaxMipLevels];
+
     void LoadFrom(const uint8_t *buf);
   };
 
+  // Splits a mip chain into the compressed data of each level and the
+  // dictionary that they share, ready to be decoded as a batch. Returns
+  // false if cmp_data doesn't hold a mip chain, or holds one that is
+  // malformed or truncated.
+  bool LoadMipChain(const std::vector<uint8_t> &cmp_data,
+                    std::vector<std::vector<uint8_t> > *levels,
+                    std::vector<uint8_t> *dictionary);
+
   static const size_t kWaveletBlockDim = 32;
   static_assert((kWaveletBlockDim % 2) == 0, "Wavelet dimension must be power of two!");
+
+  // In band order the coefficients of each wavelet block are split up by
+  // how far they are from the low-pass corner of the block. Band 0 is the
+  // kCoarsestBandDim x kCoarsestBandDim corner, and each band after it is
+  // the rest of a square twice as large as the one before. Since the
+  // transform is dyadic, the top-left dim x dim coefficients of a block are
+  // its transform at 1 / (kWaveletBlockDim / dim) the size.
+  static const size_t kCoarsestBandDim = kWaveletBlockDim / 8;
+  static const size_t kMaxPreviewScale = kWaveletBlockDim / kCoarsestBandDim;
+
+  // Where coefficient (x, y) of wavelet block `tile` of plane `plane` goes in
+  // a stream of num_planes planes of num_tiles blocks each. The stream holds
+  // band 0 of every block of every plane, then band 1, and so on, so the
+  // first num_planes * num_tiles * dim * dim values are everything needed for
+  // the top-left dim x dim coefficients. Within a band the blocks of each
+  // plane follow each other, and their coefficients are in raster order.
+  size_t BandOrderIndex(size_t x, size_t y, size_t tile, size_t plane,
+                        size_t num_tiles, size_t num_planes);
 }
 
 #endif  // __TCAR_CODEC_BASE_H__
@@ -0,0 +1,1265 @@
+#include "cpu_decoder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <future>
+#include <thread>
+
+#include "ans_simd.h"
+#include "tile_index.h"
+#include "wavelet.h"
+#include "ctpl/ctpl_stl.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define GENTC_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define GENTC_TARGET(x) __attribute__((target(x)))
+#else
+#define GENTC_TARGET(x)
+#endif
+
+namespace GenTC {
+namespace cpu {
+
+// Decodes groups of interleaved streams that were coded with one frequency
+// table. Groups whose table and number of streams fit are decoded with the
+// SIMD decoder, and the others fall back to the reference decoder.
+class GroupDecoder {
+ public:
+  GroupDecoder(const uint8_t *freqs, const ans::ocl::Geometry &geom)
+    : _geom(geom)
+  {
+    std::vector<uint32_t> F(256);
+    for (size_t i = 0; i < F.size(); ++i) {
+      uint16_t f;
+      memcpy(&f, freqs + 2 * i, sizeof(f));
+      F[i] = f;
+    }
+
+    while (!F.empty() && 0 == F.back()) {
+      F.pop_back();
+    }
+
+    if (geom.table_size <= ans::simd::InterleavedDecoder::kMaxTableSize &&
+        geom.threads_per_group <= ans::simd::InterleavedDecoder::kMaxStreams) {
+      _simd.reset(new ans::simd::InterleavedDecoder(F, geom));
+    } else {
+      _opts = ans::ocl::GetOpenCLOptions(F, geom.table_size);
+    }
+  }
+
+  void Decode(const uint8_t *data, size_t data_sz, uint8_t *out) const {
+    if (nullptr != _simd) {
+      bool ok = _simd->Decode(data, data_sz, out);
+      assert(ok);
+      (void)(ok);
+    } else {
+      ans::DecodeInterleaved(data, data_sz, _geom.SymbolsPerGroup(), _opts,
+                             _geom.threads_per_group, out);
+    }
+  }
+
+ private:
+  const ans::ocl::Geometry _geom;
+  std::unique_ptr<ans::simd::InterleavedDecoder> _simd;
+  ans::Options _opts;
+};
+
+// The state of one texture as it moves through the stages. The decoded
+// symbols are laid out the same way as the output of the ans_decode kernel:
+// two luma planes, four chroma planes, the palette and the index differences.
+// The planes and indices cover blocks_x x blocks_y blocks, which are padded
+// out to whole wavelet blocks, but only the width x height pixels at the top
+// left are written out.
+struct Texture {
+  GenTCHeader hdr;
+  size_t blocks_x;
+  size_t blocks_y;
+  size_t num_blocks;
+  size_t width;
+  size_t height;
+
+  const uint8_t *streams[kNumStreamTypes];
+  size_t stream_sz[kNumStreamTypes];
+  size_t output_offsets[kNumStreamTypes];
+  uint32_t table_ids[kNumStreamTypes];
+
+  std::vector<uint8_t> symbols;
+  std::vector<int8_t> planes;
+  std::vector<int32_t> indices;
+};
+
+// One group of interleaved streams and where its symbols go
+struct GroupTask {
+  const uint8_t *data;
+  size_t data_sz;
+  const GroupDecoder *decoder;
+  uint8_t *out;
+};
+
+// The long-range index references of a decoded texture, if it has any
+static const uint8_t *IndexRefs(const Texture &tex) {
+  if (0 == tex.hdr.index_refs) {
+    return nullptr;
+  }
+
+  return tex.symbols.data() + tex.output_offsets[eStreamType_Palette] + tex.hdr.palette_bytes;
+}
+
+static uint32_t ReadUnaligned32(const uint8_t *ptr) {
+  uint32_t result;
+  memcpy(&result, ptr, sizeof(result));
+  return result;
+}
+
+// Returns false if the texture's header doesn't load
+static bool InitializeTexture(const std::vector<uint8_t> &cmp_data, uint32_t *next_inline_table,
+                              std::vector<const uint8_t *> *inline_tables, Texture *tex) {
+  if (!tex->hdr.LoadFrom(cmp_data)) {
+    return false;
+  }
+  const GenTCHeader &hdr = tex->hdr;
+
+  tex->blocks_x = hdr.CodedBlocksWide();
+  tex->blocks_y = hdr.CodedBlocksHigh();
+  tex->num_blocks = tex->blocks_x * tex->blocks_y;
+  tex->width = hdr.width;
+  tex->height = hdr.height;
+
+  // The inline tables come right after the header in stream order
+  const uint8_t *data = cmp_data.data() + sizeof(GenTCHeader);
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    if (kInlineFreqTable == hdr.table_ids[i]) {
+      tex->table_ids[i] = (*next_inline_table)++;
+      inline_tables->push_back(data);
+      data += kFreqTableSz;
+    } else {
+      tex->table_ids[i] = hdr.table_ids[i];
+    }
+  }
+
+  const size_t cmp_sz[kNumStreamTypes] = {
+    hdr.y_cmp_sz, hdr.chroma_cmp_sz, hdr.palette_sz, hdr.indices_sz
+  };
+
+  const size_t decmp_sz[kNumStreamTypes] = {
+    hdr.NumSymbols(eStreamType_Y), hdr.NumSymbols(eStreamType_Chroma),
+    hdr.NumSymbols(eStreamType_Palette), hdr.NumSymbols(eStreamType_Indices)
+  };
+
+  size_t output_offset = 0;
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    tex->streams[i] = data;
+    tex->stream_sz[i] = cmp_sz[i];
+    tex->output_offsets[i] = output_offset;
+
+    data += cmp_sz[i];
+    output_offset += decmp_sz[i];
+  }
+  assert(data <= cmp_data.data() + cmp_data.size());
+  return true;
+}
+
+// Each stream starts with the offsets of the ends of its groups relative to
+// the start of the stream, followed by the groups themselves. Adds the groups
+// [first_group, first_group + num_groups) of a stream of total_groups groups.
+static void AddGroupRangeTasks(const uint8_t *stream, size_t stream_sz, size_t total_groups,
+                               size_t first_group, size_t num_groups,
+                               const ans::ocl::Geometry &geom, const GroupDecoder *decoder,
+                               uint8_t *out, std::vector<GroupTask> *tasks) {
+  assert(total_groups * 4 <= stream_sz);
+  assert(first_group + num_groups <= total_groups);
+  size_t last_offset = (0 == first_group) ? total_groups * 4
+    : ReadUnaligned32(stream + 4 * (first_group - 1));
+  for (size_t i = first_group; i < first_group + num_groups; ++i) {
+    const size_t offset = ReadUnaligned32(stream + 4 * i);
+    assert(last_offset <= offset && offset <= stream_sz);
+    GroupTask task;
+    task.data = stream + last_offset;
+    task.data_sz = offset - last_offset;
+    task.decoder = decoder;
+    task.out = out + (i - first_group) * geom.SymbolsPerGroup();
+    tasks->push_back(task);
+    last_offset = offset;
+  }
+}
+
+static void AddGroupTasks(const uint8_t *stream, size_t stream_sz, size_t num_symbols,
+                          const ans::ocl::Geometry &geom, const GroupDecoder *decoder,
+                          uint8_t *out, std::vector<GroupTask> *tasks) {
+  const size_t symbols_per_group = geom.SymbolsPerGroup();
+  assert((num_symbols % symbols_per_group) == 0);
+  const size_t num_groups = num_symbols / symbols_per_group;
+  AddGroupRangeTasks(stream, stream_sz, num_groups, 0, num_groups, geom, decoder, out, tasks);
+}
+
+// Copies the top-left dim x dim coefficients of each wavelet block in a row
+// of blocks of one of the six endpoint planes out of the decoded streams of a
+// texture in band order. The blocks are written one after another, the way
+// that they're stored in tile order. Each band of a row of a block is stored
+// contiguously, so it's copied in one go.
+static void GatherBandTiles(const Texture &tex, size_t plane, size_t tile_row, size_t dim,
+                            uint8_t *out) {
+  assert(eCoefficientOrder_Bands == tex.hdr.coefficient_order);
+  const size_t tiles_x = tex.hdr.CodedBlocksWide() / kWaveletBlockDim;
+  const size_t num_tiles = tex.hdr.NumCodedBlocks() / (kWaveletBlockDim * kWaveletBlockDim);
+
+  const bool is_luma = plane < 2;
+  const uint8_t *stream =
+    tex.symbols.data() + tex.output_offsets[is_luma ? eStreamType_Y : eStreamType_Chroma];
+  const size_t stream_plane = is_luma ? plane : plane - 2;
+  const size_t num_planes = is_luma ? 2 : 4;
+
+  for (size_t i = 0; i < tiles_x; ++i) {
+    const size_t tile = tile_row * tiles_x + i;
+    for (size_t end = kCoarsestBandDim; end <= dim; end *= 2) {
+      const size_t begin = (kCoarsestBandDim == end) ? 0 : end / 2;
+      for (size_t y = 0; y < end; ++y) {
+        const size_t x = (y < begin) ? begin : 0;
+        memcpy(out + y * dim + x,
+               stream + BandOrderIndex(x, y, tile, stream_plane, num_tiles, num_planes), end - x);
+      }
+    }
+    out += dim * dim;
+  }
+}
+
+// Runs the inverse wavelet transform on one row of wavelet blocks of one of
+// the six endpoint planes. The coefficients are biased by 128, and the plane
+// is written out in raster order, matching the inv_wavelet kernel.
+static void InverseWaveletBlockRow(Texture *tex, size_t plane, size_t block_row) {
+  static const size_t kBlockSz = kWaveletBlockDim * kWaveletBlockDim;
+  const size_t wavelet_blocks_x = tex->blocks_x / kWaveletBlockDim;
+  int8_t *out = tex->planes.data() + plane * tex->num_blocks
+    + block_row * kWaveletBlockDim * tex->blocks_x;
+
+  if (eCoefficientOrder_Bands == tex->hdr.coefficient_order) {
+    std::vector<uint8_t> coeffs(wavelet_blocks_x * kBlockSz);
+    GatherBandTiles(*tex, plane, block_row, kWaveletBlockDim, coeffs.data());
+    InverseWaveletBlocks(coeffs.data(), wavelet_blocks_x, out, tex->blocks_x);
+    return;
+  }
+
+  // In tile order each stream holds its planes one after another
+  const uint8_t *coeffs = tex->symbols.data() + ((plane < 2)
+    ? tex->output_offsets[eStreamType_Y] + plane * tex->num_blocks
+    : tex->output_offsets[eStreamType_Chroma] + (plane - 2) * tex->num_blocks);
+  InverseWaveletBlocks(coeffs + block_row * wavelet_blocks_x * kBlockSz, wavelet_blocks_x,
+                       out, tex->blocks_x);
+}
+
+// The index differences are stored biased by 128. The palette index of each
+// block is the inclusive prefix sum of the differences up to it, except that
+// a zero byte in a stream with long-range references sets the index to the
+// next reference instead. Each stream is split into chunks that are summed on
+// their own, with the references counting as zero, and then every chunk is
+// offset by the index at the end of the chunks before it. The blocks after
+// a reference are moved to count from it. The sums wrap around the same way
+// that the int arithmetic of the decode_indices kernel does.
+static const size_t kIndexChunkSz = 1 << 14;
+
+// A run of up to kIndexChunkSz differences of one stream
+struct IndexChunk {
+  const uint8_t *diffs;
+  int32_t *indices;
+  size_t num_vals;
+  bool first;
+  uint32_t total;
+  uint32_t offset;
+
+  // The references of the stream, or null, and the number of them that the
+  // chunk takes starting from ref_start. The references are moved down by
+  // ref_base. last_ref_sum is the sum of the chunk at its last reference.
+  const uint8_t *refs;
+  uint32_t ref_base;
+  size_t num_refs;
+  size_t ref_start;
+  uint32_t last_ref_sum;
+};
+
+static uint32_t IndexRef(const IndexChunk &chunk, size_t k) {
+  uint32_t ref = 0;
+  for (size_t i = 0; i < 4; ++i) {
+    ref |= static_cast<uint32_t>(chunk.refs[4 * k + i]) << (8 * i);
+  }
+  return ref - chunk.ref_base;
+}
+
+static void AddIndexChunks(const IndexStream &stream, std::vector<IndexChunk> *chunks) {
+  for (size_t i = 0; i < stream.num_vals; i += kIndexChunkSz) {
+    IndexChunk chunk;
+    chunk.diffs = stream.diffs + i;
+    chunk.indices = stream.indices + i;
+    chunk.num_vals = std::min(kIndexChunkSz, stream.num_vals - i);
+    chunk.first = (0 == i);
+    chunk.total = 0;
+    chunk.offset = 0;
+    chunk.refs = stream.refs;
+    chunk.ref_base = 0;
+    chunk.num_refs = 0;
+    chunk.ref_start = 0;
+    chunk.last_ref_sum = 0;
+    chunks->push_back(chunk);
+  }
+}
+
+// Finds the offset of each chunk once they all know their totals.
+static void AccumulateIndexChunks(std::vector<IndexChunk> *chunks) {
+  uint32_t sum = 0;
+  size_t num_refs = 0;
+  for (auto &chunk : *chunks) {
+    sum = chunk.first ? 0 : sum;
+    num_refs = chunk.first ? 0 : num_refs;
+    chunk.offset = sum;
+    chunk.ref_start = num_refs;
+
+    if (0 == chunk.num_refs) {
+      sum += chunk.total;
+    } else {
+      num_refs += chunk.num_refs;
+      sum = IndexRef(chunk, num_refs - 1) + chunk.total - chunk.last_ref_sum;
+    }
+  }
+}
+
+static uint32_t ScanIndicesScalar(const uint8_t *diffs, size_t num_vals, bool has_refs,
+                                  int32_t *indices) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < num_vals; ++i) {
+    if (!has_refs || 0 != diffs[i]) {
+      sum += static_cast<uint32_t>(static_cast<int>(diffs[i]) - 128);
+    }
+    indices[i] = static_cast<int32_t>(sum);
+  }
+  return sum;
+}
+
+static void OffsetIndicesScalar(int32_t *indices, size_t num_vals, uint32_t offset) {
+  for (size_t i = 0; i < num_vals; ++i) {
+    indices[i] = static_cast<int32_t>(static_cast<uint32_t>(indices[i]) + offset);
+  }
+}
+
+#ifdef GENTC_SIMD_X86
+GENTC_TARGET("sse4.1")
+static uint32_t ScanIndicesSSE41(const uint8_t *diffs, size_t num_vals, bool has_refs,
+                                 int32_t *indices) {
+  const __m128i bias = _mm_set1_epi16(128);
+  const __m128i ref_mask = has_refs ? _mm_set1_epi16(-1) : _mm_setzero_si128();
+  __m128i carry = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 8 <= num_vals; i += 8) {
+    __m128i d = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(diffs + i));
+    d = _mm_sub_epi16(_mm_cvtepu8_epi16(d), bias);
+
+    // References add nothing to the sum
+    d = _mm_andnot_si128(_mm_and_si128(_mm_cmpeq_epi16(d, _mm_set1_epi16(-128)), ref_mask), d);
+
+    // Scan the eight differences in the register. Their partial sums are at
+    // most 8 * 128 in magnitude, so they fit in 16 bits until they're widened
+    // and added to the sum of everything before them.
+    d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+    d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+    d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+
+    const __m128i lo = _mm_add_epi32(_mm_cvtepi16_epi32(d), carry);
+    const __m128i hi = _mm_add_epi32(_mm_cvtepi16_epi32(_mm_srli_si128(d, 8)), carry);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(indices + i), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(indices + i + 4), hi);
+    carry = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+
+  const uint32_t sum = static_cast<uint32_t>(_mm_cvtsi128_si32(carry));
+  if (i == num_vals) {
+    return sum;
+  }
+
+  const uint32_t tail = ScanIndicesScalar(diffs + i, num_vals - i, has_refs, indices + i);
+  OffsetIndicesScalar(indices + i, num_vals - i, sum);
+  return sum + tail;
+}
+
+GENTC_TARGET("sse4.1")
+static void OffsetIndicesSSE41(int32_t *indices, size_t num_vals, uint32_t offset) {
+  const __m128i offsets = _mm_set1_epi32(static_cast<int>(offset));
+
+  size_t i = 0;
+  for (; i + 4 <= num_vals; i += 4) {
+    __m128i *ptr = reinterpret_cast<__m128i *>(indices + i);
+    _mm_storeu_si128(ptr, _mm_add_epi32(_mm_loadu_si128(ptr), offsets));
+  }
+
+  OffsetIndicesScalar(indices + i, num_vals - i, offset);
+}
+#endif  // GENTC_SIMD_X86
+
+static bool UseSSE41(ans::simd::EInstructionSet set) {
+  return ans::simd::eInstructionSet_Scalar != set &&
+    ans::simd::IsSupported(ans::simd::eInstructionSet_SSE41);
+}
+
+static void ScanIndexChunk(IndexChunk *chunk, bool use_sse41) {
+  const bool has_refs = nullptr != chunk->refs;
+#ifdef GENTC_SIMD_X86
+  if (use_sse41) {
+    chunk->total = ScanIndicesSSE41(chunk->diffs, chunk->num_vals, has_refs, chunk->indices);
+  } else
+#endif
+  {
+    chunk->total = ScanIndicesScalar(chunk->diffs, chunk->num_vals, has_refs, chunk->indices);
+  }
+  (void)(use_sse41);
+
+  // Count the references, and remember where the last one was
+  chunk->num_refs = 0;
+  if (has_refs) {
+    for (size_t i = 0; i < chunk->num_vals; ++i) {
+      if (0 == chunk->diffs[i]) {
+        chunk->num_refs++;
+        chunk->last_ref_sum = static_cast<uint32_t>(chunk->indices[i]);
+      }
+    }
+  }
+}
+
+static void OffsetIndexChunk(const IndexChunk &chunk, bool use_sse41) {
+  // Everything after a reference counts from it instead of the offset
+  if (0 != chunk.num_refs) {
+    uint32_t offset = chunk.offset;
+    size_t next_ref = chunk.ref_start;
+    for (size_t i = 0; i < chunk.num_vals; ++i) {
+      const uint32_t sum = static_cast<uint32_t>(chunk.indices[i]);
+      if (0 == chunk.diffs[i]) {
+        offset = IndexRef(chunk, next_ref++) - sum;
+      }
+      chunk.indices[i] = static_cast<int32_t>(sum + offset);
+    }
+    return;
+  }
+
+  if (0 == chunk.offset) {
+    return;
+  }
+
+#ifdef GENTC_SIMD_X86
+  if (use_sse41) {
+    OffsetIndicesSSE41(chunk.indices, chunk.num_vals, chunk.offset);
+    return;
+  }
+#endif
+  (void)(use_sse41);
+  OffsetIndicesScalar(chunk.indices, chunk.num_vals, chunk.offset);
+}
+
+static uint16_t GetPixel(int y, int co, int cg) {
+  // Same conversion as the YCoCgToRGB in assemble.cl
+  const int t = y - (cg / 2);
+  const int g = cg + t;
+  const int b = (t - co) / 2;
+  const int r = b + co;
+
+  // RGB should be 565 at this point...
+  uint32_t pixel = 0;
+  pixel |= static_cast<uint32_t>(r) << 11;
+  pixel |= static_cast<uint32_t>(g) << 5;
+  pixel |= static_cast<uint32_t>(b);
+  return static_cast<uint16_t>(pixel);
+}
+
+// Writes num_blocks DXT1 blocks of a row of blocks, starting at column
+// first_x, to out.
+static void AssembleDXTBlocks(const Texture &tex, size_t block_row, size_t first_x,
+                              size_t num_blocks, uint8_t *out) {
+  assert(first_x + num_blocks <= tex.blocks_x);
+  const size_t n = tex.num_blocks;
+  const int8_t *planes = tex.planes.data();
+  const uint8_t *palette = tex.symbols.data() + tex.output_offsets[eStreamType_Palette];
+
+  const size_t row_start = block_row * tex.blocks_x + first_x;
+  for (size_t i = row_start; i < row_start + num_blocks; ++i) {
+    const uint16_t ep1 = GetPixel(planes[i], planes[2 * n + i], planes[3 * n + i]);
+    const uint16_t ep2 = GetPixel(planes[n + i], planes[4 * n + i], planes[5 * n + i]);
+
+    const uint32_t plt_idx = static_cast<uint32_t>(tex.indices[i]);
+    assert(4 * static_cast<size_t>(plt_idx) + 4 <= tex.hdr.palette_bytes);
+
+    uint8_t *blk = out + 8 * (i - row_start);
+    memcpy(blk + 0, &ep1, sizeof(ep1));
+    memcpy(blk + 2, &ep2, sizeof(ep2));
+    memcpy(blk + 4, palette + 4 * plt_idx, 4);
+  }
+}
+
+static int ExpandBits(int x, int bits) {
+  return (x << (8 - bits)) | (x >> (2 * bits - 8));
+}
+
+// The first two colors of the palette of block i, with 8 bits per channel.
+// Same as the endpoint computation of the assemble_rgb kernel.
+static void GetEndpoints(const Texture &tex, size_t i, int ep1[3], int ep2[3]) {
+  const size_t n = tex.num_blocks;
+  const int8_t *planes = tex.planes.data();
+  const uint16_t pixels[2] = {
+    GetPixel(planes[i], planes[2 * n + i], planes[3 * n + i]),
+    GetPixel(planes[n + i], planes[4 * n + i], planes[5 * n + i])
+  };
+
+  int *eps[2] = { ep1, ep2 };
+  for (size_t j = 0; j < 2; ++j) {
+    eps[j][0] = ExpandBits((pixels[j] >> 11) & 0x1F, 5);
+    eps[j][1] = ExpandBits((pixels[j] >> 5) & 0x3F, 6);
+    eps[j][2] = ExpandBits(pixels[j] & 0x1F, 5);
+  }
+}
+
+static uint32_t GetPaletteEntry(const Texture &tex, size_t i) {
+  const uint32_t plt_idx = static_cast<uint32_t>(tex.indices[i]);
+  assert(4 * static_cast<size_t>(plt_idx) + 4 <= tex.hdr.palette_bytes);
+
+  uint32_t entry;
+  memcpy(&entry, tex.symbols.data() + tex.output_offsets[eStreamType_Palette] + 4 * plt_idx,
+         sizeof(entry));
+  return entry;
+}
+
+// Writes the pixels of num_blocks blocks of a row of blocks, starting at
+// column first_x. Row y of the blocks starts at out + y * row_pitch.
+static void AssembleRGBBlocksScalar(const Texture &tex, size_t block_row, size_t first_x,
+                                    size_t num_blocks, EPixelFormat fmt,
+                                    uint8_t *out, size_t row_pitch) {
+  assert(first_x + num_blocks <= tex.blocks_x);
+  const size_t bpp = (ePixelFormat_RGBA8 == fmt) ? 4 : 3;
+  for (size_t bx = 0; bx < num_blocks; ++bx) {
+    const size_t i = block_row * tex.blocks_x + first_x + bx;
+
+    int palette[4][3];
+    GetEndpoints(tex, i, palette[0], palette[1]);
+    for (size_t c = 0; c < 3; ++c) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    uint32_t idx = GetPaletteEntry(tex, i);
+    for (size_t y = 0; y < 4; ++y) {
+      uint8_t *row = out + y * row_pitch + 4 * bx * bpp;
+      for (size_t x = 0; x < 4; ++x) {
+        const int *rgb = palette[idx & 3];
+        row[x * bpp + 0] = static_cast<uint8_t>(rgb[0]);
+        row[x * bpp + 1] = static_cast<uint8_t>(rgb[1]);
+        row[x * bpp + 2] = static_cast<uint8_t>(rgb[2]);
+        if (ePixelFormat_RGBA8 == fmt) {
+          row[x * bpp + 3] = 0xFF;
+        }
+        idx >>= 2;
+      }
+    }
+  }
+}
+
+#ifdef GENTC_SIMD_X86
+// Shuffle masks that pick the colors of the four pixels in a row of a block
+// out of a register holding the four RGBA palette colors. The mask for a row
+// is indexed by the byte of the index word that holds its four indices.
+struct RowShuffles {
+  uint8_t rgba[256][16];
+  uint8_t rgb[256][16];
+
+  RowShuffles() {
+    for (size_t b = 0; b < 256; ++b) {
+      memset(rgb[b], 0x80, sizeof(rgb[b]));
+      for (size_t x = 0; x < 4; ++x) {
+        const uint8_t color = static_cast<uint8_t>((b >> (2 * x)) & 3);
+        for (size_t c = 0; c < 4; ++c) {
+          rgba[b][4 * x + c] = static_cast<uint8_t>(4 * color + c);
+        }
+        for (size_t c = 0; c < 3; ++c) {
+          rgb[b][3 * x + c] = static_cast<uint8_t>(4 * color + c);
+        }
+      }
+    }
+  }
+};
+
+GENTC_TARGET("sse4.1")
+static void AssembleRGBBlocksSSE41(const Texture &tex, size_t block_row, size_t first_x,
+                                   size_t num_blocks, EPixelFormat fmt,
+                                   uint8_t *out, size_t row_pitch) {
+  assert(first_x + num_blocks <= tex.blocks_x);
+  static const RowShuffles kShuffles;
+  const size_t bpp = (ePixelFormat_RGBA8 == fmt) ? 4 : 3;
+  const __m128i div3 = _mm_set1_epi16(static_cast<short>(0xAAAB));
+
+  for (size_t bx = 0; bx < num_blocks; ++bx) {
+    const size_t i = block_row * tex.blocks_x + first_x + bx;
+
+    int ep1[3], ep2[3];
+    GetEndpoints(tex, i, ep1, ep2);
+
+    // Interpolate both of the intermediate colors at once. The alpha lanes
+    // end up at 255 as well. For sums of at most 3 * 255, x / 3 is exactly
+    // (x * 0xAAAB) >> 17.
+    const __m128i a = _mm_setr_epi16(static_cast<short>(ep1[0]), static_cast<short>(ep1[1]),
+                                     static_cast<short>(ep1[2]), 0xFF,
+                                     static_cast<short>(ep2[0]), static_cast<short>(ep2[1]),
+                                     static_cast<short>(ep2[2]), 0xFF);
+    const __m128i b = _mm_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2));
+    const __m128i sums = _mm_add_epi16(_mm_add_epi16(a, a), b);
+    const __m128i mids = _mm_srli_epi16(_mm_mulhi_epu16(sums, div3), 1);
+    const __m128i palette = _mm_packus_epi16(a, mids);
+
+    const uint32_t idx = GetPaletteEntry(tex, i);
+    for (size_t y = 0; y < 4; ++y) {
+      const size_t row_idx = (idx >> (8 * y)) & 0xFF;
+      uint8_t *row = out + y * row_pitch + 4 * bx * bpp;
+
+      if (ePixelFormat_RGBA8 == fmt) {
+        const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(kShuffles.rgba[row_idx]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(row), _mm_shuffle_epi8(palette, mask));
+      } else {
+        const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(kShuffles.rgb[row_idx]));
+        const __m128i pixels = _mm_shuffle_epi8(palette, mask);
+        const uint32_t last = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(pixels, 8)));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(row), pixels);
+        memcpy(row + 8, &last, sizeof(last));
+      }
+    }
+  }
+}
+#endif  // GENTC_SIMD_X86
+
+// Writes the pixels of a row of blocks that are inside the texture, with row
+// y of the texture at out + y * row_pitch. The blocks that the right or
+// bottom edge of the texture cuts through are assembled into a scratch row of
+// blocks first, and only their pixels inside the texture are copied out.
+static void AssembleRGBBlockRow(const Texture &tex, size_t block_row, EPixelFormat fmt,
+                                uint8_t *out, size_t row_pitch, bool use_sse41) {
+  auto assemble = [&](size_t first_x, size_t num_blocks, uint8_t *dst, size_t pitch) {
+#ifdef GENTC_SIMD_X86
+    if (use_sse41) {
+      AssembleRGBBlocksSSE41(tex, block_row, first_x, num_blocks, fmt, dst, pitch);
+      return;
+    }
+#endif
+    (void)(use_sse41);
+    AssembleRGBBlocksScalar(tex, block_row, first_x, num_blocks, fmt, dst, pitch);
+  };
+
+  assert(4 * block_row < tex.height);
+  const size_t bpp = (ePixelFormat_RGBA8 == fmt) ? 4 : 3;
+  const size_t num_rows = std::min<size_t>(4, tex.height - 4 * block_row);
+  uint8_t *row_start = out + 4 * block_row * row_pitch;
+
+  size_t first_x = 0;
+  if (4 == num_rows) {
+    first_x = tex.width / 4;
+    assemble(0, first_x, row_start, row_pitch);
+  }
+
+  const size_t num_blocks = (tex.width + 3) / 4 - first_x;
+  if (0 == num_blocks) {
+    return;
+  }
+
+  const size_t scratch_pitch = 4 * num_blocks * bpp;
+  std::vector<uint8_t> scratch(4 * scratch_pitch);
+  assemble(first_x, num_blocks, scratch.data(), scratch_pitch);
+  for (size_t y = 0; y < num_rows; ++y) {
+    memcpy(row_start + y * row_pitch + 4 * first_x * bpp, scratch.data() + y * scratch_pitch,
+           (tex.width - 4 * first_x) * bpp);
+  }
+}
+
+Decoder::Decoder(size_t num_threads)
+  : _num_threads(0 == num_threads ? std::max(1U, std::thread::hardware_concurrency()) : num_threads)
+{
+  if (_num_threads > 1) {
+    _pool.reset(new ctpl::thread_pool(static_cast<int>(_num_threads)));
+  }
+}
+
+Decoder::~Decoder() { }
+
+template<typename F> void Decoder::ParallelFor(size_t num_items, const F &fn) {
+  if (nullptr == _pool || num_items <= 1) {
+    for (size_t i = 0; i < num_items; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  // A few runs per thread keeps them busy when the items take different
+  // amounts of time.
+  const size_t num_runs = std::min(num_items, 4 * _num_threads);
+  const size_t items_per_run = (num_items + num_runs - 1) / num_runs;
+
+  std::vector<std::future<void> > results;
+  results.reserve(num_runs);
+  for (size_t start = 0; start < num_items; start += items_per_run) {
+    const size_t end = std::min(num_items, start + items_per_run);
+    results.push_back(_pool->push([&fn, start, end](int) {
+      for (size_t i = start; i < end; ++i) {
+        fn(i);
+      }
+    }));
+  }
+
+  for (auto &result : results) {
+    result.get();
+  }
+}
+
+template<typename AssembleFn>
+void Decoder::Decompress(const std::vector<const std::vector<uint8_t> *> &cmp_data,
+                         const std::vector<uint8_t> &dictionary, const AssembleFn &assemble) {
+  assert((dictionary.size() % kFreqTableSz) == 0);
+  if (cmp_data.empty()) {
+    return;
+  }
+
+  // The frequency tables of a batch are the shared tables of the dictionary
+  // followed by the inline tables of each texture, like the OpenCL decoder.
+  const uint32_t num_shared_tables = static_cast<uint32_t>(dictionary.size() / kFreqTableSz);
+  std::vector<const uint8_t *> freq_tables;
+  for (uint32_t i = 0; i < num_shared_tables; ++i) {
+    freq_tables.push_back(dictionary.data() + i * kFreqTableSz);
+  }
+
+  std::vector<Texture> textures(cmp_data.size());
+  uint32_t next_inline_table = num_shared_tables;
+  for (size_t i = 0; i < cmp_data.size(); ++i) {
+    Texture &tex = textures[i];
+    if (!InitializeTexture(*cmp_data[i], &next_inline_table, &freq_tables, &tex)) {
+      return;
+    }
+    tex.symbols.resize(tex.output_offsets[eStreamType_Indices] + tex.hdr.NumSymbols(eStreamType_Indices));
+  }
+
+  const ans::ocl::Geometry geom = textures[0].hdr.ANSGeometry();
+  assert(geom.IsValid());
+  for (const auto &tex : textures) {
+    assert(tex.hdr.ANSGeometry() == geom);
+  }
+
+  // Build tables...
+  std::vector<std::unique_ptr<GroupDecoder> > decoders(freq_tables.size());
+  ParallelFor(decoders.size(), [&](size_t i) {
+    decoders[i].reset(new GroupDecoder(freq_tables[i], geom));
+  });
+
+  // Decode all of the groups of all of the streams...
+  std::vector<GroupTask> group_tasks;
+  for (auto &tex : textures) {
+    for (size_t i = 0; i < kNumStreamTypes; ++i) {
+      assert(tex.table_ids[i] < decoders.size());
+      const size_t end = (i + 1 < kNumStreamTypes) ? tex.output_offsets[i + 1] : tex.symbols.size();
+      AddGroupTasks(tex.streams[i], tex.stream_sz[i], end - tex.output_offsets[i], geom,
+                    decoders[tex.table_ids[i]].get(), tex.symbols.data() + tex.output_offsets[i],
+                    &group_tasks);
+    }
+  }
+
+  ParallelFor(group_tasks.size(), [&](size_t i) {
+    const GroupTask &task = group_tasks[i];
+    task.decoder->Decode(task.data, task.data_sz, task.out);
+  });
+
+  // Run the inverse wavelet transform on each row of wavelet blocks of each
+  // of the six endpoint planes, and sum up each chunk of index differences...
+  const bool use_sse41 = UseSSE41(ans::simd::GetBestInstructionSet());
+  std::vector<std::pair<size_t, size_t> > wavelet_tasks;
+  std::vector<IndexChunk> index_chunks;
+  for (size_t i = 0; i < textures.size(); ++i) {
+    Texture &tex = textures[i];
+    tex.planes.resize(6 * tex.num_blocks);
+    tex.indices.resize(tex.num_blocks);
+
+    for (size_t j = 0; j < 6 * (tex.blocks_y / kWaveletBlockDim); ++j) {
+      wavelet_tasks.push_back(std::make_pair(i, j));
+    }
+
+    IndexStream stream;
+    stream.diffs = tex.symbols.data() + tex.output_offsets[eStreamType_Indices];
+    stream.num_vals = tex.num_blocks;
+    stream.indices = tex.indices.data();
+    stream.refs = IndexRefs(tex);
+    AddIndexChunks(stream, &index_chunks);
+  }
+
+  ParallelFor(wavelet_tasks.size() + index_chunks.size(), [&](size_t i) {
+    if (i >= wavelet_tasks.size()) {
+      ScanIndexChunk(&index_chunks[i - wavelet_tasks.size()], use_sse41);
+      return;
+    }
+
+    Texture &tex = textures[wavelet_tasks[i].first];
+    const size_t rows_per_plane = tex.blocks_y / kWaveletBlockDim;
+    InverseWaveletBlockRow(&tex, wavelet_tasks[i].second / rows_per_plane,
+                           wavelet_tasks[i].second % rows_per_plane);
+  });
+
+  // ... and then carry the sums across the chunks.
+  AccumulateIndexChunks(&index_chunks);
+  ParallelFor(index_chunks.size(), [&](size_t i) {
+    OffsetIndexChunk(index_chunks[i], use_sse41);
+  });
+
+  // Assemble the blocks that cover each texture...
+  std::vector<std::pair<size_t, size_t> > assembly_tasks;
+  for (size_t i = 0; i < textures.size(); ++i) {
+    for (size_t j = 0; j < textures[i].hdr.BlocksHigh(); ++j) {
+      assembly_tasks.push_back(std::make_pair(i, j));
+    }
+  }
+
+  ParallelFor(assembly_tasks.size(), [&](size_t i) {
+    assemble(textures[assembly_tasks[i].first], assembly_tasks[i].first, assembly_tasks[i].second);
+  });
+}
+
+void Decoder::DecodeIndices(const std::vector<IndexStream> &streams,
+                            ans::simd::EInstructionSet set) {
+  std::vector<IndexChunk> chunks;
+  for (const auto &stream : streams) {
+    AddIndexChunks(stream, &chunks);
+  }
+
+  const bool use_sse41 = UseSSE41(set);
+  ParallelFor(chunks.size(), [&](size_t i) {
+    ScanIndexChunk(&chunks[i], use_sse41);
+  });
+
+  AccumulateIndexChunks(&chunks);
+  ParallelFor(chunks.size(), [&](size_t i) {
+    OffsetIndexChunk(chunks[i], use_sse41);
+  });
+}
+
+static std::vector<const std::vector<uint8_t> *>
+GetTexturePointers(const std::vector<std::vector<uint8_t> > &cmp_data) {
+  std::vector<const std::vector<uint8_t> *> textures;
+  textures.reserve(cmp_data.size());
+  for (const auto &data : cmp_data) {
+    textures.push_back(&data);
+  }
+  return std::move(textures);
+}
+
+std::vector<std::vector<uint8_t> >
+Decoder::DecompressDXTBuffers(const std::vector<std::vector<uint8_t> > &cmp_data,
+                              const std::vector<uint8_t> &dictionary) {
+  std::vector<std::vector<uint8_t> > result(cmp_data.size());
+  std::vector<uint8_t *> outputs(cmp_data.size());
+  for (size_t i = 0; i < cmp_data.size(); ++i) {
+    GenTCHeader hdr;
+    if (!hdr.LoadFrom(cmp_data[i])) {
+      return std::vector<std::vector<uint8_t> >();
+    }
+    result[i].resize(8 * hdr.NumBlocks());
+    outputs[i] = result[i].data();
+  }
+
+  DecompressDXTInto(GetTexturePointers(cmp_data), dictionary, outputs);
+  return std::move(result);
+}
+
+std::vector<std::vector<uint8_t> >
+Decoder::DecompressDXTMipChain(const std::vector<uint8_t> &cmp_data) {
+  std::vector<std::vector<uint8_t> > levels;
+  std::vector<uint8_t> dictionary;
+  if (!LoadMipChain(cmp_data, &levels, &dictionary)) {
+    return std::vector<std::vector<uint8_t> >();
+  }
+
+  return std::move(DecompressDXTBuffers(levels, dictionary));
+}
+
+void Decoder::DecompressDXTBuffers(const std::vector<std::vector<uint8_t> > &cmp_data,
+                                   const std::vector<uint8_t> &dictionary, uint8_t *out) {
+  std::vector<uint8_t *> outputs(cmp_data.size());
+  for (size_t i = 0; i < cmp_data.size(); ++i) {
+    GenTCHeader hdr;
+    if (!hdr.LoadFrom(cmp_data[i])) {
+      return;
+    }
+    outputs[i] = out;
+    out += 8 * hdr.NumBlocks();
+  }
+
+  DecompressDXTInto(GetTexturePointers(cmp_data), dictionary, outputs);
+}
+
+void Decoder::DecompressDXTInto(const std::vector<const std::vector<uint8_t> *> &cmp_data,
+                                const std::vector<uint8_t> &dictionary,
+                                const std::vector<uint8_t *> &outputs) {
+  assert(cmp_data.size() == outputs.size());
+  Decompress(cmp_data, dictionary, [&outputs](const Texture &tex, size_t idx, size_t block_row) {
+    const size_t blocks_x = tex.hdr.BlocksWide();
+    AssembleDXTBlocks(tex, block_row, 0, blocks_x, outputs[idx] + 8 * block_row * blocks_x);
+  });
+}
+
+std::vector<uint8_t> Decoder::DecompressDXTBuffer(const std::vector<uint8_t> &cmp_data) {
+  return std::move(DecompressDXTBuffer(cmp_data, std::vector<uint8_t>()));
+}
+
+std::vector<uint8_t> Decoder::DecompressDXTBuffer(const std::vector<uint8_t> &cmp_data,
+                                                  const std::vector<uint8_t> &dictionary) {
+  GenTCHeader hdr;
+  if (!hdr.LoadFrom(cmp_data)) {
+    return std::vector<uint8_t>();
+  }
+
+  std::vector<uint8_t> result(8 * hdr.NumBlocks());
+  DecompressDXTInto({ &cmp_data }, dictionary, { result.data() });
+  return std::move(result);
+}
+
+DXTImage Decoder::DecompressDXT(const std::vector<uint8_t> &cmp_data) {
+  return std::move(DecompressDXT(cmp_data, std::vector<uint8_t>()));
+}
+
+DXTImage Decoder::DecompressDXT(const std::vector<uint8_t> &cmp_data,
+                                const std::vector<uint8_t> &dictionary) {
+  GenTCHeader hdr;
+  if (!hdr.LoadFrom(cmp_data)) {
+    return DXTImage(0, 0, std::vector<uint8_t>());
+  }
+
+  std::vector<uint8_t> decmp_data = std::move(DecompressDXTBuffer(cmp_data, dictionary));
+  return DXTImage(hdr.width, hdr.height, decmp_data);
+}
+
+std::vector<uint8_t> Decoder::DecompressDXTRegion(const std::vector<uint8_t> &cmp_data,
+                                                  size_t x, size_t y, size_t width, size_t height) {
+  return std::move(DecompressDXTRegion(cmp_data, std::vector<uint8_t>(), x, y, width, height));
+}
+
+std::vector<uint8_t> Decoder::DecompressDXTRegion(const std::vector<uint8_t> &cmp_data,
+                                                  const std::vector<uint8_t> &dictionary,
+                                                  size_t x, size_t y, size_t width, size_t height) {
+  assert((dictionary.size() % kFreqTableSz) == 0);
+  std::vector<const uint8_t *> freq_tables;
+  for (size_t i = 0; i < dictionary.size() / kFreqTableSz; ++i) {
+    freq_tables.push_back(dictionary.data() + i * kFreqTableSz);
+  }
+
+  Texture tex;
+  uint32_t next_inline_table = static_cast<uint32_t>(freq_tables.size());
+  if (!InitializeTexture(cmp_data, &next_inline_table, &freq_tables, &tex)) {
+    return std::vector<uint8_t>();
+  }
+
+  std::vector<TileInfo> tiles;
+  RegionPlan plan;
+  if (!LoadTileIndex(tex.hdr, cmp_data, &tiles) ||
+      !PlanRegion(tex.hdr, tiles, x, y, width, height, &plan)) {
+    return std::vector<uint8_t>();
+  }
+
+  const ans::ocl::Geometry geom = tex.hdr.ANSGeometry();
+  assert(geom.IsValid());
+
+  // Build the tables of the streams...
+  std::vector<uint32_t> table_ids(tex.table_ids, tex.table_ids + kNumStreamTypes);
+  std::sort(table_ids.begin(), table_ids.end());
+  table_ids.erase(std::unique(table_ids.begin(), table_ids.end()), table_ids.end());
+
+  std::vector<std::unique_ptr<GroupDecoder> > decoders(freq_tables.size());
+  ParallelFor(table_ids.size(), [&](size_t i) {
+    assert(table_ids[i] < freq_tables.size());
+    decoders[table_ids[i]].reset(new GroupDecoder(freq_tables[table_ids[i]], geom));
+  });
+
+  // The tiles that overlap the region are decoded like a texture of their
+  // own, with the palette entries that they refer to...
+  Texture region;
+  region.hdr = tex.hdr;
+  region.hdr.palette_bytes = static_cast<uint32_t>(plan.palette_sz);
+  region.blocks_x = plan.TextureBlocksX();
+  region.blocks_y = plan.TextureBlocksY();
+  region.num_blocks = region.blocks_x * region.blocks_y;
+  region.width = 4 * region.blocks_x;
+  region.height = 4 * region.blocks_y;
+  region.output_offsets[eStreamType_Palette] = plan.palette_offset;
+  region.symbols.resize(plan.decoded_sz);
+  region.planes.resize(6 * region.num_blocks);
+  region.indices.resize(region.num_blocks);
+
+  // ... starting with the groups that hold their symbols...
+  const size_t symbols_per_group = geom.SymbolsPerGroup();
+  std::vector<GroupTask> group_tasks;
+  for (const auto &run : plan.runs) {
+    const size_t stream = run.stream;
+    AddGroupRangeTasks(tex.streams[stream], tex.stream_sz[stream],
+                       tex.hdr.NumSymbols(run.stream) / symbols_per_group,
+                       run.first_group, run.num_groups, geom,
+                       decoders[tex.table_ids[stream]].get(),
+                       region.symbols.data() + run.offset, &group_tasks);
+  }
+
+  ParallelFor(group_tasks.size(), [&](size_t i) {
+    const GroupTask &task = group_tasks[i];
+    task.decoder->Decode(task.data, task.data_sz, task.out);
+  });
+
+  // ... then the endpoint planes a row of tiles at a time, and the indices a
+  // row of blocks at a time. Each row of indices starts from the sum stored
+  // in the tile index, so the rows don't depend on each other...
+  const bool use_sse41 = UseSSE41(ans::simd::GetBestInstructionSet());
+  const size_t num_plane_rows = plan.plane_rows.size();
+  ParallelFor(num_plane_rows + region.blocks_y, [&](size_t i) {
+    if (i < num_plane_rows) {
+      const size_t plane = i / plan.tiles_y;
+      const size_t tile_row = i % plan.tiles_y;
+      InverseWaveletBlocks(region.symbols.data() + plan.plane_rows[i], plan.tiles_x,
+                           region.planes.data() + plane * region.num_blocks
+                             + tile_row * kWaveletBlockDim * region.blocks_x,
+                           region.blocks_x);
+      return;
+    }
+
+    const size_t block_row = i - num_plane_rows;
+    IndexChunk chunk;
+    chunk.diffs = region.symbols.data() + plan.index_rows[block_row];
+    chunk.indices = region.indices.data() + block_row * region.blocks_x;
+    chunk.num_vals = region.blocks_x;
+    chunk.first = true;
+    chunk.total = 0;
+    chunk.offset = plan.index_sums[block_row];
+    chunk.refs = nullptr;
+    chunk.ref_base = plan.index_ref_base;
+    chunk.num_refs = 0;
+    chunk.ref_start = 0;
+    chunk.last_ref_sum = 0;
+    if (!plan.index_ref_starts.empty()) {
+      chunk.refs = region.symbols.data() + plan.index_refs_offset;
+      chunk.ref_start = plan.index_ref_starts[block_row];
+    }
+    ScanIndexChunk(&chunk, use_sse41);
+    OffsetIndexChunk(chunk, use_sse41);
+  });
+
+  // ... and finally crop the region out of it.
+  std::vector<uint8_t> result(8 * plan.blocks_x * plan.blocks_y);
+  ParallelFor(plan.blocks_y, [&](size_t i) {
+    AssembleDXTBlocks(region, plan.offset_y + i, plan.offset_x, plan.blocks_x,
+                      result.data() + 8 * i * plan.blocks_x);
+  });
+
+  return std::move(result);
+}
+
+template<typename AssembleFn>
+void Decoder::DecompressPreview(const std::vector<uint8_t> &cmp_data,
+                                const std::vector<uint8_t> &dictionary, size_t scale,
+                                const AssembleFn &assemble) {
+  assert((dictionary.size() % kFreqTableSz) == 0);
+  std::vector<const uint8_t *> freq_tables;
+  for (size_t i = 0; i < dictionary.size() / kFreqTableSz; ++i) {
+    freq_tables.push_back(dictionary.data() + i * kFreqTableSz);
+  }
+
+  Texture tex;
+  uint32_t next_inline_table = static_cast<uint32_t>(freq_tables.size());
+  if (!InitializeTexture(cmp_data, &next_inline_table, &freq_tables, &tex)) {
+    return;
+  }
+  assert(eCoefficientOrder_Bands == tex.hdr.coefficient_order &&
+         "Texture was compressed without a preview!");
+
+  const ans::ocl::Geometry geom = tex.hdr.ANSGeometry();
+  assert(geom.IsValid());
+
+  // Build the tables of the streams...
+  std::vector<uint32_t> table_ids(tex.table_ids, tex.table_ids + kNumStreamTypes);
+  std::sort(table_ids.begin(), table_ids.end());
+  table_ids.erase(std::unique(table_ids.begin(), table_ids.end()), table_ids.end());
+
+  std::vector<std::unique_ptr<GroupDecoder> > decoders(freq_tables.size());
+  ParallelFor(table_ids.size(), [&](size_t i) {
+    assert(table_ids[i] < freq_tables.size());
+    decoders[table_ids[i]].reset(new GroupDecoder(freq_tables[table_ids[i]], geom));
+  });
+
+  // The preview is a texture of its own with the low-pass endpoints of the
+  // texture. Its symbols are the front of each endpoint stream, which holds
+  // the coarse bands, followed by the whole palette and index differences...
+  const size_t dim = kWaveletBlockDim / scale;
+  Texture preview;
+  preview.hdr = tex.hdr;
+  preview.blocks_x = tex.blocks_x / scale;
+  preview.blocks_y = tex.blocks_y / scale;
+  preview.num_blocks = preview.blocks_x * preview.blocks_y;
+  preview.width = (tex.width + scale - 1) / scale;
+  preview.height = (tex.height + scale - 1) / scale;
+
+  const size_t symbols_per_group = geom.SymbolsPerGroup();
+  std::vector<GroupTask> group_tasks;
+  size_t num_symbols = 0;
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    const EStreamType stream = static_cast<EStreamType>(i);
+    preview.output_offsets[i] = num_symbols;
+    num_symbols += tex.hdr.NumPreviewSymbols(stream, scale);
+  }
+  preview.symbols.resize(num_symbols);
+
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    const EStreamType stream = static_cast<EStreamType>(i);
+    AddGroupRangeTasks(tex.streams[i], tex.stream_sz[i],
+                       tex.hdr.NumSymbols(stream) / symbols_per_group, 0,
+                       tex.hdr.NumPreviewSymbols(stream, scale) / symbols_per_group, geom,
+                       decoders[tex.table_ids[i]].get(),
+                       preview.symbols.data() + preview.output_offsets[i], &group_tasks);
+  }
+
+  ParallelFor(group_tasks.size(), [&](size_t i) {
+    const GroupTask &task = group_tasks[i];
+    task.decoder->Decode(task.data, task.data_sz, task.out);
+  });
+
+  // ... then the low-pass endpoint planes a row of wavelet blocks at a time,
+  // and all of the indices since each one depends on the ones before it...
+  const bool use_sse41 = UseSSE41(ans::simd::GetBestInstructionSet());
+  const size_t tiles_x = tex.blocks_x / kWaveletBlockDim;
+  const size_t tiles_y = tex.blocks_y / kWaveletBlockDim;
+  preview.planes.resize(6 * preview.num_blocks);
+
+  std::vector<int32_t> indices(tex.num_blocks);
+  std::vector<IndexChunk> index_chunks;
+  IndexStream index_stream;
+  index_stream.diffs = preview.symbols.data() + preview.output_offsets[eStreamType_Indices];
+  index_stream.num_vals = tex.num_blocks;
+  index_stream.indices = indices.data();
+  index_stream.refs = IndexRefs(preview);
+  AddIndexChunks(index_stream, &index_chunks);
+
+  const size_t num_wavelet_tasks = 6 * tiles_y;
+  ParallelFor(num_wavelet_tasks + index_chunks.size(), [&](size_t i) {
+    if (i >= num_wavelet_tasks) {
+      ScanIndexChunk(&index_chunks[i - num_wavelet_tasks], use_sse41);
+      return;
+    }
+
+    const size_t plane = i / tiles_y;
+    const size_t tile_row = i % tiles_y;
+    std::vector<uint8_t> coeffs(tiles_x * dim * dim);
+    GatherBandTiles(preview, plane, tile_row, dim, coeffs.data());
+    InverseWaveletLowPass(coeffs.data(), tiles_x, dim,
+                          preview.planes.data() + plane * preview.num_blocks
+                            + tile_row * dim * preview.blocks_x,
+                          preview.blocks_x);
+  });
+
+  AccumulateIndexChunks(&index_chunks);
+  ParallelFor(index_chunks.size(), [&](size_t i) {
+    OffsetIndexChunk(index_chunks[i], use_sse41);
+  });
+
+  // ... and finally assemble the blocks that cover the preview. Each of them
+  // uses the indices of the block of the texture at the same position.
+  preview.indices.resize(preview.num_blocks);
+  ParallelFor((preview.height + 3) / 4, [&](size_t y) {
+    const int32_t *src = indices.data() + scale * y * tex.blocks_x;
+    int32_t *dst = preview.indices.data() + y * preview.blocks_x;
+    for (size_t x = 0; x < preview.blocks_x; ++x) {
+      dst[x] = src[scale * x];
+    }
+
+    assemble(preview, y);
+  });
+}
+
+std::vector<uint8_t> Decoder::DecompressDXTPreview(const std::vector<uint8_t> &cmp_data,
+                                                   size_t scale) {
+  return std::move(DecompressDXTPreview(cmp_data, std::vector<uint8_t>(), scale));
+}
+
+std::vector<uint8_t> Decoder::DecompressDXTPreview(const std::vector<uint8_t> &cmp_data,
+                                                   const std::vector<uint8_t> &dictionary,
+                                                   size_t scale) {
+  GenTCHeader hdr;
+  if (!hdr.LoadFrom(cmp_data)) {
+    return std::vector<uint8_t>();
+  }
+
+  const size_t blocks_x = ((hdr.width + scale - 1) / scale + 3) / 4;
+  const size_t blocks_y = ((hdr.height + scale - 1) / scale + 3) / 4;
+  std::vector<uint8_t> result(8 * blocks_x * blocks_y);
+  DecompressPreview(cmp_data, dictionary, scale, [&](const Texture &tex, size_t block_row) {
+    AssembleDXTBlocks(tex, block_row, 0, blocks_x, result.data() + 8 * block_row * blocks_x);
+  });
+
+  return std::move(result);
+}
+
+void Decoder::DecompressRGBPreview(const std::vector<uint8_t> &cmp_data,
+                                   const std::vector<uint8_t> &dictionary, size_t scale,
+                                   EPixelFormat fmt, uint8_t *out, size_t row_pitch,
+                                   ans::simd::EInstructionSet set) {
+#ifndef NDEBUG
+  GenTCHeader hdr;
+  if (hdr.LoadFrom(cmp_data)) {
+    assert(row_pitch >= ((hdr.width + scale - 1) / scale) * ((ePixelFormat_RGBA8 == fmt) ? 4 : 3));
+  }
+#endif
+
+  const bool use_sse41 = UseSSE41(set);
+  DecompressPreview(cmp_data, dictionary, scale, [&](const Texture &tex, size_t block_row) {
+    AssembleRGBBlockRow(tex, block_row, fmt, out, row_pitch, use_sse41);
+  });
+}
+
+void Decoder::DecompressRGB(const std::vector<uint8_t> &cmp_data, EPixelFormat fmt,
+                            uint8_t *out, size_t row_pitch, ans::simd::EInstructionSet set) {
+  DecompressRGB(cmp_data, std::vector<uint8_t>(), fmt, out, row_pitch, set);
+}
+
+void Decoder::DecompressRGB(const std::vector<uint8_t> &cmp_data,
+                            const std::vector<uint8_t> &dictionary, EPixelFormat fmt,
+                            uint8_t *out, size_t row_pitch, ans::simd::EInstructionSet set) {
+  DecompressRGBInto({ &cmp_data }, dictionary, fmt, { out }, row_pitch, set);
+}
+
+void Decoder::DecompressRGBs(const std::vector<std::vector<uint8_t> > &cmp_data,
+                             const std::vector<uint8_t> &dictionary, EPixelFormat fmt,
+                             uint8_t *out, size_t row_pitch, ans::simd::EInstructionSet set) {
+  std::vector<uint8_t *> outputs(cmp_data.size());
+  for (size_t i = 0; i < cmp_data.size(); ++i) {
+    GenTCHeader hdr;
+    if (!hdr.LoadFrom(cmp_data[i])) {
+      return;
+    }
+    outputs[i] = out;
+    out += hdr.height * row_pitch;
+  }
+
+  DecompressRGBInto(GetTexturePointers(cmp_data), dictionary, fmt, outputs, row_pitch, set);
+}
+
+void Decoder::DecompressRGBInto(const std::vector<const std::vector<uint8_t> *> &cmp_data,
+                                const std::vector<uint8_t> &dictionary, EPixelFormat fmt,
+                                const std::vector<uint8_t *> &outputs, size_t row_pitch,
+                                ans::simd::EInstructionSet set) {
+  assert(cmp_data.size() == outputs.size());
+#ifndef NDEBUG
+  for (const auto data : cmp_data) {
+    GenTCHeader hdr;
+    if (hdr.LoadFrom(*data)) {
+      assert(row_pitch >= hdr.width * ((ePixelFormat_RGBA8 == fmt) ? 4 : 3));
+    }
+  }
+#endif
+
+  const bool use_sse41 = UseSSE41(set);
+  Decompress(cmp_data, dictionary, [&](const Texture &tex, size_t idx, size_t block_row) {
+    AssembleRGBBlockRow(tex, block_row, fmt, outputs[idx], row_pitch, use_sse41);
+  });
+}
+
+}  // namespace cpu
+}  // namespace GenTC
@@ -0,0 +1,175 @@
+#ifndef __TCAR_CPU_DECODER_H__
+#define __TCAR_CPU_DECODER_H__
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ans_simd.h"
+#include "codec_base.h"
+#include "dxt_image.h"
+
+namespace ctpl {
+  class thread_pool;
+}
+
+namespace GenTC {
+namespace cpu {
+
+  enum EPixelFormat {
+    ePixelFormat_RGB8,
+    ePixelFormat_RGBA8
+  };
+
+  // The index differences of one texture, bytes biased by 128 like they are
+  // stored in the indices stream, and where its palette indices go. If the
+  // texture has long-range index references, refs points at them, and a zero
+  // difference takes the next one. Otherwise refs is null.
+  struct IndexStream {
+    const uint8_t *diffs;
+    size_t num_vals;
+    int32_t *indices;
+    const uint8_t *refs;
+  };
+
+  struct Texture;
+
+  // Decodes GenTC textures without OpenCL. The decoder runs the same stages as
+  // the OpenCL kernels -- building the rANS tables, decoding the interleaved
+  // streams, the inverse wavelet transform of the endpoint planes, the prefix
+  // sum of the index differences and the assembly of the blocks -- on a pool
+  // of threads, and produces the same bytes as the assemble_dxt kernel.
+  // Textures whose headers don't load aren't decoded: the methods that return
+  // their output return it empty, and the others leave it untouched.
+  class Decoder {
+   public:
+    // Uses one thread per core if num_threads is zero. A decoder with a
+    // single thread does all of the work on the calling thread.
+    explicit Decoder(size_t num_threads = 0);
+    ~Decoder();
+
+    size_t NumThreads() const { return _num_threads; }
+
+    // Decodes a texture compressed with CompressDXT, or one texture of a batch
+    // compressed with CompressDXTs along with the batch's dictionary.
+    std::vector<uint8_t> DecompressDXTBuffer(const std::vector<uint8_t> &cmp_data);
+    std::vector<uint8_t> DecompressDXTBuffer(const std::vector<uint8_t> &cmp_data,
+                                             const std::vector<uint8_t> &dictionary);
+
+    DXTImage DecompressDXT(const std::vector<uint8_t> &cmp_data);
+    DXTImage DecompressDXT(const std::vector<uint8_t> &cmp_data,
+                           const std::vector<uint8_t> &dictionary);
+
+    // Decodes a batch of textures at once so that every stage has enough work
+    // to keep all of the threads busy. Like with the OpenCL decoder the
+    // textures don't need to have the same dimensions, but they do need to
+    // share an ANS geometry. Returns the DXT1 blocks of each texture in order.
+    std::vector<std::vector<uint8_t> >
+    DecompressDXTBuffers(const std::vector<std::vector<uint8_t> > &cmp_data,
+                         const std::vector<uint8_t> &dictionary);
+
+    // Same as above, but writes the blocks of the textures back to back
+    // starting at out, like the OpenCL decoder does for a batch.
+    void DecompressDXTBuffers(const std::vector<std::vector<uint8_t> > &cmp_data,
+                              const std::vector<uint8_t> &dictionary, uint8_t *out);
+
+    // Decodes every level of a mip chain compressed with CompressDXTMipChain
+    // as one batch. Returns the DXT1 blocks of each level, largest first.
+    std::vector<std::vector<uint8_t> > DecompressDXTMipChain(const std::vector<uint8_t> &cmp_data);
+
+    // Decodes the width x height pixels at (x, y) of a texture that was
+    // compressed with a tile index, without touching the tiles that don't
+    // overlap them. The region needs to be aligned to DXT blocks, and may
+    // take in the whole of the last row and column of blocks of a texture
+    // that isn't a multiple of four pixels in size. Returns the DXT1 blocks
+    // of the region in raster order, or nothing if the texture has no tile
+    // index, its tile index is malformed, or the region doesn't fit.
+    std::vector<uint8_t> DecompressDXTRegion(const std::vector<uint8_t> &cmp_data,
+                                             size_t x, size_t y, size_t width, size_t height);
+    std::vector<uint8_t> DecompressDXTRegion(const std::vector<uint8_t> &cmp_data,
+                                             const std::vector<uint8_t> &dictionary,
+                                             size_t x, size_t y, size_t width, size_t height);
+
+    // Decodes a preview of a texture compressed with CompressDXTWithPreview
+    // that is 1 / scale its size in each dimension, for a scale of 1, 2, 4 or
+    // 8. The endpoints of the preview are reconstructed from the coarse
+    // bands of the wavelet blocks alone, so only the front of the endpoint
+    // streams is decoded. Each block of the preview keeps the palette index
+    // of the block at the same position in the texture. The preview is
+    // ceil(width / scale) x ceil(height / scale) pixels. Returns the DXT1
+    // blocks of the preview.
+    std::vector<uint8_t> DecompressDXTPreview(const std::vector<uint8_t> &cmp_data, size_t scale);
+    std::vector<uint8_t> DecompressDXTPreview(const std::vector<uint8_t> &cmp_data,
+                                              const std::vector<uint8_t> &dictionary,
+                                              size_t scale);
+
+    // Same as above, but decodes the preview straight to pixels like
+    // DecompressRGB does.
+    void DecompressRGBPreview(const std::vector<uint8_t> &cmp_data,
+                              const std::vector<uint8_t> &dictionary, size_t scale,
+                              EPixelFormat fmt, uint8_t *out, size_t row_pitch,
+                              ans::simd::EInstructionSet set = ans::simd::GetBestInstructionSet());
+
+    // Decodes straight to 8-bit pixels like the assemble_rgb kernel does,
+    // without going through DXT blocks. Row y of the texture starts at
+    // out + y * row_pitch. RGBA8 pixels have an alpha of 255. The blocks are
+    // assembled with SSE4.1 unless set is scalar or the host doesn't have it.
+    void DecompressRGB(const std::vector<uint8_t> &cmp_data, EPixelFormat fmt,
+                       uint8_t *out, size_t row_pitch,
+                       ans::simd::EInstructionSet set = ans::simd::GetBestInstructionSet());
+    void DecompressRGB(const std::vector<uint8_t> &cmp_data,
+                       const std::vector<uint8_t> &dictionary, EPixelFormat fmt,
+                       uint8_t *out, size_t row_pitch,
+                       ans::simd::EInstructionSet set = ans::simd::GetBestInstructionSet());
+
+    // Decodes a batch to pixels. The textures are stacked on top of each
+    // other, so the first row of each texture comes right after the last row
+    // of the one before it.
+    void DecompressRGBs(const std::vector<std::vector<uint8_t> > &cmp_data,
+                        const std::vector<uint8_t> &dictionary, EPixelFormat fmt,
+                        uint8_t *out, size_t row_pitch,
+                        ans::simd::EInstructionSet set = ans::simd::GetBestInstructionSet());
+
+    // Turns the index differences of each stream into palette indices, the
+    // inclusive prefix sum of the differences restarted at each long-range
+    // reference, ready for assembly. The work is split into chunks across all
+    // of the streams.
+    void DecodeIndices(const std::vector<IndexStream> &streams,
+                       ans::simd::EInstructionSet set = ans::simd::GetBestInstructionSet());
+
+   private:
+    const size_t _num_threads;
+    std::unique_ptr<ctpl::thread_pool> _pool;
+
+    void DecompressDXTInto(const std::vector<const std::vector<uint8_t> *> &cmp_data,
+                           const std::vector<uint8_t> &dictionary,
+                           const std::vector<uint8_t *> &outputs);
+
+    void DecompressRGBInto(const std::vector<const std::vector<uint8_t> *> &cmp_data,
+                           const std::vector<uint8_t> &dictionary, EPixelFormat fmt,
+                           const std::vector<uint8_t *> &outputs, size_t row_pitch,
+                           ans::simd::EInstructionSet set);
+
+    // Runs every stage but the last one on the batch, and then calls
+    // assemble(texture, index in the batch, block row) for each row of
+    // blocks that covers each texture.
+    template<typename AssembleFn>
+    void Decompress(const std::vector<const std::vector<uint8_t> *> &cmp_data,
+                    const std::vector<uint8_t> &dictionary, const AssembleFn &assemble);
+
+    // Decodes the preview of one texture and calls assemble(preview, block row)
+    // for each row of blocks of the preview.
+    template<typename AssembleFn>
+    void DecompressPreview(const std::vector<uint8_t> &cmp_data,
+                           const std::vector<uint8_t> &dictionary, size_t scale,
+                           const AssembleFn &assemble);
+
+    // Calls fn(i) for each i in [0, num_items), splitting the range into
+    // contiguous runs across the pool, and returns once all of them are done.
+    template<typename F> void ParallelFor(size_t num_items, const F &fn);
+  };
+
+}  // namespace cpu
+}  // namespace GenTC
+
+#endif  // __TCAR_CPU_DECODER_H__
@@ -0,0 +1,171 @@
+#include "decode_backend.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <future>
+
+#include "cpu_decoder.h"
+
+namespace GenTC {
+
+size_t DecodedSize(const GenTCHeader &hdr, EDecodeOutput output) {
+  switch (output) {
+  case eDecodeOutput_DXT: return 8 * hdr.NumBlocks();
+  case eDecodeOutput_RGB: return hdr.width * hdr.height * 3;
+  }
+
+  assert(!"Unknown output type!");
+  return 0;
+}
+
+std::vector<uint8_t> DecodeBackend::Decode(const std::vector<std::vector<uint8_t> > &cmp_data,
+                                           const std::vector<uint8_t> &dictionary,
+                                           EDecodeOutput output_type) {
+  size_t total_sz = 0;
+  for (const auto &data : cmp_data) {
+    GenTCHeader hdr;
+    if (!hdr.LoadFrom(data)) {
+      return std::vector<uint8_t>();
+    }
+    total_sz += DecodedSize(hdr, output_type);
+  }
+
+  std::unique_ptr<Buffer> output = CreateBuffer(total_sz);
+  DecodeBatch(cmp_data, dictionary, output_type, output.get())->Wait();
+
+  std::vector<uint8_t> result(total_sz);
+  output->Read(0, total_sz, result.data());
+  return std::move(result);
+}
+
+class CPUBuffer : public DecodeBackend::Buffer {
+ public:
+  explicit CPUBuffer(size_t sz) : _mem(sz) { }
+
+  size_t Size() const override { return _mem.size(); }
+  void Read(size_t offset, size_t sz, uint8_t *dst) const override {
+    assert(offset + sz <= _mem.size());
+    memcpy(dst, _mem.data() + offset, sz);
+  }
+
+  uint8_t *Data() { return _mem.data(); }
+
+ private:
+  std::vector<uint8_t> _mem;
+};
+
+class CPUCompletion : public DecodeBackend::Completion {
+ public:
+  explicit CPUCompletion(std::future<void> &&result) : _result(std::move(result)) { }
+
+  bool IsComplete() const override {
+    return std::future_status::ready == _result.wait_for(std::chrono::seconds(0));
+  }
+
+  void Wait() override { _result.wait(); }
+
+ private:
+  std::future<void> _result;
+};
+
+class CPUBackend : public DecodeBackend {
+ public:
+  explicit CPUBackend(size_t num_threads) : _decoder(num_threads) { }
+
+  EDecodeBackend Type() const override { return eDecodeBackend_CPU; }
+
+  std::unique_ptr<Buffer> CreateBuffer(size_t sz) override {
+    return std::unique_ptr<Buffer>(new CPUBuffer(sz));
+  }
+
+  std::unique_ptr<Completion>
+  DecodeBatch(const std::vector<std::vector<uint8_t> > &cmp_data,
+              const std::vector<uint8_t> &dictionary,
+              EDecodeOutput output_type, Buffer *output) override {
+    uint8_t *out = static_cast<CPUBuffer *>(output)->Data();
+
+    // Rows of pixels are tightly packed, and each texture starts where the
+    // one before it ends, like DecodedSize lays them out. A batch whose
+    // textures are all as wide can be stacked into one image, and the others
+    // are decoded one texture at a time.
+    std::vector<size_t> widths;
+    std::vector<size_t> offsets;
+    size_t total_sz = 0;
+    for (const auto &data : cmp_data) {
+      GenTCHeader hdr;
+      if (!hdr.LoadFrom(data)) {
+        // A batch that doesn't load completes right away without any output
+        std::promise<void> done;
+        done.set_value();
+        return std::unique_ptr<Completion>(new CPUCompletion(done.get_future()));
+      }
+
+      widths.push_back(hdr.width);
+      offsets.push_back(total_sz);
+      total_sz += DecodedSize(hdr, output_type);
+    }
+    assert(total_sz <= output->Size());
+    (void)(total_sz);
+
+    const bool same_widths =
+      std::equal(widths.begin() + (widths.empty() ? 0 : 1), widths.end(), widths.begin());
+
+    // The decoder splits the batch up across its own pool, so all that
+    // the extra thread does is wait on it.
+    cpu::Decoder *decoder = &_decoder;
+    const std::vector<std::vector<uint8_t> > *cmp = &cmp_data;
+    const std::vector<uint8_t> *dict = &dictionary;
+    std::future<void> result = std::async(std::launch::async, [=]() {
+      if (eDecodeOutput_DXT == output_type) {
+        decoder->DecompressDXTBuffers(*cmp, *dict, out);
+      } else if (same_widths) {
+        if (!widths.empty()) {
+          decoder->DecompressRGBs(*cmp, *dict, cpu::ePixelFormat_RGB8, out, 3 * widths[0]);
+        }
+      } else {
+        for (size_t i = 0; i < cmp->size(); ++i) {
+          decoder->DecompressRGB((*cmp)[i], *dict, cpu::ePixelFormat_RGB8, out + offsets[i],
+                                 3 * widths[i]);
+        }
+      }
+    });
+
+    return std::unique_ptr<Completion>(new CPUCompletion(std::move(result)));
+  }
+
+  std::vector<uint8_t> DecodeRegion(const std::vector<uint8_t> &cmp_data,
+                                    const std::vector<uint8_t> &dictionary,
+                                    size_t x, size_t y, size_t width, size_t height) override {
+    return std::move(_decoder.DecompressDXTRegion(cmp_data, dictionary, x, y, width, height));
+  }
+
+  std::vector<uint8_t> DecodePreview(const std::vector<uint8_t> &cmp_data,
+                                     const std::vector<uint8_t> &dictionary,
+                                     size_t scale, EDecodeOutput output_type) override {
+    if (eDecodeOutput_DXT == output_type) {
+      return std::move(_decoder.DecompressDXTPreview(cmp_data, dictionary, scale));
+    }
+
+    GenTCHeader hdr;
+    if (!hdr.LoadFrom(cmp_data)) {
+      return std::vector<uint8_t>();
+    }
+
+    const size_t width = (hdr.width + scale - 1) / scale;
+    std::vector<uint8_t> result(3 * width * ((hdr.height + scale - 1) / scale));
+    _decoder.DecompressRGBPreview(cmp_data, dictionary, scale, cpu::ePixelFormat_RGB8,
+                                  result.data(), 3 * width);
+    return std::move(result);
+  }
+
+ private:
+  cpu::Decoder _decoder;
+};
+
+std::unique_ptr<DecodeBackend> CreateCPUBackend(size_t num_threads) {
+  return std::unique_ptr<DecodeBackend>(new CPUBackend(num_threads));
+}
+
+}  // namespace GenTC
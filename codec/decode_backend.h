@@ -0,0 +1,94 @@
+#ifndef __TCAR_DECODE_BACKEND_H__
+#define __TCAR_DECODE_BACKEND_H__
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "codec_base.h"
+
+namespace GenTC {
+
+  enum EDecodeBackend {
+    eDecodeBackend_OpenCL,
+    eDecodeBackend_CPU
+  };
+
+  // DXT1 blocks like assemble_dxt, or tightly packed RGB8 pixels like
+  // assemble_rgb.
+  enum EDecodeOutput {
+    eDecodeOutput_DXT,
+    eDecodeOutput_RGB
+  };
+
+  // Number of bytes that a texture decodes to. The textures of a batch are
+  // written back to back in the output buffer.
+  size_t DecodedSize(const GenTCHeader &hdr, EDecodeOutput output);
+
+  // Something that can decode batches of textures, either with the OpenCL
+  // kernels or on the CPU. The interface only deals in opaque buffers and
+  // completion handles so that the same code can drive either one.
+  class DecodeBackend {
+   public:
+    // Memory that a batch decodes into. This is device memory for OpenCL
+    // and host memory for the CPU.
+    class Buffer {
+     public:
+      virtual ~Buffer() { }
+      virtual size_t Size() const = 0;
+
+      // Copies sz bytes starting at offset to dst. Only valid once the
+      // batches that write to the buffer are complete.
+      virtual void Read(size_t offset, size_t sz, uint8_t *dst) const = 0;
+    };
+
+    // Handle to a batch that is being decoded.
+    class Completion {
+     public:
+      virtual ~Completion() { }
+      virtual bool IsComplete() const = 0;
+      virtual void Wait() = 0;
+    };
+
+    virtual ~DecodeBackend() { }
+
+    virtual EDecodeBackend Type() const = 0;
+    virtual std::unique_ptr<Buffer> CreateBuffer(size_t sz) = 0;
+
+    // Starts decoding a batch of textures into output. The batch has the
+    // same restrictions as the backend's decoder. The compressed data and
+    // the dictionary of shared frequency tables need to stay alive until
+    // the batch is complete.
+    virtual std::unique_ptr<Completion>
+    DecodeBatch(const std::vector<std::vector<uint8_t> > &cmp_data,
+                const std::vector<uint8_t> &dictionary,
+                EDecodeOutput output_type, Buffer *output) = 0;
+
+    // Decodes the DXT1 blocks of the width x height pixels at (x, y) of a
+    // texture compressed with a tile index and waits for them. The region
+    // needs to be aligned to DXT blocks, and the blocks are returned in
+    // raster order.
+    virtual std::vector<uint8_t> DecodeRegion(const std::vector<uint8_t> &cmp_data,
+                                              const std::vector<uint8_t> &dictionary,
+                                              size_t x, size_t y, size_t width, size_t height) = 0;
+
+    // Decodes the preview of a texture compressed with CompressDXTWithPreview
+    // that is 1 / scale its size in each dimension and waits for it. The
+    // preview is laid out like a texture of that size decoded to output_type.
+    virtual std::vector<uint8_t> DecodePreview(const std::vector<uint8_t> &cmp_data,
+                                               const std::vector<uint8_t> &dictionary,
+                                               size_t scale, EDecodeOutput output_type) = 0;
+
+    // Decodes a batch into host memory and waits for it to finish.
+    std::vector<uint8_t> Decode(const std::vector<std::vector<uint8_t> > &cmp_data,
+                                const std::vector<uint8_t> &dictionary,
+                                EDecodeOutput output_type);
+  };
+
+  // Decodes on a pool of num_threads threads with cpu::Decoder, or one
+  // thread per core if num_threads is zero.
+  std::unique_ptr<DecodeBackend> CreateCPUBackend(size_t num_threads = 0);
+
+}  // namespace GenTC
+
+#endif  // __TCAR_DECODE_BACKEND_H__
@@ -3,15 +3,44 @@
 #define LOCAL_SCAN_SIZE_LOG 7
 #define LOCAL_SCAN_SIZE 128
 
-__kernel void decode_indices(const __global   uchar *global_index_data,
-                             const __constant uint  *global_offsets,
-                             const            uint   stage,
-                             const            uint   num_vals,
-                                   __global   int   *global_out) {
-  const __global uchar *const index_data =
-    global_index_data + global_offsets[4 * get_global_id(1) + 3];
-
-  __global int *const out = global_out + num_vals * get_global_id(1);
+// Matches TextureInfo in decoder.cpp
+typedef struct {
+  uint stream_offsets[4];
+  uint blocks_x;
+  uint blocks_y;
+  uint first_block;
+  uint width;
+  uint height;
+  uint out_offset;
+  uint refs_offset;
+  uint num_refs;
+} TextureInfo;
+
+#ifdef GENTC_APPLE
+static bool IsIndexRef(const __global TextureInfo *texture, uchar diff);
+#endif
+
+// A zero index difference of a texture with long-range references takes
+// the next reference instead of adding to the sum.
+bool IsIndexRef(const __global TextureInfo *texture, uchar diff) {
+  return 0 < texture->num_refs && 0 == diff;
+}
+
+// The textures of a batch go along the second dimension, and the first one
+// is sized for the texture with the most blocks. The indices of each texture
+// are written out starting at its first block. The long-range references add
+// nothing to the sum, unless count_refs is set, in which case the references
+// are counted instead of summing the differences.
+__kernel void decode_indices(const __global   uchar       *global_index_data,
+                             const __global   TextureInfo *textures,
+                             const            uint         stage,
+                             const            uint         count_refs,
+                                   __global   int         *global_out) {
+  const __global TextureInfo *texture = textures + get_global_id(1);
+  const uint num_vals = texture->blocks_x * texture->blocks_y;
+  const __global uchar *const index_data = global_index_data + texture->stream_offsets[3];
+
+  __global int *const out = global_out + texture->first_block;
   __local int scratch[LOCAL_SCAN_SIZE];
 
   // First read in data
@@ -20,11 +49,22 @@ __kernel void decode_indices(const __global   uchar *global_index_data,
   const uint gidx = idx_offset * (get_global_id(0) + 1) - 1;
   const uint pgidx = idx_offset * get_global_id(0) - 1;
 
+  // A chunk that runs past the end of a texture ends at its last value
+  // instead, but smaller textures have threads past all of their chunks.
   if (0 == stage) {
-    scratch[get_local_id(0)] = (int)(index_data[get_global_id(0)]) - 128;
+    int val = 0;
+    if (gidx < num_vals) {
+      const uchar diff = index_data[gidx];
+      if (count_refs) {
+        val = IsIndexRef(texture, diff) ? 1 : 0;
+      } else {
+        val = IsIndexRef(texture, diff) ? 0 : (int)(diff) - 128;
+      }
+    }
+    scratch[get_local_id(0)] = val;
   } else if (gidx < num_vals) {
     scratch[get_local_id(0)] = out[gidx];
-  } else if (pgidx < num_vals) {
+  } else if (pgidx + 1 < num_vals) {
     scratch[get_local_id(0)] = out[num_vals - 1];
   } else {
     scratch[get_local_id(0)] = 0;
@@ -56,17 +96,19 @@ __kernel void decode_indices(const __global   uchar *global_index_data,
   }
 
   barrier(CLK_LOCAL_MEM_FENCE);
-  if (0 == stage || gidx < num_vals) {
+  if (gidx < num_vals) {
     out[gidx] = scratch[get_local_id(0)];
-  } else if (pgidx < num_vals && gidx >= num_vals) {
+  } else if (0 < stage && pgidx + 1 < num_vals) {
     out[num_vals - 1] = scratch[get_local_id(0)];
   }
 }
 
-__kernel void collect_indices(const            int    stage,
-                              const            uint   num_vals,
-                                    __global   int   *global_out) {
-  __global int *const out = global_out + num_vals * get_global_id(1);
+__kernel void collect_indices(const __global   TextureInfo *textures,
+                              const            int          stage,
+                                    __global   int         *global_out) {
+  const __global TextureInfo *texture = textures + get_global_id(1);
+  const uint num_vals = texture->blocks_x * texture->blocks_y;
+  __global int *const out = global_out + texture->first_block;
 
   uint offset = 1 << (stage * LOCAL_SCAN_SIZE_LOG);
   uint gidx = offset * get_group_id(0) - 1;
@@ -82,3 +124,95 @@ __kernel void collect_indices(const            int    stage,
     out[tidx] += out[gidx];
   }
 }
+
+// The sums of the index differences count the references as zero. Once both
+// the sums and the number of references up to each block are known, each
+// reference is turned into the amount that the blocks from it up to the next
+// reference need to be moved by. The references of a texture start at its
+// refs_offset, which is a multiple of four bytes.
+__kernel void bias_index_refs(      __global   uchar       *global_data,
+                              const __global   TextureInfo *textures,
+                              const __global   int         *global_ref_counts,
+                              const __global   int         *global_indices) {
+  const __global TextureInfo *texture = textures + get_global_id(1);
+  const uint num_vals = texture->blocks_x * texture->blocks_y;
+  const uint idx = get_global_id(0);
+  if (idx >= num_vals) {
+    return;
+  }
+
+  const uchar diff = global_data[texture->stream_offsets[3] + idx];
+  if (!IsIndexRef(texture, diff)) {
+    return;
+  }
+
+  __global uint *const refs = (__global uint *)(global_data + texture->refs_offset);
+  const uint ref = global_ref_counts[texture->first_block + idx] - 1;
+  refs[ref] -= (uint)(global_indices[texture->first_block + idx]);
+}
+
+__kernel void apply_index_refs(const __global   uchar       *global_data,
+                               const __global   TextureInfo *textures,
+                               const __global   int         *global_ref_counts,
+                                     __global   int         *global_indices) {
+  const __global TextureInfo *texture = textures + get_global_id(1);
+  const uint num_vals = texture->blocks_x * texture->blocks_y;
+  const uint idx = get_global_id(0);
+  if (idx >= num_vals || 0 == texture->num_refs) {
+    return;
+  }
+
+  const int num_refs = global_ref_counts[texture->first_block + idx];
+  if (0 < num_refs) {
+    const __global uint *const refs = (const __global uint *)(global_data + texture->refs_offset);
+    global_indices[texture->first_block + idx] =
+      (int)((uint)(global_indices[texture->first_block + idx]) + refs[num_refs - 1]);
+  }
+}
+
+// Decodes the indices of a region of a texture one row of blocks per thread.
+// Each row starts from the running sum that the tile index stores for it, so
+// the rows don't depend on each other. The offset of the index differences of
+// each row in the decoded data is followed by the sum to start from and the
+// first long-range reference that the row takes. If has_refs is set, the
+// references start at refs_offset in the decoded data and are moved down by
+// ref_base.
+__kernel void decode_region_indices(const __global   uchar *global_index_data,
+                                    const __global   uint  *rows,
+                                    const            uint   row_len,
+                                    const            uint   has_refs,
+                                    const            uint   refs_offset,
+                                    const            uint   ref_base,
+                                          __global   int   *global_out) {
+  const __global uint *const row = rows + 3 * get_global_id(0);
+  const __global uchar *const index_data = global_index_data + row[0];
+  __global int *const out = global_out + row_len * get_global_id(0);
+
+  const __global uint *const refs = (const __global uint *)(global_index_data + refs_offset);
+  uint next_ref = row[2];
+
+  // Sum as unsigned so that it wraps around like the other kernels
+  uint sum = row[1];
+  for (uint i = 0; i < row_len; ++i) {
+    const uchar diff = index_data[i];
+    if (has_refs && 0 == diff) {
+      sum = refs[next_ref++] - ref_base;
+    } else {
+      sum += (uint)((int)(diff) - 128);
+    }
+    out[i] = (int)(sum);
+  }
+}
+
+// Picks out the palette index of every scale-th block in each direction of
+// a texture that is row_len blocks wide, for a preview that is 1 / scale the
+// size of the texture. There's one thread per block of the preview.
+__kernel void subsample_indices(const __global int *indices,
+                                const          uint row_len,
+                                const          uint scale,
+                                      __global int *out)
+{
+  const uint x = get_global_id(0);
+  const uint y = get_global_id(1);
+  out[y * get_global_size(0) + x] = indices[scale * (y * row_len + x)];
+}
@@ -2,10 +2,12 @@
 #include "decoder_config.h"
 
 #include <atomic>
+#include <cstring>
 #include <iostream>
 
 #include "ans_config.h"
 #include "ans_ocl.h"
+#include "tile_index.h"
 
 using gpu::GPUContext;
 
@@ -40,9 +42,23 @@ namespace GenTC {
 
 size_t RequiredScratchMem(const GenTCHeader &hdr) {
   size_t scratch_mem_sz = 0;
-  scratch_mem_sz += 4 * ans::ocl::kANSTableSize * sizeof(AnsTableEntry);
-  scratch_mem_sz += 17 * hdr.width * hdr.height / 16;
-  scratch_mem_sz += hdr.palette_bytes;
+  scratch_mem_sz += 4 * hdr.ans_table_size * sizeof(AnsTableEntry);
+  size_t decoded_sz = 0;
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    decoded_sz += hdr.NumSymbols(static_cast<EStreamType>(i));
+  }
+  scratch_mem_sz += decoded_sz;
+  scratch_mem_sz += 10 * hdr.NumCodedBlocks();
+
+  // The long-range index references are counted up to each block
+  if (0 < hdr.index_refs) {
+    scratch_mem_sz += 4 * hdr.NumCodedBlocks();
+  }
+
+  // Band ordered coefficients are gathered into a copy of the decoded streams
+  if (eCoefficientOrder_Bands == hdr.coefficient_order) {
+    scratch_mem_sz += decoded_sz;
+  }
   return scratch_mem_sz; 
 }
 
@@ -95,33 +111,405 @@ public:
 };
 static std::unique_ptr<PreloadedMemory> gPreloader;
 
+// The frequency tables of a batch are laid out with the shared tables first,
+// followed by the inline tables of each texture in order. Returns the index
+// of the table for each stream of each texture.
+static std::vector<cl_uint> GetTableIndices(const std::vector<GenTCHeader> &hdrs,
+                                            cl_uint num_shared_tables, cl_uint *num_tables) {
+  std::vector<cl_uint> table_ids;
+  table_ids.reserve(kNumStreamTypes * hdrs.size());
+
+  cl_uint next_inline_table = num_shared_tables;
+  for (const auto &hdr : hdrs) {
+    for (size_t i = 0; i < kNumStreamTypes; ++i) {
+      if (kInlineFreqTable == hdr.table_ids[i]) {
+        table_ids.push_back(next_inline_table++);
+      } else {
+        assert(hdr.table_ids[i] < num_shared_tables);
+        table_ids.push_back(static_cast<cl_uint>(hdr.table_ids[i]));
+      }
+    }
+  }
+
+  *num_tables = next_inline_table;
+  return std::move(table_ids);
+}
+
+// Where the kernels that run after entropy decoding find each texture of a
+// batch. The coded blocks of all of the textures are numbered one after
+// another, and the kernels launch over all of them at once, so a batch of
+// textures with different dimensions still takes one dispatch per stage.
+// The endpoint planes of a texture start at six times its first block, and
+// its palette indices at its first block. Matches TextureInfo in the kernels.
+struct TextureInfo {
+  cl_uint stream_offsets[kNumStreamTypes];  // Into the decoded streams
+  cl_uint blocks_x;                         // Coded blocks
+  cl_uint blocks_y;
+  cl_uint first_block;
+  cl_uint width;                            // Pixels
+  cl_uint height;
+  cl_uint out_offset;                       // Bytes into the output
+  cl_uint refs_offset;                      // Long-range index references
+  cl_uint num_refs;
+};
+
+static TextureInfo GetTextureInfo(const cl_uint *stream_offsets, size_t blocks_x, size_t blocks_y,
+                                  size_t first_block, size_t width, size_t height,
+                                  size_t out_offset, size_t refs_offset, size_t num_refs) {
+  TextureInfo info;
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    info.stream_offsets[i] = stream_offsets[i];
+  }
+  info.blocks_x = static_cast<cl_uint>(blocks_x);
+  info.blocks_y = static_cast<cl_uint>(blocks_y);
+  info.first_block = static_cast<cl_uint>(first_block);
+  info.width = static_cast<cl_uint>(width);
+  info.height = static_cast<cl_uint>(height);
+  info.out_offset = static_cast<cl_uint>(out_offset);
+  info.refs_offset = static_cast<cl_uint>(refs_offset);
+  info.num_refs = static_cast<cl_uint>(num_refs);
+  return info;
+}
+
+static cl_mem CreateTextureInfoBuffer(const std::unique_ptr<GPUContext> &gpu_ctx,
+                                      const std::vector<TextureInfo> &textures) {
+  cl_int errCreateBuffer;
+  cl_mem textures_buf = clCreateBuffer(gpu_ctx->GetOpenCLContext(), GetHostReadOnlyFlags(),
+                                       textures.size() * sizeof(TextureInfo),
+                                       const_cast<TextureInfo *>(textures.data()), &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
+  return textures_buf;
+}
+
+// The multi-pass prefix sum of decode_indices and collect_indices over the
+// index differences of each texture, or over its long-range references if
+// count_refs is set. The passes are sized for the texture with the most
+// blocks, max_num_indices, and the threads past the end of the smaller ones
+// have nothing to do. Waits on and releases wait_event, and returns the event
+// of the last pass.
+static cl_event EnqueuePrefixSum(const std::unique_ptr<GPUContext> &gpu_ctx, cl_command_queue queue,
+                                 cl_mem decoded, cl_mem textures, size_t max_num_indices,
+                                 size_t num_textures, cl_uint count_refs, cl_event wait_event,
+                                 cl_mem sums) {
+  static const size_t kLocalScanSz = 128;
+  static const size_t kLocalScanSzLog = 7;
+
+  cl_event decode_event = wait_event;
+
+  cl_int stage = -1;
+  while (true) {
+    stage++;
+    size_t num_decode_indices_vals = max_num_indices >> (stage * kLocalScanSzLog);
+    if (0 == num_decode_indices_vals) {
+      break;
+    }
+
+    cl_event next_event;
+    size_t decode_indices_global_work_sz[2] = {
+      ((num_decode_indices_vals + kLocalScanSz - 1) / kLocalScanSz) * kLocalScanSz,
+      num_textures
+    };
+
+    size_t decode_indices_local_work_sz[2] = {
+      kLocalScanSz,
+      1
+    };
+
+#ifndef NDEBUG
+    assert(decode_indices_local_work_sz[0] <= gpu_ctx->GetKernelWGInfo<size_t>(
+      GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "decode_indices",
+      CL_KERNEL_WORK_GROUP_SIZE));
+#endif
+
+    gpu_ctx->EnqueueOpenCLKernel<2>(
+      // Queue to run on
+      queue,
+
+      // Kernel to run...
+      GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "decode_indices",
+
+      // Work size (global and local)
+      decode_indices_global_work_sz, decode_indices_local_work_sz,
+
+      // Events to depend on and return
+      1, &decode_event, &next_event,
+
+      // Kernel arguments
+      decoded, textures, stage, count_refs, sums);
+
+    CHECK_CL(clReleaseEvent, decode_event);
+    decode_event = next_event;
+  }
+
+  while (stage > 0) {
+    size_t num_decode_indices_vals = max_num_indices >> std::max<int>(0, ((stage - 1) * kLocalScanSzLog));
+
+    size_t collect_indices_global_work_sz[2] = {
+      ((num_decode_indices_vals + kLocalScanSz - 1) / kLocalScanSz) * kLocalScanSz,
+      num_textures
+    };
+    assert(collect_indices_global_work_sz[0] % kLocalScanSz == 0);
+
+    size_t collect_indices_local_work_sz[2] = {
+      kLocalScanSz,
+      1
+    };
+
+    cl_event next_event;
+    gpu_ctx->EnqueueOpenCLKernel<2>(
+      // Queue to run on
+      queue,
+
+      // Kernel to run...
+      GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "collect_indices",
+
+      // Work size (global and local)
+      collect_indices_global_work_sz, collect_indices_local_work_sz,
+
+      // Events to depend on and return
+      1, &decode_event, &next_event,
+
+      // Kernel arguments
+      textures, stage, sums);
+
+    CHECK_CL(clReleaseEvent, decode_event);
+    decode_event = next_event;
+
+    stage--;
+  }
+
+  return decode_event;
+}
+
+// Turns the index differences of each texture into palette indices. If any
+// of the textures have long-range index references, ref_counts holds the
+// number of references up to each block, and the blocks from each reference
+// on are moved to count from it. The references are changed in place in the
+// decoded streams. Waits on and releases wait_event, and returns the event
+// of the last pass.
+static cl_event EnqueueIndexScan(const std::unique_ptr<GPUContext> &gpu_ctx, cl_command_queue queue,
+                                 cl_mem decoded, cl_mem textures, size_t max_num_indices,
+                                 size_t num_textures, cl_event wait_event, cl_mem ref_counts,
+                                 cl_mem decoded_indices) {
+  if (NULL == ref_counts) {
+    return EnqueuePrefixSum(gpu_ctx, queue, decoded, textures, max_num_indices, num_textures, 0,
+                            wait_event, decoded_indices);
+  }
+
+  // Both of the sums wait on the same event
+  CHECK_CL(clRetainEvent, wait_event);
+  cl_event sum_events[2];
+  sum_events[0] = EnqueuePrefixSum(gpu_ctx, queue, decoded, textures, max_num_indices,
+                                   num_textures, 0, wait_event, decoded_indices);
+  sum_events[1] = EnqueuePrefixSum(gpu_ctx, queue, decoded, textures, max_num_indices,
+                                   num_textures, 1, wait_event, ref_counts);
+
+  size_t refs_global_work_sz[2] = { max_num_indices, num_textures };
+
+  cl_event bias_event;
+  gpu_ctx->EnqueueOpenCLKernel<2>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "bias_index_refs",
+    refs_global_work_sz, NULL,
+    2, sum_events, &bias_event,
+    decoded, textures, ref_counts, decoded_indices);
+
+  cl_event apply_event;
+  gpu_ctx->EnqueueOpenCLKernel<2>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "apply_index_refs",
+    refs_global_work_sz, NULL,
+    1, &bias_event, &apply_event,
+    decoded, textures, ref_counts, decoded_indices);
+
+  CHECK_CL(clReleaseEvent, sum_events[0]);
+  CHECK_CL(clReleaseEvent, sum_events[1]);
+  CHECK_CL(clReleaseEvent, bias_event);
+  return apply_event;
+}
+
+// Runs the stages after entropy decoding on the textures of a batch, with
+// one dispatch per stage whatever their dimensions. If tiles isn't NULL then
+// the coefficients are in band order and are gathered into it first.
+// Doesn't release decode_ans_event.
+static cl_event AssembleTextures(const std::unique_ptr<GPUContext> &gpu_ctx, cl_command_queue queue,
+                                 const std::vector<TextureInfo> &textures,
+                                 const std::string &assembly_kernel, cl_mem decoded,
+                                 cl_mem tiles, cl_event decode_ans_event,
+                                 PreloadedMemory *scratch_mem, cl_mem output) {
+  size_t num_vals = 0;
+  size_t max_num_vals = 0;
+  for (const auto &texture : textures) {
+    assert(texture.blocks_x % kWaveletBlockDim == 0);
+    assert(texture.blocks_y % kWaveletBlockDim == 0);
+    assert(texture.first_block == num_vals);
+
+    const size_t texture_vals = texture.blocks_x * texture.blocks_y;
+    num_vals += texture_vals;
+    max_num_vals = std::max(max_num_vals, texture_vals);
+  }
+  const size_t num_tiles = num_vals / (kWaveletBlockDim * kWaveletBlockDim);
+
+  cl_mem textures_buf = CreateTextureInfoBuffer(gpu_ctx, textures);
+  const cl_uint num_textures = static_cast<cl_uint>(textures.size());
+
+  // Run inverse wavelet
+  size_t local_mem_sz = 8 * kWaveletBlockDim * kWaveletBlockDim;
+
+#ifndef NDEBUG
+  // One thread per pixel, kWaveletBlockDim * kWaveletBlockDim threads
+  // per group...
+  size_t threads_per_group = (kWaveletBlockDim / 2) * (kWaveletBlockDim / 2);
+
+  // Make sure that we can launch enough kernels per group
+  assert(threads_per_group <=
+    gpu_ctx->GetDeviceInfo<size_t>(CL_DEVICE_MAX_WORK_GROUP_SIZE));
+
+  // I don't know of a GPU implementation that uses more than 3 dims..
+  assert(3 ==
+    gpu_ctx->GetDeviceInfo<cl_uint>(CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS));
+
+  struct WorkGroupSizes {
+    size_t sizes[3];
+  };
+  WorkGroupSizes wgsz =
+    gpu_ctx->GetDeviceInfo<WorkGroupSizes>(CL_DEVICE_MAX_WORK_ITEM_SIZES);
+  assert(threads_per_group <= wgsz.sizes[0]);
+#endif
+
+  // One group per wavelet block, with the blocks of every texture one
+  // after another along the second dimension
+  size_t inv_wavelet_global_work_size[3] = {
+    static_cast<size_t>(kWaveletBlockDim / 2),
+    static_cast<size_t>(kWaveletBlockDim / 2) * num_tiles,
+    6
+  };
+
+  size_t inv_wavelet_local_work_size[3] = {
+    static_cast<size_t>(kWaveletBlockDim / 2),
+    static_cast<size_t>(kWaveletBlockDim / 2),
+    1
+  };
+
+  cl_mem inv_wavelet_output = scratch_mem->GetNextRegion(6 * num_vals);
+
+  // Coefficients stored in band order need to be put back into tiles first
+  cl_mem wavelet_input = decoded;
+  cl_event wavelet_input_event = decode_ans_event;
+  if (NULL != tiles) {
+    wavelet_input = tiles;
+
+    size_t gather_bands_global_work_size[3] = {
+      kWaveletBlockDim, kWaveletBlockDim * num_tiles, 6
+    };
+    gpu_ctx->EnqueueOpenCLKernel<3>(
+      queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_InverseWavelet], "gather_bands",
+      gather_bands_global_work_size, NULL,
+      1, &decode_ans_event, &wavelet_input_event,
+      decoded, textures_buf, num_textures, static_cast<cl_uint>(kWaveletBlockDim), tiles);
+  }
+
+  gpu::GPUContext::LocalMemoryKernelArg local_mem;
+  local_mem._local_mem_sz = local_mem_sz;
+
+  cl_event inv_wavelet_event;
+  gpu_ctx->EnqueueOpenCLKernel<3>(
+    // Queue to run on
+    queue,
+
+    // Kernel to run...
+    GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_InverseWavelet], "inv_wavelet",
+
+    // Work size (global and local)
+    inv_wavelet_global_work_size, inv_wavelet_local_work_size,
+
+    // Events to depend on and return
+    1, &wavelet_input_event, &inv_wavelet_event,
+
+    // Kernel arguments
+    wavelet_input, textures_buf, num_textures, local_mem, inv_wavelet_output);
+
+  if (NULL != tiles) {
+    CHECK_CL(clReleaseEvent, wavelet_input_event);
+  }
+
+  cl_mem decoded_indices = scratch_mem->GetNextRegion(4 * num_vals);
+
+  bool has_refs = false;
+  for (const auto &texture : textures) {
+    has_refs = has_refs || 0 < texture.num_refs;
+  }
+  cl_mem ref_counts = has_refs ? scratch_mem->GetNextRegion(4 * num_vals) : NULL;
+
+  // The scan releases the event that it waits on
+  CHECK_CL(clRetainEvent, decode_ans_event);
+  cl_event decode_event = EnqueueIndexScan(gpu_ctx, queue, decoded, textures_buf, max_num_vals,
+                                           textures.size(), decode_ans_event, ref_counts,
+                                           decoded_indices);
+
+  // One thread per coded block of the batch
+  size_t assembly_global_work_size = num_vals;
+
+  cl_event assembly_events[2] = { inv_wavelet_event, decode_event };
+  cl_event assembly_event;
+  gpu_ctx->EnqueueOpenCLKernel<1>(
+    // Queue to run on
+    queue,
+
+    // Kernel to run...
+    GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_Assemble], assembly_kernel,
+
+    // Work size (global and local)
+    &assembly_global_work_size, NULL,
+
+    // Events to depend on and return
+    2, assembly_events, &assembly_event,
+
+    // Kernel arguments
+    decoded, textures_buf, num_textures, inv_wavelet_output, decoded_indices, output);
+
+  CHECK_CL(clReleaseEvent, decode_event);
+  CHECK_CL(clReleaseEvent, inv_wavelet_event);
+  if (has_refs) {
+    CHECK_CL(clReleaseMemObject, ref_counts);
+  }
+  CHECK_CL(clReleaseMemObject, decoded_indices);
+  CHECK_CL(clReleaseMemObject, inv_wavelet_output);
+  CHECK_CL(clReleaseMemObject, textures_buf);
+  return assembly_event;
+}
+
 static cl_event DecompressDXTImage(const std::unique_ptr<GPUContext> &gpu_ctx,
                                    const std::vector<GenTCHeader> &hdrs, cl_command_queue queue,
-                                   const std::string &assembly_kernel,
-                                   cl_mem cmp_data, cl_uint num_init, const cl_event *init_event, cl_mem output) {
+                                   const std::string &assembly_kernel, cl_mem cmp_data,
+                                   cl_uint num_shared_tables, cl_uint num_init,
+                                   const cl_event *init_event, cl_mem output) {
   // Queue the decompression...
   cl_int errCreateBuffer;
 
-  size_t blocks_x = hdrs[0].width / 4;
-  size_t blocks_y = hdrs[0].height / 4;
-  size_t num_vals = blocks_x * blocks_y;
+  // All of the textures in a batch are decoded by the same kernels
+  const ans::ocl::Geometry geom = hdrs[0].ANSGeometry();
+  const std::string ans_build_options = geom.BuildOptions();
+  const bool band_order = eCoefficientOrder_Bands == hdrs[0].coefficient_order;
+  for (const auto &hdr : hdrs) {
+    assert(hdr.ANSGeometry() == geom);
+    assert(band_order == (eCoefficientOrder_Bands == hdr.coefficient_order));
+  }
 
   size_t offsets_scratch_sz =
     4 /* offsets per hdr */ * sizeof(cl_uint) * 2 /* input/output offsets */ * hdrs.size();
   offsets_scratch_sz = ((offsets_scratch_sz + 511) / 512) * 512; // Align to 512 byte size...
 
+  // Each unique table is only built once for the whole batch
+  cl_uint num_tables = 0;
+  std::vector<cl_uint> table_ids = GetTableIndices(hdrs, num_shared_tables, &num_tables);
+
   PreloadedMemory _scratch_mem;
   PreloadedMemory *scratch_mem = NULL;
   if (nullptr == gPreloader) {
     size_t scratch_mem_sz = 0;
     for (const auto &hdr : hdrs) {
-      // If the images don't match in each dimension, then our inverse wavelet calculation
-      // doesn't do a good job. =(
-      assert(hdr.width / 4 == blocks_x);
-      assert(hdr.height / 4 == blocks_y);
-
       scratch_mem_sz += RequiredScratchMem(hdr);
     }
+    scratch_mem_sz += num_shared_tables * geom.table_size * sizeof(AnsTableEntry);
 
     scratch_mem = &_scratch_mem;
     scratch_mem->Allocate(gpu_ctx, scratch_mem_sz);
@@ -139,15 +527,16 @@ static cl_event DecompressDXTImage(const std::unique_ptr<GPUContext> &gpu_ctx,
   }
 
   // Setup ANS output offsets
+  std::vector<cl_uint> output_offsets(4 * hdrs.size());
   cl_uint output_offset = 0;
   for (size_t i = 0; i < hdrs.size(); ++i) {
-    cl_uint nvals = static_cast<cl_uint>(num_vals);
-    output_offset += 2 * nvals; // Y planes
-    output_offset += 4 * nvals; // Chroma planes
-    output_offset += static_cast<cl_uint>(hdrs[i].palette_bytes); // Palette
-    output_offset += nvals; // Indices
+    const GenTCHeader &hdr = hdrs[i];
+    output_offsets[4 * i + 0] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(eStreamType_Y)); // Y planes
+    output_offsets[4 * i + 1] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(eStreamType_Chroma)); // Chroma planes
+    output_offsets[4 * i + 2] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(eStreamType_Palette)); // Palette
+    output_offsets[4 * i + 3] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(eStreamType_Indices)); // Indices
   }
-  assert(output_offset % ans::ocl::kNumEncodedSymbols == 0);
+  assert(output_offset % geom.SymbolsPerGroup() == 0);
 
   // Setup OpenCL buffers for input and output offsets
   cl_buffer_region ans_offsets_region;
@@ -162,16 +551,16 @@ static cl_event DecompressDXTImage(const std::unique_ptr<GPUContext> &gpu_ctx,
   assert((0x7 & gpu_ctx->GetDeviceInfo<cl_uint>(CL_DEVICE_MEM_BASE_ADDR_ALIGN)) == 0);
 
   // First get the number of frequencies...
-  const size_t M = ans::ocl::kANSTableSize;
-  const size_t build_table_global_work_size[2] = { M, 4 * hdrs.size() };
+  const size_t M = geom.table_size;
+  const size_t build_table_global_work_size[2] = { M, num_tables };
   const size_t build_table_local_work_size[2] = { 256, 1 };
   assert(build_table_local_work_size[0] <= gpu_ctx->GetKernelWGInfo<size_t>(
     ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_BuildTable], "build_table",
-    CL_KERNEL_WORK_GROUP_SIZE));
+    CL_KERNEL_WORK_GROUP_SIZE, ans_build_options));
 
   cl_buffer_region freqs_sub_region;
   freqs_sub_region.origin = ans_offsets_region.origin + ans_offsets_region.size;
-  freqs_sub_region.size = 4 * 512 * hdrs.size();
+  freqs_sub_region.size = kFreqTableSz * num_tables;
 
   assert((0x7 & gpu_ctx->GetDeviceInfo<cl_uint>(CL_DEVICE_MEM_BASE_ADDR_ALIGN)) == 0);
   assert((freqs_sub_region.origin % (gpu_ctx->GetDeviceInfo<cl_uint>(CL_DEVICE_MEM_BASE_ADDR_ALIGN) / 8)) == 0);
@@ -180,7 +569,7 @@ static cl_event DecompressDXTImage(const std::unique_ptr<GPUContext> &gpu_ctx,
                                           &freqs_sub_region, &errCreateBuffer);
   CHECK_CL((cl_int), errCreateBuffer);
 
-  const size_t table_sz = hdrs.size() * 4 * ans::ocl::kANSTableSize * sizeof(AnsTableEntry);
+  const size_t table_sz = num_tables * geom.table_size * sizeof(AnsTableEntry);
   cl_mem table_region = scratch_mem->GetNextRegion(table_sz);
 
   cl_event build_table_event;
@@ -188,7 +577,7 @@ static cl_event DecompressDXTImage(const std::unique_ptr<GPUContext> &gpu_ctx,
     // Queue to run on
     queue,
 
-    ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_BuildTable], "build_table",
+    ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_BuildTable], "build_table", ans_build_options,
 
     build_table_global_work_size, build_table_local_work_size,
 
@@ -212,12 +601,17 @@ static cl_event DecompressDXTImage(const std::unique_ptr<GPUContext> &gpu_ctx,
   cl_mem decmp_buf = scratch_mem->GetNextRegion(output_offset);
 
   // Allocate 256 * num interleaved slots for result
-  const size_t rANS_global_work = output_offset / ans::ocl::kNumEncodedSymbols;
-  const size_t rANS_local_work = ans::ocl::kThreadsPerEncodingGroup;
+  const size_t rANS_global_work = output_offset / geom.num_encoded_symbols;
+  const size_t rANS_local_work = geom.threads_per_group;
   assert(rANS_global_work % rANS_local_work == 0);
 
   cl_uint num_offsets = static_cast<cl_uint>(4 * hdrs.size());
 
+  cl_mem table_ids_buf = clCreateBuffer(gpu_ctx->GetOpenCLContext(), GetHostReadOnlyFlags(),
+                                        table_ids.size() * sizeof(table_ids[0]),
+                                        table_ids.data(), &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
+
   cl_event decode_ans_event;
   gpu_ctx->EnqueueOpenCLKernel<1>(
     // Queue to run on
@@ -225,6 +619,7 @@ static cl_event DecompressDXTImage(const std::unique_ptr<GPUContext> &gpu_ctx,
 
     // Kernel to run...
     ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_ANSDecode], "ans_decode_multiple",
+    ans_build_options,
 
     // Work size (global and local)
     &rANS_global_work, &rANS_local_work,
@@ -233,337 +628,832 @@ static cl_event DecompressDXTImage(const std::unique_ptr<GPUContext> &gpu_ctx,
     1, &build_table_event, &decode_ans_event,
 
     // Kernel arguments
-    table_region, num_offsets, ans_offsets_buf, ans_input_buf, decmp_buf);
+    table_region, table_ids_buf, num_offsets, ans_offsets_buf, ans_input_buf, decmp_buf);
 
   CHECK_CL(clReleaseEvent, build_table_event);
   CHECK_CL(clReleaseMemObject, table_region);
+  CHECK_CL(clReleaseMemObject, table_ids_buf);
   CHECK_CL(clReleaseMemObject, ans_input_buf);
 
-  // Run inverse wavelet
-  assert(blocks_x % kWaveletBlockDim == 0);
-  assert(blocks_y % kWaveletBlockDim == 0);
-  size_t local_mem_sz = 8 * kWaveletBlockDim * kWaveletBlockDim;
+  // Coefficients stored in band order are gathered back into tiles in a
+  // copy of the decoded streams
+  cl_mem tiles_buf = band_order ? scratch_mem->GetNextRegion(output_offset) : NULL;
+
+  // The rest of the stages launch over the blocks of every texture at once,
+  // and write the textures back to back.
+  const bool is_rgb = "assemble_rgb" == assembly_kernel;
+  std::vector<TextureInfo> textures;
+  textures.reserve(hdrs.size());
+  size_t first_block = 0;
+  size_t out_offset = 0;
+  for (size_t i = 0; i < hdrs.size(); ++i) {
+    const GenTCHeader &hdr = hdrs[i];
+    textures.push_back(GetTextureInfo(output_offsets.data() + 4 * i, hdr.CodedBlocksWide(),
+                                      hdr.CodedBlocksHigh(), first_block, hdr.width, hdr.height,
+                                      out_offset, output_offsets[4 * i + 2] + hdr.palette_bytes,
+                                      hdr.index_refs));
+    first_block += hdr.NumCodedBlocks();
+    out_offset += is_rgb ? 3 * hdr.width * hdr.height : 8 * hdr.NumBlocks();
+  }
 
-#ifndef NDEBUG
-  // One thread per pixel, kWaveletBlockDim * kWaveletBlockDim threads
-  // per group...
-  size_t threads_per_group = (kWaveletBlockDim / 2) * (kWaveletBlockDim / 2);
+  cl_event assembly_event =
+    AssembleTextures(gpu_ctx, queue, textures, assembly_kernel, decmp_buf, tiles_buf,
+                     decode_ans_event, scratch_mem, output);
 
-  // Make sure that we can launch enough kernels per group
-  assert(threads_per_group <=
-    gpu_ctx->GetDeviceInfo<size_t>(CL_DEVICE_MAX_WORK_GROUP_SIZE));
+  CHECK_CL(clReleaseEvent, decode_ans_event);
+  if (band_order) {
+    CHECK_CL(clReleaseMemObject, tiles_buf);
+  }
+  CHECK_CL(clReleaseMemObject, decmp_buf);
+  CHECK_CL(clReleaseMemObject, ans_offsets_buf);
 
-  // I don't know of a GPU implementation that uses more than 3 dims..
-  assert(3 ==
-    gpu_ctx->GetDeviceInfo<cl_uint>(CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS));
+  // Send back the events...
+  return assembly_event;
+}
 
-  struct WorkGroupSizes {
-    size_t sizes[3];
-  };
-  WorkGroupSizes wgsz =
-    gpu_ctx->GetDeviceInfo<WorkGroupSizes>(CL_DEVICE_MAX_WORK_ITEM_SIZES);
-  assert(threads_per_group <= wgsz.sizes[0]);
-#endif
+cl_mem UploadCompressedDXTs(const std::unique_ptr<GPUContext> &gpu_ctx,
+                            const std::vector<std::vector<uint8_t> > &cmp_data,
+                            const std::vector<uint8_t> &dictionary,
+                            std::vector<GenTCHeader> *hdrs) {
+  assert((dictionary.size() % kFreqTableSz) == 0);
+  assert(!cmp_data.empty());
 
-  size_t inv_wavelet_global_work_size[3] = {
-    static_cast<size_t>(blocks_x / 2),
-    static_cast<size_t>(blocks_y / 2),
-    6 * hdrs.size()
-  };
+  static const size_t kHeaderSz = sizeof(GenTCHeader);
+  const size_t num_hdrs = cmp_data.size();
+  hdrs->resize(num_hdrs);
 
-  size_t inv_wavelet_local_work_size[3] = {
-    static_cast<size_t>(kWaveletBlockDim / 2),
-    static_cast<size_t>(kWaveletBlockDim / 2),
-    1
-  };
+  std::vector<cl_uint> ans_offsets(8 * num_hdrs);
+  cl_uint *input_offsets = ans_offsets.data() + 4 * num_hdrs;
+  cl_uint *output_offsets = ans_offsets.data();
 
-  cl_mem inv_wavelet_output = scratch_mem->GetNextRegion(6 * num_vals * hdrs.size());
+  cl_uint input_offset = 0;
+  cl_uint output_offset = 0;
+  size_t inline_tables_sz = 0;
+  for (size_t i = 0; i < num_hdrs; ++i) {
+    GenTCHeader &hdr = (*hdrs)[i];
+    if (!hdr.LoadFrom(cmp_data[i])) {
+      hdrs->clear();
+      return NULL;
+    }
+    inline_tables_sz += hdr.NumInlineTables() * kFreqTableSz;
+
+    // Setup ANS input offsets
+    input_offsets[4 * i + 0] = input_offset; input_offset += hdr.y_cmp_sz;
+    input_offsets[4 * i + 1] = input_offset; input_offset += hdr.chroma_cmp_sz;
+    input_offsets[4 * i + 2] = input_offset; input_offset += hdr.palette_sz;
+    input_offsets[4 * i + 3] = input_offset; input_offset += hdr.indices_sz;
+
+    // Setup ANS output offsets
+    output_offsets[4 * i + 0] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(eStreamType_Y)); // Y planes
+    output_offsets[4 * i + 1] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(eStreamType_Chroma)); // Chroma planes
+    output_offsets[4 * i + 2] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(eStreamType_Palette)); // Palette
+    output_offsets[4 * i + 3] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(eStreamType_Indices)); // Indices
+  }
+  assert(output_offset % (*hdrs)[0].ANSGeometry().SymbolsPerGroup() == 0);
 
-  gpu::GPUContext::LocalMemoryKernelArg local_mem;
-  local_mem._local_mem_sz = local_mem_sz;
+  // The offsets are followed by all of the frequency tables, the shared
+  // ones first, and then by the streams of each texture.
+  size_t offsets_sz = ans_offsets.size() * sizeof(ans_offsets[0]);
+  offsets_sz = ((offsets_sz + 511) / 512) * 512;
 
-  cl_event inv_wavelet_event;
-  gpu_ctx->EnqueueOpenCLKernel<3>(
-    // Queue to run on
-    queue,
+  std::vector<uint8_t> upload(offsets_sz + dictionary.size() + inline_tables_sz + input_offset);
+  memcpy(upload.data(), ans_offsets.data(), ans_offsets.size() * sizeof(ans_offsets[0]));
 
-    // Kernel to run...
-    GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_InverseWavelet], "inv_wavelet",
+  uint8_t *tables = upload.data() + offsets_sz;
+  if (!dictionary.empty()) {
+    memcpy(tables, dictionary.data(), dictionary.size());
+  }
+  tables += dictionary.size();
+
+  uint8_t *streams = tables + inline_tables_sz;
+  for (size_t i = 0; i < num_hdrs; ++i) {
+    // Leave out the tile index after the streams, if there is one
+    const size_t tables_sz = (*hdrs)[i].NumInlineTables() * kFreqTableSz;
+    const size_t streams_sz = (*hdrs)[i].StreamsEnd() - kHeaderSz - tables_sz;
+
+    memcpy(tables, cmp_data[i].data() + kHeaderSz, tables_sz);
+    memcpy(streams, cmp_data[i].data() + kHeaderSz + tables_sz, streams_sz);
+    tables += tables_sz;
+    streams += streams_sz;
+  }
+  assert(streams == upload.data() + upload.size());
 
-    // Work size (global and local)
-    inv_wavelet_global_work_size, inv_wavelet_local_work_size,
+  cl_int errCreateBuffer;
+  cl_mem cmp_buf = clCreateBuffer(gpu_ctx->GetOpenCLContext(), CL_MEM_READ_ONLY,
+                                  upload.size(), NULL, &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
 
-    // Events to depend on and return
-    1, &decode_ans_event, &inv_wavelet_event,
+  cl_command_queue q = gpu_ctx->GetDefaultCommandQueue();
+  CHECK_CL(clEnqueueWriteBuffer, q, cmp_buf, CL_TRUE, 0, upload.size(), upload.data(),
+                                 0, NULL, NULL);
+  return cmp_buf;
+}
 
-    // Kernel arguments
-    decmp_buf, ans_offsets_buf, local_mem, inv_wavelet_output);
+void PreallocateDecompressor(const std::unique_ptr<gpu::GPUContext> &gpu_ctx, size_t req_sz) {
+  gPreloader = std::unique_ptr<PreloadedMemory>(new PreloadedMemory);
+  gPreloader->Allocate(gpu_ctx, req_sz);
+}
 
-  cl_mem decoded_indices = scratch_mem->GetNextRegion(4 * num_vals * hdrs.size());
+void FreeDecompressor() {
+  gPreloader = nullptr;
+}
 
-  static const size_t kLocalScanSz = 128;
-  static const size_t kLocalScanSzLog = 7;
+std::vector<uint8_t>  DecompressDXTBuffer(const std::unique_ptr<GPUContext> &gpu_ctx,
+                                          const std::vector<uint8_t> &cmp_data,
+                                          const std::vector<uint8_t> &dictionary) {
+  cl_command_queue queue = gpu_ctx->GetNextQueue();
 
-  // !SPEED! We don't really need to allocate here...
-  cl_event decode_event = decode_ans_event;
-  const cl_uint total_num_indices = static_cast<cl_uint>(num_vals);
+  std::vector<GenTCHeader> hdrs;
+  cl_mem cmp_buf = UploadCompressedDXTs(gpu_ctx, { cmp_data }, dictionary, &hdrs);
+  if (NULL == cmp_buf) {
+    return std::vector<uint8_t>();
+  }
+  const GenTCHeader &hdr = hdrs[0];
+  const cl_uint num_shared_tables = static_cast<cl_uint>(dictionary.size() / kFreqTableSz);
 
-  cl_int stage = -1;
-  while (true) {
-    stage++;
-    size_t num_decode_indices_vals = total_num_indices >> (stage * kLocalScanSzLog);
-    if (0 == num_decode_indices_vals) {
-      break;
-    }
+  // Setup output
+  cl_int errCreateBuffer;
+  size_t dxt_size = 8 * hdr.NumBlocks();
+  cl_mem dxt_output = clCreateBuffer(gpu_ctx->GetOpenCLContext(), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY,
+                                     dxt_size, NULL, &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
 
-    cl_event next_event;
-    size_t decode_indices_global_work_sz[2] = {
-      ((num_decode_indices_vals + kLocalScanSz - 1) / kLocalScanSz) * kLocalScanSz,
-      hdrs.size()
-    };
+  // Set a dummy event
+  cl_event init_event;
+#ifdef CL_VERSION_1_2
+  CHECK_CL(clEnqueueMarkerWithWaitList, queue, 0, NULL, &init_event);
+#else
+  CHECK_CL(clEnqueueMarker, queue, &init_event);
+#endif
 
-    size_t decode_indices_local_work_sz[2] = {
-      std::min(num_decode_indices_vals, kLocalScanSz),
-      1
-    };
+  // Queue the decompression...
+  cl_event dxt_event =
+    DecompressDXTImage(gpu_ctx, { hdr }, queue, "assemble_dxt", cmp_buf, num_shared_tables,
+                       1, &init_event, dxt_output);
 
-#ifndef NDEBUG
-    assert(decode_indices_local_work_sz[0] <= gpu_ctx->GetKernelWGInfo<size_t>(
-      GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "decode_indices",
-      CL_KERNEL_WORK_GROUP_SIZE));
-#endif
+  // Block on read
+  std::vector<uint8_t> decmp_data(dxt_size, 0xFF);
+  CHECK_CL(clEnqueueReadBuffer, queue, dxt_output, CL_TRUE, 0, dxt_size, decmp_data.data(),
+                                1, &dxt_event, NULL);
 
-    gpu_ctx->EnqueueOpenCLKernel<2>(
-      // Queue to run on
-      queue,
+  CHECK_CL(clReleaseMemObject, cmp_buf);
+  CHECK_CL(clReleaseEvent, dxt_event);
+  CHECK_CL(clReleaseMemObject, dxt_output);
+  CHECK_CL(clReleaseEvent, init_event);
+  return std::move(decmp_data);
+}
 
-      // Kernel to run...
-      GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "decode_indices",
+DXTImage DecompressDXT(const std::unique_ptr<GPUContext> &gpu_ctx,
+                       const std::vector<uint8_t> &cmp_data) {
+  return std::move(DecompressDXT(gpu_ctx, cmp_data, std::vector<uint8_t>()));
+}
 
-      // Work size (global and local)
-      decode_indices_global_work_sz, decode_indices_local_work_sz,
+DXTImage DecompressDXT(const std::unique_ptr<GPUContext> &gpu_ctx,
+                       const std::vector<uint8_t> &cmp_data,
+                       const std::vector<uint8_t> &dictionary) {
+  GenTCHeader hdr;
+  if (!hdr.LoadFrom(cmp_data)) {
+    return DXTImage(0, 0, std::vector<uint8_t>());
+  }
 
-      // Events to depend on and return
-      1, &decode_event, &next_event,
+  std::vector<uint8_t> decmp_data = std::move(DecompressDXTBuffer(gpu_ctx, cmp_data, dictionary));
+  return DXTImage(hdr.width, hdr.height, decmp_data);
+}
 
-      // Kernel arguments
-      decmp_buf, ans_offsets_buf, stage, total_num_indices, decoded_indices);
+std::vector<std::vector<uint8_t> > DecompressDXTMipChain(const std::unique_ptr<GPUContext> &gpu_ctx,
+                                                         const std::vector<uint8_t> &cmp_data) {
+  std::vector<std::vector<uint8_t> > levels;
+  std::vector<uint8_t> dictionary;
+  if (!LoadMipChain(cmp_data, &levels, &dictionary)) {
+    return std::vector<std::vector<uint8_t> >();
+  }
 
-    CHECK_CL(clReleaseEvent, decode_event);
-    decode_event = next_event;
+  cl_command_queue queue = gpu_ctx->GetNextQueue();
+
+  // All of the levels are decoded as one batch
+  std::vector<GenTCHeader> hdrs;
+  cl_mem cmp_buf = UploadCompressedDXTs(gpu_ctx, levels, dictionary, &hdrs);
+  if (NULL == cmp_buf) {
+    return std::vector<std::vector<uint8_t> >();
   }
+  const cl_uint num_shared_tables = static_cast<cl_uint>(dictionary.size() / kFreqTableSz);
 
-  while (stage > 0) {
-    size_t num_decode_indices_vals = total_num_indices >> std::max<int>(0, ((stage - 1) * kLocalScanSzLog));
+  size_t dxt_size = 0;
+  for (const auto &hdr : hdrs) {
+    dxt_size += 8 * hdr.NumBlocks();
+  }
 
-    size_t collect_indices_global_work_sz[2] = {
-      ((num_decode_indices_vals + kLocalScanSz - 1) / kLocalScanSz) * kLocalScanSz,
-      hdrs.size()
-    };
-    assert(collect_indices_global_work_sz[0] % kLocalScanSz == 0);
+  cl_int errCreateBuffer;
+  cl_mem dxt_output = clCreateBuffer(gpu_ctx->GetOpenCLContext(), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY,
+                                     dxt_size, NULL, &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
 
-    size_t collect_indices_local_work_sz[2] = {
-      kLocalScanSz,
-      1
-    };
+  cl_event dxt_event =
+    LoadCompressedDXTs(gpu_ctx, hdrs, queue, cmp_buf, dxt_output, 0, NULL, num_shared_tables);
 
-    cl_event next_event;
-    gpu_ctx->EnqueueOpenCLKernel<2>(
-      // Queue to run on
-      queue,
+  std::vector<uint8_t> decmp_data(dxt_size);
+  CHECK_CL(clEnqueueReadBuffer, queue, dxt_output, CL_TRUE, 0, dxt_size, decmp_data.data(),
+                                1, &dxt_event, NULL);
 
-      // Kernel to run...
-      GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "collect_indices",
+  CHECK_CL(clReleaseMemObject, cmp_buf);
+  CHECK_CL(clReleaseEvent, dxt_event);
+  CHECK_CL(clReleaseMemObject, dxt_output);
 
-      // Work size (global and local)
-      collect_indices_global_work_sz, collect_indices_local_work_sz,
+  // The levels come out back to back
+  std::vector<std::vector<uint8_t> > result;
+  result.reserve(hdrs.size());
+  size_t offset = 0;
+  for (const auto &hdr : hdrs) {
+    const size_t level_sz = 8 * hdr.NumBlocks();
+    result.push_back(std::vector<uint8_t>(decmp_data.begin() + offset,
+                                          decmp_data.begin() + offset + level_sz));
+    offset += level_sz;
+  }
 
-      // Events to depend on and return
-      1, &decode_event, &next_event,
+  return std::move(result);
+}
 
-      // Kernel arguments
-      stage, total_num_indices, decoded_indices);
+static size_t AlignTo512(size_t sz) {
+  return ((sz + 511) / 512) * 512;
+}
 
-    CHECK_CL(clReleaseEvent, decode_event);
-    decode_event = next_event;
+static cl_mem CreateSubBuffer(cl_mem buffer, size_t origin, size_t sz) {
+  cl_buffer_region region;
+  region.origin = origin;
+  region.size = sz;
 
-    stage--;
-  }
+  cl_int errCreateBuffer;
+  cl_mem sub_buffer = clCreateSubBuffer(buffer, CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION,
+                                        &region, &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
+  return sub_buffer;
+}
 
-  size_t assembly_global_work_size[3] = {
-    blocks_x,
-    blocks_y,
-    hdrs.size(), // Number of textures
+// Copies the groups of each run of a region into a stream of its own, with
+// its own table of group offsets, so that ans_decode_multiple can decode the
+// runs as if they were the streams of a batch. Returns where each of the
+// streams starts in run_data.
+static std::vector<cl_uint> PackGroupRuns(const std::vector<uint8_t> &cmp_data,
+                                          const GenTCHeader &hdr, const RegionPlan &plan,
+                                          std::vector<uint8_t> *run_data) {
+  const size_t cmp_sz[kNumStreamTypes] = {
+    hdr.y_cmp_sz, hdr.chroma_cmp_sz, hdr.palette_sz, hdr.indices_sz
   };
 
-  cl_event assembly_events[2] = { inv_wavelet_event, decode_event };
-  cl_event assembly_event;
-  gpu_ctx->EnqueueOpenCLKernel<3>(
-    // Queue to run on
-    queue,
-
-    // Kernel to run...
-    GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_Assemble], assembly_kernel,
+  const uint8_t *streams[kNumStreamTypes];
+  const uint8_t *data = cmp_data.data() + sizeof(GenTCHeader) + hdr.NumInlineTables() * kFreqTableSz;
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    streams[i] = data;
+    data += cmp_sz[i];
+  }
 
-    // Work size (global and local)
-    assembly_global_work_size, NULL,
+  const size_t symbols_per_group = hdr.ANSGeometry().SymbolsPerGroup();
+  std::vector<cl_uint> input_offsets;
+  input_offsets.reserve(plan.runs.size());
+  for (const auto &run : plan.runs) {
+    const uint8_t *stream = streams[run.stream];
+    const size_t total_groups = hdr.NumSymbols(run.stream) / symbols_per_group;
+    assert(run.first_group + run.num_groups <= total_groups);
+
+    // The groups keep their alignment since every offset is a multiple of four
+    uint32_t begin = static_cast<uint32_t>(4 * total_groups);
+    if (0 < run.first_group) {
+      memcpy(&begin, stream + 4 * (run.first_group - 1), sizeof(begin));
+    }
 
-    // Events to depend on and return
-    2, assembly_events, &assembly_event,
+    input_offsets.push_back(static_cast<cl_uint>(run_data->size()));
+    const uint32_t table_sz = static_cast<uint32_t>(4 * run.num_groups);
+    uint32_t end = begin;
+    for (size_t i = run.first_group; i < run.first_group + run.num_groups; ++i) {
+      memcpy(&end, stream + 4 * i, sizeof(end));
+      assert(begin <= end && end <= cmp_sz[run.stream]);
 
-    // Kernel arguments
-    decmp_buf, ans_offsets_buf, inv_wavelet_output, decoded_indices, output);
+      const uint32_t offset = end - begin + table_sz;
+      const uint8_t *offset_bytes = reinterpret_cast<const uint8_t *>(&offset);
+      run_data->insert(run_data->end(), offset_bytes, offset_bytes + sizeof(offset));
+    }
 
-  CHECK_CL(clReleaseEvent, decode_event);
-  CHECK_CL(clReleaseEvent, inv_wavelet_event);
-  CHECK_CL(clReleaseMemObject, decoded_indices);
-  CHECK_CL(clReleaseMemObject, inv_wavelet_output);
-  CHECK_CL(clReleaseMemObject, decmp_buf);
-  CHECK_CL(clReleaseMemObject, ans_offsets_buf);
+    run_data->insert(run_data->end(), stream + begin, stream + end);
+  }
 
-  // Send back the events...
-  return assembly_event;
+  return std::move(input_offsets);
 }
 
-cl_mem UploadData(const std::unique_ptr<GPUContext> &gpu_ctx,
-                  const std::vector<uint8_t> &cmp_data, GenTCHeader *hdr) {
-  hdr->LoadFrom(cmp_data.data());
+std::vector<uint8_t> DecompressDXTRegion(const std::unique_ptr<GPUContext> &gpu_ctx,
+                                         const std::vector<uint8_t> &cmp_data,
+                                         const std::vector<uint8_t> &dictionary,
+                                         size_t x, size_t y, size_t width, size_t height) {
+  assert((dictionary.size() % kFreqTableSz) == 0);
 
-  std::vector<cl_uint> ans_offsets(8);
+  GenTCHeader hdr;
+  if (!hdr.LoadFrom(cmp_data)) {
+    return std::vector<uint8_t>();
+  }
 
-  cl_uint *input_offsets = ans_offsets.data() + 4;
-  cl_uint *output_offsets = ans_offsets.data();
+  std::vector<TileInfo> tiles;
+  RegionPlan plan;
+  if (!LoadTileIndex(hdr, cmp_data, &tiles) ||
+      !PlanRegion(hdr, tiles, x, y, width, height, &plan)) {
+    return std::vector<uint8_t>();
+  }
 
-  // Setup ANS input offsets
-  cl_uint input_offset = 0;
-  input_offsets[0] = input_offset; input_offset += hdr->y_cmp_sz;
-  input_offsets[1] = input_offset; input_offset += hdr->chroma_cmp_sz;
-  input_offsets[2] = input_offset; input_offset += hdr->palette_sz;
-  input_offsets[3] = input_offset; input_offset += hdr->indices_sz;
+  // The tiles that overlap the region are decoded like a texture of their own
+  const size_t blocks_x = plan.TextureBlocksX();
+  const size_t blocks_y = plan.TextureBlocksY();
+  const size_t num_vals = blocks_x * blocks_y;
+
+  const ans::ocl::Geometry geom = hdr.ANSGeometry();
+  const std::string ans_build_options = geom.BuildOptions();
+  assert((plan.decoded_sz % geom.SymbolsPerGroup()) == 0);
+
+  // The tables are laid out the same way as for a batch of one texture
+  const cl_uint num_shared_tables = static_cast<cl_uint>(dictionary.size() / kFreqTableSz);
+  cl_uint num_tables = 0;
+  const std::vector<cl_uint> stream_tables = GetTableIndices({ hdr }, num_shared_tables, &num_tables);
+
+  std::vector<uint8_t> run_data;
+  const std::vector<cl_uint> run_inputs = PackGroupRuns(cmp_data, hdr, plan, &run_data);
+
+  const size_t num_runs = plan.runs.size();
+  std::vector<cl_uint> run_offsets(2 * num_runs);
+  std::vector<cl_uint> run_tables(num_runs);
+  for (size_t i = 0; i < num_runs; ++i) {
+    run_offsets[i] = static_cast<cl_uint>(plan.runs[i].offset);
+    run_offsets[num_runs + i] = run_inputs[i];
+    run_tables[i] = stream_tables[plan.runs[i].stream];
+  }
 
-  // Setup ANS output offsets
-  cl_uint nvals = static_cast<cl_uint>(hdr->width * hdr->height / 16);
-  cl_uint output_offset = 0;
+  // The endpoint planes of the region texture are copied out of the decoded
+  // runs, but its palette is read from them directly.
+  const cl_uint region_offsets[4] = {
+    0, static_cast<cl_uint>(2 * num_vals), static_cast<cl_uint>(plan.palette_offset), 0
+  };
+  const TextureInfo region_texture =
+    GetTextureInfo(region_offsets, blocks_x, blocks_y, 0, 4 * blocks_x, 4 * blocks_y, 0, 0, 0);
+
+  const bool has_refs = !plan.index_ref_starts.empty();
+  std::vector<cl_uint> index_rows(3 * blocks_y);
+  for (size_t i = 0; i < blocks_y; ++i) {
+    index_rows[3 * i + 0] = static_cast<cl_uint>(plan.index_rows[i]);
+    index_rows[3 * i + 1] = static_cast<cl_uint>(plan.index_sums[i]);
+    index_rows[3 * i + 2] = has_refs ? static_cast<cl_uint>(plan.index_ref_starts[i]) : 0;
+  }
 
-  output_offsets[0] = output_offset;
-  output_offset += 2 * nvals; // Y planes
+  // The upload has the offsets of the runs, the region texture, the rows of indices and the frequency tables, each padded to
+  // 512 bytes so that they can be sub-buffers, followed by the runs.
+  const size_t run_offsets_sz = AlignTo512(run_offsets.size() * sizeof(cl_uint));
+  const size_t region_texture_sz = AlignTo512(sizeof(region_texture));
+  const size_t index_rows_sz = AlignTo512(index_rows.size() * sizeof(cl_uint));
+  const size_t inline_tables_sz = hdr.NumInlineTables() * kFreqTableSz;
+  const size_t tables_sz = AlignTo512(dictionary.size() + inline_tables_sz);
+
+  std::vector<uint8_t> upload(run_offsets_sz + region_texture_sz + index_rows_sz + tables_sz + run_data.size());
+  uint8_t *ptr = upload.data();
+  memcpy(ptr, run_offsets.data(), run_offsets.size() * sizeof(cl_uint));
+  ptr += run_offsets_sz;
+  memcpy(ptr, &region_texture, sizeof(region_texture));
+  ptr += region_texture_sz;
+  memcpy(ptr, index_rows.data(), index_rows.size() * sizeof(cl_uint));
+  ptr += index_rows_sz;
+  if (!dictionary.empty()) {
+    memcpy(ptr, dictionary.data(), dictionary.size());
+  }
+  ptr += dictionary.size();
+  memcpy(ptr, cmp_data.data() + sizeof(GenTCHeader), inline_tables_sz);
+  ptr += tables_sz - dictionary.size();
+  memcpy(ptr, run_data.data(), run_data.size());
 
-  output_offsets[1] = output_offset;
-  output_offset += 4 * nvals; // Chroma planes
+  cl_int errCreateBuffer;
+  cl_mem upload_buf = clCreateBuffer(gpu_ctx->GetOpenCLContext(), GetHostReadOnlyFlags(),
+                                     upload.size(), upload.data(), &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
 
-  output_offsets[2] = output_offset;
-  output_offset += static_cast<cl_uint>(hdr->palette_bytes); // Palette
+  size_t origin = 0;
+  cl_mem run_offsets_buf = CreateSubBuffer(upload_buf, origin, run_offsets_sz);
+  origin += run_offsets_sz;
+  cl_mem region_texture_buf = CreateSubBuffer(upload_buf, origin, region_texture_sz);
+  origin += region_texture_sz;
+  cl_mem index_rows_buf = CreateSubBuffer(upload_buf, origin, index_rows_sz);
+  origin += index_rows_sz;
+  cl_mem freqs_buf = CreateSubBuffer(upload_buf, origin, tables_sz);
+  origin += tables_sz;
+  cl_mem runs_buf = CreateSubBuffer(upload_buf, origin, run_data.size());
+
+  cl_mem run_tables_buf = clCreateBuffer(gpu_ctx->GetOpenCLContext(), GetHostReadOnlyFlags(),
+                                         run_tables.size() * sizeof(cl_uint), run_tables.data(),
+                                         &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
 
-  output_offsets[3] = output_offset;
-  output_offset += nvals; // Indices
-  assert(output_offset % ans::ocl::kNumEncodedSymbols == 0);
+  const size_t table_sz = AlignTo512(num_tables * geom.table_size * sizeof(AnsTableEntry));
+  const size_t decoded_sz = AlignTo512(plan.decoded_sz);
 
-  // Upload everything but the header
-  cl_int errCreateBuffer;
-  static const size_t kHeaderSz = sizeof(*hdr);
-  cl_mem cmp_buf = clCreateBuffer(gpu_ctx->GetOpenCLContext(), CL_MEM_READ_ONLY,
-                                  cmp_data.size() - kHeaderSz + 512, NULL, &errCreateBuffer);
+  PreloadedMemory _scratch_mem;
+  PreloadedMemory *scratch_mem = gPreloader.get();
+  if (nullptr == scratch_mem) {
+    scratch_mem = &_scratch_mem;
+    scratch_mem->Allocate(gpu_ctx, table_sz + decoded_sz + 16 * num_vals);
+  }
+
+  cl_mem table_region = scratch_mem->GetNextRegion(table_sz);
+  cl_mem decoded_buf = scratch_mem->GetNextRegion(decoded_sz);
+  cl_mem planes_buf = scratch_mem->GetNextRegion(6 * num_vals);
+  cl_mem inv_wavelet_output = scratch_mem->GetNextRegion(6 * num_vals);
+  cl_mem decoded_indices = scratch_mem->GetNextRegion(4 * num_vals);
+
+  cl_mem output = clCreateBuffer(gpu_ctx->GetOpenCLContext(), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY,
+                                 8 * num_vals, NULL, &errCreateBuffer);
   CHECK_CL((cl_int), errCreateBuffer);
 
-  cl_command_queue q = gpu_ctx->GetDefaultCommandQueue();
-  CHECK_CL(clEnqueueWriteBuffer, q, cmp_buf, CL_TRUE, 0, ans_offsets.size() * sizeof(ans_offsets[0]),
-                                 ans_offsets.data(), 0, NULL, NULL);
-  CHECK_CL(clEnqueueWriteBuffer, q, cmp_buf, CL_TRUE, 512, cmp_data.size() - kHeaderSz,
-                                 cmp_data.data() + kHeaderSz, 0, NULL, NULL);
-  return cmp_buf;
-}
+  cl_command_queue queue = gpu_ctx->GetNextQueue();
 
-void PreallocateDecompressor(const std::unique_ptr<gpu::GPUContext> &gpu_ctx, size_t req_sz) {
-  gPreloader = std::unique_ptr<PreloadedMemory>(new PreloadedMemory);
-  gPreloader->Allocate(gpu_ctx, req_sz);
-}
+  // Build the tables...
+  const size_t build_table_global_work_size[2] = { geom.table_size, num_tables };
+  const size_t build_table_local_work_size[2] = { 256, 1 };
 
-void FreeDecompressor() {
-  gPreloader = nullptr;
+  cl_event build_table_event;
+  gpu_ctx->EnqueueOpenCLKernel<2>(
+    queue, ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_BuildTable], "build_table", ans_build_options,
+    build_table_global_work_size, build_table_local_work_size,
+    0, NULL, &build_table_event,
+    freqs_buf, table_region);
+
+  // Decode the runs...
+  const size_t rANS_global_work = plan.decoded_sz / geom.num_encoded_symbols;
+  const size_t rANS_local_work = geom.threads_per_group;
+  assert(rANS_global_work % rANS_local_work == 0);
+
+  cl_event decode_ans_event;
+  gpu_ctx->EnqueueOpenCLKernel<1>(
+    queue, ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_ANSDecode], "ans_decode_multiple",
+    ans_build_options, &rANS_global_work, &rANS_local_work,
+    1, &build_table_event, &decode_ans_event,
+    table_region, run_tables_buf, static_cast<cl_uint>(num_runs), run_offsets_buf, runs_buf,
+    decoded_buf);
+
+  // Gather the rows of tiles of each endpoint plane...
+  const size_t plane_row_sz = plan.tiles_x * kWaveletBlockDim * kWaveletBlockDim;
+  std::vector<cl_event> copy_events(plan.plane_rows.size());
+  for (size_t i = 0; i < plan.plane_rows.size(); ++i) {
+    const size_t plane = i / plan.tiles_y;
+    const size_t tile_row = i % plan.tiles_y;
+    CHECK_CL(clEnqueueCopyBuffer, queue, decoded_buf, planes_buf, plan.plane_rows[i],
+                                  plane * num_vals + tile_row * plane_row_sz, plane_row_sz,
+                                  1, &decode_ans_event, &copy_events[i]);
+  }
+
+  // ... and run the inverse wavelet transform on them...
+  size_t inv_wavelet_global_work_size[3] = {
+    kWaveletBlockDim / 2, (kWaveletBlockDim / 2) * plan.tiles_x * plan.tiles_y, 6
+  };
+  size_t inv_wavelet_local_work_size[3] = { kWaveletBlockDim / 2, kWaveletBlockDim / 2, 1 };
+
+  gpu::GPUContext::LocalMemoryKernelArg local_mem;
+  local_mem._local_mem_sz = 8 * kWaveletBlockDim * kWaveletBlockDim;
+
+  cl_event inv_wavelet_event;
+  gpu_ctx->EnqueueOpenCLKernel<3>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_InverseWavelet], "inv_wavelet",
+    inv_wavelet_global_work_size, inv_wavelet_local_work_size,
+    static_cast<cl_uint>(copy_events.size()), copy_events.data(), &inv_wavelet_event,
+    planes_buf, region_texture_buf, static_cast<cl_uint>(1), local_mem, inv_wavelet_output);
+
+  // ... while the rows of indices are decoded from their sums...
+  const size_t decode_indices_global_work_size = blocks_y;
+  cl_event decode_indices_event;
+  gpu_ctx->EnqueueOpenCLKernel<1>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "decode_region_indices",
+    &decode_indices_global_work_size, NULL,
+    1, &decode_ans_event, &decode_indices_event,
+    decoded_buf, index_rows_buf, static_cast<cl_uint>(blocks_x),
+    static_cast<cl_uint>(has_refs ? 1 : 0), static_cast<cl_uint>(plan.index_refs_offset),
+    static_cast<cl_uint>(plan.index_ref_base), decoded_indices);
+
+  // ... then assemble the region texture and read back the region.
+  size_t assembly_global_work_size = num_vals;
+  cl_event assembly_events[2] = { inv_wavelet_event, decode_indices_event };
+  cl_event assembly_event;
+  gpu_ctx->EnqueueOpenCLKernel<1>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_Assemble], "assemble_dxt",
+    &assembly_global_work_size, NULL,
+    2, assembly_events, &assembly_event,
+    decoded_buf, region_texture_buf, static_cast<cl_uint>(1), inv_wavelet_output, decoded_indices,
+    output);
+
+  const size_t buffer_origin[3] = { 8 * plan.offset_x, plan.offset_y, 0 };
+  const size_t host_origin[3] = { 0, 0, 0 };
+  const size_t read_region[3] = { 8 * plan.blocks_x, plan.blocks_y, 1 };
+
+  std::vector<uint8_t> result(8 * plan.blocks_x * plan.blocks_y);
+  CHECK_CL(clEnqueueReadBufferRect, queue, output, CL_TRUE, buffer_origin, host_origin, read_region,
+                                    8 * blocks_x, 0, 8 * plan.blocks_x, 0, result.data(),
+                                    1, &assembly_event, NULL);
+
+  for (auto e : copy_events) {
+    CHECK_CL(clReleaseEvent, e);
+  }
+  CHECK_CL(clReleaseEvent, build_table_event);
+  CHECK_CL(clReleaseEvent, decode_ans_event);
+  CHECK_CL(clReleaseEvent, inv_wavelet_event);
+  CHECK_CL(clReleaseEvent, decode_indices_event);
+  CHECK_CL(clReleaseEvent, assembly_event);
+
+  CHECK_CL(clReleaseMemObject, output);
+  CHECK_CL(clReleaseMemObject, decoded_indices);
+  CHECK_CL(clReleaseMemObject, inv_wavelet_output);
+  CHECK_CL(clReleaseMemObject, planes_buf);
+  CHECK_CL(clReleaseMemObject, decoded_buf);
+  CHECK_CL(clReleaseMemObject, table_region);
+  CHECK_CL(clReleaseMemObject, run_tables_buf);
+  CHECK_CL(clReleaseMemObject, runs_buf);
+  CHECK_CL(clReleaseMemObject, freqs_buf);
+  CHECK_CL(clReleaseMemObject, index_rows_buf);
+  CHECK_CL(clReleaseMemObject, region_texture_buf);
+  CHECK_CL(clReleaseMemObject, run_offsets_buf);
+  CHECK_CL(clReleaseMemObject, upload_buf);
+  return std::move(result);
 }
 
-std::vector<uint8_t>  DecompressDXTBuffer(const std::unique_ptr<GPUContext> &gpu_ctx,
-                                          const std::vector<uint8_t> &cmp_data) {
-  cl_command_queue queue = gpu_ctx->GetNextQueue();
+std::vector<uint8_t> DecompressPreview(const std::unique_ptr<GPUContext> &gpu_ctx,
+                                       const std::vector<uint8_t> &cmp_data,
+                                       const std::vector<uint8_t> &dictionary,
+                                       size_t scale, EDecodeOutput output_type) {
+  assert((dictionary.size() % kFreqTableSz) == 0);
 
   GenTCHeader hdr;
-  cl_mem cmp_buf = UploadData(gpu_ctx, cmp_data, &hdr);
+  if (!hdr.LoadFrom(cmp_data)) {
+    return std::vector<uint8_t>();
+  }
+  assert(eCoefficientOrder_Bands == hdr.coefficient_order && "Texture has no preview!");
+
+  const size_t blocks_x = hdr.CodedBlocksWide();
+  const size_t blocks_y = hdr.CodedBlocksHigh();
+  const size_t num_vals = blocks_x * blocks_y;
+  const size_t tiles_x = blocks_x / kWaveletBlockDim;
+  const size_t tiles_y = blocks_y / kWaveletBlockDim;
+
+  // Only the coarse bands of each wavelet block make it into the preview
+  const size_t dim = kWaveletBlockDim / scale;
+  const size_t preview_x = tiles_x * dim;
+  const size_t preview_y = tiles_y * dim;
+  const size_t preview_vals = preview_x * preview_y;
+  const size_t preview_width = (hdr.width + scale - 1) / scale;
+  const size_t preview_height = (hdr.height + scale - 1) / scale;
+
+  const ans::ocl::Geometry geom = hdr.ANSGeometry();
+  const std::string ans_build_options = geom.BuildOptions();
+
+  const cl_uint num_shared_tables = static_cast<cl_uint>(dictionary.size() / kFreqTableSz);
+  cl_uint num_tables = 0;
+  const std::vector<cl_uint> table_ids = GetTableIndices({ hdr }, num_shared_tables, &num_tables);
+
+  // The endpoint streams are cut short at the end of their coarse bands, so
+  // ans_decode_multiple only decodes the groups at the front of them.
+  const size_t y_sz = hdr.NumPreviewSymbols(eStreamType_Y, scale);
+  const size_t chroma_sz = hdr.NumPreviewSymbols(eStreamType_Chroma, scale);
+  const cl_uint ans_offsets[8] = {
+    0,
+    static_cast<cl_uint>(y_sz),
+    static_cast<cl_uint>(y_sz + chroma_sz),
+    static_cast<cl_uint>(y_sz + chroma_sz + hdr.NumSymbols(eStreamType_Palette)),
+
+    0,
+    hdr.y_cmp_sz,
+    hdr.y_cmp_sz + hdr.chroma_cmp_sz,
+    hdr.y_cmp_sz + hdr.chroma_cmp_sz + hdr.palette_sz
+  };
+  const size_t decoded_sz = y_sz + chroma_sz + hdr.NumSymbols(eStreamType_Palette)
+    + hdr.NumSymbols(eStreamType_Indices);
+  assert((decoded_sz % geom.SymbolsPerGroup()) == 0);
+
+  // The upload has the offsets and the frequency tables, each padded to 512
+  // bytes so that they can be sub-buffers, followed by the streams.
+  const size_t offsets_sz = AlignTo512(sizeof(ans_offsets));
+  const size_t inline_tables_sz = hdr.NumInlineTables() * kFreqTableSz;
+  const size_t tables_sz = AlignTo512(dictionary.size() + inline_tables_sz);
+  const size_t streams_sz = hdr.StreamsEnd() - sizeof(GenTCHeader) - inline_tables_sz;
+
+  std::vector<uint8_t> upload(offsets_sz + tables_sz + streams_sz);
+  uint8_t *ptr = upload.data();
+  memcpy(ptr, ans_offsets, sizeof(ans_offsets));
+  ptr += offsets_sz;
+  if (!dictionary.empty()) {
+    memcpy(ptr, dictionary.data(), dictionary.size());
+  }
+  ptr += dictionary.size();
+  memcpy(ptr, cmp_data.data() + sizeof(GenTCHeader), inline_tables_sz);
+  ptr += tables_sz - dictionary.size();
+  memcpy(ptr, cmp_data.data() + sizeof(GenTCHeader) + inline_tables_sz, streams_sz);
 
-  // Setup output
   cl_int errCreateBuffer;
-  size_t dxt_size = (hdr.width * hdr.height) / 2;
-  cl_mem dxt_output = clCreateBuffer(gpu_ctx->GetOpenCLContext(), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY,
-                                     dxt_size, NULL, &errCreateBuffer);
+  cl_mem upload_buf = clCreateBuffer(gpu_ctx->GetOpenCLContext(), GetHostReadOnlyFlags(),
+                                     upload.size(), upload.data(), &errCreateBuffer);
   CHECK_CL((cl_int), errCreateBuffer);
 
-  // Set a dummy event
-  cl_event init_event;
-#ifdef CL_VERSION_1_2
-  CHECK_CL(clEnqueueMarkerWithWaitList, queue, 0, NULL, &init_event);
-#else
-  CHECK_CL(clEnqueueMarker, queue, &init_event);
-#endif
+  cl_mem offsets_buf = CreateSubBuffer(upload_buf, 0, offsets_sz);
+  cl_mem freqs_buf = CreateSubBuffer(upload_buf, offsets_sz, tables_sz);
+  cl_mem streams_buf = CreateSubBuffer(upload_buf, offsets_sz + tables_sz, streams_sz);
+
+  // The indices are decoded for the whole texture, but the rest of the
+  // stages only see the preview.
+  const size_t refs_offset = ans_offsets[2] + hdr.palette_bytes;
+  cl_mem texture_buf = CreateTextureInfoBuffer(gpu_ctx, {
+    GetTextureInfo(ans_offsets, blocks_x, blocks_y, 0, hdr.width, hdr.height, 0,
+                   refs_offset, hdr.index_refs)
+  });
+  cl_mem preview_buf = CreateTextureInfoBuffer(gpu_ctx, {
+    GetTextureInfo(ans_offsets, preview_x, preview_y, 0, preview_width, preview_height, 0,
+                   refs_offset, hdr.index_refs)
+  });
+
+  cl_mem table_ids_buf = clCreateBuffer(gpu_ctx->GetOpenCLContext(), GetHostReadOnlyFlags(),
+                                        table_ids.size() * sizeof(table_ids[0]),
+                                        table_ids.data(), &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
 
-  // Queue the decompression...
-  cl_event dxt_event =
-    DecompressDXTImage(gpu_ctx, { hdr }, queue, "assemble_dxt", cmp_buf, 1, &init_event, dxt_output);
+  const size_t table_sz = AlignTo512(num_tables * geom.table_size * sizeof(AnsTableEntry));
+  const size_t decoded_buf_sz = AlignTo512(decoded_sz);
+  const size_t planes_sz = AlignTo512(6 * preview_vals);
+  const size_t indices_sz = AlignTo512(4 * num_vals);
+  const size_t preview_indices_sz = AlignTo512(4 * preview_vals);
+  const size_t ref_counts_sz = (0 < hdr.index_refs) ? indices_sz : 0;
 
-  // Block on read
-  std::vector<uint8_t> decmp_data(dxt_size, 0xFF);
-  CHECK_CL(clEnqueueReadBuffer, queue, dxt_output, CL_TRUE, 0, dxt_size, decmp_data.data(),
-                                1, &dxt_event, NULL);
+  PreloadedMemory _scratch_mem;
+  PreloadedMemory *scratch_mem = gPreloader.get();
+  if (nullptr == scratch_mem) {
+    scratch_mem = &_scratch_mem;
+    scratch_mem->Allocate(gpu_ctx, table_sz + 2 * decoded_buf_sz + planes_sz
+                                   + indices_sz + preview_indices_sz + ref_counts_sz);
+  }
 
-  CHECK_CL(clReleaseMemObject, cmp_buf);
-  CHECK_CL(clReleaseEvent, dxt_event);
-  CHECK_CL(clReleaseMemObject, dxt_output);
-  CHECK_CL(clReleaseEvent, init_event);
-  return std::move(decmp_data);
-}
+  cl_mem table_region = scratch_mem->GetNextRegion(table_sz);
+  cl_mem decoded_buf = scratch_mem->GetNextRegion(decoded_buf_sz);
+  // The bands are gathered at the same offsets as the streams they came from
+  cl_mem planes_buf = scratch_mem->GetNextRegion(decoded_buf_sz);
+  cl_mem inv_wavelet_output = scratch_mem->GetNextRegion(planes_sz);
+  cl_mem decoded_indices = scratch_mem->GetNextRegion(indices_sz);
+  cl_mem preview_indices = scratch_mem->GetNextRegion(preview_indices_sz);
+  cl_mem ref_counts = (0 < ref_counts_sz) ? scratch_mem->GetNextRegion(ref_counts_sz) : NULL;
+
+  const size_t output_sz = (eDecodeOutput_DXT == output_type)
+    ? 8 * ((preview_width + 3) / 4) * ((preview_height + 3) / 4)
+    : 3 * preview_width * preview_height;
+  cl_mem output = clCreateBuffer(gpu_ctx->GetOpenCLContext(), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY,
+                                 output_sz, NULL, &errCreateBuffer);
+  CHECK_CL((cl_int), errCreateBuffer);
 
-DXTImage DecompressDXT(const std::unique_ptr<GPUContext> &gpu_ctx,
-                       const std::vector<uint8_t> &cmp_data) {
-  GenTCHeader hdr;
-  hdr.LoadFrom(cmp_data.data());
+  cl_command_queue queue = gpu_ctx->GetNextQueue();
 
-  std::vector<uint8_t> decmp_data = std::move(DecompressDXTBuffer(gpu_ctx, cmp_data));
-  return DXTImage(hdr.width, hdr.height, decmp_data);
+  // Build the tables...
+  const size_t build_table_global_work_size[2] = { geom.table_size, num_tables };
+  const size_t build_table_local_work_size[2] = { 256, 1 };
+
+  cl_event build_table_event;
+  gpu_ctx->EnqueueOpenCLKernel<2>(
+    queue, ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_BuildTable], "build_table", ans_build_options,
+    build_table_global_work_size, build_table_local_work_size,
+    0, NULL, &build_table_event,
+    freqs_buf, table_region);
+
+  // Decode the front of the endpoint streams along with all of the palette
+  // and the indices...
+  const size_t rANS_global_work = decoded_sz / geom.num_encoded_symbols;
+  const size_t rANS_local_work = geom.threads_per_group;
+  assert(rANS_global_work % rANS_local_work == 0);
+
+  cl_event decode_ans_event;
+  gpu_ctx->EnqueueOpenCLKernel<1>(
+    queue, ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_ANSDecode], "ans_decode_multiple",
+    ans_build_options, &rANS_global_work, &rANS_local_work,
+    1, &build_table_event, &decode_ans_event,
+    table_region, table_ids_buf, static_cast<cl_uint>(4), offsets_buf, streams_buf, decoded_buf);
+
+  // ... gather the coarse bands into dim x dim blocks...
+  size_t gather_bands_global_work_size[3] = { dim, dim * tiles_x * tiles_y, 6 };
+  cl_event gather_bands_event;
+  gpu_ctx->EnqueueOpenCLKernel<3>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_InverseWavelet], "gather_bands",
+    gather_bands_global_work_size, NULL,
+    1, &decode_ans_event, &gather_bands_event,
+    decoded_buf, preview_buf, static_cast<cl_uint>(1), static_cast<cl_uint>(dim), planes_buf);
+
+  // ... and run the inverse wavelet transform on them...
+  size_t inv_wavelet_global_work_size[3] = { dim / 2, (dim / 2) * tiles_x * tiles_y, 6 };
+  size_t inv_wavelet_local_work_size[3] = { dim / 2, dim / 2, 1 };
+
+  gpu::GPUContext::LocalMemoryKernelArg local_mem;
+  local_mem._local_mem_sz = 8 * dim * dim;
+
+  cl_event inv_wavelet_event;
+  gpu_ctx->EnqueueOpenCLKernel<3>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_InverseWavelet], "inv_wavelet",
+    inv_wavelet_global_work_size, inv_wavelet_local_work_size,
+    1, &gather_bands_event, &inv_wavelet_event,
+    planes_buf, preview_buf, static_cast<cl_uint>(1), local_mem, inv_wavelet_output);
+
+  // ... while all of the indices are decoded and the ones of the preview
+  // picked out of them...
+  CHECK_CL(clRetainEvent, decode_ans_event);
+  cl_event decode_indices_event =
+    EnqueueIndexScan(gpu_ctx, queue, decoded_buf, texture_buf, num_vals, 1,
+                     decode_ans_event, ref_counts, decoded_indices);
+
+  size_t subsample_global_work_size[2] = { preview_x, preview_y };
+  cl_event subsample_event;
+  gpu_ctx->EnqueueOpenCLKernel<2>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_DecodeIndices], "subsample_indices",
+    subsample_global_work_size, NULL,
+    1, &decode_indices_event, &subsample_event,
+    decoded_indices, static_cast<cl_uint>(blocks_x), static_cast<cl_uint>(scale), preview_indices);
+
+  // ... then assemble the preview and read it back.
+  const std::string assembly_kernel = (eDecodeOutput_DXT == output_type) ? "assemble_dxt" : "assemble_rgb";
+  size_t assembly_global_work_size = preview_vals;
+  cl_event assembly_events[2] = { inv_wavelet_event, subsample_event };
+  cl_event assembly_event;
+  gpu_ctx->EnqueueOpenCLKernel<1>(
+    queue, GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_Assemble], assembly_kernel,
+    &assembly_global_work_size, NULL,
+    2, assembly_events, &assembly_event,
+    decoded_buf, preview_buf, static_cast<cl_uint>(1), inv_wavelet_output, preview_indices,
+    output);
+
+  std::vector<uint8_t> result(output_sz);
+  CHECK_CL(clEnqueueReadBuffer, queue, output, CL_TRUE, 0, output_sz, result.data(),
+                                1, &assembly_event, NULL);
+
+  CHECK_CL(clReleaseEvent, build_table_event);
+  CHECK_CL(clReleaseEvent, decode_ans_event);
+  CHECK_CL(clReleaseEvent, gather_bands_event);
+  CHECK_CL(clReleaseEvent, inv_wavelet_event);
+  CHECK_CL(clReleaseEvent, decode_indices_event);
+  CHECK_CL(clReleaseEvent, subsample_event);
+  CHECK_CL(clReleaseEvent, assembly_event);
+
+  CHECK_CL(clReleaseMemObject, output);
+  if (NULL != ref_counts) {
+    CHECK_CL(clReleaseMemObject, ref_counts);
+  }
+  CHECK_CL(clReleaseMemObject, preview_indices);
+  CHECK_CL(clReleaseMemObject, decoded_indices);
+  CHECK_CL(clReleaseMemObject, inv_wavelet_output);
+  CHECK_CL(clReleaseMemObject, planes_buf);
+  CHECK_CL(clReleaseMemObject, decoded_buf);
+  CHECK_CL(clReleaseMemObject, table_region);
+  CHECK_CL(clReleaseMemObject, table_ids_buf);
+  CHECK_CL(clReleaseMemObject, preview_buf);
+  CHECK_CL(clReleaseMemObject, texture_buf);
+  CHECK_CL(clReleaseMemObject, streams_buf);
+  CHECK_CL(clReleaseMemObject, freqs_buf);
+  CHECK_CL(clReleaseMemObject, offsets_buf);
+  CHECK_CL(clReleaseMemObject, upload_buf);
+  return std::move(result);
 }
 
 cl_event LoadCompressedDXT(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                            const GenTCHeader &hdr, cl_command_queue queue,
                            cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init) {
-  return DecompressDXTImage(gpu_ctx, { hdr }, queue, "assemble_dxt", cmp_data, num_init, init, output);
+  return DecompressDXTImage(gpu_ctx, { hdr }, queue, "assemble_dxt", cmp_data, 0, num_init, init, output);
 }
 
 cl_event LoadCompressedDXTs(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                             const std::vector<GenTCHeader> &hdrs, cl_command_queue queue,
-                            cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init) {
-  return DecompressDXTImage(gpu_ctx, hdrs, queue, "assemble_dxt", cmp_data, num_init, init, output);
+                            cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init,
+                            cl_uint num_shared_tables) {
+  return DecompressDXTImage(gpu_ctx, hdrs, queue, "assemble_dxt", cmp_data, num_shared_tables,
+                            num_init, init, output);
 }
 
 cl_event LoadRGB(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                  const GenTCHeader &hdr, cl_command_queue queue,
                  cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init) {
-  return DecompressDXTImage(gpu_ctx, { hdr }, queue, "assemble_rgb", cmp_data, num_init, init, output);
+  return DecompressDXTImage(gpu_ctx, { hdr }, queue, "assemble_rgb", cmp_data, 0, num_init, init, output);
 }
 
 cl_event LoadRGBs(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                   const std::vector<GenTCHeader> &hdrs, cl_command_queue queue,
-                  cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init) {
-  return DecompressDXTImage(gpu_ctx, hdrs, queue, "assemble_rgb", cmp_data, num_init, init, output);
+                  cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init,
+                  cl_uint num_shared_tables) {
+  return DecompressDXTImage(gpu_ctx, hdrs, queue, "assemble_rgb", cmp_data, num_shared_tables,
+                            num_init, init, output);
 }
 
 bool InitializeDecoder(const std::unique_ptr<gpu::GPUContext> &gpu_ctx) {
-  bool ok = true;
+  return InitializeDecoder(gpu_ctx, ans::ocl::Geometry());
+}
+
+bool InitializeDecoder(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                       const ans::ocl::Geometry &geom) {
+  bool ok = geom.IsValid();
+  const std::string ans_build_options = ok ? geom.BuildOptions() : std::string();
 
   // At least make sure that the work group size needed for each kernel is met...
   ok = ok && 256 <= gpu_ctx->GetKernelWGInfo<size_t>(
     ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_BuildTable], "build_table",
-    CL_KERNEL_WORK_GROUP_SIZE);
+    CL_KERNEL_WORK_GROUP_SIZE, ans_build_options);
 
-  ok = ok && ans::ocl::kThreadsPerEncodingGroup <= gpu_ctx->GetKernelWGInfo<size_t>(
+  ok = ok && geom.threads_per_group <= gpu_ctx->GetKernelWGInfo<size_t>(
     ans::kANSOpenCLKernels[ans::eANSOpenCLKernel_ANSDecode], "ans_decode_multiple",
-    CL_KERNEL_WORK_GROUP_SIZE);
+    CL_KERNEL_WORK_GROUP_SIZE, ans_build_options);
 
   ok = ok && (kWaveletBlockDim * kWaveletBlockDim / 4) <= gpu_ctx->GetKernelWGInfo<size_t>(
     GenTC::kOpenCLKernels[GenTC::eOpenCLKernel_InverseWavelet], "inv_wavelet",
@@ -588,4 +1478,145 @@ bool InitializeDecoder(const std::unique_ptr<gpu::GPUContext> &gpu_ctx) {
   return ok;
 }
 
+class OpenCLBuffer : public DecodeBackend::Buffer {
+ public:
+  OpenCLBuffer(const std::unique_ptr<GPUContext> &gpu_ctx, size_t sz)
+    : _gpu_ctx(gpu_ctx), _sz(sz) {
+    cl_int errCreateBuffer;
+    _mem = clCreateBuffer(gpu_ctx->GetOpenCLContext(), CL_MEM_READ_WRITE, sz, NULL, &errCreateBuffer);
+    CHECK_CL((cl_int), errCreateBuffer);
+  }
+
+  ~OpenCLBuffer() {
+    CHECK_CL(clReleaseMemObject, _mem);
+  }
+
+  size_t Size() const override { return _sz; }
+  void Read(size_t offset, size_t sz, uint8_t *dst) const override {
+    assert(offset + sz <= _sz);
+    CHECK_CL(clEnqueueReadBuffer, _gpu_ctx->GetDefaultCommandQueue(), _mem, CL_TRUE,
+                                  offset, sz, dst, 0, NULL, NULL);
+  }
+
+  cl_mem Memory() const { return _mem; }
+
+ private:
+  const std::unique_ptr<GPUContext> &_gpu_ctx;
+  const size_t _sz;
+  cl_mem _mem;
+};
+
+class OpenCLCompletion : public DecodeBackend::Completion {
+ public:
+  explicit OpenCLCompletion(cl_event e) : _event(e) { }
+  ~OpenCLCompletion() {
+    CHECK_CL(clReleaseEvent, _event);
+  }
+
+  bool IsComplete() const override {
+    cl_int status;
+    CHECK_CL(clGetEventInfo, _event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+    return CL_COMPLETE == status;
+  }
+
+  void Wait() override {
+    CHECK_CL(clWaitForEvents, 1, &_event);
+  }
+
+ private:
+  cl_event _event;
+};
+
+class OpenCLBackend : public DecodeBackend {
+ public:
+  explicit OpenCLBackend(const std::unique_ptr<GPUContext> &gpu_ctx) : _gpu_ctx(gpu_ctx) { }
+
+  EDecodeBackend Type() const override { return eDecodeBackend_OpenCL; }
+
+  std::unique_ptr<Buffer> CreateBuffer(size_t sz) override {
+    return std::unique_ptr<Buffer>(new OpenCLBuffer(_gpu_ctx, sz));
+  }
+
+  std::unique_ptr<Completion>
+  DecodeBatch(const std::vector<std::vector<uint8_t> > &cmp_data,
+              const std::vector<uint8_t> &dictionary,
+              EDecodeOutput output_type, Buffer *output) override {
+    cl_command_queue queue = _gpu_ctx->GetNextQueue();
+
+    std::vector<GenTCHeader> hdrs;
+    cl_mem cmp_buf = UploadCompressedDXTs(_gpu_ctx, cmp_data, dictionary, &hdrs);
+    const cl_uint num_shared_tables = static_cast<cl_uint>(dictionary.size() / kFreqTableSz);
+
+    // A batch that doesn't load completes right away without any output
+    if (NULL == cmp_buf) {
+      cl_event done_event;
+#ifdef CL_VERSION_1_2
+      CHECK_CL(clEnqueueMarkerWithWaitList, queue, 0, NULL, &done_event);
+#else
+      CHECK_CL(clEnqueueMarker, queue, &done_event);
+#endif
+      return std::unique_ptr<Completion>(new OpenCLCompletion(done_event));
+    }
+
+#ifndef NDEBUG
+    size_t total_sz = 0;
+    for (const auto &hdr : hdrs) {
+      total_sz += DecodedSize(hdr, output_type);
+    }
+    assert(total_sz <= output->Size());
+#endif
+
+    // Set a dummy event
+    cl_event init_event;
+#ifdef CL_VERSION_1_2
+    CHECK_CL(clEnqueueMarkerWithWaitList, queue, 0, NULL, &init_event);
+#else
+    CHECK_CL(clEnqueueMarker, queue, &init_event);
+#endif
+
+    cl_mem out = static_cast<OpenCLBuffer *>(output)->Memory();
+    cl_event done_event;
+    if (eDecodeOutput_DXT == output_type) {
+      done_event = LoadCompressedDXTs(_gpu_ctx, hdrs, queue, cmp_buf, out, 1, &init_event,
+                                      num_shared_tables);
+    } else {
+      done_event = LoadRGBs(_gpu_ctx, hdrs, queue, cmp_buf, out, 1, &init_event, num_shared_tables);
+    }
+    CHECK_CL(clFlush, queue);
+
+    CHECK_CL(clReleaseMemObject, cmp_buf);
+    CHECK_CL(clReleaseEvent, init_event);
+    return std::unique_ptr<Completion>(new OpenCLCompletion(done_event));
+  }
+
+  std::vector<uint8_t> DecodeRegion(const std::vector<uint8_t> &cmp_data,
+                                    const std::vector<uint8_t> &dictionary,
+                                    size_t x, size_t y, size_t width, size_t height) override {
+    return std::move(DecompressDXTRegion(_gpu_ctx, cmp_data, dictionary, x, y, width, height));
+  }
+
+  std::vector<uint8_t> DecodePreview(const std::vector<uint8_t> &cmp_data,
+                                     const std::vector<uint8_t> &dictionary,
+                                     size_t scale, EDecodeOutput output_type) override {
+    return std::move(DecompressPreview(_gpu_ctx, cmp_data, dictionary, scale, output_type));
+  }
+
+ private:
+  const std::unique_ptr<GPUContext> &_gpu_ctx;
+};
+
+std::unique_ptr<DecodeBackend> CreateOpenCLBackend(const std::unique_ptr<gpu::GPUContext> &gpu_ctx) {
+  return std::unique_ptr<DecodeBackend>(new OpenCLBackend(gpu_ctx));
+}
+
+std::unique_ptr<DecodeBackend> CreateDecodeBackend(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                                                   size_t num_cpu_threads) {
+  if (nullptr != gpu_ctx && gpu::eContextType_GenericGPU == gpu_ctx->Type() &&
+      InitializeDecoder(gpu_ctx)) {
+    return std::move(CreateOpenCLBackend(gpu_ctx));
+  }
+
+  return std::move(CreateCPUBackend(num_cpu_threads));
+}
+
 }
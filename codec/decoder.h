@@ -8,21 +8,76 @@
 #include "dxt_image.h"
 #include "gpu.h"
 #include "codec_base.h"
+#include "decode_backend.h"
 
 namespace GenTC {
   // Optional to compile kernels so that we don't have to do it at runtime.
   // Returns true if our platform meets all of the expectations...
   bool InitializeDecoder(const std::unique_ptr<gpu::GPUContext> &gpu_ctx);
+
+  // Same as above for streams compressed with a different ANS geometry.
+  bool InitializeDecoder(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                         const ans::ocl::Geometry &geom);
   DXTImage DecompressDXT(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                          const std::vector<uint8_t> &cmp_data);
 
+  // Decompresses a texture from a batch compressed with CompressDXTs using
+  // the dictionary of frequency tables shared by the batch.
+  DXTImage DecompressDXT(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                         const std::vector<uint8_t> &cmp_data,
+                         const std::vector<uint8_t> &dictionary);
+
+  // Decodes every level of a mip chain compressed with CompressDXTMipChain
+  // as one batch. Returns the DXT1 blocks of each level, largest first.
+  std::vector<std::vector<uint8_t> > DecompressDXTMipChain(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                                                           const std::vector<uint8_t> &cmp_data);
+
+  // Decodes the width x height pixels at (x, y) of a texture that was
+  // compressed with a tile index. Only the tiles that overlap the region are
+  // decoded. The region needs to be aligned to DXT blocks, and its DXT1
+  // blocks are returned in raster order. Returns nothing if the texture has
+  // no tile index, its tile index is malformed, or the region doesn't fit.
+  std::vector<uint8_t> DecompressDXTRegion(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                                           const std::vector<uint8_t> &cmp_data,
+                                           const std::vector<uint8_t> &dictionary,
+                                           size_t x, size_t y, size_t width, size_t height);
+
+  // Decodes the preview of a texture compressed with CompressDXTWithPreview
+  // that is 1 / scale its size in each dimension, for a scale of 1, 2, 4 or
+  // 8, like cpu::Decoder::DecompressDXTPreview does. Only the front of the
+  // endpoint streams is decoded. Returns DXT1 blocks or tightly packed RGB8
+  // pixels depending on output_type.
+  std::vector<uint8_t> DecompressPreview(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                                         const std::vector<uint8_t> &cmp_data,
+                                         const std::vector<uint8_t> &dictionary,
+                                         size_t scale, EDecodeOutput output_type);
+
   cl_event LoadCompressedDXT(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                              const GenTCHeader &hdr, cl_command_queue queue,
                              cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init);
 
+  // The compressed data of a batch starts with the input and output offsets
+  // of every stream, followed by the frequency tables and then the streams
+  // themselves. The frequency tables are the num_shared_tables tables of the
+  // batch's dictionary, if any, followed by the inline tables of each texture
+  // in order. Each table is only built once no matter how many of the
+  // textures refer to it. The streams of the whole batch are entropy decoded
+  // together. The textures can have different dimensions, like the levels of
+  // a mip chain, and the rest of the stages still take one dispatch each for
+  // the whole batch. The textures are written to output back to back.
   cl_event LoadCompressedDXTs(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                               const std::vector<GenTCHeader> &hdr, cl_command_queue queue,
-                              cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init);
+                              cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init,
+                              cl_uint num_shared_tables = 0);
+
+  // Uploads a batch of textures, and the dictionary of frequency tables that
+  // they share, in the layout that LoadCompressedDXTs and LoadRGBs expect.
+  // Returns the header of each texture in hdrs, or NULL if any of the
+  // headers don't load.
+  cl_mem UploadCompressedDXTs(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                              const std::vector<std::vector<uint8_t> > &cmp_data,
+                              const std::vector<uint8_t> &dictionary,
+                              std::vector<GenTCHeader> *hdrs);
 
   cl_event LoadRGB(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                    const GenTCHeader &hdr, cl_command_queue queue,
@@ -30,7 +85,19 @@ namespace GenTC {
 
   cl_event LoadRGBs(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
                     const std::vector<GenTCHeader> &hdr, cl_command_queue queue,
-                    cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init);
+                    cl_mem cmp_data, cl_mem output, cl_uint num_init, const cl_event *init,
+                    cl_uint num_shared_tables = 0);
+
+  // Decodes with the kernels above. The context needs to outlive the backend.
+  std::unique_ptr<DecodeBackend> CreateOpenCLBackend(const std::unique_ptr<gpu::GPUContext> &gpu_ctx);
+
+  // Picks the backend for this machine from the context returned by
+  // GPUContext::TryInitializeOpenCL. Uses OpenCL if the context is a GPU that
+  // can run the decoder, and the CPU decoder otherwise, including when there
+  // is no context at all. OpenCL devices that are themselves the CPU are
+  // slower than the native CPU decoder.
+  std::unique_ptr<DecodeBackend> CreateDecodeBackend(const std::unique_ptr<gpu::GPUContext> &gpu_ctx,
+                                                     size_t num_cpu_threads = 0);
 
   size_t RequiredScratchMem(const GenTCHeader &hdr);
   void PreallocateDecompressor(const std::unique_ptr<gpu::GPUContext> &gpu_ctx, size_t req_sz);
@@ -1,13 +1,19 @@
 #include "dxt_image.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cmath>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <functional>
-#include <random>
+#include <future>
+#include <limits>
+#include <thread>
+#include <unordered_map>
 
 #ifndef _MSC_VER
 #pragma GCC diagnostic push
@@ -33,9 +39,22 @@
 #pragma warning(default : 4312)
 #endif
 
+#include "ans_simd.h"
+#include "ctpl/ctpl_stl.h"
 #include "vptree/vptree.hh"
 #define PREDICT_VPTREE
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define GENTC_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define GENTC_TARGET(x) __attribute__((target(x)))
+#else
+#define GENTC_TARGET(x)
+#endif
+
 template <typename T>
 static inline T AbsDiff(T a, T b) {
   return a > b ? a - b : b - a;
@@ -214,16 +233,6 @@ PhysicalDXTBlock LogicalToPhysical(const LogicalDXTBlock &b) {
   return result;
 }
 
-static void Deinterleave(uint32_t x, uint16_t *i, uint16_t *j) {
-  uint64_t w = (static_cast<uint64_t>(x & 0xAAAAAAAA) << 31) | (x & 0x55555555);
-  w = (w | (w >> 1)) & 0x3333333333333333ULL;
-  w = (w | (w >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
-  w = (w | (w >> 4)) & 0x00FF00FF00FF00FFULL;
-  w = (w | (w >> 8)) & 0x0000FFFF0000FFFFULL;
-  *i = static_cast<uint16_t>(w & 0xFFFF);
-  *j = static_cast<uint16_t>((w >> 32) & 0xFFFF);
-}
-
 static void ChunkBy(int chunk_sz_x, int chunk_sz_y, int sz_x, int sz_y,
   std::function<void(int x, int y)> func) {
   for (int y = 0; y < sz_y; y += chunk_sz_y) {
@@ -247,22 +256,10 @@ static std::vector<LogicalDXTBlock>
   return std::move(out);
 }
 
-static std::vector<PhysicalDXTBlock>
-  LogicalToPhysicalBlocks(const std::vector<LogicalDXTBlock> &blocks) {
-  std::vector<PhysicalDXTBlock> out;
-  out.reserve(blocks.size());
-
-  for (const LogicalDXTBlock &b : blocks) {
-    PhysicalDXTBlock pb = LogicalToPhysical(b);
-    assert(PhysicalToLogical(pb) == b);
-    out.push_back(pb);
-  }
-
-  return std::move(out);
-}
-
 struct CompressedBlock {
-  std::vector<uint8_t> _uncompressed;
+  // The 4x4 source pixels in raster order. Blocks are copied once for every
+  // candidate that they're measured against, so this stays off the heap.
+  alignas(16) uint8_t _uncompressed[48];
   LogicalDXTBlock _logical;
 
   size_t Error() const {
@@ -285,12 +282,13 @@ struct CompressedBlock {
     return err / (16 * 3);
   }
 
-  size_t CompareAgainst(const LogicalDXTBlock &other) const {
-    CompressedBlock dup = *this;
-    dup._logical = other;
-    dup.RecalculateEndpoints();
-    return dup.Error();
-  }
+  // Writes out the error that Error() would give after AssignIndices and
+  // RecalculateEndpoints for each of the num candidate index words. keeps[i]
+  // is false if the refit endpoints can only be stored by swapping them,
+  // which flips the indices. With use_sse41 the candidates are fit four at
+  // a time, and the results are the same as without it.
+  void EvaluateIndices(const uint32_t *candidates, size_t num, bool use_sse41,
+                       int *errs, bool *keeps) const;
 
   void AssignIndices(const uint32_t idx) {
     PhysicalDXTBlock pblk = LogicalToPhysical(_logical);
@@ -299,6 +297,8 @@ struct CompressedBlock {
   }
 
   void RecalculateEndpoints() {
+    // EvaluateIndicesSSE41 does the same fit one candidate per lane, and
+    // needs to follow this operation for operation to match it.
     // Now that we know the index of each pixel, we can assign the endpoints based
     // on a least squares fit of the clusters. For more information, take a look
     // at this article by NVidia: http://developer.download.nvidia.com/compute/
@@ -307,7 +307,7 @@ struct CompressedBlock {
     float ax[3] = { 0.0f, 0.0f, 0.0f };
     float bx[3] = { 0.0f, 0.0f, 0.0f };
     for (size_t i = 0; i < 16; i++) {
-      const uint8_t *orig_pixel = _uncompressed.data() + i * 3;
+      const uint8_t *orig_pixel = _uncompressed + i * 3;
 
       static const float idx_to_order[4] = { 0.f, 3.f, 1.f, 2.f };
       const float order = idx_to_order[_logical.indices[i]];
@@ -359,6 +359,177 @@ struct CompressedBlock {
   }
 };
 
+#ifdef GENTC_SIMD_X86
+// Fits the endpoints of four candidates at once, one in each lane, with the
+// same sequence of float operations as RecalculateEndpoints so that the
+// results match it bit for bit. The error of each candidate is then measured
+// over all sixteen pixels at once.
+GENTC_TARGET("sse4.1")
+static void EvaluateIndicesSSE41(const uint8_t pixels[48], const uint32_t *candidates, size_t num,
+                                 int *errs, bool *keeps) {
+  alignas(16) uint8_t planar[3][16];
+  for (int i = 0; i < 16; ++i) {
+    for (int c = 0; c < 3; ++c) {
+      planar[c][i] = pixels[3 * i + c];
+    }
+  }
+
+  __m128i src[3];
+  for (int c = 0; c < 3; ++c) {
+    src[c] = _mm_load_si128(reinterpret_cast<const __m128i *>(planar[c]));
+  }
+
+  // Same as idx_to_order in RecalculateEndpoints. The upper bytes of each
+  // lane are zero and pick out the first entry, which is zero too.
+  const __m128i order_table = _mm_setr_epi8(0, 3, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i index_mask = _mm_set1_epi32(3);
+  const __m128 three = _mm_set1_ps(3.0f);
+
+  for (size_t first = 0; first < num; first += 4) {
+    const size_t count = std::min<size_t>(4, num - first);
+
+    // Lanes past the end repeat the last candidate
+    alignas(16) uint32_t words[4];
+    for (size_t k = 0; k < 4; ++k) {
+      words[k] = candidates[first + std::min(k, count - 1)];
+    }
+    const __m128i w = _mm_load_si128(reinterpret_cast<const __m128i *>(words));
+
+    __m128 asq = _mm_setzero_ps();
+    __m128 bsq = _mm_setzero_ps();
+    __m128 ab = _mm_setzero_ps();
+    __m128 ax[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    __m128 bx[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    for (int i = 0; i < 16; ++i) {
+      const __m128i idx = _mm_and_si128(_mm_srl_epi32(w, _mm_cvtsi32_si128(2 * i)), index_mask);
+      const __m128 order = _mm_cvtepi32_ps(_mm_shuffle_epi8(order_table, idx));
+
+      const __m128 a = _mm_div_ps(_mm_sub_ps(three, order), three);
+      const __m128 b = _mm_div_ps(order, three);
+
+      asq = _mm_add_ps(asq, _mm_mul_ps(a, a));
+      bsq = _mm_add_ps(bsq, _mm_mul_ps(b, b));
+      ab = _mm_add_ps(ab, _mm_mul_ps(a, b));
+
+      for (int j = 0; j < 3; ++j) {
+        const __m128 pixel = _mm_set1_ps(static_cast<float>(pixels[3 * i + j]));
+        ax[j] = _mm_add_ps(ax[j], _mm_mul_ps(pixel, a));
+        bx[j] = _mm_add_ps(bx[j], _mm_mul_ps(pixel, b));
+      }
+    }
+
+    const __m128 f =
+      _mm_div_ps(_mm_set1_ps(1.0f), _mm_sub_ps(_mm_mul_ps(asq, bsq), _mm_mul_ps(ab, ab)));
+
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i max_val = _mm_set1_epi32(255);
+    const __m128i min_val = _mm_setzero_si128();
+    alignas(16) int32_t q1[3][4];
+    alignas(16) int32_t q2[3][4];
+    for (int j = 0; j < 3; ++j) {
+      const __m128 p1 = _mm_mul_ps(f, _mm_sub_ps(_mm_mul_ps(ax[j], bsq), _mm_mul_ps(bx[j], ab)));
+      const __m128 p2 = _mm_mul_ps(f, _mm_sub_ps(_mm_mul_ps(bx[j], asq), _mm_mul_ps(ax[j], ab)));
+
+      // Truncate like static_cast does, which also turns NaN into INT_MIN
+      __m128i v1 = _mm_cvttps_epi32(_mm_add_ps(p1, half));
+      __m128i v2 = _mm_cvttps_epi32(_mm_add_ps(p2, half));
+      v1 = _mm_max_epi32(min_val, _mm_min_epi32(max_val, v1));
+      v2 = _mm_max_epi32(min_val, _mm_min_epi32(max_val, v2));
+      _mm_store_si128(reinterpret_cast<__m128i *>(q1[j]), v1);
+      _mm_store_si128(reinterpret_cast<__m128i *>(q2[j]), v2);
+    }
+
+    for (size_t k = 0; k < count; ++k) {
+      const uint8_t ep1[3] = {
+        ToFiveBits(static_cast<uint8_t>(q1[0][k])),
+        ToSixBits(static_cast<uint8_t>(q1[1][k])),
+        ToFiveBits(static_cast<uint8_t>(q1[2][k]))
+      };
+      const uint8_t ep2[3] = {
+        ToFiveBits(static_cast<uint8_t>(q2[0][k])),
+        ToSixBits(static_cast<uint8_t>(q2[1][k])),
+        ToFiveBits(static_cast<uint8_t>(q2[2][k]))
+      };
+
+      // The palette is always in four color mode after a refit, so the
+      // endpoints only keep their order if the first one packs higher.
+      keeps[first + k] = Pack565(ep1) > Pack565(ep2);
+
+      alignas(16) uint8_t indices[16];
+      for (int i = 0; i < 16; ++i) {
+        indices[i] = (words[k] >> (2 * i)) & 0x3;
+      }
+      const __m128i idx = _mm_load_si128(reinterpret_cast<const __m128i *>(indices));
+
+      __m128i sum = _mm_setzero_si128();
+      for (int c = 0; c < 3; ++c) {
+        const int c1 = ep1[c];
+        const int c2 = ep2[c];
+        const __m128i palette = _mm_setr_epi8(
+          static_cast<char>(c1), static_cast<char>(c2),
+          static_cast<char>((2 * c1 + c2) / 3), static_cast<char>((c1 + 2 * c2) / 3),
+          0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i decoded = _mm_shuffle_epi8(palette, idx);
+        const __m128i diff = _mm_sub_epi8(_mm_max_epu8(src[c], decoded),
+                                          _mm_min_epu8(src[c], decoded));
+
+        const __m128i lo = _mm_cvtepu8_epi16(diff);
+        const __m128i hi = _mm_unpackhi_epi8(diff, _mm_setzero_si128());
+        sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+      }
+
+      sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+      sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+      errs[first + k] = _mm_cvtsi128_si32(sum) / (16 * 3);
+    }
+  }
+}
+#endif  // GENTC_SIMD_X86
+
+void CompressedBlock::EvaluateIndices(const uint32_t *candidates, size_t num, bool use_sse41,
+                                      int *errs, bool *keeps) const {
+#ifdef GENTC_SIMD_X86
+  if (use_sse41) {
+    EvaluateIndicesSSE41(_uncompressed, candidates, num, errs, keeps);
+    return;
+  }
+#else
+  (void)(use_sse41);
+#endif
+
+  for (size_t i = 0; i < num; ++i) {
+    CompressedBlock blk = *this;
+    blk.AssignIndices(candidates[i]);
+    blk.RecalculateEndpoints();
+
+    // !HACK! Check if it flips the indices... There has to be a
+    // better way to deal with this... In principle we can just leave
+    // them flipped and then reflip them back to the proper value
+    // in the decompressor...
+    PhysicalDXTBlock maybe_blk = LogicalToPhysical(blk._logical);
+    keeps[i] = maybe_blk.interpolation == candidates[i] && blk._logical.palette[3][3] == 0xFF;
+    errs[i] = static_cast<int>(blk.Error());
+  }
+}
+
+static bool UseSSE41(ans::simd::EInstructionSet set) {
+  return ans::simd::eInstructionSet_Scalar != set &&
+    ans::simd::IsSupported(ans::simd::eInstructionSet_SSE41);
+}
+
+void EvaluateIndexWords(const uint8_t pixels[48], const uint32_t *candidates, size_t num,
+                        int *errs, bool *keeps, ans::simd::EInstructionSet set) {
+  // The fit only depends on the pixels and the candidate's indices, so the
+  // block starts out with any endpoints.
+  PhysicalDXTBlock pblk;
+  pblk.dxt_block = 0;
+
+  CompressedBlock blk;
+  memcpy(blk._uncompressed, pixels, sizeof(blk._uncompressed));
+  blk._logical = PhysicalToLogical(pblk);
+  blk.EvaluateIndices(candidates, num, UseSSE41(set), errs, keeps);
+}
+
 static uint64_t CompressRGB(const uint8_t *img, int width) {
   unsigned char block[64];
   memset(block, 0, sizeof(block));
@@ -507,119 +678,355 @@ double DXTImage::PSNR() const {
   return 10.0 * log10((3.0 * 255.0 * 255.0) / orig_mse);
 }
 
+void DXTImage::GetSourceBlock(int block_x, int block_y, uint8_t out[48]) const {
+  // Blocks that hang off the right or bottom edge repeat the last column
+  // and row of pixels, so images don't need to be a multiple of four wide.
+  for (int row = 0; row < 4; ++row) {
+    const int y = std::min(4 * block_y + row, _height - 1);
+    for (int p = 0; p < 4; ++p) {
+      const int x = std::min(4 * block_x + p, _width - 1);
+      memcpy(out + 3 * (4 * row + p), _src_img.data() + (y * _width + x) * 3, 3);
+    }
+  }
+}
+
+// A pool of num_threads threads, or one per core if num_threads is zero, for
+// ParallelForRanges. Returns null if there would only be one thread.
+static std::unique_ptr<ctpl::thread_pool> CreatePool(size_t num_threads) {
+  if (0 == num_threads) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+
+  std::unique_ptr<ctpl::thread_pool> pool;
+  if (num_threads > 1) {
+    pool.reset(new ctpl::thread_pool(static_cast<int>(num_threads)));
+  }
+  return std::move(pool);
+}
+
+// Calls fn(start, end) for contiguous runs of [0, num_items) on the pool, or
+// on the calling thread if the pool is null, and returns once all of them
+// are done.
+template<typename F>
+static void ParallelForRanges(ctpl::thread_pool *pool, size_t num_items, const F &fn) {
+  const size_t num_threads =
+    (nullptr == pool) ? 1 : std::min(num_items, static_cast<size_t>(pool->size()));
+  if (num_threads <= 1) {
+    fn(0, num_items);
+    return;
+  }
+
+  std::vector<std::future<void> > results;
+  results.reserve(num_threads);
+
+  const size_t items_per_thread = (num_items + num_threads - 1) / num_threads;
+  for (size_t start = 0; start < num_items; start += items_per_thread) {
+    const size_t end = std::min(num_items, start + items_per_thread);
+    results.push_back(pool->push([&fn, start, end](int) {
+      fn(start, end);
+    }));
+  }
+
+  for (auto &result : results) {
+    result.get();
+  }
+}
+
 static const int kErrThreshold = 35;
-static const size_t kNumPrevLookup = 128;
+
+// The furthest that the palette index of a block can be from the index of
+// the block before it and still be coded as a difference. Anything further
+// away takes a long-range reference.
+static const int kMaxIndexDiff = 127;
+
+// The number of entries of the whole palette that a block is measured
+// against when none of the entries within kMaxIndexDiff of the index before
+// it are close enough.
+static const size_t kNumNearestEntries = 16;
+
+// Blocks are matched against the index palette in strips of this many
+// blocks in raster order. Each strip builds a palette of its own, so the
+// strips can be searched in parallel, and the palettes are then joined in
+// order. The strips don't depend on the number of threads, so neither does
+// the result, and textures of up to 512x512 pixels are a single strip.
+static const int kPaletteStripBlocks = 16384;
+
+// Finds the entries of an index palette whose indices are the most like the
+// indices of a block. Each index is placed along the line between the two
+// endpoints, and entries are compared by the L1 distance between the places
+// of their sixteen indices. That distance is at least the difference between
+// the sums of the places, so the entries are bucketed by that sum and only
+// the buckets that could hold something closer are searched.
+class PaletteIndex {
+ public:
+  // Adds the next entry of the palette
+  void Add(uint32_t interpolation) {
+    Places places;
+    const int sum = GetPlaces(interpolation, &places);
+    _places.push_back(places);
+    _buckets[sum].push_back(static_cast<uint32_t>(_places.size() - 1));
+  }
+
+  // Writes the palette indices of the (at most) k entries closest to
+  // interpolation to nearest, closest first. Entries at the same distance
+  // come in palette order, so the result doesn't depend on anything but the
+  // palette. Returns the number of entries written.
+  size_t Nearest(uint32_t interpolation, size_t k, uint32_t *nearest) const {
+    Places query;
+    const int sum = GetPlaces(interpolation, &query);
+
+    std::vector<std::pair<int, uint32_t> > found;
+    found.reserve(k + 1);
+    for (int offset = 0; offset < kNumBuckets; ++offset) {
+      if (found.size() == k && offset > found.back().first) {
+        break;
+      }
+
+      const int buckets[2] = { sum - offset, sum + offset };
+      for (int side = 0; side < (0 == offset ? 1 : 2); ++side) {
+        const int bucket = buckets[side];
+        if (bucket < 0 || bucket >= kNumBuckets) {
+          continue;
+        }
+
+        for (uint32_t entry : _buckets[bucket]) {
+          const std::pair<int, uint32_t> candidate(Distance(query, _places[entry]), entry);
+          if (found.size() == k && !(candidate < found.back())) {
+            continue;
+          }
+
+          found.insert(std::upper_bound(found.begin(), found.end(), candidate), candidate);
+          if (found.size() > k) {
+            found.pop_back();
+          }
+        }
+      }
+    }
+
+    for (size_t i = 0; i < found.size(); ++i) {
+      nearest[i] = found[i].second;
+    }
+    return found.size();
+  }
+
+ private:
+  typedef std::array<uint8_t, 16> Places;
+  static const int kNumBuckets = 16 * 3 + 1;
+
+  static int GetPlaces(uint32_t interpolation, Places *places) {
+    // The second endpoint is index 1, and the two in between are 2 and 3
+    static const uint8_t kPlaces[4] = { 0, 3, 1, 2 };
+
+    int sum = 0;
+    for (size_t i = 0; i < 16; ++i) {
+      (*places)[i] = kPlaces[(interpolation >> (2 * i)) & 0x3];
+      sum += (*places)[i];
+    }
+    return sum;
+  }
+
+  static int Distance(const Places &a, const Places &b) {
+    int dist = 0;
+    for (size_t i = 0; i < 16; ++i) {
+      dist += std::abs(static_cast<int>(a[i]) - static_cast<int>(b[i]));
+    }
+    return dist;
+  }
+
+  std::vector<Places> _places;
+  std::vector<uint32_t> _buckets[kNumBuckets];
+};
+
 void DXTImage::Reencode() {
   _blocks_width = (_width + 3) / 4;
   _blocks_height = (_height + 3) / 4;
   const int num_blocks = _blocks_width * _blocks_height;
+  std::unique_ptr<ctpl::thread_pool> pool = CreatePool(0);
 
   if (_physical_blocks.size() == 0) {
     // Compress the DXT data
     _physical_blocks.resize(num_blocks);
-    for (int physical_idx = 0; physical_idx < num_blocks; ++physical_idx) {
+    auto compress_block = [this](int physical_idx) {
       uint16_t i, j;
       i = static_cast<uint16_t>(physical_idx % _blocks_width);
       j = static_cast<uint16_t>(physical_idx / _blocks_width);
 
       int block_idx = j * _blocks_width + i;
-      const unsigned char *offset_data = _src_img.data() + (j * 4 * _width + i * 4) * 3;
-      _physical_blocks[block_idx].dxt_block = CompressRGB(offset_data, _width);
-    }
+      uint8_t block_data[48];
+      GetSourceBlock(i, j, block_data);
+      _physical_blocks[block_idx].dxt_block = CompressRGB(block_data, 4);
+    };
+
+    // stb_dxt sets up its tables the first time that it's called, so that
+    // has to happen before the rest of the blocks go to the other threads.
+    compress_block(0);
+    ParallelForRanges(pool.get(), num_blocks - 1, [&](size_t start, size_t end) {
+      for (size_t idx = start; idx < end; ++idx) {
+        compress_block(static_cast<int>(idx + 1));
+      }
+    });
   }
 
   _logical_blocks = std::move(PhysicalToLogicalBlocks(_physical_blocks));
   std::cout << "DXT Compressed PSNR: " << PSNR() << std::endl;
 
-  assert((_width & 0x3) == 0);
-  assert((_height & 0x3) == 0);
+  // Now do the dxt compression... Each block in a strip either reuses an
+  // entry of the strip's palette, or its own indices are added to it. The
+  // entries within kMaxIndexDiff of the index of the block before it are
+  // tried first since they're the cheapest to refer to, and then the entries
+  // of the whole palette with the most similar indices.
+  const int num_strips = (num_blocks + kPaletteStripBlocks - 1) / kPaletteStripBlocks;
+  std::vector<std::vector<uint32_t> > strip_palettes(num_strips);
+  std::vector<int> strip_indices(num_blocks);
+
+  const bool use_sse41 = UseSSE41(ans::simd::GetBestInstructionSet());
+  auto search_strip = [&](int strip) {
+    std::vector<uint32_t> &palette = strip_palettes[strip];
+    PaletteIndex palette_index;
+    int last_index = 0;
+
+    const int strip_end = std::min(num_blocks, (strip + 1) * kPaletteStripBlocks);
+    for (int physical_idx = strip * kPaletteStripBlocks; physical_idx < strip_end; ++physical_idx) {
+      uint16_t i, j;
+      i = static_cast<uint16_t>(physical_idx % _blocks_width);
+      j = static_cast<uint16_t>(physical_idx / _blocks_width);
 
-  // Now do the dxt compression...
-  int last_index = 0;
+      int block_idx = j * _blocks_width + i;
+      assert(block_idx == physical_idx);
+
+      CompressedBlock blk;
+      blk._logical = _logical_blocks[block_idx];
+      GetSourceBlock(i, j, blk._uncompressed);
+
+      const int orig_err = static_cast<int>(blk.Error());
+      int min_err = std::numeric_limits<int>::max();
+      int min_err_idx = 0;
+
+      // Candidates are measured a few at a time, but picked in the same
+      // order as if they were measured one by one. The entries around the
+      // last index are tried from the most recent one down.
+      static const size_t kBatchSz = 4;
+      const int window_begin = std::max(0, last_index - kMaxIndexDiff);
+      const int window_end = std::min(static_cast<int>(palette.size()), last_index + kMaxIndexDiff + 1);
+      const size_t num_candidates = static_cast<size_t>(std::max(0, window_end - window_begin));
+      bool found = false;
+      for (size_t batch = 0; !found && batch < num_candidates; batch += kBatchSz) {
+        const size_t batch_sz = std::min(kBatchSz, num_candidates - batch);
+        uint32_t candidates[kBatchSz];
+        for (size_t k = 0; k < batch_sz; ++k) {
+          candidates[k] = palette[window_end - 1 - (batch + k)];
+        }
 
-  for (int physical_idx = 0; physical_idx < num_blocks; ++physical_idx) {
-    uint16_t i, j;
-    Deinterleave(static_cast<uint32_t>(physical_idx), &i, &j);
-    i = static_cast<uint16_t>(physical_idx % _blocks_width);
-    j = static_cast<uint16_t>(physical_idx / _blocks_width);
-
-    int block_idx = j * _blocks_width + i;
-    assert(block_idx == physical_idx);
-    const unsigned char *offset_data = _src_img.data() + (j * 4 * _width + i * 4) * 3;
-
-    CompressedBlock blk;
-    blk._logical = _logical_blocks[block_idx];
-    blk._uncompressed = std::vector<uint8_t>(48, 0);
-
-    for (int row = 0; row < 4; ++row) {
-      uint8_t block_row[12];
-      for (int p = 0; p < 4; ++p) {
-        block_row[3 * p + 0] = offset_data[(row * _width + p) * 3 + 0];
-        block_row[3 * p + 1] = offset_data[(row * _width + p) * 3 + 1];
-        block_row[3 * p + 2] = offset_data[(row * _width + p) * 3 + 2];
-      }
+        int errs[kBatchSz];
+        bool keeps[kBatchSz];
+        blk.EvaluateIndices(candidates, batch_sz, use_sse41, errs, keeps);
 
-      memcpy(blk._uncompressed.data() + 12 * row, block_row, sizeof(block_row));
-    }
+        for (size_t k = 0; k < batch_sz; ++k) {
+          if (!keeps[k]) {
+            continue;
+          }
 
-    const int orig_err = static_cast<int>(blk.Error());
-    int min_err = std::numeric_limits<int>::max();
-    size_t min_err_idx = 0;
-
-    for (size_t idx = 0; idx < std::min<size_t>(kNumPrevLookup - 1, _index_palette.size()); ++idx) {
-      uint32_t indices = *(_index_palette.crbegin() + idx);
-      CompressedBlock blk2 = blk;
-      blk2.AssignIndices(indices);
-      blk2.RecalculateEndpoints();
-
-      // !HACK! Check if it flips the indices... There has to be a
-      // better way to deal with this... In principle we can just leave
-      // them flipped and then reflip them back to the proper value
-      // in the decompressor...
-      PhysicalDXTBlock maybe_blk = LogicalToPhysical(blk2._logical);
-      bool ok = maybe_blk.interpolation == indices;
-      ok = ok && blk2._logical.palette[3][3] == 0xFF;
-      if (!ok) {
-        continue;
+          int err_diff = errs[k] - orig_err;
+          if (err_diff < min_err) {
+            min_err = err_diff;
+            min_err_idx = window_end - 1 - static_cast<int>(batch + k);
+            if (err_diff <= 0) {
+              found = true;
+              break;
+            }
+          }
+        }
       }
 
-      int err = static_cast<int>(blk2.Error());
-      int err_diff = err - orig_err;
-      if (err_diff < min_err) {
-        min_err = err_diff;
-        min_err_idx = idx;
-        if (err_diff <= 0) {
-          break;
+      if (min_err >= kErrThreshold && num_candidates < palette.size()) {
+        uint32_t nearest[kNumNearestEntries];
+        size_t num_nearest = palette_index.Nearest(_physical_blocks[block_idx].interpolation,
+                                                   kNumNearestEntries, nearest);
+
+        // The ones in the window were already measured
+        num_nearest = std::remove_if(nearest, nearest + num_nearest, [=](uint32_t entry) {
+          return window_begin <= static_cast<int>(entry) && static_cast<int>(entry) < window_end;
+        }) - nearest;
+
+        for (size_t batch = 0; batch < num_nearest; batch += kBatchSz) {
+          const size_t batch_sz = std::min(kBatchSz, num_nearest - batch);
+          uint32_t candidates[kBatchSz];
+          for (size_t k = 0; k < batch_sz; ++k) {
+            candidates[k] = palette[nearest[batch + k]];
+          }
+
+          int errs[kBatchSz];
+          bool keeps[kBatchSz];
+          blk.EvaluateIndices(candidates, batch_sz, use_sse41, errs, keeps);
+
+          for (size_t k = 0; k < batch_sz; ++k) {
+            if (keeps[k] && errs[k] - orig_err < min_err) {
+              min_err = errs[k] - orig_err;
+              min_err_idx = static_cast<int>(nearest[batch + k]);
+            }
+          }
         }
       }
+
+      if (min_err < kErrThreshold) {
+        blk.AssignIndices(palette[min_err_idx]);
+        blk.RecalculateEndpoints();
+        assert(static_cast<int>(blk.Error()) - orig_err == min_err);
+        _logical_blocks[block_idx] = blk._logical;
+        _physical_blocks[block_idx] = LogicalToPhysical(blk._logical);
+        strip_indices[block_idx] = min_err_idx;
+      } else {
+        strip_indices[block_idx] = static_cast<int>(palette.size());
+        palette.push_back(_physical_blocks[block_idx].interpolation);
+        palette_index.Add(palette.back());
+      }
+
+      last_index = strip_indices[block_idx];
     }
+  };
 
-    int this_index = -1;
-    if (min_err < kErrThreshold) {
-      blk.AssignIndices(*(_index_palette.crbegin() + min_err_idx));
-      blk.RecalculateEndpoints();
-      assert(static_cast<int>(blk.Error()) - orig_err == min_err);
-      _logical_blocks[block_idx] = blk._logical;
-      _physical_blocks[block_idx] = LogicalToPhysical(blk._logical);
-      this_index = static_cast<int>(_index_palette.size() - min_err_idx - 1);
-    } else {
-      this_index = static_cast<int>(_index_palette.size());
-      _index_palette.push_back(_physical_blocks[block_idx].interpolation);
+  ParallelForRanges(pool.get(), num_strips, [&](size_t start, size_t end) {
+    for (size_t strip = start; strip < end; ++strip) {
+      search_strip(static_cast<int>(strip));
     }
+  });
 
-    int idx_diff = this_index - last_index;
-    assert(-128 <= idx_diff && idx_diff < 128);
+  // Join the palettes of the strips in order. Each index is stored as the
+  // difference from the one before it if that fits, and as a long-range
+  // reference if it doesn't.
+  _index_palette.clear();
+  _indices.clear();
+  _indices.reserve(num_blocks);
+  _index_refs.clear();
 
-    // The first index... everyone knows it's zero...
-    assert(physical_idx != 0 || 0 == this_index);
-    assert(physical_idx != 0 || 0 == last_index);
-    assert(physical_idx != 0 || 0 == idx_diff);
+  int last_index = 0;
+  for (int strip = 0; strip < num_strips; ++strip) {
+    const int palette_offset = static_cast<int>(_index_palette.size());
+    const int strip_end = std::min(num_blocks, (strip + 1) * kPaletteStripBlocks);
+    for (int physical_idx = strip * kPaletteStripBlocks; physical_idx < strip_end; ++physical_idx) {
+      const int this_index = palette_offset + strip_indices[physical_idx];
+      int idx_diff = this_index - last_index;
+
+      // The first index... everyone knows it's zero...
+      assert(physical_idx != 0 || 0 == this_index);
+      assert(physical_idx != 0 || 0 == last_index);
+      assert(physical_idx != 0 || 0 == idx_diff);
+
+      if (-kMaxIndexDiff <= idx_diff && idx_diff <= kMaxIndexDiff) {
+        _indices.push_back(static_cast<uint8_t>(idx_diff + 128));
+      } else {
+        _indices.push_back(0);
+        _index_refs.push_back(static_cast<uint32_t>(this_index));
+      }
+      last_index = this_index;
+    }
 
-    _indices.push_back(idx_diff + 128);
-    last_index = this_index;
+    _index_palette.insert(_index_palette.end(), strip_palettes[strip].begin(),
+                          strip_palettes[strip].end());
   }
 
   std::cout << "Unique index blocks: " << _index_palette.size() << std::endl;
+  std::cout << "Long-range index references: " << _index_refs.size() << std::endl;
   std::cout << "DXT Optimized PSNR: " << PSNR() << std::endl;
 }
 
@@ -916,62 +1323,150 @@ uint8_t compute_prediction_delta(uint8_t idx, uint8_t orig_idx) {
   return ((orig_order + 4) - pred_order) % 4;
 }
 
-#ifdef PREDICT_VPTREE
-
-static double BlockDist(const LogicalDXTBlock &p1, const LogicalDXTBlock &p2) {
-  // The indices are ordered like 0, 3, 1, 2
-  static const uint8_t idx_to_order[4] = { 0, 3, 1, 2 };
-
-  double dist = 0.0;
-  for (size_t i = 0; i < 16; ++i) {
-    double x = static_cast<double>(idx_to_order[p1.indices[i]]);
-    double y = static_cast<double>(idx_to_order[p2.indices[i]]);
-
-    double err = x - y;
-    dist += err * err;
-  }
-
-  return dist;
-}
-
+// Counts the blocks that use each index word. The most used words come
+// first, and words that are used as often come in increasing order.
 static std::vector<std::pair<uint32_t, size_t> > CountBlocks(
   const std::vector<PhysicalDXTBlock> &blocks) {
   typedef std::pair<uint32_t, size_t> Res;
   std::vector<Res> result;
-  result.reserve(blocks.size());
 
+  std::unordered_map<uint32_t, size_t> word_idx;
+  word_idx.reserve(blocks.size());
   for (const auto &b : blocks) {
-    bool found = false;
-    for (auto &r : result) {
-      if (r.first == b.interpolation) {
-        r.second++;
-        found = true;
-        break;
-      }
-    }
-
-    if (!found) {
-      result.push_back(std::make_pair(b.interpolation, 1));
+    auto it = word_idx.insert(std::make_pair(b.interpolation, result.size())).first;
+    if (it->second == result.size()) {
+      result.push_back(std::make_pair(b.interpolation, 0));
     }
+    result[it->second].second++;
   }
 
   std::sort(result.begin(), result.end(), [](const Res &a, const Res &b) {
-    return std::greater<size_t>()(a.second, b.second);
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
   });
 
   return std::move(result);
 }
 
-static std::vector<LogicalDXTBlock> KMeansBlocks(const std::vector<PhysicalDXTBlock> &blocks,
-                                                 size_t num_clusters) {
-  // Generate num_clusters random logical blocks
-  std::vector<LogicalDXTBlock> clusters;
-  clusters.reserve(num_clusters);
+// The points of KMeansBlocks are the sixteen indices of a block, and the
+// clusters are kept as floats so that their distances can be measured four
+// indices at a time.
+static const size_t kClusterDims = 16;
+
+static float ClusterDistSqScalar(const float *a, const float *b) {
+  float dist = 0.0f;
+  for (size_t i = 0; i < kClusterDims; ++i) {
+    const float d = a[i] - b[i];
+    dist += d * d;
+  }
+  return dist;
+}
+
+#ifdef GENTC_SIMD_X86
+GENTC_TARGET("sse4.1")
+static float ClusterDistSqSSE41(const float *a, const float *b) {
+  __m128 sum = _mm_setzero_ps();
+  for (size_t i = 0; i < kClusterDims; i += 4) {
+    const __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+  }
+
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(sum);
+}
 
-  std::default_random_engine gen(
-    static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count()));
-  std::uniform_int_distribution<unsigned> dist(0, static_cast<unsigned>(blocks.size() - 1));
+// Finds the closest and second closest clusters to a point
+GENTC_TARGET("sse4.1")
+static void NearestClustersSSE41(const float *point, const float *clusters, size_t num_clusters,
+                                 uint32_t *nearest, float *nearest_dist, float *second_dist) {
+  const __m128 p0 = _mm_loadu_ps(point + 0);
+  const __m128 p1 = _mm_loadu_ps(point + 4);
+  const __m128 p2 = _mm_loadu_ps(point + 8);
+  const __m128 p3 = _mm_loadu_ps(point + 12);
+
+  *nearest = 0;
+  *nearest_dist = std::numeric_limits<float>::max();
+  *second_dist = std::numeric_limits<float>::max();
+  for (size_t c = 0; c < num_clusters; ++c) {
+    const float *cluster = clusters + c * kClusterDims;
+    const __m128 d0 = _mm_sub_ps(p0, _mm_loadu_ps(cluster + 0));
+    const __m128 d1 = _mm_sub_ps(p1, _mm_loadu_ps(cluster + 4));
+    const __m128 d2 = _mm_sub_ps(p2, _mm_loadu_ps(cluster + 8));
+    const __m128 d3 = _mm_sub_ps(p3, _mm_loadu_ps(cluster + 12));
+
+    // Same order of additions as ClusterDistSqSSE41
+    __m128 sum = _mm_mul_ps(d0, d0);
+    sum = _mm_add_ps(sum, _mm_mul_ps(d1, d1));
+    sum = _mm_add_ps(sum, _mm_mul_ps(d2, d2));
+    sum = _mm_add_ps(sum, _mm_mul_ps(d3, d3));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+
+    const float dist = _mm_cvtss_f32(sum);
+    if (dist < *nearest_dist) {
+      *second_dist = *nearest_dist;
+      *nearest_dist = dist;
+      *nearest = static_cast<uint32_t>(c);
+    } else if (dist < *second_dist) {
+      *second_dist = dist;
+    }
+  }
+}
+#endif  // GENTC_SIMD_X86
 
+static float ClusterDist(const float *a, const float *b, bool use_sse41) {
+#ifdef GENTC_SIMD_X86
+  if (use_sse41) {
+    return std::sqrt(ClusterDistSqSSE41(a, b));
+  }
+#else
+  (void)(use_sse41);
+#endif
+  return std::sqrt(ClusterDistSqScalar(a, b));
+}
+
+static void NearestClusters(const float *point, const float *clusters, size_t num_clusters,
+                            bool use_sse41, uint32_t *nearest, float *nearest_dist,
+                            float *second_dist) {
+#ifdef GENTC_SIMD_X86
+  if (use_sse41) {
+    NearestClustersSSE41(point, clusters, num_clusters, nearest, nearest_dist, second_dist);
+  } else
+#else
+  (void)(use_sse41);
+#endif
+  {
+    *nearest = 0;
+    *nearest_dist = std::numeric_limits<float>::max();
+    *second_dist = std::numeric_limits<float>::max();
+    for (size_t c = 0; c < num_clusters; ++c) {
+      const float dist = ClusterDistSqScalar(point, clusters + c * kClusterDims);
+      if (dist < *nearest_dist) {
+        *second_dist = *nearest_dist;
+        *nearest_dist = dist;
+        *nearest = static_cast<uint32_t>(c);
+      } else if (dist < *second_dist) {
+        *second_dist = dist;
+      }
+    }
+  }
+
+  *nearest_dist = std::sqrt(*nearest_dist);
+  *second_dist = std::sqrt(*second_dist);
+}
+
+// Clusters the index words of the blocks with Lloyd's k-means, seeded with
+// the num_clusters most used words. Blocks with the same word are the same
+// point, so each distinct word is clustered once, weighted by its number of
+// blocks. Following Hamerly, every word keeps an upper bound on the distance
+// to its cluster and a lower bound on the distance to any other one, and is
+// only measured against all of the clusters when the bounds don't settle it.
+// The words are assigned in parallel on one pool that lives as long as the
+// clustering. The sums of the clusters are exact integers, so the result
+// doesn't depend on the number of threads.
+std::vector<LogicalDXTBlock> KMeansBlocks(const std::vector<PhysicalDXTBlock> &blocks,
+                                          size_t num_clusters, size_t num_threads,
+                                          ans::simd::EInstructionSet set) {
   std::vector<std::pair<uint32_t, size_t> > counted_indices = CountBlocks(blocks);
   std::cout << "Num unique index blocks: " << counted_indices.size() << std::endl;
 
@@ -985,143 +1480,163 @@ static std::vector<LogicalDXTBlock> KMeansBlocks(const std::vector<PhysicalDXTBl
 
   std::cout << "Num duplicated indices: " << num_duplicated << std::endl;
 
-  while (clusters.size() < num_clusters) {
-
-    LogicalDXTBlock blk;
-    memset(&blk, 0, sizeof(blk));
-
-    //////////
-    /// Choose cluster samples as first most-used 
-    ///
+  // Choose cluster samples as the most used words
+  num_clusters = std::min(num_clusters, counted_indices.size());
+  const size_t num_points = counted_indices.size();
+  std::vector<float> points(num_points * kClusterDims);
+  for (size_t i = 0; i < num_points; ++i) {
     PhysicalDXTBlock pblk;
-    pblk.interpolation = counted_indices[clusters.size()].first;
-    memcpy(blk.indices, PhysicalToLogical(pblk).indices, sizeof(blk.indices));
-
-    //////////
-    /// Choose cluster samples as sampling of existing index values
-    ///
-    // memcpy(blk.indices, PhysicalToLogical(blocks[dist(gen)]).indices, sizeof(blk.indices));
-
-    //////////
-    /// Choose a stratified initial distribution of clusters
-    ///
-    //for (int i = 0; i < 8; ++i) {
-    //  uint8_t blk0[2] = { 0xFF, 0x00 };
-    //  uint8_t blk1[2] = { 0x00, 0xFF };
-
-    //  if ((clusters.size() >> i) & 0x1) {
-    //    blk.indices[2 * i + 0] = blk0[0];
-    //    blk.indices[2 * i + 1] = blk0[1];
-    //  } else {
-    //    blk.indices[2 * i + 0] = blk1[0];
-    //    blk.indices[2 * i + 1] = blk1[1];
-    //  }
-    //}
-
-    //////////
-    /// Choose a random initial distribution of clusters
-    ///
-    //for (int i = 0; i < 16; ++i) {
-    //  blk.indices[i] = dist(gen);
-    //  assert(blk.indices[i] < 4);
-    //}
-
-    //// If we already have this seeded cluster, then generate a new one...
-    //if (std::find(clusters.begin(), clusters.end(), blk) != clusters.end()) {
-    //  continue;
-    //}
-
-    clusters.push_back(blk);
+    pblk.dxt_block = 0;
+    pblk.interpolation = counted_indices[i].first;
+    const LogicalDXTBlock lblk = PhysicalToLogical(pblk);
+    for (size_t j = 0; j < kClusterDims; ++j) {
+      points[i * kClusterDims + j] = static_cast<float>(lblk.indices[j]);
+    }
   }
 
-  // Allocate data for k-means
-  std::vector<std::vector<double> > old_clusters
-    (clusters.size(), std::vector<double>(16, 0.0));
-  std::vector<std::vector<double> > new_clusters
-    (clusters.size(), std::vector<double>(16, 0.0));
-  std::vector<size_t> cluster_idx(blocks.size(), 0);
-  std::vector<double> tmp(16, 0.0);
-
-  // Get old clusters from initial clusters...
-  for (size_t i = 0; i < num_clusters; ++i) {
-    for (size_t j = 0; j < 16; ++j) {
-      old_clusters[i][j] = static_cast<double>(clusters[i].indices[j]);
+  std::vector<float> centers(points.begin(), points.begin() + num_clusters * kClusterDims);
+  std::vector<float> new_centers(centers.size());
+  std::vector<float> shifts(num_clusters);
+  std::vector<float> half_gaps(num_clusters);
+  std::vector<uint64_t> sums(num_clusters * kClusterDims);
+  std::vector<uint64_t> weights(num_clusters);
+
+  std::vector<uint32_t> assignment(num_points);
+  std::vector<float> upper(num_points);
+  std::vector<float> lower(num_points);
+
+  const bool use_sse41 = UseSSE41(set);
+  std::unique_ptr<ctpl::thread_pool> pool = CreatePool(num_threads);
+  ParallelForRanges(pool.get(), num_points, [&](size_t start, size_t end) {
+    for (size_t i = start; i < end; ++i) {
+      NearestClusters(points.data() + i * kClusterDims, centers.data(), num_clusters, use_sse41,
+                      &assignment[i], &upper[i], &lower[i]);
     }
-  }
+  });
 
   // Do until fixed point...
   for (;;) {
-
-    // Assign each block to a cluster
-    EuclideanVPTree vp_tree;
-    vp_tree.addMany(old_clusters.begin(), old_clusters.end());
-
-    for (size_t i = 0; i < blocks.size(); ++i) {
-      for (size_t j = 0; j < 16; ++j) {
-        tmp[j] = static_cast<double>(PhysicalToLogical(blocks[i]).indices[j]);
+    // Move each cluster to the mean of its words. Clusters that lose all of
+    // their words stay where they are, and are dropped at the end.
+    std::fill(sums.begin(), sums.end(), 0);
+    std::fill(weights.begin(), weights.end(), 0);
+    for (size_t i = 0; i < num_points; ++i) {
+      const size_t weight = counted_indices[i].second;
+      weights[assignment[i]] += weight;
+      for (size_t j = 0; j < kClusterDims; ++j) {
+        sums[assignment[i] * kClusterDims + j] +=
+          weight * static_cast<uint64_t>(points[i * kClusterDims + j]);
       }
+    }
 
-      const std::vector<double> *closest = vp_tree.nearestNeighbors(tmp)[0];
+    float max_shift = 0.0f;
+    float second_max_shift = 0.0f;
+    size_t max_shift_cluster = 0;
+    for (size_t c = 0; c < num_clusters; ++c) {
+      for (size_t j = 0; j < kClusterDims; ++j) {
+        new_centers[c * kClusterDims + j] = (0 == weights[c])
+          ? centers[c * kClusterDims + j]
+          : static_cast<float>(static_cast<double>(sums[c * kClusterDims + j]) /
+                               static_cast<double>(weights[c]));
+      }
 
-      auto closest_itr = std::find(old_clusters.begin(), old_clusters.end(), *closest);
-      size_t idx = closest_itr - old_clusters.begin();
-      assert(idx < blocks.size());
-      cluster_idx[i] = idx;
+      shifts[c] = ClusterDist(centers.data() + c * kClusterDims,
+                              new_centers.data() + c * kClusterDims, use_sse41);
+      if (shifts[c] > max_shift) {
+        second_max_shift = max_shift;
+        max_shift = shifts[c];
+        max_shift_cluster = c;
+      } else if (shifts[c] > second_max_shift) {
+        second_max_shift = shifts[c];
+      }
     }
-
-    // Generate new clusters based on the index of each cluster...
-    size_t cidx = 0;
-    for (size_t c = 0; c < clusters.size(); ++c) {
-      tmp.assign(16, 0.0);
-      double cluster_sz = 0.0;
-      for (size_t b = 0; b < blocks.size(); ++b) {
-        if (cluster_idx[b] == c) {
-          for (size_t i = 0; i < 16; ++i) {
-            tmp[i] += static_cast<double>(PhysicalToLogical(blocks[b]).indices[i]);
+    centers.swap(new_centers);
+
+    // A word is closer to its own cluster than any other if it's within half
+    // the distance to the nearest other cluster.
+    ParallelForRanges(pool.get(), num_clusters, [&](size_t start, size_t end) {
+      for (size_t c = start; c < end; ++c) {
+        float gap = std::numeric_limits<float>::max();
+        for (size_t other = 0; other < num_clusters; ++other) {
+          if (other != c) {
+            gap = std::min(gap, ClusterDist(centers.data() + c * kClusterDims,
+                                            centers.data() + other * kClusterDims, use_sse41));
           }
-
-          cluster_sz += 1.0;
         }
+        half_gaps[c] = 0.5f * gap;
       }
+    });
 
-      if (0.0 != cluster_sz) {
-        for (size_t i = 0; i < 16; ++i) {
-          tmp[i] /= cluster_sz;
+    std::atomic<size_t> num_changed(0);
+    ParallelForRanges(pool.get(), num_points, [&](size_t start, size_t end) {
+      size_t changed = 0;
+      for (size_t i = start; i < end; ++i) {
+        const uint32_t a = assignment[i];
+        const float *point = points.data() + i * kClusterDims;
+        upper[i] += shifts[a];
+        lower[i] -= (a == max_shift_cluster) ? second_max_shift : max_shift;
+
+        const float bound = std::max(half_gaps[a], lower[i]);
+        if (upper[i] <= bound) {
+          continue;
         }
 
-        new_clusters[cidx].assign(tmp.begin(), tmp.end());
-        cidx++;
-      }
-    }
+        upper[i] = ClusterDist(point, centers.data() + a * kClusterDims, use_sse41);
+        if (upper[i] <= bound) {
+          continue;
+        }
 
-    bool fixed_point = cidx == old_clusters.size();
-    for (size_t i = 0; i < cidx && fixed_point; ++i) {
-      fixed_point = old_clusters[i] == new_clusters[i];
-    }
+        NearestClusters(point, centers.data(), num_clusters, use_sse41,
+                        &assignment[i], &upper[i], &lower[i]);
+        changed += (assignment[i] != a) ? 1 : 0;
+      }
+      num_changed += changed;
+    });
 
-    if (fixed_point) {
+    if (0 == num_changed) {
       break;
     }
+  }
 
-    // Not fixed point, so set each old cluster to a new cluster...
-    for (size_t i = 0; i < cidx; ++i) {
-      old_clusters[i].assign(new_clusters[i].begin(), new_clusters[i].end());
+  // Create discrete clusters by rounding continuous clusters, leaving out
+  // the ones without any blocks
+  std::vector<LogicalDXTBlock> clusters;
+  clusters.reserve(num_clusters);
+  for (size_t c = 0; c < num_clusters; ++c) {
+    if (0 == weights[c]) {
+      continue;
     }
-    old_clusters.resize(cidx);
-  }
 
-  // Create discrete clusters by rounding continuous clusters
-  for (size_t i = 0; i < old_clusters.size(); ++i) {
-    for (size_t j = 0; j < 16; ++j) {
-      clusters[i].indices[j] = static_cast<uint8_t>(old_clusters[i][j] + 0.5);
-      assert(0 <= clusters[i].indices[j] && clusters[i].indices[j] < 4);
+    LogicalDXTBlock blk;
+    memset(&blk, 0, sizeof(blk));
+    for (size_t j = 0; j < kClusterDims; ++j) {
+      blk.indices[j] = static_cast<uint8_t>(centers[c * kClusterDims + j] + 0.5f);
+      assert(blk.indices[j] < 4);
     }
+    clusters.push_back(blk);
   }
 
-  clusters.resize(old_clusters.size());
   return std::move(clusters);
 }
 
+#ifdef PREDICT_VPTREE
+
+static double BlockDist(const LogicalDXTBlock &p1, const LogicalDXTBlock &p2) {
+  // The indices are ordered like 0, 3, 1, 2
+  static const uint8_t idx_to_order[4] = { 0, 3, 1, 2 };
+
+  double dist = 0.0;
+  for (size_t i = 0; i < 16; ++i) {
+    double x = static_cast<double>(idx_to_order[p1.indices[i]]);
+    double y = static_cast<double>(idx_to_order[p2.indices[i]]);
+
+    double err = x - y;
+    dist += err * err;
+  }
+
+  return dist;
+}
+
 class IndexVPTree : public VPTree<LogicalDXTBlock> {
  protected:
   double distance(const LogicalDXTBlock &p1, const LogicalDXTBlock &p2) override {
@@ -1226,7 +1741,8 @@ DXTImage::PredictIndicesLinearize(int chunk_width, int chunk_height) const {
   return std::move(symbols);
 }
 
-void DXTImage::ReassignIndices(int mse_threshold) {
+void DXTImage::ReassignIndices(int mse_threshold, size_t num_threads,
+                               ans::simd::EInstructionSet set) {
   if (_src_img.size() == 0) {
     std::cout << "WARNING: Cannot reassign DXT indices without source data" << std::endl;
     assert(false);
@@ -1243,72 +1759,126 @@ void DXTImage::ReassignIndices(int mse_threshold) {
     for (int x = 0; x < _blocks_width; ++x) {
       int block_idx = y * _blocks_width + x;
       CompressedBlock &blk = blocks[block_idx];
-
-      for (int row = 0; row < 4; ++row) {
-        int row_idx = ((4 * y + row) * _width + (4 * x)) * 3;
-        blk._uncompressed.insert(
-          blk._uncompressed.end(),
-          _src_img.begin() + row_idx,
-          _src_img.begin() + row_idx + 12);
-      }
-
+      GetSourceBlock(x, y, blk._uncompressed);
       blk._logical = LogicalBlocks()[block_idx];
     }
   }
 
-  // For each block, see if we can reassign its index: search through
-  // all of the other indices and measure it against the current index. If we
-  // find one that's not as bad w.r.t. the current one, then switch the index...
-
-  int idx = 0;
-  for (auto &block : blocks) {
-    idx++;
-    size_t min_MSE = mse_threshold;
-    std::pair<uint32_t, size_t> *cnt_ptr = nullptr;
-    std::pair<uint32_t, size_t> *orig_cnt_ptr = nullptr;
-
-    PhysicalDXTBlock pb = LogicalToPhysical(block._logical);
-    assert(PhysicalToLogical(pb) == block._logical);
-    
-    for (auto &cnt : counted_indices) {
-      if (cnt.second == 0) {
-        continue;
-      }
+  // For each block, see if we can reassign its index: measure the index words
+  // with the most similar indices against the current one. The blocks are
+  // measured in parallel, and each one keeps the words that would do, best
+  // first. Words that are equally good keep their order in counted_indices,
+  // so the result doesn't depend on the threads.
+  static const size_t kNumCandidates = 32;
+  PaletteIndex word_index;
+  for (const auto &cnt : counted_indices) {
+    word_index.Add(cnt.first);
+  }
 
-      if (pb.interpolation == cnt.first) {
-        orig_cnt_ptr = &cnt;
-        continue;
-      }
+  // Each candidate only changes the indices of the block, so they're
+  // measured a few at a time.
+  static const size_t kBatchSz = 4;
+  const bool use_sse41 = UseSSE41(set);
 
-      PhysicalDXTBlock npb = pb;
-      npb.interpolation = cnt.first;
-      LogicalDXTBlock lb = PhysicalToLogical(npb);
+  // The choices of each block are kept in its own run of kNumCandidates
+  // entries of one array, with the number of them in num_choices.
+  struct Choice {
+    uint32_t mse;
+    uint32_t id;
+
+    bool operator<(const Choice &other) const {
+      return mse != other.mse ? mse < other.mse : id < other.id;
+    }
+  };
+  std::vector<Choice> choices(blocks.size() * kNumCandidates);
+  std::vector<uint8_t> num_choices(blocks.size(), 0);
+  std::vector<uint32_t> orig_words(blocks.size());
+  std::unique_ptr<ctpl::thread_pool> pool = CreatePool(num_threads);
+  ParallelForRanges(pool.get(), blocks.size(), [&](size_t start, size_t end) {
+    uint32_t nearest[kNumCandidates + 1];
+    for (size_t block_idx = start; block_idx < end; ++block_idx) {
+      CompressedBlock &block = blocks[block_idx];
+      const PhysicalDXTBlock &pb = _physical_blocks[block_idx];
+
+      // The block's own word is always the nearest, so look for one more
+      const size_t num_nearest = word_index.Nearest(pb.interpolation, kNumCandidates + 1, nearest);
+      std::sort(nearest, nearest + num_nearest);
+
+      Choice *block_choices = choices.data() + block_idx * kNumCandidates;
+      uint8_t &num_block_choices = num_choices[block_idx];
+      for (size_t batch = 0; batch < num_nearest; batch += kBatchSz) {
+        uint32_t candidates[kBatchSz];
+        uint32_t candidate_ids[kBatchSz];
+        size_t batch_sz = 0;
+        for (size_t k = batch; k < std::min(num_nearest, batch + kBatchSz); ++k) {
+          if (counted_indices[nearest[k]].first == pb.interpolation) {
+            orig_words[block_idx] = nearest[k];
+            continue;
+          }
+
+          candidates[batch_sz] = counted_indices[nearest[k]].first;
+          candidate_ids[batch_sz++] = nearest[k];
+        }
+
+        if (0 == batch_sz) {
+          continue;
+        }
 
-      size_t mse = block.CompareAgainst(lb);
-      if (mse < min_MSE) {
-        block._logical = lb;
-        min_MSE = mse;
-        cnt_ptr = &cnt;
+        int errs[kBatchSz];
+        bool keeps[kBatchSz];
+        block.EvaluateIndices(candidates, batch_sz, use_sse41, errs, keeps);
+
+        for (size_t k = 0; k < batch_sz; ++k) {
+          const uint32_t mse = static_cast<uint32_t>(errs[k]);
+          if (keeps[k] && mse < static_cast<uint32_t>(mse_threshold)) {
+            assert(num_block_choices < kNumCandidates);
+            block_choices[num_block_choices].mse = mse;
+            block_choices[num_block_choices++].id = candidate_ids[k];
+          }
+        }
       }
+
+      assert(counted_indices[orig_words[block_idx]].first == pb.interpolation);
+      std::sort(block_choices, block_choices + num_block_choices);
     }
+  });
 
-    assert(orig_cnt_ptr);
+  // Then the blocks take the best word that is still in use, in order, so
+  // that words that lose all of their blocks aren't brought back...
+  std::vector<bool> reassigned(blocks.size(), false);
+  for (size_t block_idx = 0; block_idx < blocks.size(); ++block_idx) {
+    const Choice *block_choices = choices.data() + block_idx * kNumCandidates;
+    for (size_t k = 0; k < num_choices[block_idx]; ++k) {
+      std::pair<uint32_t, size_t> &cnt = counted_indices[block_choices[k].id];
+      if (cnt.second == 0) {
+        continue;
+      }
 
-    if (min_MSE < static_cast<size_t>(mse_threshold)) {
-      assert(cnt_ptr);
+      counted_indices[orig_words[block_idx]].second--;
+      cnt.second++;
 
-      orig_cnt_ptr->second--;
-      cnt_ptr->second++;
-      block.RecalculateEndpoints();
+      PhysicalDXTBlock npb = _physical_blocks[block_idx];
+      npb.interpolation = cnt.first;
+      blocks[block_idx]._logical = PhysicalToLogical(npb);
+      reassigned[block_idx] = true;
+      break;
     }
   }
 
-  // Reassign blocks
-  for (size_t i = 0; i < _logical_blocks.size(); ++i) {
-    _logical_blocks[i] = blocks[i]._logical;
-  }
+  // ... and the endpoints of the blocks that changed are fit to their new
+  // indices. Only words that keep their indices after the fit were chosen,
+  // so the blocks end up with the words that were counted for them.
+  ParallelForRanges(pool.get(), blocks.size(), [&](size_t start, size_t end) {
+    for (size_t block_idx = start; block_idx < end; ++block_idx) {
+      if (!reassigned[block_idx]) {
+        continue;
+      }
 
-  _physical_blocks = LogicalToPhysicalBlocks(_logical_blocks);
+      blocks[block_idx].RecalculateEndpoints();
+      _logical_blocks[block_idx] = blocks[block_idx]._logical;
+      _physical_blocks[block_idx] = LogicalToPhysical(blocks[block_idx]._logical);
+    }
+  });
 }
 
 }  // namespace GenTC
@@ -7,6 +7,7 @@
 #include <memory>
 #include <vector>
 
+#include "ans_simd.h"
 #include "image.h"
 
 namespace GenTC {
@@ -36,6 +37,24 @@ namespace GenTC {
     }
   };
 
+  // Clusters the index words of the blocks into at most num_clusters
+  // clusters with k-means, and at most one cluster per distinct word. Uses
+  // num_threads threads, or one per core if it's zero, and SSE4.1 unless set
+  // is scalar or the host doesn't have it. Only the indices of the result
+  // are set.
+  std::vector<LogicalDXTBlock> KMeansBlocks(
+    const std::vector<PhysicalDXTBlock> &blocks, size_t num_clusters, size_t num_threads = 0,
+    ans::simd::EInstructionSet set = ans::simd::GetBestInstructionSet());
+
+  // Fits the endpoints of a block with the 4x4 RGB pixels, in raster order,
+  // to each of the num candidate index words, and writes out the error of
+  // the fit to errs. keeps[i] is false if the endpoints can only be stored
+  // by swapping them, which flips the indices. Uses SSE4.1 unless set is
+  // scalar or the host doesn't have it, with the same results either way.
+  void EvaluateIndexWords(const uint8_t pixels[48], const uint32_t *candidates, size_t num,
+                          int *errs, bool *keeps,
+                          ans::simd::EInstructionSet set = ans::simd::GetBestInstructionSet());
+
   class DXTImage {
    public:
     DXTImage(const char *orig_fn, const char *cmp_fn);
@@ -91,16 +110,37 @@ namespace GenTC {
     std::vector<uint8_t> PredictIndices(int chunk_width, int chunk_height) const;
     std::vector<uint8_t> PredictIndicesLinearize(int chunk_width, int chunk_height) const;
 
-    void ReassignIndices(int mse_threshold);
+    // Moves each block to the index word of another block, if the block
+    // still has an error below mse_threshold with its endpoints fit to that
+    // word, and refits the endpoints of the blocks that moved. Only words
+    // that are already in use are taken. Uses num_threads threads, or one
+    // per core if it's zero, and SSE4.1 unless set is scalar or the host
+    // doesn't have it. The result doesn't depend on either.
+    void ReassignIndices(int mse_threshold, size_t num_threads = 0,
+                         ans::simd::EInstructionSet set = ans::simd::GetBestInstructionSet());
 
     std::vector<uint8_t> PaletteData() const;
+
+    // The palette index of each block as a difference from the index of the
+    // block before it, biased by 128. A zero is a long-range reference
+    // instead: the block takes the next index of IndexRefs(), and the blocks
+    // after it count from there.
     const std::vector<uint8_t> &IndexDiffs() const { return _indices; }
+    const std::vector<uint32_t> &IndexRefs() const { return _index_refs; }
+
+    // The 8-bit RGB pixels that the blocks were compressed from. Empty if
+    // the image was made from DXT blocks alone.
+    const std::vector<uint8_t> &SourceImage() const { return _src_img; }
 
   private:
     uint32_t BlockAt(int x, int y) const {
       return (y / 4) * _blocks_width + (x / 4);
     }
 
+    // The 4x4 RGB pixels of the source image that block (block_x, block_y)
+    // covers, in raster order.
+    void GetSourceBlock(int block_x, int block_y, uint8_t out[48]) const;
+
     void Reencode();
     double PSNR() const;
 
@@ -114,6 +154,7 @@ namespace GenTC {
 
     std::vector<uint32_t> _index_palette;
     std::vector<uint8_t> _indices;
+    std::vector<uint32_t> _index_refs;
 
     std::vector<uint8_t> _src_img;
   };
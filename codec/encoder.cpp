@@ -9,8 +9,12 @@
 #include "image_utils.h"
 #include "pipeline.h"
 #include "entropy.h"
+#include "tile_index.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cstring>
 #include <iostream>
 
 #include "ans.h"
@@ -18,7 +22,7 @@
 namespace GenTC {
 
 template <typename T> std::unique_ptr<std::vector<uint8_t> >
-RunDXTEndpointPipeline(const std::unique_ptr<Image<T> > &img) {
+RunDXTEndpointPipeline(const std::unique_ptr<Image<T> > &img, ECoefficientOrder order) {
   static_assert(PixelTraits::NumChannels<T>::value,
     "This should operate on each DXT endpoing channel separately");
 
@@ -30,19 +34,89 @@ RunDXTEndpointPipeline(const std::unique_ptr<Image<T> > &img) {
     ::Create(FWavelet2D<T, kWaveletBlockDim>::New())
     ->Chain(MakeUnsigned<WaveletSignedTy>::New())
     ->Chain(Linearize<WaveletUnsignedTy>::New())
-    ->Chain(RearrangeStream<WaveletUnsignedTy>::New(img->Width(), kWaveletBlockDim))
+    ->Chain(RearrangeStream<WaveletUnsignedTy>::New(img->Width(), kWaveletBlockDim,
+      (eCoefficientOrder_Bands == order) ? kCoarsestBandDim : 0))
     ->Chain(ReducePrecision<WaveletUnsignedTy, uint8_t>::New());
 
   return std::move(pipeline->Run(img));
 }
 
-static std::vector<uint8_t> CompressDXTImage(const DXTImage &dxt_img) {
-  // Otherwise we can't really compress this...
-  assert((dxt_img.Width() % 128) == 0);
-  assert((dxt_img.Height() % 128) == 0);
+// The byte streams of a texture in EStreamType order, before entropy coding.
+typedef std::array<std::unique_ptr<std::vector<uint8_t> >, kNumStreamTypes> SymbolStreams;
+
+// Concatenates the planes of a stream. Planes in band order are spliced
+// together a band at a time so that the coarse bands of all of them come
+// first, in the order of BandOrderIndex.
+static std::unique_ptr<std::vector<uint8_t> >
+ConcatenatePlanes(const std::vector<const std::vector<uint8_t> *> &planes, ECoefficientOrder order,
+                  size_t num_tiles) {
+  std::unique_ptr<std::vector<uint8_t> > result(new std::vector<uint8_t>);
+  if (eCoefficientOrder_Tiles == order) {
+    for (const auto plane : planes) {
+      result->insert(result->end(), plane->begin(), plane->end());
+    }
+    return std::move(result);
+  }
+
+  for (size_t end = kCoarsestBandDim; end <= kWaveletBlockDim; end *= 2) {
+    const size_t begin = (kCoarsestBandDim == end) ? 0 : end / 2;
+    const size_t band_offset = num_tiles * begin * begin;
+    const size_t band_sz = num_tiles * (end * end - begin * begin);
+    for (const auto plane : planes) {
+      assert(band_offset + band_sz <= plane->size());
+      result->insert(result->end(), plane->begin() + band_offset,
+                     plane->begin() + band_offset + band_sz);
+    }
+  }
+  return std::move(result);
+}
+
+// Textures are coded in whole wavelet blocks, so the endpoints and index
+// differences of textures whose blocks don't fill them are padded out.
+static size_t CodedBlocks(size_t num_blocks) {
+  return ((num_blocks + kWaveletBlockDim - 1) / kWaveletBlockDim) * kWaveletBlockDim;
+}
+
+// Repeats the last column and row of endpoints into the padding. The padding
+// is then flat, so its wavelet detail coefficients are all zero.
+static std::unique_ptr<RGB565Image> PadEndpoints(std::unique_ptr<RGB565Image> &&img) {
+  const size_t width = CodedBlocks(img->Width());
+  const size_t height = CodedBlocks(img->Height());
+  if (width == img->Width() && height == img->Height()) {
+    return std::move(img);
+  }
+
+  std::unique_ptr<RGB565Image> result(new RGB565Image(width, height));
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      result->SetAt(x, y, img->GetAt(std::min(x, img->Width() - 1),
+                                     std::min(y, img->Height() - 1)));
+    }
+  }
+  return std::move(result);
+}
+
+// The padding blocks reuse the palette index of the block before them, so
+// their differences are all zero (128 once biased) and the differences of
+// the real blocks stay the same.
+static std::vector<uint8_t> PadIndexDiffs(const std::vector<uint8_t> &diffs,
+                                          size_t blocks_x, size_t blocks_y) {
+  const size_t coded_x = CodedBlocks(blocks_x);
+  const size_t coded_y = CodedBlocks(blocks_y);
+  assert(diffs.size() == blocks_x * blocks_y);
+
+  std::vector<uint8_t> result(coded_x * coded_y, 128);
+  for (size_t y = 0; y < blocks_y; ++y) {
+    std::copy(diffs.begin() + y * blocks_x, diffs.begin() + (y + 1) * blocks_x,
+              result.begin() + y * coded_x);
+  }
+  return std::move(result);
+}
 
-  auto endpoint_one = dxt_img.EndpointOneValues();
-  auto endpoint_two = dxt_img.EndpointTwoValues();
+static SymbolStreams PrepareStreams(const DXTImage &dxt_img, const ans::ocl::Geometry &geom,
+                                    ECoefficientOrder order) {
+  auto endpoint_one = PadEndpoints(dxt_img.EndpointOneValues());
+  auto endpoint_two = PadEndpoints(dxt_img.EndpointTwoValues());
 
   assert(endpoint_one->Width() == endpoint_two->Width());
   assert(endpoint_one->Height() == endpoint_two->Height());
@@ -56,92 +130,153 @@ static std::vector<uint8_t> CompressDXTImage(const DXTImage &dxt_img) {
   auto ep2_planes = initial_endpoint_pipeline->Run(endpoint_two);
 
   std::cout << "Processing Y plane for EP 1... ";
-  auto ep1_y_cmp = RunDXTEndpointPipeline(std::get<0>(*ep1_planes));
+  auto ep1_y_cmp = RunDXTEndpointPipeline(std::get<0>(*ep1_planes), order);
   std::cout << "Done. " << std::endl;
 
   std::cout << "Processing Co plane for EP 1... ";
-  auto ep1_co_cmp = RunDXTEndpointPipeline(std::get<1>(*ep1_planes));
+  auto ep1_co_cmp = RunDXTEndpointPipeline(std::get<1>(*ep1_planes), order);
   std::cout << "Done. " << std::endl;
 
   std::cout << "Processing Cg plane for EP 1... ";
-  auto ep1_cg_cmp = RunDXTEndpointPipeline(std::get<2>(*ep1_planes));
+  auto ep1_cg_cmp = RunDXTEndpointPipeline(std::get<2>(*ep1_planes), order);
   std::cout << "Done. " << std::endl;
 
   std::cout << "Processing Y plane for EP 2... ";
-  auto ep2_y_cmp = RunDXTEndpointPipeline(std::get<0>(*ep2_planes));
+  auto ep2_y_cmp = RunDXTEndpointPipeline(std::get<0>(*ep2_planes), order);
   std::cout << "Done. " << std::endl;
 
   std::cout << "Processing Co plane for EP 2... ";
-  auto ep2_co_cmp = RunDXTEndpointPipeline(std::get<1>(*ep2_planes));
+  auto ep2_co_cmp = RunDXTEndpointPipeline(std::get<1>(*ep2_planes), order);
   std::cout << "Done. " << std::endl;
 
   std::cout << "Processing Cg plane for EP 2... ";
-  auto ep2_cg_cmp = RunDXTEndpointPipeline(std::get<2>(*ep2_planes));
+  auto ep2_cg_cmp = RunDXTEndpointPipeline(std::get<2>(*ep2_planes), order);
   std::cout << "Done. " << std::endl;
 
-  auto cmp_pipeline =
-    Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
-    ::Create(ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols));
+  SymbolStreams streams;
+  const size_t num_tiles = (endpoint_one->Width() / kWaveletBlockDim) *
+    (endpoint_one->Height() / kWaveletBlockDim);
 
   // Concatenate Y planes
-  ep1_y_cmp->insert(ep1_y_cmp->end(), ep2_y_cmp->begin(), ep2_y_cmp->end());
-  std::cout << "Compressing luma planes (" << ep1_y_cmp->size() << " bytes)...";
-  auto y_planes = cmp_pipeline->Run(ep1_y_cmp);
-  std::cout << "Done. (" << y_planes->size() << " bytes)" << std::endl;
+  streams[eStreamType_Y] =
+    std::move(ConcatenatePlanes({ ep1_y_cmp.get(), ep2_y_cmp.get() }, order, num_tiles));
 
   // Concatenate Chroma planes
-  ep1_co_cmp->insert(ep1_co_cmp->end(), ep1_cg_cmp->begin(), ep1_cg_cmp->end());
-  ep1_co_cmp->insert(ep1_co_cmp->end(), ep2_co_cmp->begin(), ep2_co_cmp->end());
-  ep1_co_cmp->insert(ep1_co_cmp->end(), ep2_cg_cmp->begin(), ep2_cg_cmp->end());
-  std::cout << "Compressing chroma planes (" << ep1_co_cmp->size() << " bytes)...";
-  auto chroma_planes = cmp_pipeline->Run(ep1_co_cmp);
-  std::cout << "Done. (" << chroma_planes->size() << " bytes)" << std::endl;
+  streams[eStreamType_Chroma] = std::move(ConcatenatePlanes(
+    { ep1_co_cmp.get(), ep1_cg_cmp.get(), ep2_co_cmp.get(), ep2_cg_cmp.get() }, order, num_tiles));
 
   std::unique_ptr<std::vector<uint8_t> > palette_data(
     new std::vector<uint8_t>(std::move(dxt_img.PaletteData())));
   size_t palette_data_size = palette_data->size();
   std::cout << "Original palette data size: " << palette_data_size << std::endl;
-  static const size_t f =
-    ans::ocl::kNumEncodedSymbols * ans::ocl::kThreadsPerEncodingGroup;
+  const size_t f = geom.SymbolsPerGroup();
   size_t padding = ((palette_data_size + (f - 1)) / f) * f;
   std::cout << "Padded palette data size: " << padding << std::endl;
   palette_data->resize(padding, 0);
 
-  std::cout << "Compressing index palette... ";
-  auto palette_cmp = cmp_pipeline->Run(palette_data);
-  std::cout << "Done: " << palette_cmp->size() << " bytes" << std::endl;
+  // The long-range index references come right after the palette
+  for (uint32_t ref : dxt_img.IndexRefs()) {
+    for (size_t i = 0; i < 4; ++i) {
+      palette_data->push_back(static_cast<uint8_t>((ref >> (8 * i)) & 0xFF));
+    }
+  }
+  std::cout << "Long-range index references size: " << 4 * dxt_img.IndexRefs().size() << std::endl;
+  streams[eStreamType_Palette] = std::move(palette_data);
 
   std::unique_ptr<std::vector<uint8_t> > idx_data(
-    new std::vector<uint8_t>(dxt_img.IndexDiffs()));
-
+    new std::vector<uint8_t>(PadIndexDiffs(dxt_img.IndexDiffs(), dxt_img.BlocksWide(),
+                                           dxt_img.BlocksHigh())));
   std::cout << "Original index differences size: " << idx_data->size() << std::endl;
-  std::cout << "Compressing index differences... ";
-  auto idx_cmp = cmp_pipeline->Run(idx_data);
-  std::cout << "Done: " << idx_cmp->size() << " bytes" << std::endl;
+  streams[eStreamType_Indices] = std::move(idx_data);
+
+  // Every stream needs to fill a whole number of interleaved groups. The
+  // endpoint planes and index differences of textures smaller than a group
+  // are padded with zeros that the decoders never read.
+  for (const auto &stream : streams) {
+    stream->resize(((stream->size() + f - 1) / f) * f, 0);
+  }
+
+  return std::move(streams);
+}
+
+// Entropy codes each stream and lays out the compressed texture. Streams whose
+// table id is kInlineFreqTable get a table built from their own symbols that
+// is stored after the header. The others are coded with tables[id] from a
+// shared dictionary, and only the id is stored. The tile index, if any, comes
+// after the streams. The tile index needs the coefficients to be in tile order.
+// The streams are encoded on pool, which callers share across textures.
+static std::vector<uint8_t> EncodeStreams(const DXTImage &dxt_img, const SymbolStreams &streams,
+                                          const ans::ocl::Geometry &geom,
+                                          const uint32_t table_ids[kNumStreamTypes],
+                                          const std::vector<std::vector<uint32_t> > &tables,
+                                          bool build_tile_index, ECoefficientOrder order,
+                                          const std::shared_ptr<ctpl::thread_pool> &pool) {
+  assert(!build_tile_index || eCoefficientOrder_Tiles == order);
+
+  static const char *kStreamNames[kNumStreamTypes] = {
+    "luma planes", "chroma planes", "index palette", "index differences"
+  };
+
+  std::unique_ptr<std::vector<uint8_t> > cmp[kNumStreamTypes];
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    std::unique_ptr<ByteEncoder::Base> encoder;
+    if (kInlineFreqTable == table_ids[i]) {
+      encoder = ByteEncoder::Encoder(geom, std::vector<uint32_t>(), pool);
+    } else {
+      assert(table_ids[i] < tables.size());
+      encoder = ByteEncoder::Encoder(geom, tables[table_ids[i]], pool);
+    }
+
+    auto cmp_pipeline =
+      Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >::Create(std::move(encoder));
+
+    std::cout << "Compressing " << kStreamNames[i] << " (" << streams[i]->size() << " bytes)...";
+    cmp[i] = cmp_pipeline->Run(streams[i]);
+    std::cout << "Done. (" << cmp[i]->size() << " bytes)" << std::endl;
+  }
 
   GenTCHeader hdr;
+  hdr.magic = kGenTCMagic;
   hdr.width = dxt_img.Width();
   hdr.height = dxt_img.Height();
-  hdr.palette_bytes = static_cast<uint32_t>(palette_data->size());
-  hdr.y_cmp_sz = static_cast<uint32_t>(y_planes->size()) - 512;
-  hdr.chroma_cmp_sz = static_cast<uint32_t>(chroma_planes->size()) - 512;
-  hdr.palette_sz = static_cast<uint32_t>(palette_cmp->size()) - 512;
-  hdr.indices_sz = static_cast<uint32_t>(idx_cmp->size()) - 512;
+  const size_t f = geom.SymbolsPerGroup();
+  hdr.palette_bytes = static_cast<uint32_t>(((dxt_img.PaletteData().size() + f - 1) / f) * f);
+  hdr.y_cmp_sz = static_cast<uint32_t>(cmp[eStreamType_Y]->size() - kFreqTableSz);
+  hdr.chroma_cmp_sz = static_cast<uint32_t>(cmp[eStreamType_Chroma]->size() - kFreqTableSz);
+  hdr.palette_sz = static_cast<uint32_t>(cmp[eStreamType_Palette]->size() - kFreqTableSz);
+  hdr.indices_sz = static_cast<uint32_t>(cmp[eStreamType_Indices]->size() - kFreqTableSz);
+  memcpy(hdr.table_ids, table_ids, sizeof(hdr.table_ids));
+  hdr.ans_table_size = geom.table_size;
+  hdr.ans_num_encoded_symbols = geom.num_encoded_symbols;
+  hdr.ans_threads_per_group = geom.threads_per_group;
+
+  std::vector<TileInfo> tiles;
+  if (build_tile_index) {
+    tiles = std::move(BuildTileIndex(*streams[eStreamType_Indices], dxt_img.IndexRefs(),
+                                     hdr.CodedBlocksWide(), hdr.CodedBlocksHigh()));
+  }
+  hdr.tile_index_sz = static_cast<uint32_t>(tiles.size() * sizeof(TileInfo));
+  hdr.coefficient_order = order;
+  hdr.index_refs = static_cast<uint32_t>(dxt_img.IndexRefs().size());
 
   std::vector<uint8_t> result(sizeof(hdr), 0);
   memcpy(result.data(), &hdr, sizeof(hdr));
 
   // Input the frequencies first
-  result.insert(result.end(), y_planes->begin(), y_planes->begin() + 512);
-  result.insert(result.end(), chroma_planes->begin(), chroma_planes->begin() + 512);
-  result.insert(result.end(), palette_cmp->begin(), palette_cmp->begin() + 512);
-  result.insert(result.end(), idx_cmp->begin(), idx_cmp->begin() + 512);
-  
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    if (kInlineFreqTable == table_ids[i]) {
+      result.insert(result.end(), cmp[i]->begin(), cmp[i]->begin() + kFreqTableSz);
+    }
+  }
+
   // Input the compressed streams next
-  result.insert(result.end(), y_planes->begin() + 512, y_planes->end());
-  result.insert(result.end(), chroma_planes->begin() + 512, chroma_planes->end());
-  result.insert(result.end(), palette_cmp->begin() + 512, palette_cmp->end());
-  result.insert(result.end(), idx_cmp->begin() + 512, idx_cmp->end());
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    result.insert(result.end(), cmp[i]->begin() + kFreqTableSz, cmp[i]->end());
+  }
+
+  // The tile index goes last so that decoders that don't use it never see it
+  const uint8_t *tile_data = reinterpret_cast<const uint8_t *>(tiles.data());
+  result.insert(result.end(), tile_data, tile_data + hdr.tile_index_sz);
 
 #if 0
   std::cout << "Interpolation value stats:" << std::endl;
@@ -179,6 +314,19 @@ static std::vector<uint8_t> CompressDXTImage(const DXTImage &dxt_img) {
   return std::move(result);
 }
 
+static std::vector<uint8_t> CompressDXTImage(const DXTImage &dxt_img,
+                                             const ans::ocl::Geometry &geom = ans::ocl::Geometry(),
+                                             bool build_tile_index = false,
+                                             ECoefficientOrder order = eCoefficientOrder_Tiles) {
+  assert(geom.IsValid());
+  const uint32_t table_ids[kNumStreamTypes] = {
+    kInlineFreqTable, kInlineFreqTable, kInlineFreqTable, kInlineFreqTable
+  };
+  return std::move(EncodeStreams(dxt_img, PrepareStreams(dxt_img, geom, order), geom, table_ids,
+                                 std::vector<std::vector<uint32_t> >(), build_tile_index, order,
+                                 CreateEncoderPool()));
+}
+
 std::vector<uint8_t> CompressDXT(const char *filename, const char *cmp_fn) {
   DXTImage dxt_img(filename, cmp_fn);
   return std::move(CompressDXTImage(dxt_img));
@@ -194,4 +342,148 @@ std::vector<uint8_t> CompressDXT(const DXTImage &dxt_img) {
   return std::move(CompressDXTImage(dxt_img));
 }
 
+std::vector<uint8_t> CompressDXT(const DXTImage &dxt_img, const ans::ocl::Geometry &geom) {
+  return std::move(CompressDXTImage(dxt_img, geom));
+}
+
+std::vector<uint8_t> CompressDXTWithTileIndex(const DXTImage &dxt_img,
+                                              const ans::ocl::Geometry &geom) {
+  return std::move(CompressDXTImage(dxt_img, geom, true));
+}
+
+std::vector<uint8_t> CompressDXTWithPreview(const DXTImage &dxt_img,
+                                            const ans::ocl::Geometry &geom) {
+  return std::move(CompressDXTImage(dxt_img, geom, false, eCoefficientOrder_Bands));
+}
+
+std::vector<std::vector<uint8_t> > CompressDXTs(const std::vector<DXTImage> &dxt_imgs,
+                                                size_t max_tables,
+                                                std::vector<uint8_t> *dictionary,
+                                                const ans::ocl::Geometry &geom,
+                                                bool build_tile_index,
+                                                ECoefficientOrder order) {
+  assert(!dxt_imgs.empty());
+  assert(geom.IsValid());
+
+  std::vector<SymbolStreams> streams;
+  streams.reserve(dxt_imgs.size());
+
+  std::vector<std::vector<uint32_t> > counts;
+  counts.reserve(kNumStreamTypes * dxt_imgs.size());
+  for (const auto &dxt_img : dxt_imgs) {
+    streams.push_back(std::move(PrepareStreams(dxt_img, geom, order)));
+    for (const auto &stream : streams.back()) {
+      std::vector<uint32_t> c(256, 0);
+      for (auto v : *stream) {
+        c[v]++;
+      }
+      counts.push_back(std::move(c));
+    }
+  }
+
+  std::vector<uint32_t> table_ids;
+  std::vector<std::vector<uint32_t> > tables =
+    std::move(ClusterFrequencyTables(counts, max_tables, &table_ids, geom.table_size));
+  std::cout << "Sharing " << tables.size() << " frequency tables between "
+            << dxt_imgs.size() << " textures" << std::endl;
+
+  // The dictionary has the same layout as the tables stored in each stream
+  dictionary->assign(tables.size() * kFreqTableSz, 0);
+  for (size_t i = 0; i < tables.size(); ++i) {
+    assert(tables[i].size() <= kFreqTableSz / 2);
+    for (size_t j = 0; j < tables[i].size(); ++j) {
+      assert(tables[i][j] < (1U << 16));
+      const uint16_t f = static_cast<uint16_t>(tables[i][j]);
+      memcpy(dictionary->data() + i * kFreqTableSz + j * 2, &f, sizeof(f));
+    }
+  }
+
+  std::shared_ptr<ctpl::thread_pool> pool = CreateEncoderPool();
+  std::vector<std::vector<uint8_t> > result;
+  result.reserve(dxt_imgs.size());
+  for (size_t i = 0; i < dxt_imgs.size(); ++i) {
+    result.push_back(std::move(EncodeStreams(dxt_imgs[i], streams[i], geom,
+                                             table_ids.data() + i * kNumStreamTypes, tables,
+                                             build_tile_index, order, pool)));
+  }
+
+  return std::move(result);
+}
+
+std::vector<DXTImage> GenerateMipChain(const DXTImage &dxt_img) {
+  assert(!dxt_img.SourceImage().empty());
+
+  std::vector<DXTImage> levels;
+  levels.push_back(dxt_img);
+
+  std::vector<uint8_t> pixels = dxt_img.SourceImage();
+  size_t width = dxt_img.Width();
+  size_t height = dxt_img.Height();
+  while (levels.size() < kMaxMipLevels && (1 < width || 1 < height)) {
+    const size_t level_width = (width + 1) / 2;
+    const size_t level_height = (height + 1) / 2;
+
+    // Odd sides round up, and the pixels of the last row or column of the
+    // level are averaged with themselves where there's nothing past them.
+    std::vector<uint8_t> level_pixels(level_width * level_height * 3);
+    for (size_t y = 0; y < level_height; ++y) {
+      const size_t y0 = 2 * y;
+      const size_t y1 = std::min(y0 + 1, height - 1);
+      for (size_t x = 0; x < level_width; ++x) {
+        const size_t x0 = 2 * x;
+        const size_t x1 = std::min(x0 + 1, width - 1);
+        for (size_t c = 0; c < 3; ++c) {
+          const uint32_t sum =
+            pixels[(y0 * width + x0) * 3 + c] + pixels[(y0 * width + x1) * 3 + c] +
+            pixels[(y1 * width + x0) * 3 + c] + pixels[(y1 * width + x1) * 3 + c];
+          level_pixels[(y * level_width + x) * 3 + c] = static_cast<uint8_t>((sum + 2) / 4);
+        }
+      }
+    }
+
+    std::cout << "Compressing mip level " << levels.size() << " ("
+              << level_width << "x" << level_height << ")..." << std::endl;
+    levels.push_back(DXTImage(static_cast<int>(level_width), static_cast<int>(level_height),
+                              level_pixels.data()));
+
+    pixels = std::move(level_pixels);
+    width = level_width;
+    height = level_height;
+  }
+
+  return std::move(levels);
+}
+
+std::vector<uint8_t> CompressDXTMipChain(const std::vector<DXTImage> &levels,
+                                         size_t max_tables,
+                                         const ans::ocl::Geometry &geom) {
+  assert(!levels.empty() && levels.size() <= kMaxMipLevels);
+  for (size_t i = 1; i < levels.size(); ++i) {
+    assert(levels[i].Width() == (levels[i - 1].Width() + 1) / 2);
+    assert(levels[i].Height() == (levels[i - 1].Height() + 1) / 2);
+  }
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > cmp_levels =
+    std::move(CompressDXTs(levels, max_tables, &dictionary, geom));
+
+  GenTCMipChainHeader chain;
+  memset(&chain, 0, sizeof(chain));
+  chain.magic = kMipChainMagic;
+  chain.num_levels = static_cast<uint32_t>(levels.size());
+  chain.dictionary_sz = static_cast<uint32_t>(dictionary.size());
+  for (size_t i = 0; i < cmp_levels.size(); ++i) {
+    chain.level_sz[i] = static_cast<uint32_t>(cmp_levels[i].size());
+  }
+
+  std::vector<uint8_t> result(sizeof(chain));
+  memcpy(result.data(), &chain, sizeof(chain));
+  result.insert(result.end(), dictionary.begin(), dictionary.end());
+  for (const auto &level : cmp_levels) {
+    result.insert(result.end(), level.begin(), level.end());
+  }
+
+  return std::move(result);
+}
+
 }
@@ -5,6 +5,8 @@
 #include <functional>
 #include <vector>
 
+#include "ans.h"
+#include "codec_base.h"
 #include "dxt_image.h"
 
 namespace GenTC {
@@ -15,6 +17,51 @@ namespace GenTC {
                                    const std::vector<uint8_t> &rgb_data,
                                    const std::vector<uint8_t> &dxt_data);
   std::vector<uint8_t> CompressDXT(const DXTImage &dxt_img);
+
+  // Compresses the texture into interleaved ANS streams with the given
+  // geometry rather than the default one. The geometry is recorded in the
+  // header so that the decoder can compile its kernels to match.
+  std::vector<uint8_t> CompressDXT(const DXTImage &dxt_img, const ans::ocl::Geometry &geom);
+
+  // Also stores a tile index after the streams so that regions of the
+  // texture can be decoded on their own. See tile_index.h.
+  std::vector<uint8_t> CompressDXTWithTileIndex(const DXTImage &dxt_img,
+                                                const ans::ocl::Geometry &geom = ans::ocl::Geometry());
+
+  // Stores the wavelet coefficients of the endpoint planes in band order so
+  // that low resolution previews of the texture can be decoded from the
+  // front of the endpoint streams. Such textures can't have a tile index.
+  std::vector<uint8_t> CompressDXTWithPreview(const DXTImage &dxt_img,
+                                              const ans::ocl::Geometry &geom = ans::ocl::Geometry());
+
+  // Compresses a batch of textures whose streams share a dictionary of at
+  // most max_tables frequency tables. The tables are chosen by clustering the
+  // symbol statistics of every stream in the batch, and the headers refer to
+  // them by their index in the dictionary. The dictionary is written as
+  // consecutive kFreqTableSz byte tables and needs to be given to the decoder
+  // along with the batch. Each texture gets a tile index if build_tile_index
+  // is set, and has its coefficients stored in the given order.
+  std::vector<std::vector<uint8_t> > CompressDXTs(const std::vector<DXTImage> &dxt_imgs,
+                                                  size_t max_tables,
+                                                  std::vector<uint8_t> *dictionary,
+                                                  const ans::ocl::Geometry &geom = ans::ocl::Geometry(),
+                                                  bool build_tile_index = false,
+                                                  ECoefficientOrder order = eCoefficientOrder_Tiles);
+
+  // Builds the levels of a mip chain from the source pixels of dxt_img by
+  // averaging each 2x2 square of pixels of the level above. Each level is
+  // half the size of the one above it with odd sides rounded up, down to
+  // 1x1 or kMaxMipLevels levels, whichever comes first.
+  std::vector<DXTImage> GenerateMipChain(const DXTImage &dxt_img);
+
+  // Compresses the levels of a mip chain, largest first, into one stream
+  // laid out as described by GenTCMipChainHeader. Each level needs to be
+  // half the size of the one before it, rounded up. The levels share a dictionary of at
+  // most max_tables frequency tables like a batch compressed with
+  // CompressDXTs does.
+  std::vector<uint8_t> CompressDXTMipChain(const std::vector<DXTImage> &levels,
+                                           size_t max_tables = 4,
+                                           const ans::ocl::Geometry &geom = ans::ocl::Geometry());
 }  // namespace GenTC
 
 #endif  // __TCAR_ENCODER_H__
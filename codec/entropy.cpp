@@ -1,14 +1,83 @@
 #include "entropy.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <future>
+#include <limits>
 #include <numeric>
 #include <iostream>
+#include <thread>
 
 #include "ans_ocl.h"
 #include "data_stream.h"
+#include "histogram.h"
+#include "ctpl/ctpl_stl.h"
 
 namespace GenTC {
 
+std::shared_ptr<ctpl::thread_pool> CreateEncoderPool(size_t num_threads) {
+  if (0 == num_threads) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+
+  std::shared_ptr<ctpl::thread_pool> pool;
+  if (num_threads > 1) {
+    pool.reset(new ctpl::thread_pool(static_cast<int>(num_threads)));
+  }
+  return pool;
+}
+
+// The number of threads that an encoder with the given pool counts on
+static size_t NumPoolThreads(const std::shared_ptr<ctpl::thread_pool> &pool) {
+  return (nullptr == pool) ? 1 : static_cast<size_t>(pool->size());
+}
+
+// Encodes consecutive groups of streams_per_group interleaved streams. Once
+// the table is built the groups don't depend on each other, so we hand out
+// contiguous runs of them to the pool. Each group lands in its own slot,
+// so the result is the same regardless of the number of threads.
+static std::vector<std::vector<uint8_t> >
+EncodeGroups(const uint8_t *symbols, size_t num_groups, size_t symbols_per_thread,
+             size_t streams_per_group, const ans::EncoderTable &table,
+             ctpl::thread_pool *pool) {
+  const size_t symbols_per_group = symbols_per_thread * streams_per_group;
+  std::vector<std::vector<uint8_t> > groups(num_groups);
+
+  auto encode_range = [&](size_t start, size_t end) {
+    for (size_t i = start; i < end; ++i) {
+      groups[i] = std::move(
+        ans::EncodeInterleaved(symbols + i * symbols_per_group, symbols_per_group,
+                               table, streams_per_group));
+    }
+  };
+
+  const size_t num_threads =
+    (nullptr == pool) ? 1 : std::min(static_cast<size_t>(pool->size()), num_groups);
+
+  if (num_threads <= 1) {
+    encode_range(0, num_groups);
+    return std::move(groups);
+  }
+
+  std::vector<std::future<void> > results;
+  results.reserve(num_threads);
+
+  const size_t groups_per_thread = (num_groups + num_threads - 1) / num_threads;
+  for (size_t start = 0; start < num_groups; start += groups_per_thread) {
+    const size_t end = std::min(num_groups, start + groups_per_thread);
+    results.push_back(pool->push([&encode_range, start, end](int) {
+      encode_range(start, end);
+    }));
+  }
+
+  for (auto &result : results) {
+    result.get();
+  }
+
+  return std::move(groups);
+}
+
 ShortEncoder::EncodeUnit::ReturnType
 ShortEncoder::Encode::Run(const ShortEncoder::EncodeUnit::ArgType &in) const {
   assert(in->size() > 0);
@@ -39,11 +108,8 @@ ShortEncoder::Encode::Run(const ShortEncoder::EncodeUnit::ArgType &in) const {
   assert(num_threads * _symbols_per_thread == num_symbols);
   assert(num_thread_groups * ans::ocl::kThreadsPerEncodingGroup == num_threads);
 
-  std::vector<uint32_t> counts(256, 0);
-  for (auto v : vals) {
-    assert(static_cast<uint32_t>(v) < 256);
-    counts[v]++;
-  }
+  std::vector<uint32_t> counts =
+    ans::CountBytes(vals.data(), vals.size(), NumPoolThreads(_pool));
 
 #ifndef NDEBUG
   for (auto v : vals) {
@@ -52,30 +118,30 @@ ShortEncoder::Encode::Run(const ShortEncoder::EncodeUnit::ArgType &in) const {
   }
 #endif
 
-  std::vector<uint8_t> encoded_symbols;
-  std::vector<uint32_t> encoded_symbol_offsets;
-  encoded_symbol_offsets.reserve(num_thread_groups);
+  std::shared_ptr<const ans::EncoderTable> table =
+    ans::EncoderTable::Create(ans::ocl::GetOpenCLOptions(counts));
 
-  ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
+  std::vector<std::vector<uint8_t> > groups =
+    EncodeGroups(vals.data(), num_thread_groups, _symbols_per_thread,
+                 ans::ocl::kThreadsPerEncodingGroup, *table, _pool.get());
 
-  size_t symbols_encoded = 0;
-  while (symbols_encoded < num_symbols) {
-    auto start = vals.begin() + symbols_encoded;
-    auto end = vals.begin() + symbols_encoded +
-      _symbols_per_thread * ans::ocl::kThreadsPerEncodingGroup;
-    std::vector<uint8_t> symbols_for_group(start, end);
+  // The offsets mark the end of each group
+  std::vector<uint32_t> encoded_symbol_offsets;
+  encoded_symbol_offsets.reserve(num_thread_groups);
 
-    std::vector<uint8_t> group =
-      ans::EncodeInterleaved(symbols_for_group, opts,
-                             ans::ocl::kThreadsPerEncodingGroup);
+  size_t encoded_size = 0;
+  for (const auto &group : groups) {
+    encoded_size += group.size();
+    encoded_symbol_offsets.push_back(static_cast<uint32_t>(encoded_size));
+  }
 
-    encoded_symbols.insert(encoded_symbols.end(), group.begin(), group.end());
-    encoded_symbol_offsets.push_back(static_cast<uint32_t>(encoded_symbols.size()));
-    symbols_encoded += _symbols_per_thread * ans::ocl::kThreadsPerEncodingGroup;
+  std::vector<uint8_t> encoded_symbols(encoded_size);
+  for (size_t i = 0; i < groups.size(); ++i) {
+    const size_t start = encoded_symbol_offsets[i] - groups[i].size();
+    memcpy(encoded_symbols.data() + start, groups[i].data(), groups[i].size());
   }
 
   assert(encoded_symbol_offsets.size() == num_thread_groups);
-  assert(symbols_encoded == num_symbols);
 
   // Write header...
   DataStream hdr;
@@ -129,31 +195,26 @@ ShortEncoder::Decode::Run(const ShortEncoder::DecodeUnit::ArgType &in) const {
 
   ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
 
-  std::vector<uint8_t> symbols;
+  std::vector<uint8_t> symbols(num_symbols);
   size_t last_offset = hdr.BytesRead();
   size_t symbols_read = 0;
   size_t group_idx = 0;
   while (symbols_read < num_symbols) {
     size_t offset = last_offset + offsets[group_idx];
-    std::vector<uint8_t> interleaved_stream(in->begin() + last_offset,
-                                            in->begin() + offset);
+    assert(offset <= in->size());
 
     size_t symbols_to_read = ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
-    std::vector<uint8_t> interleaved_symbols =
-      ans::DecodeInterleaved(interleaved_stream, symbols_to_read, opts,
-                             ans::ocl::kThreadsPerEncodingGroup);
-
-    symbols.insert(symbols.end(), interleaved_symbols.begin(), interleaved_symbols.end());
-    assert(interleaved_symbols.size() == symbols_to_read);
+    ans::DecodeInterleaved(in->data() + last_offset, offset - last_offset,
+                           symbols_to_read, opts, ans::ocl::kThreadsPerEncodingGroup,
+                           symbols.data() + symbols_read);
 
     last_offset = offset;
-    symbols_read += interleaved_symbols.size();
+    symbols_read += symbols_to_read;
     group_idx++;
   }
 
   assert(group_idx == offsets.size());
   assert(symbols_read == num_symbols);
-  assert(symbols.size() == num_symbols);
 
   // Convert the symbols back to their representation...
   std::vector<int16_t> *result = new std::vector<int16_t>;
@@ -173,64 +234,69 @@ ShortEncoder::Decode::Run(const ShortEncoder::DecodeUnit::ArgType &in) const {
 
 ByteEncoder::Base::ReturnType
 ByteEncoder::EncodeBytes::Run(const ByteEncoder::Base::ArgType &in) const {
-  std::vector<uint32_t> counts(256, 0);
+  std::vector<uint32_t> counts = _freqs;
+  if (counts.empty()) {
+    counts = ans::CountBytes(in->data(), in->size(), NumPoolThreads(_pool));
+
+    // Determine size
+    size_t non_zero_counts = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      if (0 != counts[i]) {
+        non_zero_counts = i + 1;
+      }
+    }
 
-  for (size_t i = 0; i < in->size(); ++i) {
-    counts[in->at(i)]++;
+    counts.resize(non_zero_counts);
+    counts = std::move(ans::ocl::NormalizeFrequencies(counts, _geom.table_size));
   }
 
-  // Determine size
-  size_t non_zero_counts = 0;
-  for (size_t i = 0; i < counts.size(); ++i) {
-    if (0 != counts[i]) {
-      non_zero_counts = i + 1;
-    }
+#ifndef NDEBUG
+  for (auto v : *in) {
+    assert(v < counts.size());
+    assert(0 < counts[v]);
   }
+#endif
 
-  counts.resize(non_zero_counts);
-  counts = std::move(ans::ocl::NormalizeFrequencies(counts));
-
-  std::vector<size_t> offsets;
+  assert(_geom.IsValid());
+  assert(std::accumulate(counts.begin(), counts.end(), 0U) == _geom.table_size);
 
   const size_t num_symbols = in->size();
-  ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
-
-  std::vector<uint8_t> encoded_stream;
-  size_t num_encoded_symbols = 0;
-  const size_t num_symbols_to_encode_per_group = 
-    ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
-  size_t cum_offset = num_symbols / num_symbols_to_encode_per_group;
-  assert(cum_offset * num_symbols_to_encode_per_group == num_symbols);
-  cum_offset *= 4;
-
-  while (num_encoded_symbols < num_symbols) {
-    auto symbol_it = in->begin() + num_encoded_symbols;
-    std::vector<uint8_t> symbols_to_encode(symbol_it, symbol_it + num_symbols_to_encode_per_group);
-    std::vector<uint8_t> encoded_symbols = 
-      ans::EncodeInterleaved(symbols_to_encode, opts,
-                             ans::ocl::kThreadsPerEncodingGroup);
-
-    // Make sure that it's aligned to a multiple of four...
-    if (encoded_symbols.size() & 0x3) {
-
-      // ANS codec writes 16 bits at a time, so we should definitely be
-      // at least a multiple of two...
-      assert((encoded_symbols.size() & 1) == 0);
-
-      // If we *are* a multiple of two and *aren't* a multiple of four,
-      // then we just need to insert two bytes at the beginning since
-      // decoders read in reverse...
-      const uint8_t padding[2] = { 0, 0 };
-      encoded_symbols.insert(encoded_symbols.begin(), padding, padding + 2);
-    }
+  std::shared_ptr<const ans::EncoderTable> table =
+    ans::EncoderTable::Create(ans::ocl::GetOpenCLOptions(counts, _geom.table_size));
+
+  const size_t num_symbols_to_encode_per_group = _geom.SymbolsPerGroup();
+  const size_t num_groups = num_symbols / num_symbols_to_encode_per_group;
+  assert(num_groups * num_symbols_to_encode_per_group == num_symbols);
+
+  std::vector<std::vector<uint8_t> > groups =
+    EncodeGroups(in->data(), num_groups, _geom.num_encoded_symbols,
+                 _geom.threads_per_group, *table, _pool.get());
+
+  // Each group needs to be aligned to a multiple of four. The ANS codec
+  // writes 16 bits at a time, so we should definitely be at least a multiple
+  // of two. If we *are* a multiple of two and *aren't* a multiple of four,
+  // then we just need to insert two bytes at the beginning since decoders
+  // read in reverse...
+  std::vector<size_t> padding(num_groups);
+  for (size_t i = 0; i < num_groups; ++i) {
+    assert((groups[i].size() & 1) == 0);
+    padding[i] = groups[i].size() & 0x3;
+  }
 
-    // Should be multiple of four now.
-    assert((encoded_symbols.size() & 0x3) == 0);
+  // Prefix sum of the padded group sizes gives us the offsets, which start
+  // after the offset table.
+  std::vector<size_t> offsets(num_groups);
+  size_t cum_offset = num_groups * 4;
+  for (size_t i = 0; i < num_groups; ++i) {
+    cum_offset += padding[i] + groups[i].size();
+    assert((cum_offset & 0x3) == 0);
+    offsets[i] = cum_offset;
+  }
 
-    cum_offset += encoded_symbols.size();
-    offsets.push_back(cum_offset);
-    encoded_stream.insert(encoded_stream.end(), encoded_symbols.begin(), encoded_symbols.end());
-    num_encoded_symbols += num_symbols_to_encode_per_group;
+  std::vector<uint8_t> encoded_stream(cum_offset - num_groups * 4, 0);
+  for (size_t i = 0; i < num_groups; ++i) {
+    const size_t end = offsets[i] - num_groups * 4;
+    memcpy(encoded_stream.data() + end - groups[i].size(), groups[i].data(), groups[i].size());
   }
 
   DataStream hdr;
@@ -266,57 +332,264 @@ ByteEncoder::EncodeBytes::Run(const ByteEncoder::Base::ArgType &in) const {
 
 ByteEncoder::Base::ReturnType
 ByteEncoder::DecodeBytes::Run(const ByteEncoder::Base::ArgType &in) const {
-  DataStream hdr(*(in.get()));
-  size_t num_unique_symbols = 256;
+  std::vector<uint8_t> *result = new std::vector<uint8_t>;
+  *result = std::move(ByteEncoder::Decode(in->data(), in->size(), _geom));
+  return std::move(std::unique_ptr<std::vector<uint8_t> >(result));
+}
 
-  std::vector<uint32_t> counts;
-  counts.reserve(num_unique_symbols);
+static uint32_t ReadUnaligned32(const uint8_t *ptr) {
+  uint32_t result;
+  memcpy(&result, ptr, sizeof(result));
+  return result;
+}
+
+std::vector<uint8_t> ByteEncoder::Decode(const uint8_t *data, size_t data_sz,
+                                         const ans::ocl::Geometry &geom) {
+  // Read the normalized frequencies. Drop the padding at the end so that
+  // we end up with the same counts that the encoder used.
+  const size_t num_unique_symbols = 256;
+  if (data_sz < num_unique_symbols * 2) {
+    return std::vector<uint8_t>();
+  }
 
+  std::vector<uint32_t> counts(num_unique_symbols);
   for (size_t i = 0; i < num_unique_symbols; ++i) {
-    counts.push_back(hdr.ReadInt());
+    uint16_t c;
+    memcpy(&c, data + 2 * i, sizeof(c));
+    counts[i] = c;
   }
 
-  uint32_t num_offsets = hdr.ReadInt();
+  while (!counts.empty() && 0 == counts.back()) {
+    counts.pop_back();
+  }
 
-  // Skip to next 512 byte boundary
-  size_t num_to_skip = (((hdr.BytesRead() + 511) / 512) * 512) - hdr.BytesRead();
-  for (size_t i = 0; i < num_to_skip; ++i) {
-    hdr.ReadByte();
+  if (counts.empty()) {
+    return std::vector<uint8_t>();
   }
 
-  std::vector<uint32_t> offsets;
-  offsets.reserve(num_offsets);
+  // The offsets are relative to the start of the offset table and mark the
+  // end of each group. The last one marks the end of the data.
+  const uint8_t *groups = data + num_unique_symbols * 2;
+  const size_t groups_sz = data_sz - num_unique_symbols * 2;
 
-  for (size_t i = 0; i < num_offsets; ++i) {
-    offsets.push_back(hdr.ReadInt());
+  size_t num_offsets = 0;
+  do {
+    if ((num_offsets + 1) * 4 > groups_sz) {
+      return std::vector<uint8_t>();
+    }
+    num_offsets++;
+  } while (ReadUnaligned32(groups + (num_offsets - 1) * 4) < groups_sz);
+
+  if (ReadUnaligned32(groups + (num_offsets - 1) * 4) != groups_sz) {
+    return std::vector<uint8_t>();
   }
 
-  ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
+  ans::Options opts = ans::ocl::GetOpenCLOptions(counts, geom.table_size);
 
-  std::vector<uint8_t> *result = new std::vector<uint8_t>;
-  const size_t num_symbols = num_offsets * ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
-  size_t symbols_decoded = 0;
-  size_t group_idx = 0;
+  // Each group ends after the one before it and holds at least the final
+  // state of each of its streams.
+  const size_t states_sz = geom.threads_per_group * 4;
   size_t last_offset = num_offsets * 4;
-  while (symbols_decoded < num_symbols) {
-    size_t offset = offsets[group_idx++];
-    auto start = in->begin() + last_offset;
-    auto end = in->begin() + offset;
-    std::vector<uint8_t> data(start, end);
+  for (size_t group_idx = 0; group_idx < num_offsets; ++group_idx) {
+    const size_t offset = ReadUnaligned32(groups + group_idx * 4);
+    if (offset < last_offset || offset - last_offset < states_sz) {
+      return std::vector<uint8_t>();
+    }
+    last_offset = offset;
+  }
 
-    size_t symbols_to_read = ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
-    std::vector<uint8_t> decoded = 
-      ans::DecodeInterleaved(data, symbols_to_read, opts,
-                             ans::ocl::kThreadsPerEncodingGroup);
+  const size_t symbols_per_group = geom.SymbolsPerGroup();
+  std::vector<uint8_t> result(num_offsets * symbols_per_group);
+
+  last_offset = num_offsets * 4;
+  for (size_t group_idx = 0; group_idx < num_offsets; ++group_idx) {
+    const size_t offset = ReadUnaligned32(groups + group_idx * 4);
 
-    result->insert(result->end(), decoded.begin(), decoded.end());
-    symbols_decoded += decoded.size();
+    ans::DecodeInterleaved(groups + last_offset, offset - last_offset,
+                           symbols_per_group, opts, geom.threads_per_group,
+                           result.data() + group_idx * symbols_per_group);
     last_offset = offset;
   }
 
-  assert(symbols_decoded == num_symbols);
+  return std::move(result);
+}
+
+// The number of bits needed to code a stream with the given symbol counts
+// using the probabilities of a table, given as -log2(p) per symbol. This is
+// infinite if the table is missing any of the stream's symbols.
+static double CodedBits(const std::vector<uint32_t> &counts, const std::vector<double> &neg_log_p) {
+  double bits = 0.0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    if (0 != counts[i]) {
+      bits += static_cast<double>(counts[i]) * neg_log_p[i];
+    }
+  }
+  return bits;
+}
 
-  return std::move(std::unique_ptr<std::vector<uint8_t> >(result));
+static std::vector<double> NegLogProbabilities(const std::vector<uint64_t> &counts) {
+  const uint64_t total = std::accumulate(counts.begin(), counts.end(), 0ULL);
+  std::vector<double> result(counts.size(), std::numeric_limits<double>::infinity());
+  for (size_t i = 0; i < counts.size(); ++i) {
+    if (0 != counts[i]) {
+      result[i] = log2(static_cast<double>(total) / static_cast<double>(counts[i]));
+    }
+  }
+  return std::move(result);
+}
+
+std::vector<std::vector<uint32_t> >
+ClusterFrequencyTables(const std::vector<std::vector<uint32_t> > &counts,
+                       size_t max_tables, std::vector<uint32_t> *table_ids,
+                       uint32_t table_size) {
+  assert(max_tables > 0);
+  assert(!counts.empty());
+
+  static const size_t kNumSymbols = 256;
+  static const size_t kMaxIterations = 16;
+
+  const size_t num_streams = counts.size();
+  std::vector<std::vector<uint32_t> > stream_counts(counts);
+  std::vector<double> self_bits(num_streams);
+  for (size_t i = 0; i < num_streams; ++i) {
+    assert(stream_counts[i].size() <= kNumSymbols);
+    stream_counts[i].resize(kNumSymbols, 0);
+
+    std::vector<uint64_t> c(stream_counts[i].begin(), stream_counts[i].end());
+    self_bits[i] = CodedBits(stream_counts[i], NegLogProbabilities(c));
+  }
+
+  // Seed the clusters with the streams that are most expensive to code with
+  // the clusters that we already have, starting with the largest stream.
+  std::vector<std::vector<double> > cluster_bits;
+  std::vector<double> best_bits(num_streams, std::numeric_limits<double>::infinity());
+  std::vector<uint32_t> assignment(num_streams, 0);
+
+  size_t seed = 0;
+  for (size_t i = 1; i < num_streams; ++i) {
+    const uint64_t seed_total =
+      std::accumulate(stream_counts[seed].begin(), stream_counts[seed].end(), 0ULL);
+    const uint64_t total =
+      std::accumulate(stream_counts[i].begin(), stream_counts[i].end(), 0ULL);
+    if (total > seed_total) {
+      seed = i;
+    }
+  }
+
+  while (cluster_bits.size() < max_tables) {
+    std::vector<uint64_t> c(stream_counts[seed].begin(), stream_counts[seed].end());
+    cluster_bits.push_back(NegLogProbabilities(c));
+
+    const uint32_t cluster = static_cast<uint32_t>(cluster_bits.size() - 1);
+    for (size_t i = 0; i < num_streams; ++i) {
+      double bits = CodedBits(stream_counts[i], cluster_bits.back());
+      if (bits < best_bits[i]) {
+        best_bits[i] = bits;
+        assignment[i] = cluster;
+      }
+    }
+
+    double max_excess = 0.0;
+    for (size_t i = 0; i < num_streams; ++i) {
+      const double excess = best_bits[i] - self_bits[i];
+      if (excess > max_excess) {
+        max_excess = excess;
+        seed = i;
+      }
+    }
+
+    // Every stream is already coded as well as it can be
+    if (max_excess <= 0.0) {
+      break;
+    }
+  }
+
+  // Refine the clusters: each table is built from the sum of the counts of
+  // its streams, and the streams move to whichever table is cheapest. Each
+  // stream's own cluster always covers its symbols, so the cost stays finite.
+  const size_t num_clusters = cluster_bits.size();
+  std::vector<std::vector<uint64_t> > cluster_counts;
+  for (size_t iter = 0; iter < kMaxIterations; ++iter) {
+    cluster_counts.assign(num_clusters, std::vector<uint64_t>(kNumSymbols, 0));
+    for (size_t i = 0; i < num_streams; ++i) {
+      for (size_t j = 0; j < kNumSymbols; ++j) {
+        cluster_counts[assignment[i]][j] += stream_counts[i][j];
+      }
+    }
+
+    for (size_t k = 0; k < num_clusters; ++k) {
+      cluster_bits[k] = std::move(NegLogProbabilities(cluster_counts[k]));
+    }
+
+    bool changed = false;
+    for (size_t i = 0; i < num_streams; ++i) {
+      uint32_t best = assignment[i];
+      double bits = CodedBits(stream_counts[i], cluster_bits[best]);
+      for (size_t k = 0; k < num_clusters; ++k) {
+        double b = CodedBits(stream_counts[i], cluster_bits[k]);
+        if (b < bits) {
+          bits = b;
+          best = static_cast<uint32_t>(k);
+        }
+      }
+
+      changed = changed || best != assignment[i];
+      assignment[i] = best;
+    }
+
+    if (!changed) {
+      break;
+    }
+  }
+
+  // Recount with the final assignment, drop the clusters that lost all of
+  // their streams, and normalize the rest.
+  cluster_counts.assign(num_clusters, std::vector<uint64_t>(kNumSymbols, 0));
+  std::vector<bool> used(num_clusters, false);
+  for (size_t i = 0; i < num_streams; ++i) {
+    used[assignment[i]] = true;
+    for (size_t j = 0; j < kNumSymbols; ++j) {
+      cluster_counts[assignment[i]][j] += stream_counts[i][j];
+    }
+  }
+
+  std::vector<uint32_t> cluster_ids(num_clusters, 0);
+  std::vector<std::vector<uint32_t> > tables;
+  for (size_t k = 0; k < num_clusters; ++k) {
+    if (!used[k]) {
+      continue;
+    }
+
+    cluster_ids[k] = static_cast<uint32_t>(tables.size());
+
+    // Scale the counts down so that they fit in 32 bits without dropping
+    // any symbols.
+    const uint64_t max_count =
+      *std::max_element(cluster_counts[k].begin(), cluster_counts[k].end());
+    int shift = 0;
+    while ((max_count >> shift) >= (1ULL << 31)) {
+      shift++;
+    }
+
+    std::vector<uint32_t> c(kNumSymbols, 0);
+    size_t non_zero_counts = 0;
+    for (size_t j = 0; j < kNumSymbols; ++j) {
+      if (0 != cluster_counts[k][j]) {
+        c[j] = static_cast<uint32_t>(std::max<uint64_t>(1, cluster_counts[k][j] >> shift));
+        non_zero_counts = j + 1;
+      }
+    }
+
+    c.resize(non_zero_counts);
+    tables.push_back(std::move(ans::ocl::NormalizeFrequencies(c, table_size)));
+  }
+
+  table_ids->resize(num_streams);
+  for (size_t i = 0; i < num_streams; ++i) {
+    (*table_ids)[i] = cluster_ids[assignment[i]];
+  }
+
+  return std::move(tables);
 }
 
 }  // namespace GenTC
@@ -4,24 +4,44 @@
 #include "pixel_traits.h"
 #include "pipeline.h"
 
+#include "ans.h"
+
 #include <cassert>
 #include <cstdint>
 #include <iostream>
+#include <memory>
 #include <type_traits>
 #include <vector>
 
+namespace ctpl {
+  class thread_pool;
+}
+
 namespace GenTC {
 
+// A pool of num_threads threads, or one per core if num_threads is zero, to
+// encode groups of streams on. Many encoders can share one pool, e.g. all of
+// the streams of a batch of textures. Returns null if there would only be
+// one thread, in which case the encoders run on the calling thread.
+std::shared_ptr<ctpl::thread_pool> CreateEncoderPool(size_t num_threads = 0);
+
 // Rearrange the stream of values such that the current stream
 // is treated as a matrix with "row_length" number of columns.
 // The values are rearranged such that blocks with 'block_length'
 // number of columns are linearized in order and placed on the stream
+//
+// If coarsest_band is nonzero, the blocks are split into bands instead: the
+// coarsest_band x coarsest_band corner of every block comes first, then the
+// rest of the corner twice that size of every block, and so on. Each band of
+// a block is linearized in raster order. This puts the low-pass coefficients
+// of wavelet blocks at the front of the stream.
 template<typename T>
 class RearrangeStream : public PipelineUnit<std::vector<T>, std::vector<T> > {
  public:
   typedef PipelineUnit<std::vector<T>, std::vector<T> > Base;
-  static std::unique_ptr<Base> New(size_t row_length, size_t block_length) {
-    return std::unique_ptr<Base>(new RearrangeStream<T>(row_length, block_length));
+  static std::unique_ptr<Base> New(size_t row_length, size_t block_length,
+                                   size_t coarsest_band = 0) {
+    return std::unique_ptr<Base>(new RearrangeStream<T>(row_length, block_length, coarsest_band));
   }
 
   typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
@@ -37,6 +57,24 @@ class RearrangeStream : public PipelineUnit<std::vector<T>, std::vector<T> > {
     std::vector<T> *result = new std::vector<T>;
     result->reserve(in->size());
 
+    if (0 < _coarsest_band) {
+      for (size_t end = _coarsest_band; end <= _block_length; end *= 2) {
+        const size_t begin = (_coarsest_band == end) ? 0 : end / 2;
+        for (size_t j = 0; j < in->size(); j += _row_length * _block_length) {
+          for (size_t i = 0; i < _row_length; i += _block_length) {
+            for (size_t y = 0; y < end; ++y) {
+              for (size_t x = (y < begin) ? begin : 0; x < end; ++x) {
+                result->push_back(in->at(j + y * _row_length + i + x));
+              }
+            }
+          }
+        }
+      }
+
+      assert(result->size() == in->size());
+      return std::move(std::unique_ptr<std::vector<T> >(result));
+    }
+
     size_t j = 0;
     while (j < in->size()) {
       for (size_t i = 0; i < _row_length; i += _block_length) {
@@ -56,12 +94,15 @@ class RearrangeStream : public PipelineUnit<std::vector<T>, std::vector<T> > {
  private:
   size_t _row_length;
   size_t _block_length;
+  size_t _coarsest_band;
 
-  RearrangeStream<T>(size_t row_length, size_t block_length)
+  RearrangeStream<T>(size_t row_length, size_t block_length, size_t coarsest_band)
     : _row_length(row_length)
     , _block_length(block_length)
+    , _coarsest_band(coarsest_band)
   {
     assert((_row_length % _block_length) == 0);
+    assert(0 == _coarsest_band || (_block_length % _coarsest_band) == 0);
   }
 };
 
@@ -93,8 +134,12 @@ class ShortEncoder {
   typedef PipelineUnit<std::vector<int16_t>, std::vector<uint8_t> > EncodeUnit;
   typedef PipelineUnit<std::vector<uint8_t>, std::vector<int16_t> > DecodeUnit;
 
-  static std::unique_ptr<EncodeUnit> Encoder(size_t symbols_per_thread) {
-    return std::unique_ptr<EncodeUnit>(new Encode(symbols_per_thread));
+  // Groups of streams are encoded on num_threads threads, or one per core if
+  // num_threads is zero. The encoder starts its threads once and keeps them
+  // for every Run. The output doesn't depend on the number of threads.
+  static std::unique_ptr<EncodeUnit> Encoder(size_t symbols_per_thread, size_t num_threads = 0) {
+    return std::unique_ptr<EncodeUnit>(
+      new Encode(symbols_per_thread, CreateEncoderPool(num_threads)));
   }
 
   static std::unique_ptr<DecodeUnit> Decoder(size_t symbols_per_thread) {
@@ -104,11 +149,13 @@ class ShortEncoder {
  private:
   class Encode : public EncodeUnit {
    public:
-    Encode(size_t spt): EncodeUnit(), _symbols_per_thread(spt) { }
+    Encode(size_t spt, const std::shared_ptr<ctpl::thread_pool> &pool)
+      : EncodeUnit(), _symbols_per_thread(spt), _pool(pool) { }
     EncodeUnit::ReturnType Run(const EncodeUnit::ArgType &in) const override;
 
    private:
     const size_t _symbols_per_thread;
+    const std::shared_ptr<ctpl::thread_pool> _pool;
   };
 
   class Decode : public DecodeUnit {
@@ -125,34 +172,99 @@ class ByteEncoder {
  public:
   typedef PipelineUnit<std::vector<uint8_t>, std::vector<uint8_t> > Base;
 
-  static std::unique_ptr<Base> Encoder(size_t symbols_per_thread) {
-    return std::unique_ptr<Base>(new EncodeBytes(symbols_per_thread));
+  // See ShortEncoder::Encoder
+  static std::unique_ptr<Base> Encoder(size_t symbols_per_thread, size_t num_threads = 0) {
+    return Encoder(DefaultGeometry(symbols_per_thread), std::vector<uint32_t>(), num_threads);
+  }
+
+  // Encodes with the given normalized frequencies rather than the ones
+  // measured from the input, e.g. a table from a shared dictionary. Every
+  // symbol in the input must have a non-zero frequency.
+  static std::unique_ptr<Base> Encoder(size_t symbols_per_thread,
+                                       const std::vector<uint32_t> &freqs,
+                                       size_t num_threads = 0) {
+    return Encoder(DefaultGeometry(symbols_per_thread), freqs, num_threads);
+  }
+
+  // Encodes groups of interleaved streams with the given table size, number
+  // of streams per group and symbols per stream. The frequencies, if given,
+  // must be normalized to the geometry's table size.
+  static std::unique_ptr<Base> Encoder(const ans::ocl::Geometry &geom,
+                                       const std::vector<uint32_t> &freqs = std::vector<uint32_t>(),
+                                       size_t num_threads = 0) {
+    return Encoder(geom, freqs, CreateEncoderPool(num_threads));
+  }
+
+  // Same as above, but encodes on the given pool from CreateEncoderPool, or
+  // on the calling thread if the pool is null.
+  static std::unique_ptr<Base> Encoder(const ans::ocl::Geometry &geom,
+                                       const std::vector<uint32_t> &freqs,
+                                       const std::shared_ptr<ctpl::thread_pool> &pool) {
+    return std::unique_ptr<Base>(new EncodeBytes(geom, pool, freqs));
   }
 
   static std::unique_ptr<Base> Decoder(size_t symbols_per_thread) {
-    return std::unique_ptr<Base>(new DecodeBytes(symbols_per_thread));
+    return Decoder(DefaultGeometry(symbols_per_thread));
+  }
+
+  static std::unique_ptr<Base> Decoder(const ans::ocl::Geometry &geom) {
+    return std::unique_ptr<Base>(new DecodeBytes(geom));
   }
 
+  // Decodes the output of the encoder directly from memory without copying
+  // any of the interleaved groups. Returns an empty vector if the data is
+  // truncated, or its offsets don't describe groups that fit in it.
+  static std::vector<uint8_t> Decode(const uint8_t *data, size_t data_sz,
+                                     size_t symbols_per_thread) {
+    return std::move(Decode(data, data_sz, DefaultGeometry(symbols_per_thread)));
+  }
+
+  static std::vector<uint8_t> Decode(const uint8_t *data, size_t data_sz,
+                                     const ans::ocl::Geometry &geom);
+
  private:
   class EncodeBytes : public Base {
    public:
-    EncodeBytes(size_t spt) :Base(), _symbols_per_thread(spt) { }
+    EncodeBytes(const ans::ocl::Geometry &geom, const std::shared_ptr<ctpl::thread_pool> &pool,
+                const std::vector<uint32_t> &freqs)
+      : Base(), _geom(geom), _pool(pool), _freqs(freqs) { }
     Base::ReturnType Run(const Base::ArgType &in) const override;
-    
+
    private:
-    const size_t _symbols_per_thread;
+    const ans::ocl::Geometry _geom;
+    const std::shared_ptr<ctpl::thread_pool> _pool;
+    const std::vector<uint32_t> _freqs;
   };
 
   class DecodeBytes : public Base {
    public:
-    DecodeBytes(size_t spt) :Base(), _symbols_per_thread(spt) { }
+    DecodeBytes(const ans::ocl::Geometry &geom) : Base(), _geom(geom) { }
     Base::ReturnType Run(const Base::ArgType &in) const override;
 
    private:
-    const size_t _symbols_per_thread;
+    const ans::ocl::Geometry _geom;
   };
+
+  // The default geometry with a different number of symbols per stream
+  static ans::ocl::Geometry DefaultGeometry(size_t symbols_per_thread) {
+    ans::ocl::Geometry geom;
+    geom.num_encoded_symbols = static_cast<uint32_t>(symbols_per_thread);
+    return geom;
+  }
 };
 
+// Clusters the symbol counts of many byte streams into at most max_tables
+// groups so that the streams in a group can share one frequency table. The
+// streams are assigned to the table that codes them in the fewest bits, and
+// each table covers every symbol of the streams assigned to it. Returns the
+// frequencies of each table normalized to table_size, ready for
+// ByteEncoder::Encoder, and writes the index of each stream's table to
+// table_ids.
+std::vector<std::vector<uint32_t> >
+ClusterFrequencyTables(const std::vector<std::vector<uint32_t> > &counts,
+                       size_t max_tables, std::vector<uint32_t> *table_ids,
+                       uint32_t table_size = ans::ocl::kANSTableSize);
+
 }  // namespace GenTC
 
 #endif  // __TCAR_ENTROPY_H__
@@ -1,6 +1,20 @@
 #pragma OPENCL EXTENSION cl_khr_byte_addressable_store : enable
 
+// Matches TextureInfo in decoder.cpp
+typedef struct {
+  uint stream_offsets[4];
+  uint blocks_x;
+  uint blocks_y;
+  uint first_block;
+  uint width;
+  uint height;
+  uint out_offset;
+  uint refs_offset;
+  uint num_refs;
+} TextureInfo;
+
 #ifdef GENTC_APPLE
+static uint FindTexture(const __global TextureInfo *textures, uint num_textures, uint block);
 static int NormalizeIndex(int idx, int range);
 static int GetAt(__local int *ptr, uint x, uint y);
 static void PutAt(__local int *ptr, uint x, uint y, int val);
@@ -10,6 +24,21 @@ static void InverseWaveletOdd(__local int *src, __local int *scratch,
                               uint x, uint y, uint len, uint mid);
 #endif
 
+// The blocks of all of the textures of a batch are numbered one after
+// another. Returns the texture that the given block belongs to.
+uint FindTexture(const __global TextureInfo *textures, uint num_textures, uint block) {
+  uint first = 0;
+  uint last = num_textures;
+  while (last - first > 1) {
+    const uint mid = (first + last) / 2;
+    if (textures[mid].first_block <= block) {
+      first = mid;
+    } else {
+      last = mid;
+    }
+  }
+  return first;
+}
 
 int NormalizeIndex(int idx, int range) {
   return abs(idx - (int)(idx >= range) * (idx - range + 2));
@@ -65,22 +94,39 @@ void InverseWaveletOdd(__local int *src, __local int *scratch,
 
 // We use one thread per pixel, and the group size (local work size)
 // dictates how big the dimensions are of the 
-
-__kernel void inv_wavelet(const __global   uchar *global_wavelet_data,
-                          const __constant uint  *output_offsets,
-                                __local    int   *local_data,
-                                __global   char  *global_out_data)
+//
+// Each group transforms one wavelet block. The wavelet blocks of all of the
+// textures of a batch go one after another along the second dimension, and
+// the six endpoint planes along the third. The planes of each texture are
+// written out starting at six times its first block.
+
+__kernel void inv_wavelet(const __global   uchar       *global_wavelet_data,
+                          const __global   TextureInfo *textures,
+                          const            uint         num_textures,
+                                __local    int         *local_data,
+                                __global   char        *global_out_data)
 {
   const int local_x = get_local_id(0);
   const int local_y = get_local_id(1);
   const int local_dim = 2 * get_local_size(1);
   const int wavelet_block_size = local_dim * local_dim;
-  const int total_num_vals = 4 * get_global_size(0) * get_global_size(1);
-  const __global uchar *wavelet_data = global_wavelet_data
-    + output_offsets[4 * (get_global_id(2) / 6)]
-    + (get_global_id(2) % 6) * total_num_vals;
 
-  __global char *out_data = global_out_data + get_global_id(2) * total_num_vals;
+  const uint block = get_group_id(1);
+  const __global TextureInfo *texture =
+    textures + FindTexture(textures, num_textures, block * wavelet_block_size);
+  const uint total_num_vals = texture->blocks_x * texture->blocks_y;
+  const uint tile = block - texture->first_block / wavelet_block_size;
+  const uint tiles_x = texture->blocks_x / local_dim;
+
+  // The two luma planes are at the start of one stream and the four chroma
+  // planes at the start of the other
+  const uint plane = get_global_id(2);
+  const __global uchar *wavelet_data = global_wavelet_data + ((plane < 2)
+    ? texture->stream_offsets[0] + plane * total_num_vals
+    : texture->stream_offsets[1] + (plane - 2) * total_num_vals);
+
+  __global char *out_data =
+    global_out_data + 6 * texture->first_block + plane * total_num_vals;
 
   // Grab global value and place it in local data in preparation for inv
   // wavelet transform. Data is expected to be linearized in the block.
@@ -91,8 +137,7 @@ __kernel void inv_wavelet(const __global   uchar *global_wavelet_data,
   // !FIXME! We're using four-byte integers here, but we can probably get away
   // with signed two-byte integers to reduce cache misses.
   {
-    const uint group_idx = get_group_id(1) * get_num_groups(0) + get_group_id(0);
-    const __global uchar *global_data = wavelet_data + group_idx * wavelet_block_size;
+    const __global uchar *global_data = wavelet_data + tile * wavelet_block_size;
 
     const uint lidx = 4 * (local_y * get_local_size(0) + local_x);
     for (int i = 0; i < 4; ++i) {
@@ -174,15 +219,15 @@ __kernel void inv_wavelet(const __global   uchar *global_wavelet_data,
   // Write final value back into global memory
   {
     const uint local_stride = local_dim;
-    const uint global_stride = local_stride * get_num_groups(0);
+    const uint global_stride = texture->blocks_x;
 
     const uint odd_column = local_x & 0x1;
     const uint ly = 2 * local_y + odd_column;
     const uint lx = 4 * (local_x >> 1);
     const uint lidx = ly * local_stride + lx;
 
-    const uint gy = get_group_id(1) * local_dim + 2 * local_y + odd_column;
-    const uint gx = 4 * (get_global_id(0) >> 1);
+    const uint gy = (tile / tiles_x) * local_dim + 2 * local_y + odd_column;
+    const uint gx = (tile % tiles_x) * local_dim + lx;
     const uint gidx = gy * global_stride + gx;
 
     for (int i = 0; i < 4; ++i) {
@@ -190,3 +235,51 @@ __kernel void inv_wavelet(const __global   uchar *global_wavelet_data,
     }
   }
 }
+
+// Matches kCoarsestBandDim in codec_base.h
+#define COARSEST_BAND_DIM 4
+
+// Copies the top-left dim x dim coefficients of every wavelet block of the
+// endpoint planes of each texture out of streams in band order and into the
+// tile order that inv_wavelet reads. There's one thread per coefficient. The
+// rows of the wavelet blocks of all of the textures go one after another
+// along the second dimension, and the six planes along the third. The planes
+// are written to tile_data at the same offsets as their streams in band_data.
+__kernel void gather_bands(const __global   uchar       *band_data,
+                           const __global   TextureInfo *textures,
+                           const            uint         num_textures,
+                           const            uint         dim,
+                                 __global   uchar       *tile_data)
+{
+  const uint block_sz = dim * dim;
+  const uint block = get_global_id(1) / dim;
+  const __global TextureInfo *texture =
+    textures + FindTexture(textures, num_textures, block * block_sz);
+  const uint num_tiles = texture->blocks_x * texture->blocks_y / block_sz;
+  const uint tile = block - texture->first_block / block_sz;
+  const uint x = get_global_id(0);
+  const uint y = get_global_id(1) % dim;
+
+  // The two luma planes are in one stream and the four chroma planes in the other
+  const uint plane = get_global_id(2);
+  const uint is_luma = plane < 2;
+  const uint stream_plane = is_luma ? plane : plane - 2;
+  const uint num_planes = is_luma ? 2 : 4;
+  const uint stream_offset = texture->stream_offsets[is_luma ? 0 : 1];
+
+  // Same as BandOrderIndex
+  uint end = COARSEST_BAND_DIM;
+  while (x >= end || y >= end) {
+    end *= 2;
+  }
+  const uint begin = (COARSEST_BAND_DIM == end) ? 0 : end / 2;
+  const uint band_idx = (y < begin)
+    ? y * (end - begin) + (x - begin)
+    : begin * (end - begin) + (y - begin) * end + x;
+  const uint band_sz = end * end - begin * begin;
+  const uint idx = num_planes * num_tiles * begin * begin
+    + (stream_plane * num_tiles + tile) * band_sz + band_idx;
+
+  tile_data[stream_offset + (stream_plane * num_tiles + tile) * block_sz + y * dim + x] =
+    band_data[stream_offset + idx];
+}
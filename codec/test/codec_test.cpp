@@ -1,8 +1,12 @@
 #include "gtest/gtest.h"
 
+#include <chrono>
+#include <cstring>
+#include <iostream>
 #include <numeric>
 #include <vector>
 
+#include "cpu_decoder.h"
 #include "encoder.h"
 #include "decoder.h"
 #include "dxt_image.h"
@@ -47,6 +51,289 @@ TEST(GenTC, CanCompressAndDecompressImage) {
   }
 }
 
+TEST(GenTC, CanDecompressOtherGeometries) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+
+  const ans::ocl::Geometry geoms[] = {
+    ans::ocl::Geometry(1 << 12, 256, 64),
+    ans::ocl::Geometry(1 << 10, 128, 8),
+  };
+
+  for (const auto &geom : geoms) {
+    ASSERT_TRUE(GenTC::InitializeDecoder(gTestEnv->GetContext(), geom));
+
+    std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img, geom));
+    GenTC::DXTImage cmp_img = std::move(GenTC::DecompressDXT(gTestEnv->GetContext(), cmp_data));
+
+    const std::vector<GenTC::PhysicalDXTBlock> &blks = dxt_img.PhysicalBlocks();
+    for (size_t i = 0; i < blks.size(); ++i) {
+      EXPECT_EQ(blks[i].dxt_block, cmp_img.PhysicalBlocks()[i].dxt_block) << "Index: " << i;
+    }
+  }
+}
+
+TEST(GenTC, CanDecompressBatchWithSharedTables) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  std::vector<GenTC::DXTImage> dxt_imgs;
+  dxt_imgs.push_back(GenTC::DXTImage(fname.c_str(), NULL));
+  dxt_imgs.push_back(dxt_imgs.back());
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > cmp_data =
+    std::move(GenTC::CompressDXTs(dxt_imgs, 4, &dictionary));
+  ASSERT_EQ(cmp_data.size(), dxt_imgs.size());
+  ASSERT_LE(dictionary.size(), 4 * GenTC::kFreqTableSz);
+
+  for (size_t i = 0; i < cmp_data.size(); ++i) {
+    GenTC::GenTCHeader hdr;
+    hdr.LoadFrom(cmp_data[i].data());
+    EXPECT_EQ(hdr.NumInlineTables(), 0);
+
+    GenTC::DXTImage cmp_img =
+      std::move(GenTC::DecompressDXT(gTestEnv->GetContext(), cmp_data[i], dictionary));
+
+    const std::vector<GenTC::PhysicalDXTBlock> &blks = dxt_imgs[i].PhysicalBlocks();
+    for (size_t j = 0; j < blks.size(); ++j) {
+      EXPECT_EQ(blks[j].dxt_block, cmp_img.PhysicalBlocks()[j].dxt_block) << "Index: " << j;
+    }
+  }
+}
+
+TEST(GenTC, CPUDecoderMatchesOpenCL) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+  std::vector<std::vector<uint8_t> > cmp_data(16, GenTC::CompressDXT(dxt_img));
+  const double mb = static_cast<double>(cmp_data.size() * dxt_img.Width() * dxt_img.Height() / 2)
+    / (1024.0 * 1024.0);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<GenTC::DXTImage> ocl_imgs;
+  for (const auto &data : cmp_data) {
+    ocl_imgs.push_back(GenTC::DecompressDXT(gTestEnv->GetContext(), data));
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double> secs = end - start;
+  std::cout << "OpenCL: " << (mb / secs.count()) << " MB/s of DXT1" << std::endl;
+
+  GenTC::cpu::Decoder decoder;
+  start = std::chrono::high_resolution_clock::now();
+  std::vector<std::vector<uint8_t> > cpu_data =
+    decoder.DecompressDXTBuffers(cmp_data, std::vector<uint8_t>());
+  end = std::chrono::high_resolution_clock::now();
+
+  secs = end - start;
+  std::cout << "CPU (" << decoder.NumThreads() << " threads): "
+            << (mb / secs.count()) << " MB/s of DXT1" << std::endl;
+
+  ASSERT_EQ(cpu_data.size(), ocl_imgs.size());
+  for (size_t i = 0; i < cpu_data.size(); ++i) {
+    GenTC::DXTImage cpu_img(dxt_img.Width(), dxt_img.Height(), cpu_data[i]);
+
+    const std::vector<GenTC::PhysicalDXTBlock> &blks = ocl_imgs[i].PhysicalBlocks();
+    for (size_t j = 0; j < blks.size(); ++j) {
+      ASSERT_EQ(blks[j].dxt_block, cpu_img.PhysicalBlocks()[j].dxt_block) << "Index: " << j;
+    }
+  }
+}
+
+TEST(GenTC, BackendsProduceTheSameOutput) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  std::vector<GenTC::DXTImage> dxt_imgs;
+  dxt_imgs.push_back(GenTC::DXTImage(fname.c_str(), NULL));
+  dxt_imgs.push_back(dxt_imgs.back());
+  dxt_imgs.push_back(dxt_imgs.back());
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > cmp_data =
+    std::move(GenTC::CompressDXTs(dxt_imgs, 2, &dictionary));
+
+  std::unique_ptr<GenTC::DecodeBackend> ocl = GenTC::CreateOpenCLBackend(gTestEnv->GetContext());
+  std::unique_ptr<GenTC::DecodeBackend> cpu = GenTC::CreateCPUBackend();
+  ASSERT_EQ(ocl->Type(), GenTC::eDecodeBackend_OpenCL);
+
+  for (auto output : { GenTC::eDecodeOutput_DXT, GenTC::eDecodeOutput_RGB }) {
+    std::vector<uint8_t> expected = cpu->Decode(cmp_data, dictionary, output);
+    EXPECT_EQ(ocl->Decode(cmp_data, dictionary, output), expected) << "Output: " << output;
+  }
+
+  // Without a context there's nothing to pick but the CPU
+  std::unique_ptr<GenTC::DecodeBackend> backend = GenTC::CreateDecodeBackend(nullptr);
+  EXPECT_EQ(backend->Type(), GenTC::eDecodeBackend_CPU);
+}
+
+TEST(GenTC, CanDecompressRegions) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  std::vector<GenTC::DXTImage> dxt_imgs;
+  dxt_imgs.push_back(GenTC::DXTImage(fname.c_str(), NULL));
+  dxt_imgs.push_back(dxt_imgs.back());
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > cmp_data =
+    std::move(GenTC::CompressDXTs(dxt_imgs, 2, &dictionary, ans::ocl::Geometry(), true));
+
+  const size_t w = dxt_imgs[0].Width();
+  const size_t h = dxt_imgs[0].Height();
+  const size_t regions[][4] = {
+    { 0, 0, w, h },
+    { 128, 256, 128, 128 },
+    { 4, 8, 12, 4 },
+    { 124, 60, 200, 264 },
+  };
+
+  std::unique_ptr<GenTC::DecodeBackend> ocl = GenTC::CreateOpenCLBackend(gTestEnv->GetContext());
+  GenTC::cpu::Decoder decoder;
+  for (const auto &data : cmp_data) {
+    for (const auto &r : regions) {
+      std::vector<uint8_t> expected = decoder.DecompressDXTRegion(data, dictionary, r[0], r[1], r[2], r[3]);
+      EXPECT_EQ(GenTC::DecompressDXTRegion(gTestEnv->GetContext(), data, dictionary, r[0], r[1], r[2], r[3]),
+                expected) << "Region: (" << r[0] << ", " << r[1] << ", " << r[2] << ", " << r[3] << ")";
+      EXPECT_EQ(ocl->DecodeRegion(data, dictionary, r[0], r[1], r[2], r[3]), expected);
+    }
+  }
+
+  // The whole texture decodes to the same blocks either way
+  std::vector<uint8_t> texture = decoder.DecompressDXTBuffer(cmp_data[0], dictionary);
+  EXPECT_EQ(GenTC::DecompressDXTRegion(gTestEnv->GetContext(), cmp_data[0], dictionary, 0, 0, w, h), texture);
+}
+
+TEST(GenTC, CanDecompressPreviews) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  std::vector<GenTC::DXTImage> dxt_imgs;
+  dxt_imgs.push_back(GenTC::DXTImage(fname.c_str(), NULL));
+  dxt_imgs.push_back(dxt_imgs.back());
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > cmp_data = std::move(GenTC::CompressDXTs(
+    dxt_imgs, 2, &dictionary, ans::ocl::Geometry(), false, GenTC::eCoefficientOrder_Bands));
+
+  // Full decodes of band ordered textures gather the bands back into tiles
+  std::unique_ptr<GenTC::DecodeBackend> cpu = GenTC::CreateCPUBackend();
+  std::unique_ptr<GenTC::DecodeBackend> ocl = GenTC::CreateOpenCLBackend(gTestEnv->GetContext());
+  for (auto output : { GenTC::eDecodeOutput_DXT, GenTC::eDecodeOutput_RGB }) {
+    EXPECT_EQ(ocl->Decode(cmp_data, dictionary, output), cpu->Decode(cmp_data, dictionary, output))
+      << "Output: " << output;
+  }
+
+  for (size_t scale : { 1, 2, 4, 8 }) {
+    for (auto output : { GenTC::eDecodeOutput_DXT, GenTC::eDecodeOutput_RGB }) {
+      std::vector<uint8_t> expected = cpu->DecodePreview(cmp_data[0], dictionary, scale, output);
+      EXPECT_EQ(GenTC::DecompressPreview(gTestEnv->GetContext(), cmp_data[0], dictionary, scale, output),
+                expected) << "Scale: " << scale << ", Output: " << output;
+      EXPECT_EQ(ocl->DecodePreview(cmp_data[1], dictionary, scale, output), expected);
+    }
+  }
+}
+
+TEST(GenTC, CanDecompressMipChains) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+  std::vector<GenTC::DXTImage> levels = GenTC::GenerateMipChain(dxt_img);
+  ASSERT_EQ(levels.size(), 10U);
+  EXPECT_EQ(levels.back().Width(), 1);
+  EXPECT_EQ(levels.back().Height(), 1);
+  std::vector<uint8_t> cmp_data = GenTC::CompressDXTMipChain(levels);
+
+  GenTC::cpu::Decoder decoder;
+  std::vector<std::vector<uint8_t> > expected = decoder.DecompressDXTMipChain(cmp_data);
+  ASSERT_EQ(expected.size(), levels.size());
+  EXPECT_EQ(GenTC::DecompressDXTMipChain(gTestEnv->GetContext(), cmp_data), expected);
+
+  // Batches with textures of different sizes decode the same way
+  std::vector<std::vector<uint8_t> > cmp_levels;
+  std::vector<uint8_t> dictionary;
+  ASSERT_TRUE(GenTC::LoadMipChain(cmp_data, &cmp_levels, &dictionary));
+  cmp_levels.push_back(cmp_levels[0]);
+
+  std::unique_ptr<GenTC::DecodeBackend> cpu = GenTC::CreateCPUBackend();
+  std::unique_ptr<GenTC::DecodeBackend> ocl = GenTC::CreateOpenCLBackend(gTestEnv->GetContext());
+  EXPECT_EQ(ocl->Decode(cmp_levels, dictionary, GenTC::eDecodeOutput_DXT),
+            cpu->Decode(cmp_levels, dictionary, GenTC::eDecodeOutput_DXT));
+}
+
+// Crops the top left width x height pixels out of the test image
+static GenTC::DXTImage CropTestImage(size_t width, size_t height) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage src_img(fname.c_str(), NULL);
+  std::vector<uint8_t> pixels(3 * width * height);
+  for (size_t y = 0; y < height; ++y) {
+    memcpy(pixels.data() + 3 * y * width,
+           src_img.SourceImage().data() + 3 * y * src_img.Width(), 3 * width);
+  }
+  return GenTC::DXTImage(static_cast<int>(width), static_cast<int>(height), pixels.data());
+}
+
+TEST(GenTC, CanDecompressArbitraryDimensions) {
+  // Crop the test image to sizes that aren't multiples of a tile, or of a block
+  std::vector<GenTC::DXTImage> imgs;
+  imgs.push_back(CropTestImage(301, 214));
+  imgs.push_back(CropTestImage(130, 7));
+
+  std::vector<uint8_t> cmp_data = GenTC::CompressDXTWithTileIndex(imgs[0]);
+  GenTC::DXTImage cmp_img = GenTC::DecompressDXT(gTestEnv->GetContext(), cmp_data);
+  const std::vector<GenTC::PhysicalDXTBlock> &blks = imgs[0].PhysicalBlocks();
+  ASSERT_EQ(blks.size(), cmp_img.PhysicalBlocks().size());
+  for (size_t i = 0; i < blks.size(); ++i) {
+    EXPECT_EQ(blks[i].dxt_block, cmp_img.PhysicalBlocks()[i].dxt_block) << "Index: " << i;
+  }
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > batch = GenTC::CompressDXTs(imgs, 2, &dictionary);
+  batch.push_back(batch[0]);
+
+  std::unique_ptr<GenTC::DecodeBackend> cpu = GenTC::CreateCPUBackend();
+  std::unique_ptr<GenTC::DecodeBackend> ocl = GenTC::CreateOpenCLBackend(gTestEnv->GetContext());
+  for (auto output : { GenTC::eDecodeOutput_DXT, GenTC::eDecodeOutput_RGB }) {
+    EXPECT_EQ(ocl->Decode(batch, dictionary, output), cpu->Decode(batch, dictionary, output));
+  }
+
+  EXPECT_EQ(ocl->DecodeRegion(cmp_data, std::vector<uint8_t>(), 256, 180, 48, 36),
+            cpu->DecodeRegion(cmp_data, std::vector<uint8_t>(), 256, 180, 48, 36));
+
+  std::vector<uint8_t> preview_data = GenTC::CompressDXTWithPreview(imgs[0]);
+  for (auto output : { GenTC::eDecodeOutput_DXT, GenTC::eDecodeOutput_RGB }) {
+    EXPECT_EQ(ocl->DecodePreview(preview_data, std::vector<uint8_t>(), 4, output),
+              cpu->DecodePreview(preview_data, std::vector<uint8_t>(), 4, output));
+  }
+}
+
+TEST(GenTC, CanDecompressBatchesWithMixedDimensions) {
+  // Small textures on either side of large ones, with their coefficients in
+  // band order so that the bands are gathered across the whole batch too
+  std::vector<std::vector<uint8_t> > batch;
+  const size_t sizes[][2] = { { 130, 7 }, { 301, 214 }, { 64, 64 }, { 130, 7 }, { 256, 132 } };
+  for (const auto &sz : sizes) {
+    batch.push_back(GenTC::CompressDXTWithPreview(CropTestImage(sz[0], sz[1])));
+  }
+
+  std::unique_ptr<GenTC::DecodeBackend> cpu = GenTC::CreateCPUBackend();
+  std::unique_ptr<GenTC::DecodeBackend> ocl = GenTC::CreateOpenCLBackend(gTestEnv->GetContext());
+  const std::vector<uint8_t> dictionary;
+  EXPECT_EQ(ocl->Decode(batch, dictionary, GenTC::eDecodeOutput_DXT),
+            cpu->Decode(batch, dictionary, GenTC::eDecodeOutput_DXT));
+
+  // Textures decoded to pixels in one batch all need to be the same width
+  std::vector<std::vector<uint8_t> > rgb_batch = { batch[0], batch[3], batch[0] };
+  EXPECT_EQ(ocl->Decode(rgb_batch, dictionary, GenTC::eDecodeOutput_RGB),
+            cpu->Decode(rgb_batch, dictionary, GenTC::eDecodeOutput_RGB));
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   gTestEnv = dynamic_cast<OpenCLEnvironment *>(
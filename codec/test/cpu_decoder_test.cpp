@@ -0,0 +1,876 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "cpu_decoder.h"
+#include "decode_backend.h"
+#include "encoder.h"
+#include "dxt_image.h"
+#include "tile_index.h"
+#include "test_config.h"
+
+static std::string TestImagePath() {
+  std::string dir(CODEC_TEST_DIR);
+  return dir + std::string("/") + std::string("test1.png");
+}
+
+static void ExpectSameBlocks(const GenTC::DXTImage &expected, const GenTC::DXTImage &actual) {
+  const std::vector<GenTC::PhysicalDXTBlock> &blks = expected.PhysicalBlocks();
+  ASSERT_EQ(blks.size(), actual.PhysicalBlocks().size());
+  for (size_t i = 0; i < blks.size(); ++i) {
+    EXPECT_EQ(blks[i].dxt_block, actual.PhysicalBlocks()[i].dxt_block) << "Index: " << i;
+  }
+}
+
+TEST(CPUDecoder, CanDecompressImage) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+  std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img));
+
+  GenTC::cpu::Decoder decoder(1);
+  std::vector<uint8_t> expected = decoder.DecompressDXTBuffer(cmp_data);
+  ExpectSameBlocks(dxt_img, GenTC::DXTImage(dxt_img.Width(), dxt_img.Height(), expected));
+
+  // The output doesn't depend on how the work is split up
+  for (size_t num_threads : { 2, 3, 0 }) {
+    GenTC::cpu::Decoder threaded_decoder(num_threads);
+    EXPECT_EQ(threaded_decoder.DecompressDXTBuffer(cmp_data), expected) << "Threads: " << num_threads;
+  }
+}
+
+TEST(CPUDecoder, CanDecompressImageWithSeveralPaletteStrips) {
+  // The test image repeated side by side has enough blocks that the encoder
+  // searches for palette entries in more than one strip.
+  GenTC::DXTImage src_img(TestImagePath().c_str(), NULL);
+  const size_t width = 1500;
+  const size_t height = src_img.Height();
+  std::vector<uint8_t> pixels(3 * width * height);
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      const size_t src_x = x % src_img.Width();
+      memcpy(pixels.data() + 3 * (y * width + x),
+             src_img.SourceImage().data() + 3 * (y * src_img.Width() + src_x), 3);
+    }
+  }
+
+  GenTC::DXTImage dxt_img(static_cast<int>(width), static_cast<int>(height), pixels.data());
+  ASSERT_EQ(dxt_img.IndexDiffs().size(), dxt_img.PhysicalBlocks().size());
+
+  std::vector<uint8_t> cmp_data = GenTC::CompressDXT(dxt_img);
+  GenTC::cpu::Decoder decoder;
+  ExpectSameBlocks(dxt_img, GenTC::DXTImage(dxt_img.Width(), dxt_img.Height(),
+                                            decoder.DecompressDXTBuffer(cmp_data)));
+}
+
+TEST(CPUDecoder, CanDecompressOtherGeometries) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+
+  // Tables larger than the SIMD decoder supports, and groups with more
+  // streams than it supports, use the reference decoder
+  const ans::ocl::Geometry geoms[] = {
+    ans::ocl::Geometry(1 << 12, 256, 64),
+    ans::ocl::Geometry(1 << 10, 128, 8),
+    ans::ocl::Geometry(1 << 13, 256, 32),
+    ans::ocl::Geometry(1 << 11, 256, 128),
+    ans::ocl::Geometry(1 << 11, 128, 256),
+  };
+
+  GenTC::cpu::Decoder decoder;
+  for (const auto &geom : geoms) {
+    std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img, geom));
+    ExpectSameBlocks(dxt_img, decoder.DecompressDXT(cmp_data));
+  }
+}
+
+TEST(CPUDecoder, CanDecompressBatchWithSharedTables) {
+  std::vector<GenTC::DXTImage> dxt_imgs;
+  dxt_imgs.push_back(GenTC::DXTImage(TestImagePath().c_str(), NULL));
+  dxt_imgs.push_back(dxt_imgs.back());
+  dxt_imgs.push_back(dxt_imgs.back());
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > cmp_data =
+    std::move(GenTC::CompressDXTs(dxt_imgs, 2, &dictionary));
+
+  GenTC::cpu::Decoder decoder;
+  std::vector<std::vector<uint8_t> > decmp_data = decoder.DecompressDXTBuffers(cmp_data, dictionary);
+  ASSERT_EQ(decmp_data.size(), dxt_imgs.size());
+
+  for (size_t i = 0; i < dxt_imgs.size(); ++i) {
+    ExpectSameBlocks(dxt_imgs[i], GenTC::DXTImage(dxt_imgs[i].Width(), dxt_imgs[i].Height(),
+                                                  decmp_data[i]));
+    EXPECT_EQ(decoder.DecompressDXTBuffer(cmp_data[i], dictionary), decmp_data[i]);
+  }
+}
+
+// Checks the blocks of a region against the same blocks of the whole texture
+static void ExpectSameRegion(const std::vector<uint8_t> &texture, size_t width,
+                             const std::vector<uint8_t> &region,
+                             size_t x, size_t y, size_t region_width, size_t region_height) {
+  const size_t row_sz = 2 * region_width;
+  ASSERT_EQ(region.size(), row_sz * region_height / 4);
+  for (size_t i = 0; i < region_height / 4; ++i) {
+    const uint8_t *expected = texture.data() + ((y / 4 + i) * (width / 4) + x / 4) * 8;
+    EXPECT_TRUE(std::equal(expected, expected + row_sz, region.data() + i * row_sz))
+      << "Region: (" << x << ", " << y << ", " << region_width << ", " << region_height
+      << "), block row: " << i;
+  }
+}
+
+TEST(CPUDecoder, CanDecompressRegions) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+  const size_t w = dxt_img.Width();
+  const size_t h = dxt_img.Height();
+
+  // Whole tiles, parts of tiles, single blocks and the whole texture
+  const size_t regions[][4] = {
+    { 0, 0, w, h },
+    { 0, 0, 128, 128 },
+    { 128, 256, 128, 128 },
+    { 4, 8, 12, 4 },
+    { 124, 60, 200, 264 },
+    { w - 4, h - 4, 4, 4 },
+    { 36, 0, 400, h },
+  };
+
+  // Groups that are smaller than a tile, the same size and larger
+  const ans::ocl::Geometry geoms[] = {
+    ans::ocl::Geometry(),
+    ans::ocl::Geometry(1 << 10, 128, 8),
+    ans::ocl::Geometry(1 << 12, 256, 64),
+  };
+
+  for (const auto &geom : geoms) {
+    std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXTWithTileIndex(dxt_img, geom));
+
+    GenTC::GenTCHeader hdr;
+    hdr.LoadFrom(cmp_data.data());
+    std::vector<GenTC::TileInfo> tiles;
+    ASSERT_TRUE(GenTC::LoadTileIndex(hdr, cmp_data, &tiles));
+    EXPECT_EQ(tiles.size(), (w / GenTC::kTileDim) * (h / GenTC::kTileDim));
+
+    for (size_t num_threads : { 1, 0 }) {
+      GenTC::cpu::Decoder decoder(num_threads);
+      const std::vector<uint8_t> texture = decoder.DecompressDXTBuffer(cmp_data);
+      ExpectSameBlocks(dxt_img, GenTC::DXTImage(dxt_img.Width(), dxt_img.Height(), texture));
+
+      for (const auto &r : regions) {
+        ExpectSameRegion(texture, w, decoder.DecompressDXTRegion(cmp_data, r[0], r[1], r[2], r[3]),
+                         r[0], r[1], r[2], r[3]);
+      }
+    }
+  }
+
+  // Textures without a tile index say so
+  std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img));
+  GenTC::GenTCHeader hdr;
+  hdr.LoadFrom(cmp_data.data());
+  std::vector<GenTC::TileInfo> tiles;
+  EXPECT_FALSE(GenTC::LoadTileIndex(hdr, cmp_data, &tiles));
+}
+
+TEST(CPUDecoder, CanDecompressRegionsWithSharedTables) {
+  std::vector<GenTC::DXTImage> dxt_imgs;
+  dxt_imgs.push_back(GenTC::DXTImage(TestImagePath().c_str(), NULL));
+  dxt_imgs.push_back(dxt_imgs.back());
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > cmp_data =
+    std::move(GenTC::CompressDXTs(dxt_imgs, 2, &dictionary, ans::ocl::Geometry(), true));
+
+  GenTC::cpu::Decoder decoder;
+  std::unique_ptr<GenTC::DecodeBackend> backend = GenTC::CreateCPUBackend();
+  const size_t w = dxt_imgs[0].Width();
+  for (const auto &data : cmp_data) {
+    const std::vector<uint8_t> texture = decoder.DecompressDXTBuffer(data, dictionary);
+    ExpectSameRegion(texture, w, decoder.DecompressDXTRegion(data, dictionary, 96, 200, 64, 100),
+                     96, 200, 64, 100);
+    ExpectSameRegion(texture, w, backend->DecodeRegion(data, dictionary, 60, 4, 200, 132),
+                     60, 4, 200, 132);
+  }
+}
+
+// What the assemble_rgb kernel produces from the DXT1 blocks of a texture
+static std::vector<uint8_t> AssembleRGB(const std::vector<uint8_t> &blocks, size_t width, size_t height) {
+  std::vector<uint8_t> rgb(width * height * 3);
+  for (size_t i = 0; i < width * height / 16; ++i) {
+    uint16_t eps[2];
+    uint32_t idx;
+    memcpy(eps, blocks.data() + 8 * i, sizeof(eps));
+    memcpy(&idx, blocks.data() + 8 * i + 4, sizeof(idx));
+
+    int palette[4][3];
+    for (size_t j = 0; j < 2; ++j) {
+      const int r = (eps[j] >> 11) & 0x1F;
+      const int g = (eps[j] >> 5) & 0x3F;
+      const int b = eps[j] & 0x1F;
+      palette[j][0] = (r << 3) | (r >> 2);
+      palette[j][1] = (g << 2) | (g >> 4);
+      palette[j][2] = (b << 3) | (b >> 2);
+    }
+
+    for (size_t c = 0; c < 3; ++c) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    const size_t bx = i % (width / 4);
+    const size_t by = i / (width / 4);
+    for (size_t p = 0; p < 16; ++p) {
+      const size_t x = 4 * bx + (p % 4);
+      const size_t y = 4 * by + (p / 4);
+      for (size_t c = 0; c < 3; ++c) {
+        rgb[3 * (y * width + x) + c] = static_cast<uint8_t>(palette[(idx >> (2 * p)) & 3][c]);
+      }
+    }
+  }
+  return std::move(rgb);
+}
+
+TEST(CPUDecoder, CanDecompressToRGB) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+  std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img));
+
+  const size_t w = dxt_img.Width();
+  const size_t h = dxt_img.Height();
+
+  GenTC::cpu::Decoder decoder;
+  const std::vector<uint8_t> expected = AssembleRGB(decoder.DecompressDXTBuffer(cmp_data), w, h);
+
+  for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+    ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+    if (!ans::simd::IsSupported(is)) {
+      continue;
+    }
+
+    std::vector<uint8_t> rgb(w * h * 3);
+    decoder.DecompressRGB(cmp_data, GenTC::cpu::ePixelFormat_RGB8, rgb.data(), 3 * w, is);
+    EXPECT_EQ(rgb, expected) << "Instruction set: " << set;
+
+    // Rows with padding at the end of them keep the padding as it was
+    const size_t pitch = 4 * w + 12;
+    std::vector<uint8_t> rgba(pitch * h, 0xCD);
+    decoder.DecompressRGB(cmp_data, GenTC::cpu::ePixelFormat_RGBA8, rgba.data(), pitch, is);
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) {
+        const uint8_t *pixel = rgba.data() + y * pitch + 4 * x;
+        const uint8_t *expected_pixel = expected.data() + 3 * (y * w + x);
+        ASSERT_EQ(pixel[0], expected_pixel[0]) << "Instruction set: " << set;
+        ASSERT_EQ(pixel[1], expected_pixel[1]) << "Instruction set: " << set;
+        ASSERT_EQ(pixel[2], expected_pixel[2]) << "Instruction set: " << set;
+        ASSERT_EQ(pixel[3], 0xFF) << "Instruction set: " << set;
+      }
+
+      for (size_t i = 4 * w; i < pitch; ++i) {
+        ASSERT_EQ(rgba[y * pitch + i], 0xCD) << "Instruction set: " << set;
+      }
+    }
+  }
+}
+
+TEST(CPUDecoder, CanDecompressPreviews) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+  std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXTWithPreview(dxt_img));
+
+  const size_t w = dxt_img.Width();
+  const size_t h = dxt_img.Height();
+
+  // Band order only changes how the coefficients are stored...
+  GenTC::cpu::Decoder decoder;
+  const std::vector<uint8_t> texture = decoder.DecompressDXTBuffer(cmp_data);
+  ExpectSameBlocks(dxt_img, GenTC::DXTImage(w, h, texture));
+
+  // ... and at full size the preview is the texture.
+  EXPECT_EQ(decoder.DecompressDXTPreview(cmp_data, 1), texture);
+
+  const std::vector<uint8_t> texture_rgb = AssembleRGB(texture, w, h);
+  for (size_t scale : { 2, 4, 8 }) {
+    const size_t pw = w / scale;
+    const size_t ph = h / scale;
+    const std::vector<uint8_t> preview = decoder.DecompressDXTPreview(cmp_data, scale);
+    ASSERT_EQ(preview.size(), pw * ph / 2);
+
+    // Each block keeps the indices of the block at the same position
+    for (size_t y = 0; y < ph / 4; ++y) {
+      for (size_t x = 0; x < pw / 4; ++x) {
+        const uint8_t *blk = preview.data() + 8 * (y * (pw / 4) + x);
+        const uint8_t *expected = texture.data() + 8 * (scale * y * (w / 4) + scale * x);
+        ASSERT_EQ(memcmp(blk + 4, expected + 4, 4), 0) << "Scale: " << scale;
+      }
+    }
+
+    std::vector<uint8_t> rgb(pw * ph * 3);
+    decoder.DecompressRGBPreview(cmp_data, std::vector<uint8_t>(), scale,
+                                 GenTC::cpu::ePixelFormat_RGB8, rgb.data(), 3 * pw);
+    EXPECT_EQ(rgb, AssembleRGB(preview, pw, ph)) << "Scale: " << scale;
+
+    // The low-pass endpoints keep the average color of each block close to
+    // the average color of the part of the texture that it covers.
+    double error = 0.0;
+    for (size_t by = 0; by < ph / 4; ++by) {
+      for (size_t bx = 0; bx < pw / 4; ++bx) {
+        for (size_t c = 0; c < 3; ++c) {
+          double preview_sum = 0.0;
+          for (size_t p = 0; p < 16; ++p) {
+            preview_sum += rgb[3 * ((4 * by + p / 4) * pw + 4 * bx + p % 4) + c];
+          }
+
+          double texture_sum = 0.0;
+          for (size_t y = 4 * scale * by; y < 4 * scale * (by + 1); ++y) {
+            for (size_t x = 4 * scale * bx; x < 4 * scale * (bx + 1); ++x) {
+              texture_sum += texture_rgb[3 * (y * w + x) + c];
+            }
+          }
+
+          error += std::abs(preview_sum / 16.0 - texture_sum / static_cast<double>(16 * scale * scale));
+        }
+      }
+    }
+    error /= static_cast<double>(3 * (pw / 4) * (ph / 4));
+    std::cout << "Preview at 1/" << scale << ": mean error " << error << std::endl;
+    EXPECT_LT(error, 24.0) << "Scale: " << scale;
+  }
+
+  // Batches in band order decode the same way
+  std::vector<GenTC::DXTImage> dxt_imgs(2, dxt_img);
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > batch = std::move(GenTC::CompressDXTs(
+    dxt_imgs, 2, &dictionary, ans::ocl::Geometry(), false, GenTC::eCoefficientOrder_Bands));
+  std::vector<std::vector<uint8_t> > decoded = decoder.DecompressDXTBuffers(batch, dictionary);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    EXPECT_EQ(decoded[i], texture);
+    EXPECT_EQ(decoder.DecompressDXTPreview(batch[i], dictionary, 4),
+              decoder.DecompressDXTPreview(cmp_data, 4));
+  }
+
+  // The backend decodes previews the same way
+  std::unique_ptr<GenTC::DecodeBackend> backend = GenTC::CreateCPUBackend(2);
+  const std::vector<uint8_t> preview = decoder.DecompressDXTPreview(batch[0], dictionary, 2);
+  EXPECT_EQ(backend->DecodePreview(batch[0], dictionary, 2, GenTC::eDecodeOutput_DXT), preview);
+  EXPECT_EQ(backend->DecodePreview(batch[0], dictionary, 2, GenTC::eDecodeOutput_RGB),
+            AssembleRGB(preview, w / 2, h / 2));
+}
+
+// The top-left width x height pixels of the test image
+static GenTC::DXTImage CropTestImage(size_t width, size_t height) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+  const std::vector<uint8_t> &src = dxt_img.SourceImage();
+  std::vector<uint8_t> pixels(3 * width * height);
+  for (size_t y = 0; y < height; ++y) {
+    memcpy(pixels.data() + 3 * y * width, src.data() + 3 * y * dxt_img.Width(), 3 * width);
+  }
+  return GenTC::DXTImage(static_cast<int>(width), static_cast<int>(height), pixels.data());
+}
+
+TEST(CPUDecoder, CanDecompressArbitraryDimensions) {
+  const size_t w = 301;
+  const size_t h = 214;
+  GenTC::DXTImage dxt_img = CropTestImage(w, h);
+  ASSERT_EQ(dxt_img.BlocksWide(), 76);
+  ASSERT_EQ(dxt_img.BlocksHigh(), 54);
+
+  std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXTWithTileIndex(dxt_img));
+  GenTC::GenTCHeader hdr;
+  hdr.LoadFrom(cmp_data.data());
+  EXPECT_EQ(hdr.width, w);
+  EXPECT_EQ(hdr.height, h);
+  EXPECT_EQ(hdr.CodedBlocksWide(), 96U);
+  EXPECT_EQ(hdr.CodedBlocksHigh(), 64U);
+
+  // Only the blocks that cover the texture come out...
+  GenTC::cpu::Decoder decoder;
+  const std::vector<uint8_t> texture = decoder.DecompressDXTBuffer(cmp_data);
+  ASSERT_EQ(texture.size(), 8U * 76U * 54U);
+  ExpectSameBlocks(dxt_img, GenTC::DXTImage(w, h, texture));
+
+  // ... and only the pixels of the texture when decoding to RGB.
+  const std::vector<uint8_t> blocks_rgb = AssembleRGB(texture, 4 * 76, 4 * 54);
+  std::vector<uint8_t> expected(3 * w * h);
+  for (size_t y = 0; y < h; ++y) {
+    memcpy(expected.data() + 3 * y * w, blocks_rgb.data() + 3 * y * 4 * 76, 3 * w);
+  }
+
+  for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+    ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+    if (!ans::simd::IsSupported(is)) {
+      continue;
+    }
+
+    const size_t pitch = 3 * w + 5;
+    std::vector<uint8_t> rgb(pitch * h + 7, 0xCD);
+    decoder.DecompressRGB(cmp_data, GenTC::cpu::ePixelFormat_RGB8, rgb.data(), pitch, is);
+    for (size_t y = 0; y < h; ++y) {
+      ASSERT_TRUE(std::equal(expected.data() + 3 * y * w, expected.data() + 3 * (y + 1) * w,
+                             rgb.data() + y * pitch)) << "Instruction set: " << set << ", row: " << y;
+      for (size_t i = 3 * w; i < pitch; ++i) {
+        ASSERT_EQ(rgb[y * pitch + i], 0xCD) << "Instruction set: " << set;
+      }
+    }
+    for (size_t i = pitch * h; i < rgb.size(); ++i) {
+      ASSERT_EQ(rgb[i], 0xCD) << "Instruction set: " << set;
+    }
+  }
+
+  // Regions can take in the blocks along the edges
+  ExpectSameRegion(texture, 4 * 76, decoder.DecompressDXTRegion(cmp_data, 256, 180, 48, 36),
+                   256, 180, 48, 36);
+
+  // Batches of textures of different sizes, some of them odd, decode the
+  // same as each texture on its own.
+  GenTC::DXTImage small_img = CropTestImage(130, 7);
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > batch =
+    GenTC::CompressDXTs({ dxt_img, small_img, dxt_img }, 2, &dictionary);
+  std::vector<std::vector<uint8_t> > decoded = decoder.DecompressDXTBuffers(batch, dictionary);
+  ASSERT_EQ(decoded.size(), 3U);
+  EXPECT_EQ(decoded[0], texture);
+  EXPECT_EQ(decoded[2], texture);
+  ExpectSameBlocks(small_img, GenTC::DXTImage(130, 7, decoded[1]));
+
+  std::unique_ptr<GenTC::DecodeBackend> backend = GenTC::CreateCPUBackend(2);
+  std::vector<uint8_t> dxt_batch = backend->Decode(batch, dictionary, GenTC::eDecodeOutput_DXT);
+  ASSERT_EQ(dxt_batch.size(), 2 * texture.size() + decoded[1].size());
+  EXPECT_TRUE(std::equal(texture.begin(), texture.end(), dxt_batch.begin()));
+
+  // Each texture of a batch of different widths is decoded to RGB at its
+  // own width, right after the one before it.
+  std::vector<uint8_t> rgb_batch = backend->Decode(batch, dictionary, GenTC::eDecodeOutput_RGB);
+  ASSERT_EQ(rgb_batch.size(), 2 * expected.size() + 3U * 130U * 7U);
+  std::vector<uint8_t> small_rgb(3 * 130 * 7);
+  decoder.DecompressRGB(batch[1], dictionary, GenTC::cpu::ePixelFormat_RGB8, small_rgb.data(), 3 * 130);
+  EXPECT_TRUE(std::equal(expected.begin(), expected.end(), rgb_batch.begin()));
+  EXPECT_TRUE(std::equal(small_rgb.begin(), small_rgb.end(), rgb_batch.begin() + expected.size()));
+  EXPECT_TRUE(std::equal(expected.begin(), expected.end(),
+                         rgb_batch.begin() + expected.size() + small_rgb.size()));
+
+  // Previews round up to whole pixels
+  std::vector<uint8_t> preview_data = std::move(GenTC::CompressDXTWithPreview(dxt_img));
+  EXPECT_EQ(decoder.DecompressDXTBuffer(preview_data), texture);
+  const std::vector<uint8_t> preview = decoder.DecompressDXTPreview(preview_data, 4);
+  EXPECT_EQ(preview.size(), 8U * 19U * 14U);
+  EXPECT_EQ(backend->DecodePreview(preview_data, std::vector<uint8_t>(), 4,
+                                   GenTC::eDecodeOutput_RGB).size(), 3U * 76U * 54U);
+}
+
+TEST(CPUDecoder, RejectsBadRegionsAndTileIndices) {
+  GenTC::DXTImage dxt_img = CropTestImage(256, 128);
+  const size_t w = dxt_img.Width();
+  const size_t h = dxt_img.Height();
+  const std::vector<uint8_t> cmp_data = GenTC::CompressDXTWithTileIndex(dxt_img);
+
+  GenTC::cpu::Decoder decoder;
+  ASSERT_FALSE(decoder.DecompressDXTRegion(cmp_data, 0, 0, w, h).empty());
+
+  // Regions that are empty, unaligned or outside of the texture
+  const size_t huge = std::numeric_limits<size_t>::max() & ~static_cast<size_t>(3);
+  const size_t regions[][4] = {
+    { 0, 0, 0, 4 },
+    { 0, 0, 4, 0 },
+    { 2, 0, 4, 4 },
+    { 0, 0, 6, 4 },
+    { 0, 2, 4, 4 },
+    { 0, 0, 4, 6 },
+    { w, 0, 4, 4 },
+    { 0, h, 4, 4 },
+    { 0, 0, w + 4, h },
+    { 4, 0, w, h },
+    { huge, 0, 8, 4 },
+    { 8, 0, huge, 4 },
+    { 0, huge, 4, 8 },
+  };
+  for (const auto &r : regions) {
+    EXPECT_TRUE(decoder.DecompressDXTRegion(cmp_data, r[0], r[1], r[2], r[3]).empty())
+      << "Region: (" << r[0] << ", " << r[1] << ", " << r[2] << ", " << r[3] << ")";
+  }
+
+  // Textures without a tile index, or with one that doesn't match the
+  // texture or refers to palette entries that it doesn't have
+  GenTC::GenTCHeader hdr;
+  ASSERT_TRUE(hdr.LoadFrom(cmp_data));
+  const size_t tile_index_sz_offset = offsetof(GenTC::GenTCHeader, tile_index_sz);
+  const size_t palette_end_offset = hdr.StreamsEnd() + offsetof(GenTC::TileInfo, palette_end);
+  auto with_field = [&cmp_data](size_t offset, uint32_t val) {
+    std::vector<uint8_t> result = cmp_data;
+    memcpy(result.data() + offset, &val, sizeof(val));
+    return result;
+  };
+
+  const std::vector<std::vector<uint8_t> > malformed = {
+    GenTC::CompressDXT(dxt_img),
+    with_field(tile_index_sz_offset, hdr.tile_index_sz - 1),
+    with_field(tile_index_sz_offset, 0xFFFFFFFF),
+    with_field(palette_end_offset, 0xFFFFFFFF),
+  };
+  for (const auto &data : malformed) {
+    std::vector<GenTC::TileInfo> tiles;
+    GenTC::GenTCHeader bad_hdr;
+    if (bad_hdr.LoadFrom(data) && GenTC::LoadTileIndex(bad_hdr, data, &tiles)) {
+      GenTC::RegionPlan plan;
+      EXPECT_FALSE(GenTC::PlanRegion(bad_hdr, tiles, 0, 0, 4, 4, &plan));
+    }
+    EXPECT_TRUE(decoder.DecompressDXTRegion(data, 0, 0, 4, 4).empty());
+  }
+}
+
+TEST(CPUDecoder, CanDecompressMipChains) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+  std::vector<GenTC::DXTImage> levels = GenTC::GenerateMipChain(dxt_img);
+
+  // The chain goes all the way down to 1x1
+  ASSERT_EQ(dxt_img.Width(), 512);
+  ASSERT_EQ(dxt_img.Height(), 512);
+  ASSERT_EQ(levels.size(), 10U);
+  for (size_t i = 0; i < levels.size(); ++i) {
+    EXPECT_EQ(levels[i].Width(), dxt_img.Width() >> i);
+    EXPECT_EQ(levels[i].Height(), dxt_img.Height() >> i);
+  }
+
+  // Odd sides round up
+  const std::vector<GenTC::DXTImage> odd_levels = GenTC::GenerateMipChain(CropTestImage(301, 7));
+  const int odd_sizes[][2] = {
+    { 301, 7 }, { 151, 4 }, { 76, 2 }, { 38, 1 }, { 19, 1 }, { 10, 1 }, { 5, 1 }, { 3, 1 },
+    { 2, 1 }, { 1, 1 }
+  };
+  ASSERT_EQ(odd_levels.size(), sizeof(odd_sizes) / sizeof(odd_sizes[0]));
+  for (size_t i = 0; i < odd_levels.size(); ++i) {
+    EXPECT_EQ(odd_levels[i].Width(), odd_sizes[i][0]) << "Level: " << i;
+    EXPECT_EQ(odd_levels[i].Height(), odd_sizes[i][1]) << "Level: " << i;
+  }
+
+  std::vector<uint8_t> cmp_data = GenTC::CompressDXTMipChain(levels);
+
+  GenTC::cpu::Decoder decoder;
+  std::vector<std::vector<uint8_t> > decoded = decoder.DecompressDXTMipChain(cmp_data);
+  ASSERT_EQ(decoded.size(), levels.size());
+  for (size_t i = 0; i < levels.size(); ++i) {
+    ExpectSameBlocks(levels[i], GenTC::DXTImage(levels[i].Width(), levels[i].Height(), decoded[i]));
+  }
+
+  // The levels can also be decoded as an ordinary batch
+  std::vector<std::vector<uint8_t> > cmp_levels;
+  std::vector<uint8_t> dictionary;
+  ASSERT_TRUE(GenTC::LoadMipChain(cmp_data, &cmp_levels, &dictionary));
+  EXPECT_FALSE(dictionary.empty());
+  EXPECT_EQ(decoder.DecompressDXTBuffers(cmp_levels, dictionary), decoded);
+
+  // Single textures aren't mip chains
+  EXPECT_FALSE(GenTC::LoadMipChain(cmp_levels[0], &cmp_levels, &dictionary));
+
+  // Malformed and truncated chains are rejected
+  auto with_field = [&cmp_data](size_t offset, uint32_t val) {
+    std::vector<uint8_t> result = cmp_data;
+    memcpy(result.data() + offset, &val, sizeof(val));
+    return result;
+  };
+
+  const size_t num_levels_offset = offsetof(GenTC::GenTCMipChainHeader, num_levels);
+  const size_t dictionary_sz_offset = offsetof(GenTC::GenTCMipChainHeader, dictionary_sz);
+  const size_t level_sz_offset = offsetof(GenTC::GenTCMipChainHeader, level_sz);
+  const std::vector<std::vector<uint8_t> > malformed = {
+    with_field(num_levels_offset, 0),
+    with_field(num_levels_offset, GenTC::kMaxMipLevels + 1),
+    with_field(dictionary_sz_offset, static_cast<uint32_t>(dictionary.size() + 1)),
+    with_field(dictionary_sz_offset, static_cast<uint32_t>(cmp_data.size() / GenTC::kFreqTableSz + 1) * GenTC::kFreqTableSz),
+    with_field(level_sz_offset, 0xFFFFFFFF),
+    std::vector<uint8_t>(cmp_data.begin(), cmp_data.end() - 1),
+    std::vector<uint8_t>(cmp_data.begin(), cmp_data.begin() + sizeof(GenTC::GenTCMipChainHeader) - 1),
+  };
+
+  for (const auto &data : malformed) {
+    EXPECT_FALSE(GenTC::LoadMipChain(data, &cmp_levels, &dictionary));
+    EXPECT_TRUE(decoder.DecompressDXTMipChain(data).empty());
+  }
+
+  std::vector<std::vector<uint8_t> > odd_decoded =
+    decoder.DecompressDXTMipChain(GenTC::CompressDXTMipChain(odd_levels));
+  ASSERT_EQ(odd_decoded.size(), odd_levels.size());
+  for (size_t i = 0; i < odd_levels.size(); ++i) {
+    ExpectSameBlocks(odd_levels[i], GenTC::DXTImage(odd_levels[i].Width(), odd_levels[i].Height(),
+                                                    odd_decoded[i]));
+  }
+}
+
+TEST(CPUDecoder, BackendDecodesBatches) {
+  std::vector<GenTC::DXTImage> dxt_imgs;
+  dxt_imgs.push_back(GenTC::DXTImage(TestImagePath().c_str(), NULL));
+  dxt_imgs.push_back(dxt_imgs.back());
+
+  std::vector<uint8_t> dictionary;
+  std::vector<std::vector<uint8_t> > cmp_data =
+    std::move(GenTC::CompressDXTs(dxt_imgs, 2, &dictionary));
+
+  std::unique_ptr<GenTC::DecodeBackend> backend = GenTC::CreateCPUBackend();
+  ASSERT_EQ(backend->Type(), GenTC::eDecodeBackend_CPU);
+
+  GenTC::cpu::Decoder decoder;
+  const size_t w = dxt_imgs[0].Width();
+  const size_t h = dxt_imgs[0].Height();
+
+  // Textures are written back to back
+  std::vector<uint8_t> dxt = backend->Decode(cmp_data, dictionary, GenTC::eDecodeOutput_DXT);
+  ASSERT_EQ(dxt.size(), cmp_data.size() * w * h / 2);
+  for (size_t i = 0; i < cmp_data.size(); ++i) {
+    std::vector<uint8_t> expected = decoder.DecompressDXTBuffer(cmp_data[i], dictionary);
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), dxt.begin() + i * expected.size()));
+  }
+
+  std::unique_ptr<GenTC::DecodeBackend::Buffer> output = backend->CreateBuffer(cmp_data.size() * w * h * 3);
+  std::unique_ptr<GenTC::DecodeBackend::Completion> done =
+    backend->DecodeBatch(cmp_data, dictionary, GenTC::eDecodeOutput_RGB, output.get());
+  done->Wait();
+  EXPECT_TRUE(done->IsComplete());
+
+  std::vector<uint8_t> rgb(output->Size());
+  output->Read(0, rgb.size(), rgb.data());
+  for (size_t i = 0; i < cmp_data.size(); ++i) {
+    std::vector<uint8_t> expected(w * h * 3);
+    decoder.DecompressRGB(cmp_data[i], dictionary, GenTC::cpu::ePixelFormat_RGB8, expected.data(), 3 * w);
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), rgb.begin() + i * expected.size()));
+  }
+}
+
+TEST(CPUDecoder, RejectsOtherVersionsAndTruncatedTextures) {
+  const std::vector<uint8_t> cmp_data = GenTC::CompressDXT(CropTestImage(128, 128));
+
+  GenTC::GenTCHeader hdr;
+  ASSERT_TRUE(hdr.LoadFrom(cmp_data));
+  EXPECT_EQ(hdr.magic, GenTC::kGenTCMagic);
+
+  // A texture from another version of the layout
+  std::vector<uint8_t> other_version = cmp_data;
+  other_version[3]++;
+  EXPECT_FALSE(hdr.LoadFrom(other_version));
+
+  // A texture that's missing the end of its streams
+  std::vector<uint8_t> truncated(cmp_data.begin(), cmp_data.end() - 1);
+  EXPECT_FALSE(hdr.LoadFrom(truncated));
+
+  // Data too small to hold a header
+  std::vector<uint8_t> tiny(cmp_data.begin(), cmp_data.begin() + 8);
+  EXPECT_FALSE(hdr.LoadFrom(tiny));
+
+  GenTC::cpu::Decoder decoder;
+  std::unique_ptr<GenTC::DecodeBackend> backend = GenTC::CreateCPUBackend();
+  for (const auto *data : { &other_version, &truncated, &tiny }) {
+    EXPECT_TRUE(decoder.DecompressDXTBuffer(*data).empty());
+    EXPECT_TRUE(decoder.DecompressDXTBuffers({ cmp_data, *data }, std::vector<uint8_t>()).empty());
+    EXPECT_TRUE(backend->Decode({ *data }, std::vector<uint8_t>(), GenTC::eDecodeOutput_DXT).empty());
+  }
+}
+
+// The inclusive prefix sum of the differences, like the decode_indices kernel
+static std::vector<int32_t> ScanIndices(const std::vector<uint8_t> &diffs) {
+  std::vector<int32_t> indices(diffs.size());
+  int32_t sum = 0;
+  for (size_t i = 0; i < diffs.size(); ++i) {
+    sum = static_cast<int32_t>(static_cast<uint32_t>(sum) + static_cast<uint32_t>(diffs[i] - 128));
+    indices[i] = sum;
+  }
+  return std::move(indices);
+}
+
+TEST(CPUDecoder, CanDecodeIndices) {
+  // Odd lengths that end partway through both a SIMD register and a chunk,
+  // and streams that are only ever increasing so that the sums wrap around.
+  const size_t lengths[] = { 0, 1, 7, 9, 1000, 16385, 100003, 250001 };
+
+  std::vector<std::vector<uint8_t> > diffs;
+  uint32_t seed = 0x9E3779B9;
+  for (size_t len : lengths) {
+    std::vector<uint8_t> stream(len);
+    for (auto &d : stream) {
+      seed = seed * 1664525 + 1013904223;
+      d = static_cast<uint8_t>(seed >> 24);
+    }
+    diffs.push_back(stream);
+  }
+  diffs.push_back(std::vector<uint8_t>(1 << 20, 0xFF));
+
+  for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+    ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+    if (!ans::simd::IsSupported(is)) {
+      continue;
+    }
+
+    for (size_t num_threads : { 1, 3, 0 }) {
+      std::vector<std::vector<int32_t> > indices(diffs.size());
+      std::vector<GenTC::cpu::IndexStream> streams;
+      for (size_t i = 0; i < diffs.size(); ++i) {
+        indices[i].resize(diffs[i].size(), -1);
+
+        GenTC::cpu::IndexStream stream;
+        stream.diffs = diffs[i].data();
+        stream.num_vals = diffs[i].size();
+        stream.indices = indices[i].data();
+        stream.refs = nullptr;
+        streams.push_back(stream);
+      }
+
+      GenTC::cpu::Decoder decoder(num_threads);
+      decoder.DecodeIndices(streams, is);
+      for (size_t i = 0; i < diffs.size(); ++i) {
+        EXPECT_EQ(indices[i], ScanIndices(diffs[i]))
+          << "Instruction set: " << set << ", threads: " << num_threads << ", stream: " << i;
+      }
+    }
+  }
+}
+
+TEST(CPUDecoder, Throughput) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+  std::vector<std::vector<uint8_t> > cmp_data(16, GenTC::CompressDXT(dxt_img));
+  const double mb = static_cast<double>(cmp_data.size() * dxt_img.Width() * dxt_img.Height() / 2)
+    / (1024.0 * 1024.0);
+
+  for (size_t num_threads : { 1, 0 }) {
+    GenTC::cpu::Decoder decoder(num_threads);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::vector<uint8_t> > decmp_data =
+      decoder.DecompressDXTBuffers(cmp_data, std::vector<uint8_t>());
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> secs = end - start;
+    std::cout << "Decoded " << decmp_data.size() << " textures on " << decoder.NumThreads()
+              << " thread(s): " << (mb / secs.count()) << " MB/s of DXT1" << std::endl;
+  }
+}
+
+TEST(CPUDecoder, RGBThroughput) {
+  GenTC::DXTImage dxt_img(TestImagePath().c_str(), NULL);
+  std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img));
+
+  const size_t num_textures = 16;
+  const size_t pitch = 4 * dxt_img.Width();
+  std::vector<uint8_t> rgba(pitch * dxt_img.Height());
+  const double mb = static_cast<double>(num_textures * rgba.size()) / (1024.0 * 1024.0);
+
+  GenTC::cpu::Decoder decoder;
+  for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+    ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+    if (!ans::simd::IsSupported(is)) {
+      continue;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < num_textures; ++i) {
+      decoder.DecompressRGB(cmp_data, GenTC::cpu::ePixelFormat_RGBA8, rgba.data(), pitch, is);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> secs = end - start;
+    std::cout << "Instruction set " << set << ": " << (mb / secs.count())
+              << " MB/s of RGBA8 on " << decoder.NumThreads() << " thread(s)" << std::endl;
+  }
+}
+
+TEST(CPUDecoder, CanDecodeIndicesWithRefs) {
+  // Zeros take the next reference, and the differences after them count
+  // from it. Some chunks have no references at all, and some have many.
+  const size_t lengths[] = { 1, 9, 1000, 16385, 100003 };
+
+  for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+    ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+    if (!ans::simd::IsSupported(is)) {
+      continue;
+    }
+
+    uint32_t seed = 0x2545F491;
+    std::vector<std::vector<uint8_t> > diffs;
+    std::vector<std::vector<uint8_t> > refs;
+    std::vector<std::vector<int32_t> > expected;
+    for (size_t len : lengths) {
+      std::vector<uint8_t> stream(len);
+      std::vector<uint8_t> stream_refs;
+      std::vector<int32_t> stream_expected(len);
+
+      uint32_t sum = 0;
+      for (size_t i = 0; i < len; ++i) {
+        seed = seed * 1664525 + 1013904223;
+        const bool in_quiet_stretch = ((i / 20000) % 2) == 1;
+        if (!in_quiet_stretch && (seed >> 24) < 8) {
+          stream[i] = 0;
+          sum = seed & 0xFFFF;
+          for (size_t b = 0; b < 4; ++b) {
+            stream_refs.push_back(static_cast<uint8_t>((sum >> (8 * b)) & 0xFF));
+          }
+        } else {
+          stream[i] = static_cast<uint8_t>(1 + ((seed >> 8) % 255));
+          sum += static_cast<uint32_t>(static_cast<int>(stream[i]) - 128);
+        }
+        stream_expected[i] = static_cast<int32_t>(sum);
+      }
+
+      diffs.push_back(stream);
+      refs.push_back(stream_refs);
+      expected.push_back(stream_expected);
+    }
+
+    for (size_t num_threads : { 1, 3 }) {
+      std::vector<std::vector<int32_t> > indices(diffs.size());
+      std::vector<GenTC::cpu::IndexStream> streams;
+      for (size_t i = 0; i < diffs.size(); ++i) {
+        indices[i].resize(diffs[i].size(), -1);
+
+        GenTC::cpu::IndexStream stream;
+        stream.diffs = diffs[i].data();
+        stream.num_vals = diffs[i].size();
+        stream.indices = indices[i].data();
+        stream.refs = refs[i].data();
+        streams.push_back(stream);
+      }
+
+      GenTC::cpu::Decoder decoder(num_threads);
+      decoder.DecodeIndices(streams, is);
+      for (size_t i = 0; i < diffs.size(); ++i) {
+        EXPECT_EQ(indices[i], expected[i])
+          << "Instruction set: " << set << ", threads: " << num_threads << ", stream: " << i;
+      }
+    }
+  }
+}
+
+TEST(CPUDecoder, IndicesThroughput) {
+  const size_t num_streams = 16;
+  std::vector<uint8_t> diffs(1 << 20);
+  for (size_t i = 0; i < diffs.size(); ++i) {
+    diffs[i] = static_cast<uint8_t>((i * 2654435761U) >> 24);
+  }
+
+  std::vector<int32_t> indices(num_streams * diffs.size());
+  std::vector<GenTC::cpu::IndexStream> streams;
+  for (size_t i = 0; i < num_streams; ++i) {
+    GenTC::cpu::IndexStream stream;
+    stream.diffs = diffs.data();
+    stream.num_vals = diffs.size();
+    stream.indices = indices.data() + i * diffs.size();
+    stream.refs = nullptr;
+    streams.push_back(stream);
+  }
+
+  const double mb = static_cast<double>(num_streams * diffs.size()) / (1024.0 * 1024.0);
+  GenTC::cpu::Decoder decoder;
+
+  // Touch the output once so that the first timing doesn't include faults
+  decoder.DecodeIndices(streams, ans::simd::eInstructionSet_Scalar);
+  for (int set = 0; set < ans::simd::kNumInstructionSets; ++set) {
+    ans::simd::EInstructionSet is = static_cast<ans::simd::EInstructionSet>(set);
+    if (!ans::simd::IsSupported(is)) {
+      continue;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    decoder.DecodeIndices(streams, is);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> secs = end - start;
+    std::cout << "Instruction set " << set << ": " << (mb / secs.count())
+              << " M indices/s on " << decoder.NumThreads() << " thread(s)" << std::endl;
+  }
+}
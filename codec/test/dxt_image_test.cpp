@@ -0,0 +1,296 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ans_simd.h"
+#include "dxt_image.h"
+#include "test_config.h"
+
+static std::string TestImagePath() {
+  std::string dir(CODEC_TEST_DIR);
+  return dir + std::string("/") + std::string("test1.png");
+}
+
+static uint32_t RandomWord() {
+  return (static_cast<uint32_t>(rand() & 0xFFFF) << 16) | static_cast<uint32_t>(rand() & 0xFFFF);
+}
+
+static GenTC::PhysicalDXTBlock BlockWithWord(uint32_t word) {
+  GenTC::PhysicalDXTBlock blk;
+  blk.ep1 = 0xFFFF;
+  blk.ep2 = 0x0000;
+  blk.interpolation = word;
+  return blk;
+}
+
+// Makes num_words distinct words that are used by 1 to max_uses blocks each,
+// with the blocks in a random order.
+static std::vector<GenTC::PhysicalDXTBlock> RandomBlocks(size_t num_words, int max_uses) {
+  std::vector<uint32_t> words;
+  while (words.size() < num_words) {
+    const uint32_t word = RandomWord();
+    if (std::find(words.begin(), words.end(), word) == words.end()) {
+      words.push_back(word);
+    }
+  }
+
+  std::vector<GenTC::PhysicalDXTBlock> blocks;
+  for (uint32_t word : words) {
+    const int uses = 1 + rand() % max_uses;
+    for (int i = 0; i < uses; ++i) {
+      blocks.push_back(BlockWithWord(word));
+    }
+  }
+
+  for (size_t i = blocks.size(); i > 1; --i) {
+    std::swap(blocks[i - 1], blocks[rand() % i]);
+  }
+
+  return blocks;
+}
+
+static std::vector<float> WordIndices(uint32_t word) {
+  std::vector<float> indices(16);
+  for (size_t j = 0; j < 16; ++j) {
+    indices[j] = static_cast<float>((word >> (2 * j)) & 0x3);
+  }
+  return indices;
+}
+
+static float DistSq(const std::vector<float> &a, const std::vector<float> &b) {
+  float dist = 0.0f;
+  for (size_t j = 0; j < 16; ++j) {
+    const float d = a[j] - b[j];
+    dist += d * d;
+  }
+  return dist;
+}
+
+// Plain weighted Lloyd's algorithm: seeded with the most used words, every
+// word is measured against every cluster on each pass, and it stops once no
+// word changes cluster.
+static std::vector<GenTC::LogicalDXTBlock> LloydBlocks(
+  const std::vector<GenTC::PhysicalDXTBlock> &blocks, size_t num_clusters) {
+  std::unordered_map<uint32_t, size_t> counts;
+  for (const auto &b : blocks) {
+    counts[b.interpolation]++;
+  }
+
+  typedef std::pair<uint32_t, size_t> Count;
+  std::vector<Count> words(counts.begin(), counts.end());
+  std::sort(words.begin(), words.end(), [](const Count &a, const Count &b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+
+  num_clusters = std::min(num_clusters, words.size());
+  std::vector<std::vector<float> > points;
+  for (const Count &w : words) {
+    points.push_back(WordIndices(w.first));
+  }
+
+  std::vector<std::vector<float> > centers(points.begin(), points.begin() + num_clusters);
+  std::vector<size_t> assignment(points.size(), num_clusters);
+  std::vector<size_t> weights(num_clusters);
+  for (;;) {
+    bool changed = false;
+    for (size_t i = 0; i < points.size(); ++i) {
+      size_t nearest = 0;
+      float nearest_dist = std::numeric_limits<float>::max();
+      for (size_t c = 0; c < num_clusters; ++c) {
+        const float dist = DistSq(points[i], centers[c]);
+        if (dist < nearest_dist) {
+          nearest_dist = dist;
+          nearest = c;
+        }
+      }
+
+      changed = changed || assignment[i] != nearest;
+      assignment[i] = nearest;
+    }
+
+    if (!changed) {
+      break;
+    }
+
+    std::vector<std::vector<uint64_t> > sums(num_clusters, std::vector<uint64_t>(16, 0));
+    std::fill(weights.begin(), weights.end(), 0);
+    for (size_t i = 0; i < points.size(); ++i) {
+      weights[assignment[i]] += words[i].second;
+      for (size_t j = 0; j < 16; ++j) {
+        sums[assignment[i]][j] += words[i].second * static_cast<uint64_t>(points[i][j]);
+      }
+    }
+
+    for (size_t c = 0; c < num_clusters; ++c) {
+      for (size_t j = 0; j < 16 && weights[c] > 0; ++j) {
+        centers[c][j] = static_cast<float>(static_cast<double>(sums[c][j]) /
+                                           static_cast<double>(weights[c]));
+      }
+    }
+  }
+
+  std::vector<GenTC::LogicalDXTBlock> clusters;
+  for (size_t c = 0; c < num_clusters; ++c) {
+    if (0 == weights[c]) {
+      continue;
+    }
+
+    GenTC::LogicalDXTBlock blk = {};
+    for (size_t j = 0; j < 16; ++j) {
+      blk.indices[j] = static_cast<uint8_t>(centers[c][j] + 0.5f);
+    }
+    clusters.push_back(blk);
+  }
+
+  return clusters;
+}
+
+TEST(DXTImage, KMeansBlocksDoesNotDependOnThreadsOrInstructionSet) {
+  srand(0);
+  const std::vector<GenTC::PhysicalDXTBlock> blocks = RandomBlocks(2000, 8);
+
+  const std::vector<GenTC::LogicalDXTBlock> expected =
+    GenTC::KMeansBlocks(blocks, 64, 1, ans::simd::eInstructionSet_Scalar);
+  ASSERT_EQ(expected.size(), 64U);
+
+  for (size_t num_threads : { 1, 3, 0 }) {
+    const std::vector<GenTC::LogicalDXTBlock> clusters =
+      GenTC::KMeansBlocks(blocks, 64, num_threads);
+    ASSERT_EQ(clusters.size(), expected.size()) << "Threads: " << num_threads;
+    for (size_t i = 0; i < clusters.size(); ++i) {
+      EXPECT_TRUE(clusters[i] == expected[i]) << "Threads: " << num_threads << " Cluster: " << i;
+    }
+  }
+}
+
+TEST(DXTImage, KMeansBlocksHasAtMostOneClusterPerWord) {
+  srand(0);
+  const std::vector<GenTC::PhysicalDXTBlock> blocks = RandomBlocks(5, 4);
+
+  const std::vector<GenTC::LogicalDXTBlock> clusters = GenTC::KMeansBlocks(blocks, 256);
+  EXPECT_LE(clusters.size(), 5U);
+
+  // With a cluster for every word, each cluster is one of the words
+  for (const GenTC::LogicalDXTBlock &c : clusters) {
+    bool found = false;
+    for (const GenTC::PhysicalDXTBlock &b : blocks) {
+      const std::vector<float> indices = WordIndices(b.interpolation);
+      found = found || std::equal(indices.begin(), indices.end(), c.indices,
+                                  [](float x, uint8_t y) { return static_cast<uint8_t>(x) == y; });
+    }
+    EXPECT_TRUE(found);
+  }
+
+  EXPECT_TRUE(GenTC::KMeansBlocks(std::vector<GenTC::PhysicalDXTBlock>(), 256).empty());
+}
+
+TEST(DXTImage, KMeansBlocksMatchesLloyd) {
+  srand(0);
+  const std::vector<GenTC::PhysicalDXTBlock> blocks = RandomBlocks(64, 6);
+
+  const std::vector<GenTC::LogicalDXTBlock> expected = LloydBlocks(blocks, 8);
+  const std::vector<GenTC::LogicalDXTBlock> clusters = GenTC::KMeansBlocks(blocks, 8);
+  ASSERT_EQ(clusters.size(), expected.size());
+  for (size_t i = 0; i < clusters.size(); ++i) {
+    EXPECT_TRUE(clusters[i] == expected[i]) << "Cluster: " << i;
+  }
+}
+
+static std::unordered_set<uint32_t> Words(const GenTC::DXTImage &img) {
+  std::unordered_set<uint32_t> words;
+  for (const GenTC::PhysicalDXTBlock &b : img.PhysicalBlocks()) {
+    words.insert(b.interpolation);
+  }
+  return words;
+}
+
+TEST(DXTImage, ReassignIndicesDoesNotDependOnThreadsOrInstructionSet) {
+  const GenTC::DXTImage orig(TestImagePath().c_str(), NULL);
+
+  GenTC::DXTImage expected = orig;
+  expected.ReassignIndices(35, 1, ans::simd::eInstructionSet_Scalar);
+
+  for (size_t num_threads : { 1, 3, 0 }) {
+    GenTC::DXTImage img = orig;
+    img.ReassignIndices(35, num_threads);
+
+    ASSERT_EQ(img.PhysicalBlocks().size(), expected.PhysicalBlocks().size());
+    for (size_t i = 0; i < img.PhysicalBlocks().size(); ++i) {
+      EXPECT_EQ(img.PhysicalBlocks()[i].dxt_block, expected.PhysicalBlocks()[i].dxt_block)
+        << "Threads: " << num_threads << " Index: " << i;
+    }
+  }
+}
+
+TEST(DXTImage, ReassignIndicesOnlyUsesWordsInUse) {
+  const GenTC::DXTImage orig(TestImagePath().c_str(), NULL);
+  const std::unordered_set<uint32_t> orig_words = Words(orig);
+
+  GenTC::DXTImage img = orig;
+  img.ReassignIndices(35);
+  ASSERT_EQ(img.PhysicalBlocks().size(), orig.PhysicalBlocks().size());
+  ASSERT_EQ(img.LogicalBlocks().size(), orig.LogicalBlocks().size());
+
+  // Blocks only move to words that other blocks had, so there are no new
+  // distinct words afterwards.
+  size_t num_moved = 0;
+  for (size_t i = 0; i < img.PhysicalBlocks().size(); ++i) {
+    const uint32_t word = img.PhysicalBlocks()[i].interpolation;
+    EXPECT_EQ(orig_words.count(word), 1U) << "Index: " << i;
+    num_moved += (word != orig.PhysicalBlocks()[i].interpolation) ? 1 : 0;
+  }
+
+  EXPECT_GT(num_moved, 0U);
+  EXPECT_LE(Words(img).size(), orig_words.size());
+}
+
+TEST(DXTImage, EvaluateIndexWordsMatchesScalar) {
+  if (!ans::simd::IsSupported(ans::simd::eInstructionSet_SSE41)) {
+    return;
+  }
+
+  srand(0);
+  for (int trial = 0; trial < 2000; ++trial) {
+    // Half of the blocks are noise, and the others are noisy gradients
+    // that the candidates can fit closely.
+    uint8_t pixels[48];
+    const int base = rand() % 256;
+    const int step = rand() % 32 - 16;
+    for (int i = 0; i < 48; ++i) {
+      const int gradient = base + step * (i / 3 % 4 + i / 12) + rand() % 5 - 2;
+      pixels[i] = static_cast<uint8_t>((trial % 2) ? rand() % 256
+                                                   : std::max(0, std::min(255, gradient)));
+    }
+
+    // Leave some lanes unused, and include the words that use a single
+    // index everywhere.
+    static const size_t kMaxCandidates = 7;
+    uint32_t candidates[kMaxCandidates];
+    const size_t num = 1 + trial % kMaxCandidates;
+    for (size_t k = 0; k < num; ++k) {
+      static const uint32_t kFlatWords[4] = { 0x00000000, 0x55555555, 0xAAAAAAAA, 0xFFFFFFFF };
+      candidates[k] = (0 == rand() % 8) ? kFlatWords[rand() % 4] : RandomWord();
+    }
+
+    int expected_errs[kMaxCandidates];
+    bool expected_keeps[kMaxCandidates];
+    GenTC::EvaluateIndexWords(pixels, candidates, num, expected_errs, expected_keeps,
+                              ans::simd::eInstructionSet_Scalar);
+
+    int errs[kMaxCandidates];
+    bool keeps[kMaxCandidates];
+    GenTC::EvaluateIndexWords(pixels, candidates, num, errs, keeps,
+                              ans::simd::eInstructionSet_SSE41);
+
+    for (size_t k = 0; k < num; ++k) {
+      EXPECT_EQ(errs[k], expected_errs[k]) << "Trial: " << trial << " Word: " << candidates[k];
+      EXPECT_EQ(keeps[k], expected_keeps[k]) << "Trial: " << trial << " Word: " << candidates[k];
+    }
+  }
+}
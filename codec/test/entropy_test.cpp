@@ -0,0 +1,251 @@
+#include "entropy.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "ans.h"
+#include "codec_base.h"
+#include "gtest/gtest.h"
+
+static std::unique_ptr<std::vector<uint8_t> > GenerateBytes(size_t num_groups) {
+  srand(0);
+  const size_t num_symbols =
+    num_groups * ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols;
+
+  std::unique_ptr<std::vector<uint8_t> > bytes(new std::vector<uint8_t>);
+  bytes->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    // Skewed distribution centered around 128 like the index deltas
+    bytes->push_back(static_cast<uint8_t>(128 + (rand() % 9) * (rand() % 5) - 16));
+  }
+  return std::move(bytes);
+}
+
+TEST(Entropy, CanEncodeAndDecodeBytes) {
+  std::unique_ptr<std::vector<uint8_t> > bytes = GenerateBytes(5);
+
+  std::unique_ptr<std::vector<uint8_t> > encoded =
+    GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols)->Run(bytes);
+  EXPECT_EQ(encoded->size() % 4, 0);
+
+  std::unique_ptr<std::vector<uint8_t> > decoded =
+    GenTC::ByteEncoder::Decoder(ans::ocl::kNumEncodedSymbols)->Run(encoded);
+  EXPECT_EQ(*decoded, *bytes);
+}
+
+TEST(Entropy, RejectsTruncatedAndCorruptBytes) {
+  std::unique_ptr<std::vector<uint8_t> > bytes = GenerateBytes(5);
+  const std::vector<uint8_t> encoded =
+    *GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols)->Run(bytes);
+
+  const ans::ocl::Geometry geom(ans::ocl::kANSTableSize, ans::ocl::kNumEncodedSymbols,
+                                ans::ocl::kThreadsPerEncodingGroup);
+  ASSERT_EQ(GenTC::ByteEncoder::Decode(encoded.data(), encoded.size(), geom), *bytes);
+
+  // The frequencies, then the offset table, then the groups
+  const size_t offsets_start = 256 * 2;
+  for (size_t sz : { size_t(0), offsets_start - 1, offsets_start, offsets_start + 4,
+                     offsets_start + 5 * 4, encoded.size() - 1 }) {
+    EXPECT_TRUE(GenTC::ByteEncoder::Decode(encoded.data(), sz, geom).empty()) << "Size: " << sz;
+  }
+
+  auto with_offset = [&encoded, offsets_start](size_t group, uint32_t offset) {
+    std::vector<uint8_t> result = encoded;
+    memcpy(result.data() + offsets_start + 4 * group, &offset, sizeof(offset));
+    return result;
+  };
+
+  uint32_t second_offset;
+  memcpy(&second_offset, encoded.data() + offsets_start + 4, sizeof(second_offset));
+  const std::vector<std::vector<uint8_t> > corrupt = {
+    // Groups that end before they start, or too soon to hold their states
+    with_offset(1, 0),
+    with_offset(0, second_offset + 4),
+    with_offset(0, 5 * 4 + 4),
+    // An offset past the end of the data
+    with_offset(4, static_cast<uint32_t>(encoded.size())),
+    // No frequencies
+    [&encoded]() {
+      std::vector<uint8_t> result = encoded;
+      memset(result.data(), 0, 256 * 2);
+      return result;
+    }(),
+  };
+
+  for (size_t i = 0; i < corrupt.size(); ++i) {
+    EXPECT_TRUE(GenTC::ByteEncoder::Decode(corrupt[i].data(), corrupt[i].size(), geom).empty())
+      << "Case: " << i;
+  }
+}
+
+TEST(Entropy, ByteEncodingIsIndependentOfThreadCount) {
+  std::unique_ptr<std::vector<uint8_t> > bytes = GenerateBytes(37);
+
+  std::unique_ptr<std::vector<uint8_t> > expected =
+    GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols, 1)->Run(bytes);
+
+  for (size_t num_threads : { 2, 3, 8, 64 }) {
+    std::unique_ptr<std::vector<uint8_t> > encoded =
+      GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols, num_threads)->Run(bytes);
+    EXPECT_EQ(*encoded, *expected) << "Threads: " << num_threads;
+  }
+}
+
+TEST(Entropy, ShortEncodingIsIndependentOfThreadCount) {
+  srand(0);
+  const size_t num_symbols = 7 * ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols;
+
+  std::unique_ptr<std::vector<int16_t> > shorts(new std::vector<int16_t>);
+  shorts->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    // Make sure that every symbol shows up, including the escape for
+    // values that don't fit in a byte.
+    shorts->push_back(static_cast<int16_t>((i < 256) ? (static_cast<int>(i) - 128) : (rand() % 21) - 10));
+  }
+  (*shorts)[0] = 300;
+
+  std::unique_ptr<std::vector<uint8_t> > expected =
+    GenTC::ShortEncoder::Encoder(ans::ocl::kNumEncodedSymbols, 1)->Run(shorts);
+
+  for (size_t num_threads : { 2, 5, 16 }) {
+    std::unique_ptr<std::vector<uint8_t> > encoded =
+      GenTC::ShortEncoder::Encoder(ans::ocl::kNumEncodedSymbols, num_threads)->Run(shorts);
+    EXPECT_EQ(*encoded, *expected) << "Threads: " << num_threads;
+  }
+}
+
+TEST(Entropy, CanEncodeBytesWithOtherGeometries) {
+  const ans::ocl::Geometry geoms[] = {
+    ans::ocl::Geometry(1 << 12, 256, 64),
+    ans::ocl::Geometry(1 << 10, 128, 8),
+    ans::ocl::Geometry(1 << 15, 256, 16),
+  };
+
+  std::unique_ptr<std::vector<uint8_t> > bytes = GenerateBytes(4);
+  for (const auto &geom : geoms) {
+    ASSERT_EQ(bytes->size() % geom.SymbolsPerGroup(), 0);
+
+    std::unique_ptr<std::vector<uint8_t> > encoded =
+      GenTC::ByteEncoder::Encoder(geom)->Run(bytes);
+    std::unique_ptr<std::vector<uint8_t> > decoded =
+      GenTC::ByteEncoder::Decoder(geom)->Run(encoded);
+    EXPECT_EQ(*decoded, *bytes) << "Table size: " << geom.table_size;
+
+    // The stored frequencies are normalized to the geometry's table size
+    uint32_t total = 0;
+    for (size_t i = 0; i < 256; ++i) {
+      uint16_t f;
+      memcpy(&f, encoded->data() + 2 * i, sizeof(f));
+      total += f;
+    }
+    EXPECT_EQ(total, geom.table_size);
+  }
+}
+
+static std::vector<uint32_t> CountBytes(const std::vector<uint8_t> &bytes) {
+  std::vector<uint32_t> counts(256, 0);
+  for (auto b : bytes) {
+    counts[b]++;
+  }
+  return std::move(counts);
+}
+
+TEST(Entropy, ClustersStreamsWithMatchingStatistics) {
+  std::unique_ptr<std::vector<uint8_t> > skewed = GenerateBytes(2);
+
+  std::vector<uint8_t> uniform(skewed->size());
+  for (size_t i = 0; i < uniform.size(); ++i) {
+    uniform[i] = static_cast<uint8_t>(rand() % 64);
+  }
+
+  std::vector<std::vector<uint32_t> > counts;
+  for (size_t i = 0; i < 4; ++i) {
+    counts.push_back(CountBytes(*skewed));
+    counts.push_back(CountBytes(uniform));
+  }
+
+  std::vector<uint32_t> table_ids;
+  std::vector<std::vector<uint32_t> > tables =
+    GenTC::ClusterFrequencyTables(counts, 16, &table_ids);
+
+  ASSERT_EQ(tables.size(), 2);
+  ASSERT_EQ(table_ids.size(), counts.size());
+  for (size_t i = 2; i < counts.size(); ++i) {
+    EXPECT_EQ(table_ids[i], table_ids[i % 2]);
+  }
+  EXPECT_NE(table_ids[0], table_ids[1]);
+}
+
+TEST(Entropy, CanEncodeWithSharedTables) {
+  std::vector<std::unique_ptr<std::vector<uint8_t> > > streams;
+  std::vector<std::vector<uint32_t> > counts;
+  for (size_t i = 0; i < 5; ++i) {
+    std::unique_ptr<std::vector<uint8_t> > bytes(new std::vector<uint8_t>(
+      ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols));
+    for (auto &b : *bytes) {
+      b = static_cast<uint8_t>(128 + (rand() % (3 + i)) * (rand() % 4) - 4 * i);
+    }
+
+    // Make sure that some symbols only show up in one of the streams
+    (*bytes)[0] = static_cast<uint8_t>(i);
+
+    counts.push_back(CountBytes(*bytes));
+    streams.push_back(std::move(bytes));
+  }
+
+  // Fewer tables than streams forces some of them to share
+  std::vector<uint32_t> table_ids;
+  std::vector<std::vector<uint32_t> > tables =
+    GenTC::ClusterFrequencyTables(counts, 2, &table_ids);
+  ASSERT_LE(tables.size(), 2);
+
+  for (size_t i = 0; i < streams.size(); ++i) {
+    ASSERT_LT(table_ids[i], tables.size());
+    const std::vector<uint32_t> &table = tables[table_ids[i]];
+
+    std::unique_ptr<std::vector<uint8_t> > encoded =
+      GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols, table)->Run(streams[i]);
+
+    // The table is stored the same way as the ones built from the input
+    for (size_t j = 0; j < 256; ++j) {
+      uint16_t f;
+      memcpy(&f, encoded->data() + 2 * j, sizeof(f));
+      EXPECT_EQ(f, (j < table.size()) ? table[j] : 0);
+    }
+
+    std::unique_ptr<std::vector<uint8_t> > decoded =
+      GenTC::ByteEncoder::Decoder(ans::ocl::kNumEncodedSymbols)->Run(encoded);
+    EXPECT_EQ(*decoded, *streams[i]) << "Stream: " << i;
+  }
+}
+
+TEST(Entropy, RearrangesBlocksIntoBands) {
+  static const size_t kDim = GenTC::kWaveletBlockDim;
+  static const size_t kBlocksX = 3;
+  static const size_t kBlocksY = 2;
+  static const size_t kRowLength = kBlocksX * kDim;
+
+  // Every value is its own position so that it can be traced
+  std::unique_ptr<std::vector<uint32_t> > values(new std::vector<uint32_t>(kRowLength * kBlocksY * kDim));
+  for (size_t i = 0; i < values->size(); ++i) {
+    (*values)[i] = static_cast<uint32_t>(i);
+  }
+
+  std::unique_ptr<std::vector<uint32_t> > tiles =
+    GenTC::RearrangeStream<uint32_t>::New(kRowLength, kDim)->Run(values);
+  std::unique_ptr<std::vector<uint32_t> > bands =
+    GenTC::RearrangeStream<uint32_t>::New(kRowLength, kDim, GenTC::kCoarsestBandDim)->Run(values);
+  ASSERT_EQ(bands->size(), tiles->size());
+
+  for (size_t t = 0; t < kBlocksX * kBlocksY; ++t) {
+    for (size_t y = 0; y < kDim; ++y) {
+      for (size_t x = 0; x < kDim; ++x) {
+        const size_t idx = GenTC::BandOrderIndex(x, y, t, 0, kBlocksX * kBlocksY, 1);
+        ASSERT_LT(idx, bands->size());
+        EXPECT_EQ((*bands)[idx], (*tiles)[t * kDim * kDim + y * kDim + x])
+          << "Block: " << t << ", (" << x << ", " << y << ")";
+      }
+    }
+  }
+}
@@ -1,8 +1,12 @@
 #include "wavelet.h"
 
+#include <chrono>
 #include <cstdint>
 #include <cmath>
+#include <iostream>
+#include <vector>
 
+#include "codec_base.h"
 #include "gtest/gtest.h"
 
 TEST(Wavelet, ForwardTransform) {
@@ -183,3 +187,191 @@ TEST(Wavelet, Recursive2DWavelet) {
     EXPECT_EQ(out[i], xs[i]) << "At index: " << i;
   }
 }
+
+// A line by line port of the inv_wavelet kernel for a single block, with one
+// loop iteration per work item.
+static void KernelInverseWavelet(const uint8_t *coeffs, int8_t *out, size_t out_stride) {
+  static const int kDim = static_cast<int>(GenTC::kWaveletBlockDim);
+  std::vector<int> src(kDim * kDim), scratch(kDim * kDim);
+  for (int i = 0; i < kDim * kDim; ++i) {
+    src[i] = static_cast<int>(coeffs[i]) - 128;
+  }
+
+  auto normalize = [](int idx, int range) { return abs(idx - (int)(idx >= range) * (idx - range + 2)); };
+  auto even = [&](const std::vector<int> &in, std::vector<int> &t, int x, int y, int len, int mid) {
+    const int idx = 2 * x;
+    const int prev = mid + normalize(idx - 1, len) / 2;
+    const int next = mid + normalize(idx + 1, len) / 2;
+    t[idx * kDim + y] = in[y * kDim + x] - (in[y * kDim + prev] + in[y * kDim + next] + 2) / 4;
+  };
+  auto odd = [&](const std::vector<int> &in, std::vector<int> &t, int x, int y, int len, int mid) {
+    const int prev = normalize(2 * x, len);
+    const int next = normalize(2 * x + 2, len);
+    t[(2 * x + 1) * kDim + y] = in[y * kDim + mid + x] + (t[prev * kDim + y] + t[next * kDim + y]) / 2;
+  };
+
+  for (int len = 2; len <= kDim; len *= 2) {
+    const int mid = len / 2;
+    for (int y = 0; y < len; ++y) for (int x = 0; x < mid; ++x) even(src, scratch, x, y, len, mid);
+    for (int y = 0; y < len; ++y) for (int x = 0; x < mid; ++x) odd(src, scratch, x, y, len, mid);
+    for (int y = 0; y < len; ++y) for (int x = 0; x < mid; ++x) even(scratch, src, x, y, len, mid);
+    for (int y = 0; y < len; ++y) for (int x = 0; x < mid; ++x) odd(scratch, src, x, y, len, mid);
+  }
+
+  for (int y = 0; y < kDim; ++y) {
+    for (int x = 0; x < kDim; ++x) {
+      out[y * out_stride + x] = static_cast<int8_t>(src[y * kDim + x]);
+    }
+  }
+}
+
+TEST(Wavelet, InverseBlocksMatchKernel) {
+  static const size_t kDim = GenTC::kWaveletBlockDim;
+  static const size_t kNumBlocks = 5;
+  static const size_t kStride = kNumBlocks * kDim + 7;
+
+  // Random coefficients over the whole range, which overflow 16 bits
+  srand(0);
+  std::vector<uint8_t> coeffs(kNumBlocks * kDim * kDim);
+  for (auto &c : coeffs) {
+    c = static_cast<uint8_t>(rand());
+  }
+
+  std::vector<int8_t> expected(kStride * kDim, 0x55);
+  for (size_t i = 0; i < kNumBlocks; ++i) {
+    KernelInverseWavelet(coeffs.data() + i * kDim * kDim, expected.data() + i * kDim, kStride);
+  }
+
+  for (bool use_simd : { false, true }) {
+    std::vector<int8_t> out(kStride * kDim, 0x55);
+    GenTC::InverseWaveletBlocks(coeffs.data(), kNumBlocks, out.data(), kStride, use_simd);
+    EXPECT_EQ(out, expected) << "SIMD: " << use_simd;
+  }
+}
+
+TEST(Wavelet, InverseBlocksMatchRecursive2DWavelet) {
+  static const size_t kDim = GenTC::kWaveletBlockDim;
+  static const size_t kRowBytes = kDim * sizeof(int16_t);
+
+  // Forward transform some 8-bit values like the encoder does
+  srand(0);
+  int16_t block[kDim * kDim];
+  for (auto &x : block) {
+    x = static_cast<int16_t>((rand() % 64) - 32);
+  }
+
+  for (size_t dim = kDim; dim >= 2; dim /= 2) {
+    GenTC::ForwardWavelet2D(block, kRowBytes, block, kRowBytes, dim);
+  }
+
+  uint8_t coeffs[kDim * kDim];
+  for (size_t i = 0; i < kDim * kDim; ++i) {
+    ASSERT_GE(block[i], -128);
+    ASSERT_LE(block[i], 127);
+    coeffs[i] = static_cast<uint8_t>(block[i] + 128);
+  }
+
+  for (size_t dim = 2; dim <= kDim; dim *= 2) {
+    GenTC::InverseWavelet2D(block, kRowBytes, block, kRowBytes, dim);
+  }
+
+  int8_t out[kDim * kDim];
+  GenTC::InverseWaveletBlocks(coeffs, 1, out, kDim);
+  for (size_t i = 0; i < kDim * kDim; ++i) {
+    EXPECT_EQ(out[i], static_cast<int8_t>(block[i])) << "At index: " << i;
+  }
+}
+
+TEST(Wavelet, InverseLowPassMatchesPartialInverse) {
+  static const size_t kDim = GenTC::kWaveletBlockDim;
+  static const size_t kRowBytes = kDim * sizeof(int16_t);
+  static const size_t kNumBlocks = 3;
+
+  srand(0);
+  std::vector<int16_t> blocks(kNumBlocks * kDim * kDim);
+  for (auto &x : blocks) {
+    x = static_cast<int16_t>((rand() % 64) - 32);
+  }
+
+  for (size_t i = 0; i < kNumBlocks; ++i) {
+    for (size_t dim = kDim; dim >= 2; dim /= 2) {
+      GenTC::ForwardWavelet2D(blocks.data() + i * kDim * kDim, kRowBytes,
+                              blocks.data() + i * kDim * kDim, kRowBytes, dim);
+    }
+  }
+
+  for (size_t dim = kDim / 8; dim <= kDim; dim *= 2) {
+    // The top-left corner of each block, one block after another
+    const size_t stride = kNumBlocks * dim;
+    std::vector<uint8_t> coeffs(kNumBlocks * dim * dim);
+    std::vector<int8_t> expected(stride * dim);
+    for (size_t i = 0; i < kNumBlocks; ++i) {
+      std::vector<int16_t> block(blocks.begin() + i * kDim * kDim, blocks.begin() + (i + 1) * kDim * kDim);
+      for (size_t y = 0; y < dim; ++y) {
+        for (size_t x = 0; x < dim; ++x) {
+          ASSERT_GE(block[y * kDim + x], -128);
+          ASSERT_LE(block[y * kDim + x], 127);
+          coeffs[i * dim * dim + y * dim + x] = static_cast<uint8_t>(block[y * kDim + x] + 128);
+        }
+      }
+
+      for (size_t d = 2; d <= dim; d *= 2) {
+        GenTC::InverseWavelet2D(block.data(), kRowBytes, block.data(), kRowBytes, d);
+      }
+
+      for (size_t y = 0; y < dim; ++y) {
+        for (size_t x = 0; x < dim; ++x) {
+          expected[y * stride + i * dim + x] = static_cast<int8_t>(block[y * kDim + x]);
+        }
+      }
+    }
+
+    for (bool use_simd : { false, true }) {
+      std::vector<int8_t> out(stride * dim);
+      GenTC::InverseWaveletLowPass(coeffs.data(), kNumBlocks, dim, out.data(), stride, use_simd);
+      EXPECT_EQ(out, expected) << "Dim: " << dim << ", SIMD: " << use_simd;
+    }
+  }
+}
+
+TEST(Wavelet, InverseBlocksThroughput) {
+  static const size_t kDim = GenTC::kWaveletBlockDim;
+  static const size_t kNumBlocks = 4096;
+
+  srand(0);
+  std::vector<uint8_t> coeffs(kNumBlocks * kDim * kDim);
+  for (auto &c : coeffs) {
+    c = static_cast<uint8_t>(128 + (rand() % 9) - 4);
+  }
+
+  // The transform of each block with InverseWavelet2D, one level at a time
+  std::vector<int16_t> block(kDim * kDim);
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < kNumBlocks; ++i) {
+    for (size_t j = 0; j < kDim * kDim; ++j) {
+      block[j] = static_cast<int16_t>(coeffs[i * kDim * kDim + j]) - 128;
+    }
+
+    for (size_t dim = 2; dim <= kDim; dim *= 2) {
+      GenTC::InverseWavelet2D(block.data(), kDim * sizeof(int16_t), block.data(), kDim * sizeof(int16_t), dim);
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double> secs = end - start;
+  const double mb = static_cast<double>(coeffs.size()) / (1024.0 * 1024.0);
+  std::cout << "InverseWavelet2D: " << (mb / secs.count()) << " MB/s" << std::endl;
+
+  std::vector<int8_t> out(coeffs.size());
+  for (bool use_simd : { false, true }) {
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < kNumBlocks; i += 16) {
+      GenTC::InverseWaveletBlocks(coeffs.data() + i * kDim * kDim, 16, out.data() + i * kDim * kDim,
+                                  16 * kDim, use_simd);
+    }
+    end = std::chrono::high_resolution_clock::now();
+
+    secs = end - start;
+    std::cout << (use_simd ? "SIMD" : "Scalar") << ": " << (mb / secs.count()) << " MB/s" << std::endl;
+  }
+}
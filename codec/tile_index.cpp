@@ -0,0 +1,265 @@
+#include "tile_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace GenTC {
+
+static const size_t kTileSz = kWaveletBlockDim * kWaveletBlockDim;
+
+std::vector<TileInfo> BuildTileIndex(const std::vector<uint8_t> &index_diffs,
+                                     const std::vector<uint32_t> &index_refs,
+                                     size_t blocks_x, size_t blocks_y) {
+  assert((blocks_x % kWaveletBlockDim) == 0);
+  assert((blocks_y % kWaveletBlockDim) == 0);
+  assert(index_diffs.size() >= blocks_x * blocks_y);
+
+  const size_t tiles_x = blocks_x / kWaveletBlockDim;
+  TileInfo empty;
+  memset(&empty, 0, sizeof(empty));
+  empty.palette_begin = std::numeric_limits<uint32_t>::max();
+  empty.refs_begin = std::numeric_limits<uint32_t>::max();
+  std::vector<TileInfo> tiles(tiles_x * (blocks_y / kWaveletBlockDim), empty);
+
+  // Same running sum as the decoders, wrapping around like int arithmetic
+  uint32_t sum = 0;
+  uint32_t num_refs = 0;
+  for (size_t y = 0; y < blocks_y; ++y) {
+    for (size_t x = 0; x < blocks_x; ++x) {
+      TileInfo &tile = tiles[(y / kWaveletBlockDim) * tiles_x + x / kWaveletBlockDim];
+      if (0 == (x % kWaveletBlockDim)) {
+        tile.index_sums[y % kWaveletBlockDim] = sum;
+        tile.ref_starts[y % kWaveletBlockDim] = num_refs;
+      }
+
+      const uint8_t diff = index_diffs[y * blocks_x + x];
+      if (0 == diff && !index_refs.empty()) {
+        assert(num_refs < index_refs.size());
+        tile.refs_begin = std::min(tile.refs_begin, num_refs);
+        tile.refs_end = num_refs + 1;
+        sum = index_refs[num_refs++];
+      } else {
+        sum += static_cast<uint32_t>(static_cast<int>(diff) - 128);
+      }
+
+      tile.palette_begin = std::min(tile.palette_begin, sum);
+      tile.palette_end = std::max(tile.palette_end, sum + 1);
+    }
+  }
+  assert(num_refs == index_refs.size());
+
+  return std::move(tiles);
+}
+
+bool LoadTileIndex(const GenTCHeader &hdr, const std::vector<uint8_t> &cmp_data,
+                   std::vector<TileInfo> *tiles) {
+  if (0 == hdr.tile_index_sz) {
+    return false;
+  }
+
+  const size_t num_tiles = hdr.NumCodedBlocks() / kTileSz;
+  if (hdr.tile_index_sz != num_tiles * sizeof(TileInfo)) {
+    return false;
+  }
+
+  const size_t offset = hdr.StreamsEnd();
+  if (offset > cmp_data.size() || hdr.tile_index_sz > cmp_data.size() - offset) {
+    return false;
+  }
+
+  tiles->resize(num_tiles);
+  memcpy(tiles->data(), cmp_data.data() + offset, num_tiles * sizeof(TileInfo));
+  return true;
+}
+
+static bool RunBefore(const GroupRun &run, const std::pair<EStreamType, size_t> &group) {
+  return run.stream < group.first || (run.stream == group.first && run.first_group <= group.second);
+}
+
+// Where symbol idx of the stream ends up in the decoded runs
+static size_t LocateSymbol(const std::vector<GroupRun> &runs, size_t symbols_per_group,
+                           EStreamType stream, size_t idx) {
+  const std::pair<EStreamType, size_t> group(stream, idx / symbols_per_group);
+  auto it = std::partition_point(runs.begin(), runs.end(), [&group](const GroupRun &run) {
+    return RunBefore(run, group);
+  });
+
+  assert(it != runs.begin());
+  --it;
+  assert(it->stream == stream);
+  assert(idx < (it->first_group + it->num_groups) * symbols_per_group);
+  return it->offset + idx - it->first_group * symbols_per_group;
+}
+
+bool PlanRegion(const GenTCHeader &hdr, const std::vector<TileInfo> &tiles,
+                size_t x, size_t y, size_t width, size_t height, RegionPlan *result) {
+  if ((x % 4) != 0 || (y % 4) != 0 || (width % 4) != 0 || (height % 4) != 0) {
+    return false;
+  }
+
+  const size_t texture_width = 4 * static_cast<size_t>(hdr.BlocksWide());
+  const size_t texture_height = 4 * static_cast<size_t>(hdr.BlocksHigh());
+  if (0 == width || 0 == height || x > texture_width || width > texture_width - x ||
+      y > texture_height || height > texture_height - y) {
+    return false;
+  }
+
+  const size_t symbols_per_group = hdr.ANSGeometry().SymbolsPerGroup();
+  assert((symbols_per_group % 4) == 0);
+
+  const size_t blocks_x = hdr.CodedBlocksWide();
+  const size_t num_blocks = hdr.NumCodedBlocks();
+  const size_t all_tiles_x = blocks_x / kWaveletBlockDim;
+  if (tiles.size() != num_blocks / kTileSz) {
+    return false;
+  }
+
+  RegionPlan &plan = *result;
+  plan = RegionPlan();
+  plan.tile_x = x / kTileDim;
+  plan.tile_y = y / kTileDim;
+  plan.tiles_x = (x + width + kTileDim - 1) / kTileDim - plan.tile_x;
+  plan.tiles_y = (y + height + kTileDim - 1) / kTileDim - plan.tile_y;
+  plan.offset_x = x / 4 - plan.tile_x * kWaveletBlockDim;
+  plan.offset_y = y / 4 - plan.tile_y * kWaveletBlockDim;
+  plan.blocks_x = width / 4;
+  plan.blocks_y = height / 4;
+
+  // The symbols that the region needs from each stream, in order. Each row
+  // of tiles of a plane is contiguous, and so is each row of index
+  // differences of the region texture.
+  std::vector<std::pair<size_t, size_t> > spans[kNumStreamTypes];
+
+  const size_t plane_row_sz = plan.tiles_x * kTileSz;
+  for (size_t p = 0; p < 6; ++p) {
+    const EStreamType stream = (p < 2) ? eStreamType_Y : eStreamType_Chroma;
+    const size_t plane_start = ((p < 2) ? p : p - 2) * num_blocks;
+    for (size_t r = 0; r < plan.tiles_y; ++r) {
+      const size_t start = plane_start + ((plan.tile_y + r) * all_tiles_x + plan.tile_x) * kTileSz;
+      spans[stream].push_back(std::make_pair(start, start + plane_row_sz));
+    }
+  }
+
+  for (size_t r = 0; r < plan.TextureBlocksY(); ++r) {
+    const size_t start = (plan.tile_y * kWaveletBlockDim + r) * blocks_x + plan.tile_x * kWaveletBlockDim;
+    spans[eStreamType_Indices].push_back(std::make_pair(start, start + plan.TextureBlocksX()));
+  }
+
+  uint32_t palette_begin = std::numeric_limits<uint32_t>::max();
+  uint32_t palette_end = 0;
+  for (size_t ty = plan.tile_y; ty < plan.tile_y + plan.tiles_y; ++ty) {
+    for (size_t tx = plan.tile_x; tx < plan.tile_x + plan.tiles_x; ++tx) {
+      palette_begin = std::min(palette_begin, tiles[ty * all_tiles_x + tx].palette_begin);
+      palette_end = std::max(palette_end, tiles[ty * all_tiles_x + tx].palette_end);
+    }
+  }
+  if (palette_begin >= palette_end || 4 * static_cast<size_t>(palette_end) > hdr.palette_bytes) {
+    return false;
+  }
+  spans[eStreamType_Palette].push_back(std::make_pair(4 * static_cast<size_t>(palette_begin),
+                                                      4 * static_cast<size_t>(palette_end)));
+
+  // The long-range references come after the palette entries
+  uint32_t refs_begin = std::numeric_limits<uint32_t>::max();
+  uint32_t refs_end = 0;
+  for (size_t ty = plan.tile_y; ty < plan.tile_y + plan.tiles_y; ++ty) {
+    for (size_t tx = plan.tile_x; tx < plan.tile_x + plan.tiles_x; ++tx) {
+      refs_begin = std::min(refs_begin, tiles[ty * all_tiles_x + tx].refs_begin);
+      refs_end = std::max(refs_end, tiles[ty * all_tiles_x + tx].refs_end);
+    }
+  }
+
+  const bool has_refs = refs_begin < refs_end;
+  if (has_refs) {
+    if (refs_end > hdr.index_refs) {
+      return false;
+    }
+
+    spans[eStreamType_Palette].push_back(
+      std::make_pair(hdr.palette_bytes + 4 * static_cast<size_t>(refs_begin),
+                     hdr.palette_bytes + 4 * static_cast<size_t>(refs_end)));
+  }
+
+  // Turn the spans into runs of whole groups, merging the runs that overlap
+  // or touch...
+  for (size_t i = 0; i < kNumStreamTypes; ++i) {
+    const EStreamType stream = static_cast<EStreamType>(i);
+    for (const auto &span : spans[i]) {
+      const size_t first = span.first / symbols_per_group;
+      const size_t last = (span.second + symbols_per_group - 1) / symbols_per_group;
+      if (last * symbols_per_group > hdr.NumSymbols(stream)) {
+        return false;
+      }
+
+      if (!plan.runs.empty() && plan.runs.back().stream == stream &&
+          first <= plan.runs.back().first_group + plan.runs.back().num_groups) {
+        GroupRun &run = plan.runs.back();
+        run.num_groups = std::max(run.num_groups, last - run.first_group);
+        continue;
+      }
+
+      GroupRun run;
+      run.stream = stream;
+      run.first_group = first;
+      run.num_groups = last - first;
+      run.offset = 0;
+      plan.runs.push_back(run);
+    }
+  }
+
+  // ... and lay them out back to back.
+  plan.decoded_sz = 0;
+  for (auto &run : plan.runs) {
+    run.offset = plan.decoded_sz;
+    plan.decoded_sz += run.num_groups * symbols_per_group;
+  }
+
+  for (size_t p = 0; p < 6; ++p) {
+    const EStreamType stream = (p < 2) ? eStreamType_Y : eStreamType_Chroma;
+    const auto &plane_spans = spans[stream];
+    for (size_t r = 0; r < plan.tiles_y; ++r) {
+      const size_t span = ((p < 2) ? p : p - 2) * plan.tiles_y + r;
+      plan.plane_rows.push_back(LocateSymbol(plan.runs, symbols_per_group, stream,
+                                             plane_spans[span].first));
+    }
+  }
+
+  // The palette entries are decoded starting from the first group that holds
+  // any of them, so the indices need to count from there.
+  const size_t palette_start = spans[eStreamType_Palette][0].first;
+  const size_t palette_group = palette_start / symbols_per_group;
+  plan.palette_offset = LocateSymbol(plan.runs, symbols_per_group, eStreamType_Palette,
+                                     palette_group * symbols_per_group);
+  plan.palette_sz = 0;
+  for (const auto &run : plan.runs) {
+    if (eStreamType_Palette == run.stream && run.first_group == palette_group) {
+      plan.palette_sz = run.num_groups * symbols_per_group;
+    }
+  }
+
+  const uint32_t palette_bias = static_cast<uint32_t>(palette_group * symbols_per_group / 4);
+  for (size_t r = 0; r < plan.TextureBlocksY(); ++r) {
+    const TileInfo &tile =
+      tiles[(plan.tile_y + r / kWaveletBlockDim) * all_tiles_x + plan.tile_x];
+    plan.index_rows.push_back(LocateSymbol(plan.runs, symbols_per_group, eStreamType_Indices,
+                                           spans[eStreamType_Indices][r].first));
+    plan.index_sums.push_back(tile.index_sums[r % kWaveletBlockDim] - palette_bias);
+    if (has_refs) {
+      // Rows without references may start before the first one, but they
+      // never take any.
+      plan.index_ref_starts.push_back(tile.ref_starts[r % kWaveletBlockDim] - refs_begin);
+    }
+  }
+
+  plan.index_refs_offset = 0;
+  plan.index_ref_base = palette_bias;
+  if (has_refs) {
+    plan.index_refs_offset = LocateSymbol(plan.runs, symbols_per_group, eStreamType_Palette,
+                                          hdr.palette_bytes + 4 * static_cast<size_t>(refs_begin));
+  }
+
+  return true;
+}
+
+}  // namespace GenTC
@@ -0,0 +1,119 @@
+#ifndef __TCAR_TILE_INDEX_H__
+#define __TCAR_TILE_INDEX_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "codec_base.h"
+
+namespace GenTC {
+
+  // Textures can store a tile index after their streams so that a region of
+  // the texture can be decoded without decoding all of it. A tile is one
+  // kWaveletBlockDim x kWaveletBlockDim block wavelet block of the endpoint
+  // planes, and the tiles are stored in raster order.
+  struct TileInfo {
+    // The range of palette entries that the blocks of the tile refer to
+    uint32_t palette_begin;
+    uint32_t palette_end;
+
+    // The palette index in front of each row of blocks of the tile. The
+    // index of a block is the index plus the differences of the row up to
+    // and including the block, unless there's a long-range reference in
+    // between.
+    uint32_t index_sums[kWaveletBlockDim];
+
+    // The range of long-range index references that the blocks of the tile
+    // take, and the number of references in front of each row of blocks of
+    // the tile.
+    uint32_t refs_begin;
+    uint32_t refs_end;
+    uint32_t ref_starts[kWaveletBlockDim];
+  };
+
+  // The width and height of a tile in pixels
+  static const size_t kTileDim = 4 * kWaveletBlockDim;
+
+  // Builds the tile index of a texture from its index differences, stored in
+  // raster order biased by 128 like the indices stream, and its long-range
+  // index references.
+  std::vector<TileInfo> BuildTileIndex(const std::vector<uint8_t> &index_diffs,
+                                       const std::vector<uint32_t> &index_refs,
+                                       size_t blocks_x, size_t blocks_y);
+
+  // Reads the tile index of a compressed texture. Returns false if the
+  // texture was compressed without one, or if it's the wrong size or runs
+  // past the end of cmp_data.
+  bool LoadTileIndex(const GenTCHeader &hdr, const std::vector<uint8_t> &cmp_data,
+                     std::vector<TileInfo> *tiles);
+
+  // Consecutive groups of interleaved streams of one stream of a texture
+  struct GroupRun {
+    EStreamType stream;
+    size_t first_group;
+    size_t num_groups;
+
+    // Where the symbols of the run start once all of the runs are decoded
+    // back to back.
+    size_t offset;
+  };
+
+  // Everything needed to decode the blocks of a region. The tiles that
+  // overlap the region form a texture of their own that is tiles_x by
+  // tiles_y tiles, and the region starts at block (offset_x, offset_y) in it.
+  // The region texture is decoded from the symbols of the runs, and the
+  // region is cropped out of it.
+  struct RegionPlan {
+    size_t tile_x;
+    size_t tile_y;
+    size_t tiles_x;
+    size_t tiles_y;
+
+    size_t offset_x;
+    size_t offset_y;
+    size_t blocks_x;
+    size_t blocks_y;
+
+    // The runs in stream order, and the total number of symbols they decode to
+    std::vector<GroupRun> runs;
+    size_t decoded_sz;
+
+    // Where the wavelet coefficients of each row of tiles of each of the six
+    // endpoint planes start in the decoded runs. The coefficients of the row
+    // of tiles at row r of plane p start at plane_rows[p * tiles_y + r].
+    std::vector<size_t> plane_rows;
+
+    // Where the index differences of each row of blocks of the region
+    // texture start in the decoded runs, and the sum to start from. The sums
+    // are adjusted so that the indices count from palette_offset.
+    std::vector<size_t> index_rows;
+    std::vector<uint32_t> index_sums;
+
+    // The palette entries that the region refers to
+    size_t palette_offset;
+    size_t palette_sz;
+
+    // Where the long-range index references that the region takes start in
+    // the decoded runs, and the first one that each row of blocks of the
+    // region texture takes. The references still count from the start of
+    // the palette, so they need to be moved down by index_ref_base. If the
+    // region doesn't take any, index_ref_starts is empty.
+    size_t index_refs_offset;
+    uint32_t index_ref_base;
+    std::vector<uint32_t> index_ref_starts;
+
+    size_t TextureBlocksX() const { return tiles_x * kWaveletBlockDim; }
+    size_t TextureBlocksY() const { return tiles_y * kWaveletBlockDim; }
+  };
+
+  // Plans the decoding of the width x height pixels starting at (x, y) into
+  // result. Returns false if the region is empty, isn't aligned to DXT
+  // blocks or doesn't fit in the blocks of the texture, or if the tiles refer
+  // to palette entries or symbols that the texture doesn't have, in which
+  // case the plan must not be used.
+  bool PlanRegion(const GenTCHeader &hdr, const std::vector<TileInfo> &tiles,
+                  size_t x, size_t y, size_t width, size_t height, RegionPlan *result);
+
+}  // namespace GenTC
+
+#endif  // __TCAR_TILE_INDEX_H__
@@ -1,7 +1,16 @@
 #include "wavelet.h"
 
+#include <cassert>
+#include <type_traits>
 #include <vector>
 
+#include "codec_base.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GENTC_WAVELET_SSE2
+#include <emmintrin.h>
+#endif
+
 // Returns a normalized index in the given range by ping-ponging
 // across boundaries...
 //
@@ -25,6 +34,243 @@ static void Transpose(int16_t *img, size_t dim, size_t rowbytes) {
   }
 }
 
+
+// The inverse transform of whole kWaveletBlockDim x kWaveletBlockDim blocks
+// works on 32-bit values, like the inv_wavelet kernel, so that it matches the
+// kernel even for coefficients whose reconstruction doesn't fit in 16 bits.
+// Each level is done the way that the kernel does it: the rows of the sub-block
+// are transformed into a transposed scratch block, and then the same is done
+// again to transform the columns. Here the transform works down the columns so
+// that each lane of a vector handles its own column, and the transposes happen
+// up front instead.
+static const size_t kBlockDim = GenTC::kWaveletBlockDim;
+static const size_t kBlockSz = kBlockDim * kBlockDim;
+
+struct ScalarLanes {
+  static const size_t kLanes = 1;
+  typedef int32_t Vec;
+
+  static Vec Load(const int32_t *ptr) { return *ptr; }
+  static void Store(int32_t *ptr, Vec v) { *ptr = v; }
+  static Vec Set(int32_t x) { return x; }
+  static Vec Add(Vec a, Vec b) { return a + b; }
+  static Vec Sub(Vec a, Vec b) { return a - b; }
+  static Vec Half(Vec a) { return a / 2; }
+  static Vec Quarter(Vec a) { return a / 4; }
+
+  template<size_t kLen>
+  static void Transpose(const int32_t *src, int32_t *dst) {
+    for (size_t y = 0; y < kLen; ++y) {
+      for (size_t x = 0; x < kLen; ++x) {
+        dst[x * kBlockDim + y] = src[y * kBlockDim + x];
+      }
+    }
+  }
+
+  static void LoadBlock(const uint8_t *coeffs, int32_t *block) {
+    for (size_t i = 0; i < kBlockSz; ++i) {
+      block[i] = static_cast<int32_t>(coeffs[i]) - 128;
+    }
+  }
+
+  static void StoreBlock(const int32_t *block, int8_t *dst, size_t dst_stride) {
+    for (size_t y = 0; y < kBlockDim; ++y) {
+      for (size_t x = 0; x < kBlockDim; ++x) {
+        dst[y * dst_stride + x] = static_cast<int8_t>(block[y * kBlockDim + x]);
+      }
+    }
+  }
+};
+
+#ifdef GENTC_WAVELET_SSE2
+struct SSE2Lanes {
+  static const size_t kLanes = 4;
+  typedef __m128i Vec;
+
+  static Vec Load(const int32_t *ptr) { return _mm_load_si128(reinterpret_cast<const __m128i *>(ptr)); }
+  static void Store(int32_t *ptr, Vec v) { _mm_store_si128(reinterpret_cast<__m128i *>(ptr), v); }
+  static Vec Set(int32_t x) { return _mm_set1_epi32(x); }
+  static Vec Add(Vec a, Vec b) { return _mm_add_epi32(a, b); }
+  static Vec Sub(Vec a, Vec b) { return _mm_sub_epi32(a, b); }
+
+  // Shifts round towards negative infinity, so negative values need to be
+  // biased to round towards zero like integer division does.
+  static Vec Half(Vec a) {
+    return _mm_srai_epi32(_mm_add_epi32(a, _mm_srli_epi32(a, 31)), 1);
+  }
+
+  static Vec Quarter(Vec a) {
+    return _mm_srai_epi32(_mm_add_epi32(a, _mm_srli_epi32(_mm_srai_epi32(a, 31), 30)), 2);
+  }
+
+  template<size_t kLen>
+  static void Transpose(const int32_t *src, int32_t *dst) {
+    for (size_t y = 0; y < kLen; y += 4) {
+      for (size_t x = 0; x < kLen; x += 4) {
+        const int32_t *s = src + y * kBlockDim + x;
+        const __m128i r0 = Load(s);
+        const __m128i r1 = Load(s + kBlockDim);
+        const __m128i r2 = Load(s + 2 * kBlockDim);
+        const __m128i r3 = Load(s + 3 * kBlockDim);
+
+        const __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+        const __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+        const __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+        const __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+        int32_t *d = dst + x * kBlockDim + y;
+        Store(d, _mm_unpacklo_epi64(t0, t1));
+        Store(d + kBlockDim, _mm_unpackhi_epi64(t0, t1));
+        Store(d + 2 * kBlockDim, _mm_unpacklo_epi64(t2, t3));
+        Store(d + 3 * kBlockDim, _mm_unpackhi_epi64(t2, t3));
+      }
+    }
+  }
+
+  static void LoadBlock(const uint8_t *coeffs, int32_t *block) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(128);
+    for (size_t i = 0; i < kBlockSz; i += 16) {
+      const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(coeffs + i));
+      const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      Store(block + i + 0, _mm_sub_epi32(_mm_unpacklo_epi16(lo, zero), bias));
+      Store(block + i + 4, _mm_sub_epi32(_mm_unpackhi_epi16(lo, zero), bias));
+      Store(block + i + 8, _mm_sub_epi32(_mm_unpacklo_epi16(hi, zero), bias));
+      Store(block + i + 12, _mm_sub_epi32(_mm_unpackhi_epi16(hi, zero), bias));
+    }
+  }
+
+  // Keeps the low byte of each value. Sign extending it first keeps the
+  // saturating packs from changing anything.
+  static __m128i LowBytes(const int32_t *values) {
+    __m128i v[4];
+    for (size_t i = 0; i < 4; ++i) {
+      v[i] = _mm_srai_epi32(_mm_slli_epi32(Load(values + 4 * i), 24), 24);
+    }
+    return _mm_packs_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+  }
+
+  static void StoreBlock(const int32_t *block, int8_t *dst, size_t dst_stride) {
+    for (size_t y = 0; y < kBlockDim; ++y) {
+      for (size_t x = 0; x < kBlockDim; x += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + y * dst_stride + x),
+                         LowBytes(block + y * kBlockDim + x));
+      }
+    }
+  }
+};
+#endif  // GENTC_WAVELET_SSE2
+
+// Inverts one level of the transform down the first kLen columns of src, with
+// the low-pass coefficients in the first half of the rows and the high-pass
+// coefficients in the second half. The mirrored coefficients at either end
+// only ever show up as the first and last rows, so they are handled outside of
+// the loops by starting them off with the mirrored value.
+template<size_t kLen, typename V>
+static void InverseColumns(const int32_t *src, int32_t *dst) {
+  static const size_t kMid = kLen / 2;
+  const int32_t *lo = src;
+  const int32_t *hi = src + kMid * kBlockDim;
+  const typename V::Vec two = V::Set(2);
+
+  for (size_t x = 0; x < kLen; x += V::kLanes) {
+    // dst[2k] = lo[k] - (hi[k - 1] + hi[k] + 2) / 4, where hi[-1] is hi[0]
+    typename V::Vec prev = V::Load(hi + x);
+    for (size_t k = 0; k < kMid; ++k) {
+      const typename V::Vec next = V::Load(hi + k * kBlockDim + x);
+      const typename V::Vec sum = V::Add(V::Add(prev, next), two);
+      V::Store(dst + 2 * k * kBlockDim + x, V::Sub(V::Load(lo + k * kBlockDim + x), V::Quarter(sum)));
+      prev = next;
+    }
+
+    // dst[2k + 1] = hi[k] + (dst[2k] + dst[2k + 2]) / 2, where the last row
+    // mirrors back onto the last even row, so it just adds it.
+    prev = V::Load(dst + x);
+    for (size_t k = 0; k + 1 < kMid; ++k) {
+      const typename V::Vec next = V::Load(dst + (2 * k + 2) * kBlockDim + x);
+      const typename V::Vec h = V::Load(hi + k * kBlockDim + x);
+      V::Store(dst + (2 * k + 1) * kBlockDim + x, V::Add(h, V::Half(V::Add(prev, next))));
+      prev = next;
+    }
+
+    const typename V::Vec h = V::Load(hi + (kMid - 1) * kBlockDim + x);
+    V::Store(dst + (kLen - 1) * kBlockDim + x, V::Add(h, prev));
+  }
+}
+
+template<size_t kLen, typename V>
+struct InverseLevels {
+  // Levels that are narrower than a vector are done one value at a time.
+  typedef typename std::conditional<(kLen >= V::kLanes), V, ScalarLanes>::type Lanes;
+
+  static void Run(int32_t *block, int32_t *scratch) {
+    InverseLevels<kLen / 2, V>::Run(block, scratch);
+
+    // Rows first, and then columns
+    Lanes::template Transpose<kLen>(block, scratch);
+    InverseColumns<kLen, Lanes>(scratch, block);
+    Lanes::template Transpose<kLen>(block, scratch);
+    InverseColumns<kLen, Lanes>(scratch, block);
+  }
+};
+
+template<typename V>
+struct InverseLevels<1, V> {
+  static void Run(int32_t *, int32_t *) { }
+};
+
+template<typename V>
+static void InverseBlocks(const uint8_t *coeffs, size_t num_blocks,
+                                 int8_t *dst, size_t dst_stride) {
+  alignas(16) int32_t block[kBlockSz];
+  alignas(16) int32_t scratch[kBlockSz];
+
+  for (size_t i = 0; i < num_blocks; ++i) {
+    V::LoadBlock(coeffs + i * kBlockSz, block);
+    InverseLevels<kBlockDim, V>::Run(block, scratch);
+    V::StoreBlock(block, dst + i * kBlockDim, dst_stride);
+  }
+}
+
+// Only the top-left kDim x kDim coefficients of each block are used, so only
+// the levels up to kDim are inverted, in place in the corner of the block.
+template<size_t kDim, typename V>
+static void InverseLowPassBlocks(const uint8_t *coeffs, size_t num_blocks,
+                                 int8_t *dst, size_t dst_stride) {
+  alignas(16) int32_t block[kBlockSz];
+  alignas(16) int32_t scratch[kBlockSz];
+
+  for (size_t i = 0; i < num_blocks; ++i) {
+    const uint8_t *src = coeffs + i * kDim * kDim;
+    for (size_t y = 0; y < kDim; ++y) {
+      for (size_t x = 0; x < kDim; ++x) {
+        block[y * kBlockDim + x] = static_cast<int32_t>(src[y * kDim + x]) - 128;
+      }
+    }
+
+    InverseLevels<kDim, V>::Run(block, scratch);
+
+    for (size_t y = 0; y < kDim; ++y) {
+      for (size_t x = 0; x < kDim; ++x) {
+        dst[y * dst_stride + i * kDim + x] = static_cast<int8_t>(block[y * kBlockDim + x]);
+      }
+    }
+  }
+}
+
+template<typename V>
+static void InverseLowPass(const uint8_t *coeffs, size_t num_blocks, size_t dim,
+                           int8_t *dst, size_t dst_stride) {
+  switch (dim) {
+  case kBlockDim: InverseBlocks<V>(coeffs, num_blocks, dst, dst_stride); break;
+  case kBlockDim / 2: InverseLowPassBlocks<kBlockDim / 2, V>(coeffs, num_blocks, dst, dst_stride); break;
+  case kBlockDim / 4: InverseLowPassBlocks<kBlockDim / 4, V>(coeffs, num_blocks, dst, dst_stride); break;
+  case kBlockDim / 8: InverseLowPassBlocks<kBlockDim / 8, V>(coeffs, num_blocks, dst, dst_stride); break;
+  default: assert(!"Unsupported low-pass size!"); break;
+  }
+}
+
 namespace GenTC {
 
 size_t ForwardWavelet1D(const int16_t *src, int16_t *dst, size_t len) {
@@ -154,4 +400,28 @@ extern void InverseWavelet2D(const int16_t *src, size_t src_rowbytes,
   Transpose(dst, dim, dst_rowbytes);
 }
 
+void InverseWaveletBlocks(const uint8_t *coeffs, size_t num_blocks,
+                          int8_t *dst, size_t dst_stride, bool use_simd) {
+#ifdef GENTC_WAVELET_SSE2
+  if (use_simd) {
+    InverseBlocks<SSE2Lanes>(coeffs, num_blocks, dst, dst_stride);
+    return;
+  }
+#endif
+  (void)(use_simd);
+  InverseBlocks<ScalarLanes>(coeffs, num_blocks, dst, dst_stride);
+}
+
+void InverseWaveletLowPass(const uint8_t *coeffs, size_t num_blocks, size_t dim,
+                           int8_t *dst, size_t dst_stride, bool use_simd) {
+#ifdef GENTC_WAVELET_SSE2
+  if (use_simd) {
+    InverseLowPass<SSE2Lanes>(coeffs, num_blocks, dim, dst, dst_stride);
+    return;
+  }
+#endif
+  (void)(use_simd);
+  InverseLowPass<ScalarLanes>(coeffs, num_blocks, dim, dst, dst_stride);
+}
+
 }
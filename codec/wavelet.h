@@ -21,6 +21,24 @@ extern void ForwardWavelet2D(const int16_t *src, size_t src_rowbytes,
 extern void InverseWavelet2D(const int16_t *src, size_t src_rowbytes,
                              int16_t *dst, size_t dst_rowbytes, size_t dim);
 
+// Reconstructs num_blocks blocks of kWaveletBlockDim x kWaveletBlockDim
+// values from their coefficients, stored one block after another and biased
+// by 128, the same way that the inv_wavelet kernel does. This is the same as
+// applying InverseWavelet2D for every dimension from 2 up to kWaveletBlockDim,
+// but with 32-bit intermediate values. Block i is written to
+// dst + i * kWaveletBlockDim with dst_stride bytes between rows, truncated to
+// eight bits.
+extern void InverseWaveletBlocks(const uint8_t *coeffs, size_t num_blocks,
+                                 int8_t *dst, size_t dst_stride, bool use_simd = true);
+
+// Same as above, but only for the top-left dim x dim coefficients of each
+// block, stored one after another. Those are the transform of the block at
+// 1 / (kWaveletBlockDim / dim) the size, so this reconstructs the low-pass
+// approximation of each block as a dim x dim block. The dimension needs to
+// be kWaveletBlockDim divided by 1, 2, 4 or 8.
+extern void InverseWaveletLowPass(const uint8_t *coeffs, size_t num_blocks, size_t dim,
+                                  int8_t *dst, size_t dst_stride, bool use_simd = true);
+
 }  // namespace GenTC
 
 #endif  // __TCAR_WAVELET_H__
@@ -161,6 +161,10 @@ void LoadGTC(const std::unique_ptr<gpu::GPUContext> &ctx, bool has_dxt,
   const size_t mem_sz = length - kHeaderSz;
 
   is.read(reinterpret_cast<char *>(&hdr), kHeaderSz);
+  if (!is || GenTC::kGenTCMagic != hdr.magic) {
+    assert(!"Not a GenTC texture, or one written by another version of GenTC!");
+    return;
+  }
 
   std::vector<uint8_t> cmp_data(mem_sz + 512);
   is.read(reinterpret_cast<char *>(cmp_data.data()) + 512, mem_sz);
@@ -170,13 +174,12 @@ void LoadGTC(const std::unique_ptr<gpu::GPUContext> &ctx, bool has_dxt,
   disk_load_times[disk_load_idx] = glfwGetTime() - start_time;
   disk_load_idx = (disk_load_idx + 1) % 8;
 
-  const cl_uint num_blocks = hdr.height * hdr.width / 16;
   cl_uint *offsets = reinterpret_cast<cl_uint *>(cmp_data.data());
   cl_uint output_offset = 0;
-  offsets[0] = output_offset; output_offset += 2 * num_blocks; // Y planes
-  offsets[1] = output_offset; output_offset += 4 * num_blocks; // Chroma planes
-  offsets[2] = output_offset; output_offset += static_cast<cl_uint>(hdr.palette_bytes); // Palette
-  offsets[3] = output_offset; output_offset += num_blocks; // Indices
+  offsets[0] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(GenTC::eStreamType_Y)); // Y planes
+  offsets[1] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(GenTC::eStreamType_Chroma)); // Chroma planes
+  offsets[2] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(GenTC::eStreamType_Palette)); // Palette
+  offsets[3] = output_offset; output_offset += static_cast<cl_uint>(hdr.NumSymbols(GenTC::eStreamType_Indices)); // Indices
 
   cl_uint input_offset = 0;
   offsets[4] = input_offset; input_offset += hdr.y_cmp_sz;
@@ -230,7 +233,7 @@ void LoadGTC(const std::unique_ptr<gpu::GPUContext> &ctx, bool has_dxt,
   // Copy the texture over
   GLsizei width = static_cast<GLsizei>(hdr.width);
   GLsizei height = static_cast<GLsizei>(hdr.height);
-  GLsizei dxt_size = (width * height) / 2;
+  GLsizei dxt_size = static_cast<GLsizei>(8 * hdr.NumBlocks());
   CHECK_GL(glBindBuffer, GL_PIXEL_UNPACK_BUFFER, pbo);
   CHECK_GL(glBindTexture, GL_TEXTURE_2D, texID);
   if (has_dxt) {
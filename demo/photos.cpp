@@ -368,6 +368,11 @@ class AsyncGenTCReq : public AsyncTexRequest {
     const size_t mem_sz = length - kHeaderSz;
 
     is.read(reinterpret_cast<char *>(&_hdr), kHeaderSz);
+    if (!is || GenTC::kGenTCMagic != _hdr.magic) {
+      std::cerr << "Not a GenTC texture, or one written by another version of GenTC: "
+                << fname << std::endl;
+      exit(EXIT_FAILURE);
+    }
 
     _cmp_data.resize(mem_sz + 512);
     is.read(reinterpret_cast<char *>(_cmp_data.data()) + 512, mem_sz);
@@ -375,13 +380,12 @@ class AsyncGenTCReq : public AsyncTexRequest {
     assert(is.tellg() == static_cast<std::streamoff>(length));
     is.close();
 
-    const cl_uint num_blocks = _hdr.height * _hdr.width / 16;
     cl_uint *offsets = reinterpret_cast<cl_uint *>(_cmp_data.data());
     cl_uint output_offset = 0;
-    offsets[0] = output_offset; output_offset += 2 * num_blocks; // Y planes
-    offsets[1] = output_offset; output_offset += 4 * num_blocks; // Chroma planes
-    offsets[2] = output_offset; output_offset += static_cast<cl_uint>(_hdr.palette_bytes); // Palette
-    offsets[3] = output_offset; output_offset += num_blocks; // Indices
+    offsets[0] = output_offset; output_offset += static_cast<cl_uint>(_hdr.NumSymbols(GenTC::eStreamType_Y)); // Y planes
+    offsets[1] = output_offset; output_offset += static_cast<cl_uint>(_hdr.NumSymbols(GenTC::eStreamType_Chroma)); // Chroma planes
+    offsets[2] = output_offset; output_offset += static_cast<cl_uint>(_hdr.NumSymbols(GenTC::eStreamType_Palette)); // Palette
+    offsets[3] = output_offset; output_offset += static_cast<cl_uint>(_hdr.NumSymbols(GenTC::eStreamType_Indices)); // Indices
 
     cl_uint input_offset = 0;
     offsets[4] = input_offset; input_offset += _hdr.y_cmp_sz;
@@ -389,7 +393,7 @@ class AsyncGenTCReq : public AsyncTexRequest {
     offsets[6] = input_offset; input_offset += _hdr.palette_sz;
     offsets[7] = input_offset; input_offset += _hdr.indices_sz;
 
-    _pbo.sz = (_hdr.width * _hdr.height) / 2;
+    _pbo.sz = 8 * _hdr.NumBlocks();
   }
 
   virtual void LoadCL() {
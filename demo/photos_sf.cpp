@@ -367,6 +367,11 @@ class AsyncGenTCReq : public AsyncTexRequest {
     const size_t mem_sz = length - kHeaderSz;
 
     is.read(reinterpret_cast<char *>(&_hdr), kHeaderSz);
+    if (!is || GenTC::kGenTCMagic != _hdr.magic) {
+      std::cerr << "Not a GenTC texture, or one written by another version of GenTC: "
+                << fname << std::endl;
+      exit(EXIT_FAILURE);
+    }
 
     _cmp_data.resize(mem_sz);
     is.read(reinterpret_cast<char *>(_cmp_data.data()), _cmp_data.size());
@@ -375,7 +380,7 @@ class AsyncGenTCReq : public AsyncTexRequest {
     assert(is.tellg() == static_cast<std::streamoff>(length));
     is.close();
 
-    _pbo.sz = (_hdr.width * _hdr.height) / 2;
+    _pbo.sz = 8 * _hdr.NumBlocks();
     _pbo.in_sz = _cmp_data.size();
     _pbo.input = _cmp_data.data();
     _pbo.hdr = &_hdr;
@@ -747,7 +752,6 @@ std::vector<std::unique_ptr<Texture> > LoadTextures(const std::unique_ptr<gpu::G
       pool.push([page_start, page_end, pinned_mem, input_sz, page_id, unmap_event, user_event, kNumPages,
                  acquire_event, cmp_buf_host, pbo_cl, &dxt_events, &m, &done, &num_finished, &ctx](int) {
         size_t num_hdrs = static_cast<size_t>(page_end - page_start);
-        cl_uint num_blocks = static_cast<cl_uint>((*page_start)->hdr->width * (*page_start)->hdr->height / 16);
         uint8_t *page_buf = reinterpret_cast<uint8_t *>(pinned_mem) + input_sz;
 
         cl_uint *offsets_buf = reinterpret_cast<cl_uint *>(page_buf);
@@ -785,10 +789,10 @@ std::vector<std::unique_ptr<Texture> > LoadTextures(const std::unique_ptr<gpu::G
           input_offsets[input_offset_idx++] = input_offset; input_offset += req->hdr->indices_sz;
 
           // Setup ANS output offsets
-          output_offsets[output_offset_idx++] = output_offset; output_offset += 2 * num_blocks; // Y planes
-          output_offsets[output_offset_idx++] = output_offset; output_offset += 4 * num_blocks; // Chroma planes
-          output_offsets[output_offset_idx++] = output_offset; output_offset += static_cast<cl_uint>(req->hdr->palette_bytes); // Palette
-          output_offsets[output_offset_idx++] = output_offset; output_offset += num_blocks; // Indices
+          output_offsets[output_offset_idx++] = output_offset; output_offset += static_cast<cl_uint>(req->hdr->NumSymbols(GenTC::eStreamType_Y)); // Y planes
+          output_offsets[output_offset_idx++] = output_offset; output_offset += static_cast<cl_uint>(req->hdr->NumSymbols(GenTC::eStreamType_Chroma)); // Chroma planes
+          output_offsets[output_offset_idx++] = output_offset; output_offset += static_cast<cl_uint>(req->hdr->NumSymbols(GenTC::eStreamType_Palette)); // Palette
+          output_offsets[output_offset_idx++] = output_offset; output_offset += static_cast<cl_uint>(req->hdr->NumSymbols(GenTC::eStreamType_Indices)); // Indices
 
           memcpy(&(*next_hdr), req->hdr, sizeof(GenTC::GenTCHeader));
           next_hdr++;
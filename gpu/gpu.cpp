@@ -206,13 +206,20 @@ static void CreateCLContext(cl_context *result, const cl_context_properties *pro
   CHECK_CL((cl_int), errCreateContext);
 }
 
-static cl_platform_id GetCLPlatform(bool share_opengl) {
+// Returns false if none of the OpenCL platforms, if there are any, can be
+// used by us.
+static bool FindCLPlatform(bool share_opengl, cl_platform_id *result) {
   const cl_uint kMaxPlatforms = 8;
   cl_platform_id platforms[kMaxPlatforms];
-  cl_uint nPlatforms;
+  cl_uint nPlatforms = 0;
   static int platform_idx = -1;
 
-  CHECK_CL(clGetPlatformIDs, kMaxPlatforms, platforms, &nPlatforms);
+  // Machines without any OpenCL drivers installed report an error here
+  // rather than zero platforms.
+  cl_int errGetPlatforms = clGetPlatformIDs(kMaxPlatforms, platforms, &nPlatforms);
+  if (CL_SUCCESS != errGetPlatforms || 0 == nPlatforms) {
+    return false;
+  }
 
   size_t strLen;
   static const size_t kStrBufSz = 1024;
@@ -225,7 +232,8 @@ static cl_platform_id GetCLPlatform(bool share_opengl) {
       << " available. Querying... " << std::endl;
 #endif
   } else {
-    return platforms[platform_idx];
+    *result = platforms[platform_idx];
+    return true;
   }
 
 #ifndef NDEBUG
@@ -321,12 +329,22 @@ static cl_platform_id GetCLPlatform(bool share_opengl) {
 #endif
 
   if (platform_idx < 0) {
+    return false;
+  }
+
+  *result = platforms[platform_idx];
+  return true;
+}
+
+static cl_platform_id GetCLPlatform(bool share_opengl) {
+  cl_platform_id platform;
+  if (!FindCLPlatform(share_opengl, &platform)) {
     assert(false);
     std::cerr << "No available OpenCL platform found!" << std::endl;
     exit(1);
   }
 
-  return platforms[platform_idx];
+  return platform;
 }
 
 static cl_device_id GetDeviceForSharedContext(cl_context ctx) {
@@ -392,17 +410,36 @@ GPUContext::~GPUContext() {
 }
 
 std::unique_ptr<GPUContext> GPUContext::InitializeOpenCL(bool share_opengl) {
+  std::unique_ptr<GPUContext> gpu_ctx = TryInitializeOpenCL(share_opengl);
+  if (nullptr == gpu_ctx) {
+    assert(false);
+    std::cerr << "No available OpenCL device found!" << std::endl;
+    exit(1);
+  }
+
+  return std::move(gpu_ctx);
+}
+
+std::unique_ptr<GPUContext> GPUContext::TryInitializeOpenCL(bool share_opengl) {
   const cl_uint kMaxDevices = 8;
   cl_device_id devices[kMaxDevices];
-  cl_uint nDevices;
+  cl_uint nDevices = 0;
+
+  cl_platform_id platform;
+  if (!FindCLPlatform(share_opengl, &platform)) {
+    return nullptr;
+  }
 
-  cl_platform_id platform = GetCLPlatform(share_opengl);
 #if (defined NDEBUG) || (defined __APPLE__)
-  CHECK_CL(clGetDeviceIDs, platform, CL_DEVICE_TYPE_GPU, kMaxDevices, devices, &nDevices);
+  cl_int errGetDevices = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, kMaxDevices, devices, &nDevices);
 #else
-  CHECK_CL(clGetDeviceIDs, platform, CL_DEVICE_TYPE_ALL, kMaxDevices, devices, &nDevices);
+  cl_int errGetDevices = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, kMaxDevices, devices, &nDevices);
 #endif
 
+  if (CL_SUCCESS != errGetDevices || 0 == nDevices) {
+    return nullptr;
+  }
+
   cl_device_type device_type;
   CHECK_CL(clGetDeviceInfo, devices[0], CL_DEVICE_TYPE, sizeof(cl_device_type), &device_type, NULL);
 
@@ -532,9 +569,10 @@ void GPUContext::PrintDeviceInfo() const {
   gpu::PrintDeviceInfo(_device);
 }
 
-cl_kernel GPUContext::GetOpenCLKernel(const std::string &filename, const std::string &kernel) const {
+cl_kernel GPUContext::GetOpenCLKernel(const std::string &filename, const std::string &kernel,
+                                      const std::string &build_options) const {
   GPUKernelCache *cache = GPUKernelCache::Instance(_ctx, _type, _version, _device);
-  return cache->GetKernel(filename, kernel);
+  return cache->GetKernel(filename, kernel, build_options);
 }
 
 }  // namespace gpu
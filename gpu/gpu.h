@@ -52,6 +52,10 @@ namespace gpu {
     ~GPUContext();
     static std::unique_ptr<GPUContext> InitializeOpenCL(bool share_opengl);
 
+    // Same as above, but returns null instead of exiting when the machine
+    // doesn't have an OpenCL device that we can use.
+    static std::unique_ptr<GPUContext> TryInitializeOpenCL(bool share_opengl);
+
     cl_command_queue GetDefaultCommandQueue() const { return _default_command_queue; }
     cl_command_queue GetNextQueue() const {
       int next = _next_work_queue++;
@@ -68,7 +72,8 @@ namespace gpu {
     cl_device_id GetDeviceID() const { return _device;  }
     cl_context GetOpenCLContext() const { return _ctx; }
 
-    cl_kernel GetOpenCLKernel(const std::string &filename, const std::string &kernel) const;
+    cl_kernel GetOpenCLKernel(const std::string &filename, const std::string &kernel,
+                              const std::string &build_options = std::string()) const;
     void PrintDeviceInfo() const;
 
     EContextType Type() const { return _type; }
@@ -87,8 +92,9 @@ namespace gpu {
 
     template<typename T>
     T GetKernelWGInfo(const std::string &filename, const std::string &kernel,
-                      cl_kernel_work_group_info param) const {
-      cl_kernel k = GetOpenCLKernel(filename, kernel);
+                      cl_kernel_work_group_info param,
+                      const std::string &build_options = std::string()) const {
+      cl_kernel k = GetOpenCLKernel(filename, kernel, build_options);
       cl_uchar ret_buffer[256];
       size_t bytes_read;
       CHECK_CL(clGetKernelWorkGroupInfo, k, _device, param, sizeof(ret_buffer),
@@ -108,8 +114,21 @@ namespace gpu {
                              const size_t *global_sz, const size_t *local_sz,
                              cl_uint num_events, const cl_event *events, cl_event *ret_event,
                              Args... kernel_args) {
+      EnqueueOpenCLKernel<WorkDim>(queue, filename, kernel, std::string(), global_sz, local_sz,
+                                   num_events, events, ret_event, kernel_args...);
+    }
+
+    // Same as above, but runs the kernel from the program compiled with the
+    // given build options.
+    template<cl_uint WorkDim, typename... Args>
+    void EnqueueOpenCLKernel(cl_command_queue queue,
+                             const std::string &filename, const std::string &kernel,
+                             const std::string &build_options,
+                             const size_t *global_sz, const size_t *local_sz,
+                             cl_uint num_events, const cl_event *events, cl_event *ret_event,
+                             Args... kernel_args) {
       std::unique_lock<std::mutex> lock(_enqueue_mutex);
-      cl_kernel k = GetOpenCLKernel(filename, kernel);
+      cl_kernel k = GetOpenCLKernel(filename, kernel, build_options);
       SetArgument(k, 0, kernel_args...);
 #ifndef NDEBUG
       CHECK_CL(clFinish, queue);
@@ -39,8 +39,8 @@ static cl_platform_id GetPlatformForContext(cl_context ctx) {
   return (cl_platform_id)(-1);
 }
 
-static cl_program CompileProgram(const char *source_filename, cl_context ctx,
-                                 EContextType ctx_ty, EOpenCLVersion ver,
+static cl_program CompileProgram(const char *source_filename, const std::string &build_options,
+                                 cl_context ctx, EContextType ctx_ty, EOpenCLVersion ver,
                                  cl_device_id device) {
   std::ifstream progfs(source_filename, std::ifstream::in);
   if (!progfs) {
@@ -80,6 +80,8 @@ static cl_program CompileProgram(const char *source_filename, cl_context ctx,
     args += std::string("\" ");
   }
 
+  args += build_options;
+
   cl_int build_program_result = clBuildProgram(program, 1, &device, args.c_str(), NULL, NULL);
   if (build_program_result == CL_BUILD_PROGRAM_FAILURE) {
     size_t bufferSz = 0;
@@ -143,14 +145,16 @@ void GPUKernelCache::Clear() {
   gKernelCache = nullptr;
 }
 
-cl_kernel GPUKernelCache::GetKernel(const std::string &filename, const std::string &kernel) {
+cl_kernel GPUKernelCache::GetKernel(const std::string &filename, const std::string &kernel,
+                                    const std::string &build_options) {
   std::unique_lock<std::mutex> lock(gKernelCacheMutex);
-  if (_programs.find(filename) == _programs.end()) {
-    _programs[filename]._prog =
-      CompileProgram(filename.c_str(), _ctx, _ctx_ty, _ctx_ver, _device);
+  const std::string program_key = filename + "\n" + build_options;
+  if (_programs.find(program_key) == _programs.end()) {
+    _programs[program_key]._prog =
+      CompileProgram(filename.c_str(), build_options, _ctx, _ctx_ty, _ctx_ver, _device);
   }
 
-  GPUProgram *program = &(_programs[filename]);
+  GPUProgram *program = &(_programs[program_key]);
   if (program->_kernels.find(kernel) == program->_kernels.end()) {
     cl_int errCreateKernel;
     program->_kernels[kernel] = clCreateKernel(program->_prog, kernel.c_str(), &errCreateKernel);
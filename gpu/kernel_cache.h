@@ -15,8 +15,11 @@ public:
                                   EOpenCLVersion ctx_ver, cl_device_id device);
   static void Clear();
 
+  // Programs are compiled once for each combination of source file and
+  // build options, e.g. -D defines that specialize a kernel.
   cl_kernel GetKernel(const std::string &filename,
-                      const std::string &kernel);
+                      const std::string &kernel,
+                      const std::string &build_options = std::string());
 private:
   // disallow copying...
   GPUKernelCache(cl_context ctx, EContextType ctx_ty, EOpenCLVersion ctx_ver, cl_device_id device)